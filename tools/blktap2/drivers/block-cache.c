@@ -36,6 +36,7 @@
 #include "tapdisk-driver.h"
 #include "tapdisk-server.h"
 #include "tapdisk-interface.h"
+#include "tapdisk-shmcache.h"
 
 #ifdef DEBUG
 #define DBG(_f, _a...) tlog_write(TLOG_DBG, _f, ##_a)
@@ -58,6 +59,8 @@
 #define BLOCK_CACHE_REQUESTS            (TAPDISK_DATA_REQUESTS << 3)
 #define BLOCK_CACHE_PAGE_IDLETIME       60
 
+#define BLOCK_CACHE_SHM_SECS            (TAPDISK_SHMCACHE_PAGE_SIZE >> SECTOR_SHIFT)
+
 typedef struct radix_tree               radix_tree_t;
 typedef struct radix_tree_node          radix_tree_node_t;
 typedef struct radix_tree_link          radix_tree_link_t;
@@ -107,6 +110,7 @@ struct block_cache_request {
 	char                           *buf;
 	uint64_t                        secs;
 	td_request_t                    treq;
+	td_request_t                    clone;
 	block_cache_t                  *cache;
 };
 
@@ -132,6 +136,10 @@ struct block_cache {
 	radix_tree_t                    tree;
 
 	block_cache_stats_t             stats;
+
+	/* host-wide cache, used instead of the tree if set up */
+	tapdisk_shmcache_t             *shm;
+	tapdisk_shmcache_id_t           shm_id;
 };
 
 static inline uint64_t
@@ -558,7 +566,15 @@ block_cache_open(td_driver_t *driver, const char *name, td_flag_t flags)
 		"tree: %p, height: %d\n",
 		cache->name, cache->sectors, tree, tree->height);
 
-	if (mlockall(MCL_CURRENT | MCL_FUTURE))
+	cache->shm = tapdisk_shmcache_attach();
+	if (cache->shm &&
+	    tapdisk_shmcache_image_id(cache->name, &cache->shm_id)) {
+		tapdisk_shmcache_detach(cache->shm);
+		cache->shm = NULL;
+	}
+
+	/* don't pin the host-wide segment into every tapdisk */
+	if (!cache->shm && mlockall(MCL_CURRENT | MCL_FUTURE))
 		DPRINTF("mlockall failed: %d\n", -errno);
 
 	return 0;
@@ -581,6 +597,7 @@ block_cache_close(td_driver_t *driver)
 	DPRINTF("closing cache for %s\n", cache->name);
 
 	tapdisk_server_unregister_event(cache->timeout_id);
+	tapdisk_shmcache_detach(cache->shm);
 	radix_tree_free(tree);
 	free(cache->name);
 
@@ -706,6 +723,121 @@ out:
 	td_forward_request(clone);
 }
 
+/*
+ * the shared cache holds whole pages: a miss reads every page the
+ * request touches, completes the request from them and caches them.
+ */
+static void
+block_cache_shm_populate(td_request_t clone, int err)
+{
+	int i, n;
+	block_cache_t *cache;
+	block_cache_request_t *breq;
+
+	breq        = (block_cache_request_t *)clone.cb_data;
+	cache       = breq->cache;
+	breq->secs -= clone.secs;
+	breq->err   = (breq->err ? breq->err : err);
+
+	if (breq->secs)
+		return;
+
+	if (!breq->err) {
+		n = breq->clone.secs / BLOCK_CACHE_SHM_SECS;
+		for (i = 0; i < n; i++)
+			tapdisk_shmcache_insert(cache->shm, &cache->shm_id,
+						breq->clone.sec /
+						BLOCK_CACHE_SHM_SECS + i,
+						breq->buf + i *
+						TAPDISK_SHMCACHE_PAGE_SIZE);
+
+		memcpy(breq->treq.buf,
+		       breq->buf + ((breq->treq.sec - breq->clone.sec) <<
+				    SECTOR_SHIFT),
+		       breq->treq.secs << SECTOR_SHIFT);
+	}
+
+	free(breq->buf);
+	td_complete_request(breq->treq, breq->err);
+	block_cache_put_request(cache, breq);
+}
+
+static void
+block_cache_shm_miss(block_cache_t *cache, td_request_t treq,
+		     uint64_t first, uint64_t last)
+{
+	char *buf;
+	td_request_t clone;
+	block_cache_request_t *breq;
+
+	clone      = treq;
+	clone.sec  = first * BLOCK_CACHE_SHM_SECS;
+	clone.secs = (last - first + 1) * BLOCK_CACHE_SHM_SECS;
+
+	/* the last page of the image may be partial: don't cache it */
+	if (clone.sec + clone.secs > cache->sectors)
+		goto forward;
+
+	breq = block_cache_get_request(cache);
+	if (!breq)
+		goto forward;
+
+	if (posix_memalign((void **)&buf, TAPDISK_SHMCACHE_PAGE_SIZE,
+			   clone.secs << SECTOR_SHIFT)) {
+		block_cache_put_request(cache, breq);
+		goto forward;
+	}
+
+	breq->treq    = treq;
+	breq->secs    = clone.secs;
+	breq->err     = 0;
+	breq->buf     = buf;
+	breq->cache   = cache;
+
+	clone.buf     = buf;
+	clone.cb      = block_cache_shm_populate;
+	clone.cb_data = breq;
+	breq->clone   = clone;
+
+	return td_forward_request(clone);
+
+forward:
+	td_forward_request(treq);
+}
+
+static void
+block_cache_shm_read(block_cache_t *cache, td_request_t treq)
+{
+	uint64_t page, first, last;
+	size_t off, len;
+	char *buf;
+
+	first = treq.sec / BLOCK_CACHE_SHM_SECS;
+	last  = (treq.sec + treq.secs - 1) / BLOCK_CACHE_SHM_SECS;
+	buf   = treq.buf;
+
+	for (page = first; page <= last; page++) {
+		off = 0;
+		if (page == first)
+			off = (treq.sec % BLOCK_CACHE_SHM_SECS) << SECTOR_SHIFT;
+
+		len = TAPDISK_SHMCACHE_PAGE_SIZE - off;
+		if (len > treq.buf + (treq.secs << SECTOR_SHIFT) - buf)
+			len = treq.buf + (treq.secs << SECTOR_SHIFT) - buf;
+
+		if (tapdisk_shmcache_read(cache->shm, &cache->shm_id,
+					  page, buf, off, len)) {
+			cache->stats.misses += treq.secs;
+			return block_cache_shm_miss(cache, treq, first, last);
+		}
+
+		buf += len;
+	}
+
+	cache->stats.hits += treq.secs;
+	td_complete_request(treq, 0);
+}
+
 static void
 block_cache_queue_read(td_driver_t *driver, td_request_t treq)
 {
@@ -719,6 +851,9 @@ block_cache_queue_read(td_driver_t *driver, td_request_t treq)
 
 	cache->stats.reads += treq.secs;
 
+	if (cache->shm)
+		return block_cache_shm_read(cache, treq);
+
 	if (treq.secs > BLOCK_CACHE_NODES_PER_PAGE)
 		return td_forward_request(treq);
 
@@ -771,6 +906,42 @@ block_cache_debug(td_driver_t *driver)
 	WARN("BLOCK CACHE %s\n", cache->name);
 	WARN("reads: %"PRIu64", hits: %"PRIu64", misses: %"PRIu64", prunes: %"PRIu64"\n",
 	     stats->reads, stats->hits, stats->misses, stats->prunes);
+
+	if (cache->shm) {
+		tapdisk_shmcache_stats_t shm;
+
+		tapdisk_shmcache_get_stats(cache->shm, &shm);
+		WARN("shared cache: %u of %u pages, lookups: %"PRIu64", "
+		     "hits: %"PRIu64", inserts: %"PRIu64", evictions: %"PRIu64
+		     ", resets: %"PRIu64"\n", shm.used, shm.pages, shm.lookups,
+		     shm.hits, shm.inserts, shm.evictions, shm.resets);
+	}
+}
+
+static int
+block_cache_stats(td_driver_t *driver, char *buf, size_t size)
+{
+	block_cache_t *cache;
+	block_cache_stats_t *stats;
+	tapdisk_shmcache_stats_t shm;
+	int n;
+
+	cache = (block_cache_t *)driver->data;
+	stats = &cache->stats;
+
+	n = snprintf(buf, size, "reads=%"PRIu64" hits=%"PRIu64" "
+		     "misses=%"PRIu64" shared=%s", stats->reads, stats->hits,
+		     stats->misses, cache->shm ? "yes" : "no");
+	if (!cache->shm || n < 0 || n >= size)
+		return n;
+
+	tapdisk_shmcache_get_stats(cache->shm, &shm);
+
+	return n + snprintf(buf + n, size - n,
+			    " shm_pages=%u/%u shm_lookups=%"PRIu64
+			    " shm_hits=%"PRIu64" shm_evictions=%"PRIu64,
+			    shm.used, shm.pages, shm.lookups, shm.hits,
+			    shm.evictions);
 }
 
 struct tap_disk tapdisk_block_cache = {
@@ -784,4 +955,5 @@ struct tap_disk tapdisk_block_cache = {
 	.td_get_parent_id           = block_cache_get_parent_id,
 	.td_validate_parent         = block_cache_validate_parent,
 	.td_debug                   = block_cache_debug,
+	.td_stats                   = block_cache_stats,
 };
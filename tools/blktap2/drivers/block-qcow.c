@@ -51,6 +51,10 @@
 #define O_LARGEFILE     0
 #endif
 
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
 #if 1
 #define ASSERT(_p) \
     if ( !(_p) ) { DPRINTF("Assertion '%s' failed, line %d, file %s", #_p , \
@@ -77,6 +81,38 @@ struct qcow_request {
 	td_request_t         treq;
 	struct tiocb         tiocb;
 	struct tdqcow_state  *state;
+
+	int                  pending;	/* data write, plus L2 write-back */
+	int                  err;
+	struct list_head     next;	/* on an L2 table's waiters */
+};
+
+/*
+ * L2 tables are cached up to a memory budget of TAPDISK_QCOW_L2_CACHE_KB
+ * (QCOW_L2_CACHE_DEFAULT_KB) per image, and recycled least recently used
+ * first.  Clusters allocated by writes only update the cached table,
+ * which is then written back asynchronously: a write is not completed
+ * until both its data and the L2 entries pointing at it are on disk.
+ * While a table's write-back is in flight, further allocations against
+ * it are queued and covered by a single follow-up write.  Writes to
+ * clusters that are already allocated also wait while their table is
+ * dirty or busy, since the entry may be one not yet on disk.
+ */
+struct qcow_l2 {
+	int                  l1_index;
+	uint64_t             offset;
+	uint64_t            *table;	/* big endian, as on disk */
+	int                  pages;
+
+	int                  dirty_lo;	/* dirty 4k pages; clean if lo > hi */
+	int                  dirty_hi;
+	int                  busy;	/* write-back in flight */
+
+	struct tiocb         tiocb;
+	struct list_head     lru;
+	struct list_head     waiting;	/* covered by the write in flight */
+	struct list_head     pending;	/* need the next write */
+	struct tdqcow_state *state;
 };
 
 static int decompress_cluster(struct tdqcow_state *s, uint64_t cluster_offset);
@@ -204,16 +240,29 @@ static int qcow_set_key(struct tdqcow_state *s, const char *key)
 	return 0;
 }
 
-void tdqcow_complete(void *arg, struct tiocb *tiocb, int err)
+static void tdqcow_put_request(struct qcow_request *aio, int err)
 {
-	struct qcow_request *aio = (struct qcow_request *)arg;
 	struct tdqcow_state *s = aio->state;
 
-	td_complete_request(aio->treq, err);
+	if (err && !aio->err)
+		aio->err = err;
+
+	if (--aio->pending)
+		return;
+
+	td_complete_request(aio->treq, aio->err);
 
 	s->aio_free_list[s->aio_free_count++] = aio;
 }
 
+void tdqcow_complete(void *arg, struct tiocb *tiocb, int err)
+{
+	tdqcow_put_request((struct qcow_request *)arg, err);
+}
+
+static void qcow_l2_wait(struct tdqcow_state *s, struct qcow_l2 *l2,
+			 struct qcow_request *aio);
+
 static void async_read(td_driver_t *driver, td_request_t treq)
 {
 	int size;
@@ -228,9 +277,11 @@ static void async_read(td_driver_t *driver, td_request_t treq)
 	if (prv->aio_free_count == 0)
 		goto fail;
 
-	aio        = prv->aio_free_list[--prv->aio_free_count];
-	aio->treq  = treq;
-	aio->state = prv;
+	aio          = prv->aio_free_list[--prv->aio_free_count];
+	aio->treq    = treq;
+	aio->state   = prv;
+	aio->pending = 1;
+	aio->err     = 0;
 
 	td_prep_read(&aio->tiocb, prv->fd, treq.buf,
 		     size, offset, tdqcow_complete, aio);
@@ -242,7 +293,12 @@ fail:
 	td_complete_request(treq, -EBUSY);
 }
 
-static void async_write(td_driver_t *driver, td_request_t treq)
+/*
+ * 'l2' is the cached table holding clusters allocated for this write, if
+ * any: the request then also waits for that table to be written back.
+ */
+static void async_write(td_driver_t *driver, td_request_t treq,
+			struct qcow_l2 *l2)
 {
 	int size;
 	uint64_t offset;
@@ -256,14 +312,21 @@ static void async_write(td_driver_t *driver, td_request_t treq)
 	if (prv->aio_free_count == 0)
 		goto fail;
 
-	aio        = prv->aio_free_list[--prv->aio_free_count];
-	aio->treq  = treq;
-	aio->state = prv;
+	aio          = prv->aio_free_list[--prv->aio_free_count];
+	aio->treq    = treq;
+	aio->state   = prv;
+	aio->pending = 1;
+	aio->err     = 0;
 
 	td_prep_write(&aio->tiocb, prv->fd, treq.buf,
 		      size, offset, tdqcow_complete, aio);
 	td_queue_tiocb(driver, &aio->tiocb);
 
+	if (l2) {
+		aio->pending++;
+		qcow_l2_wait(prv, l2, aio);
+	}
+
 	return;
 
 fail:
@@ -297,11 +360,15 @@ static void encrypt_sectors(struct tdqcow_state *s, int64_t sector_num,
 	}
 }
 
+/* zero-fill extensions at most 1MB per write */
+#define QTRUNCATE_CHUNK_SECTORS 2048
+
 int qtruncate(int fd, off_t length, int sparse)
 {
-	int ret, i; 
-	int current = 0, rem = 0;
-	uint64_t sectors;
+	int ret; 
+	int rem = 0;
+	uint64_t sectors, current, chunk;
+	size_t size;
 	struct stat st;
 	char *buf;
 
@@ -325,12 +392,15 @@ int qtruncate(int fd, off_t length, int sparse)
 	 */
 	if(st.st_size < sectors * DEFAULT_SECTOR_SIZE) {
 		/*We are extending the file*/
-		if ((ret = posix_memalign((void **)&buf, 
-					  512, DEFAULT_SECTOR_SIZE))) {
+		chunk = MIN(sectors - current, QTRUNCATE_CHUNK_SECTORS);
+		if (!chunk)
+			chunk = 1;
+		size = chunk * DEFAULT_SECTOR_SIZE;
+		if ((ret = posix_memalign((void **)&buf, 4096, size))) {
 			DPRINTF("posix_memalign failed: %d\n", ret);
 			return -1;
 		}
-		memset(buf, 0x00, DEFAULT_SECTOR_SIZE);
+		memset(buf, 0x00, size);
 		if (lseek(fd, 0, SEEK_END)==-1) {
 			DPRINTF("Lseek EOF failed (%d), internal error\n",
 				errno);
@@ -346,14 +416,17 @@ int qtruncate(int fd, off_t length, int sparse)
 				return -1;
 			}
 		}
-		for (i = current; i < sectors; i++ ) {
-			ret = write(fd, buf, DEFAULT_SECTOR_SIZE);
-			if (ret != DEFAULT_SECTOR_SIZE) {
+		while (current < sectors) {
+			chunk = MIN(sectors - current,
+				    size / DEFAULT_SECTOR_SIZE);
+			ret = write(fd, buf, chunk * DEFAULT_SECTOR_SIZE);
+			if (ret != chunk * DEFAULT_SECTOR_SIZE) {
 				DPRINTF("write failed: ret = %d, err = %s\n",
 					ret, strerror(errno));
 				free(buf);
 				return -1;
 			}
+			current += chunk;
 		}
 		free(buf);
 	} else if(sparse && (st.st_size > sectors * DEFAULT_SECTOR_SIZE))
@@ -364,6 +437,372 @@ int qtruncate(int fd, off_t length, int sparse)
 	return 0;
 }
 
+static int qcow_l2_cache_size(struct tdqcow_state *s)
+{
+	unsigned long kb;
+	const char *env;
+	uint64_t n;
+
+	kb  = QCOW_L2_CACHE_DEFAULT_KB;
+	env = getenv("TAPDISK_QCOW_L2_CACHE_KB");
+	if (env)
+		kb = strtoul(env, NULL, 10);
+
+	n = ((uint64_t)kb << 10) /
+		(s->l2_size * sizeof(uint64_t) + sizeof(struct qcow_l2));
+	n = MIN(n, s->l1_size);
+
+	return (n > QCOW_L2_CACHE_MIN ? n : QCOW_L2_CACHE_MIN);
+}
+
+static int qcow_l2_init_cache(struct tdqcow_state *s)
+{
+	INIT_LIST_HEAD(&s->l2_lru);
+
+	s->l2_cached    = 0;
+	s->l2_cache_max = qcow_l2_cache_size(s);
+
+	s->l2_tables = calloc(s->l1_size, sizeof(struct qcow_l2 *));
+	if (!s->l2_tables)
+		return -ENOMEM;
+
+	DPRINTF("L2 cache: up to %d tables of %d entries\n",
+		s->l2_cache_max, s->l2_size);
+	return 0;
+}
+
+static void qcow_l2_free_cache(struct tdqcow_state *s)
+{
+	struct qcow_l2 *l2, *tmp;
+
+	if (!s->l2_tables)
+		return;
+
+	list_for_each_entry_safe(l2, tmp, &s->l2_lru, lru) {
+		list_del(&l2->lru);
+		free(l2->table);
+		free(l2);
+	}
+
+	free(s->l2_tables);
+	s->l2_tables = NULL;
+	s->l2_cached = 0;
+}
+
+static inline int qcow_l2_idle(struct qcow_l2 *l2)
+{
+	return (!l2->busy && l2->dirty_lo > l2->dirty_hi &&
+		list_empty(&l2->waiting) && list_empty(&l2->pending));
+}
+
+/*
+ * Find a table to load into: a new one while under budget, else the
+ * least recently used one with nothing in flight.  If every table is
+ * busy, overrun the budget rather than wait.
+ */
+static struct qcow_l2 *qcow_l2_get_free(struct tdqcow_state *s)
+{
+	size_t size;
+	struct qcow_l2 *l2;
+
+	if (s->l2_cached >= s->l2_cache_max)
+		list_for_each_entry(l2, &s->l2_lru, lru)
+			if (qcow_l2_idle(l2)) {
+				s->l2_tables[l2->l1_index] = NULL;
+				list_del(&l2->lru);
+				return l2;
+			}
+
+	l2 = calloc(1, sizeof(*l2));
+	if (!l2)
+		return NULL;
+
+	size = s->l2_size * sizeof(uint64_t);
+	l2->pages = (size + 4095) >> 12;
+	if (posix_memalign((void **)&l2->table, 4096, l2->pages << 12)) {
+		free(l2);
+		return NULL;
+	}
+	memset(l2->table, 0, l2->pages << 12);
+
+	l2->state = s;
+	INIT_LIST_HEAD(&l2->waiting);
+	INIT_LIST_HEAD(&l2->pending);
+	s->l2_cached++;
+
+	return l2;
+}
+
+static void qcow_l2_install(struct tdqcow_state *s, struct qcow_l2 *l2,
+			    int l1_index, uint64_t l2_offset)
+{
+	l2->l1_index = l1_index;
+	l2->offset   = l2_offset;
+	l2->dirty_lo = l2->pages;
+	l2->dirty_hi = -1;
+
+	s->l2_tables[l1_index] = l2;
+	list_add_tail(&l2->lru, &s->l2_lru);
+}
+
+static void qcow_l2_release(struct tdqcow_state *s, struct qcow_l2 *l2)
+{
+	free(l2->table);
+	free(l2);
+	s->l2_cached--;
+}
+
+static void qcow_l2_set_dirty(struct qcow_l2 *l2, int index, int count)
+{
+	int lo, hi;
+
+	lo = (index * sizeof(uint64_t)) >> 12;
+	hi = ((index + count) * sizeof(uint64_t) - 1) >> 12;
+
+	if (lo < l2->dirty_lo)
+		l2->dirty_lo = lo;
+	if (hi > l2->dirty_hi)
+		l2->dirty_hi = hi;
+}
+
+/*
+ * Write the dirty part of a table synchronously.  Only used where no
+ * request is left to wait on an asynchronous write-back.
+ */
+static int qcow_l2_flush(struct tdqcow_state *s, struct qcow_l2 *l2)
+{
+	size_t size;
+	off_t off;
+
+	if (l2->dirty_lo > l2->dirty_hi)
+		return 0;
+
+	off  = l2->offset + (l2->dirty_lo << 12);
+	size = (l2->dirty_hi - l2->dirty_lo + 1) << 12;
+
+	if (pwrite(s->fd, (char *)l2->table + (l2->dirty_lo << 12),
+		   size, off) != size)
+		return -EIO;
+
+	l2->dirty_lo = l2->pages;
+	l2->dirty_hi = -1;
+	return 0;
+}
+
+static void qcow_l2_complete(void *arg, struct tiocb *tiocb, int err);
+
+static void qcow_l2_writeback(struct tdqcow_state *s, struct qcow_l2 *l2)
+{
+	size_t size;
+	off_t off;
+
+	off  = l2->offset + (l2->dirty_lo << 12);
+	size = (l2->dirty_hi - l2->dirty_lo + 1) << 12;
+
+	td_prep_write(&l2->tiocb, s->fd,
+		      (char *)l2->table + (l2->dirty_lo << 12),
+		      size, off, qcow_l2_complete, l2);
+
+	l2->dirty_lo = l2->pages;
+	l2->dirty_hi = -1;
+	l2->busy     = 1;
+
+	td_queue_tiocb(s->driver, &l2->tiocb);
+}
+
+static void qcow_l2_complete(void *arg, struct tiocb *tiocb, int err)
+{
+	struct qcow_l2 *l2 = (struct qcow_l2 *)arg;
+	struct tdqcow_state *s = l2->state;
+	struct qcow_request *aio, *tmp;
+	LIST_HEAD(done);
+
+	l2->busy = 0;
+
+	if (err) {
+		DPRINTF("L2 table write at %"PRIu64" failed: %d\n",
+			l2->offset, err);
+		l2->dirty_lo = 0;
+		l2->dirty_hi = l2->pages - 1;
+	}
+
+	list_splice(&l2->waiting, &done);
+	INIT_LIST_HEAD(&l2->waiting);
+
+	if (!list_empty(&l2->pending)) {
+		list_splice(&l2->pending, &l2->waiting);
+		INIT_LIST_HEAD(&l2->pending);
+		qcow_l2_writeback(s, l2);
+	}
+
+	list_for_each_entry_safe(aio, tmp, &done, next) {
+		list_del(&aio->next);
+		tdqcow_put_request(aio, err);
+	}
+}
+
+static void qcow_l2_wait(struct tdqcow_state *s, struct qcow_l2 *l2,
+			 struct qcow_request *aio)
+{
+	if (l2->busy) {
+		/* nothing dirtied since it started: the write covers us */
+		if (l2->dirty_lo > l2->dirty_hi)
+			list_add_tail(&aio->next, &l2->waiting);
+		else
+			list_add_tail(&aio->next, &l2->pending);
+		return;
+	}
+
+	list_add_tail(&aio->next, &l2->waiting);
+	qcow_l2_writeback(s, l2);
+}
+
+/*
+ * The cached table holding the entry for 'sector', if it is dirty or
+ * has a write-back in flight: the entry may not be on disk yet.
+ */
+static struct qcow_l2 *qcow_l2_unsettled(struct tdqcow_state *s,
+					 uint64_t sector)
+{
+	struct qcow_l2 *l2;
+	int l1_index;
+
+	l1_index = (sector << 9) >> (s->l2_bits + s->cluster_bits);
+	l2 = s->l2_tables[l1_index];
+
+	if (l2 && (l2->busy || l2->dirty_lo <= l2->dirty_hi))
+		return l2;
+	return NULL;
+}
+
+/* 
+ * Allocate a new L2 table at the end of the file, and point the L1
+ * entry at it.  For safety, the table is on disk before the L1 entry.
+ */
+static struct qcow_l2 *qcow_l2_create(struct tdqcow_state *s, int l1_index)
+{
+	int i, l1_sector;
+	char *l1_ptr;
+	uint64_t *tmp_ptr;
+	uint64_t l2_offset, cluster_offset;
+	struct qcow_l2 *l2;
+
+	l2 = qcow_l2_get_free(s);
+	if (!l2)
+		return NULL;
+
+	/* round to cluster size */
+	l2_offset = (s->fd_end + s->cluster_size - 1) 
+		& ~(s->cluster_size - 1);
+
+	/*Truncate file for L2 table 
+	 *(initialised to zero in case we crash)*/
+	if (qtruncate(s->fd, 
+		      l2_offset + (s->l2_size * sizeof(uint64_t)),
+		      s->sparse) != 0) {
+		DPRINTF("ERROR truncating file\n");
+		goto fail;
+	}
+	s->fd_end = l2_offset + (s->l2_size * sizeof(uint64_t));
+
+	/*Should we allocate the whole extent? Adjustable parameter.*/
+	if (s->cluster_alloc == s->l2_size) {
+		cluster_offset = l2_offset + 
+			(s->l2_size * sizeof(uint64_t));
+		cluster_offset = (cluster_offset + s->cluster_size - 1)
+			& ~(s->cluster_size - 1);
+		if (qtruncate(s->fd, cluster_offset + 
+			      (s->cluster_size * s->l2_size), 
+			      s->sparse) != 0) {
+			DPRINTF("ERROR truncating file\n");
+			goto fail;
+		}
+		s->fd_end = cluster_offset + 
+			(s->cluster_size * s->l2_size);
+		for (i = 0; i < s->l2_size; i++) {
+			l2->table[i] = cpu_to_be64(cluster_offset + 
+						   (i*s->cluster_size));
+		}  
+
+		if (pwrite(s->fd, l2->table, l2->pages << 12, l2_offset) !=
+		    l2->pages << 12)
+			goto fail;
+	} else
+		memset(l2->table, 0, l2->pages << 12);
+
+	/* update the L1 entry */
+	s->l1_table[l1_index] = l2_offset;
+
+	/*Update the L1 table entry on disk
+	 * (for O_DIRECT we write 4KByte blocks)*/
+	l1_sector = (l1_index * sizeof(uint64_t)) >> 12;
+	l1_ptr = (char *)s->l1_table + (l1_sector << 12);
+
+	if (posix_memalign((void **)&tmp_ptr, 4096, 4096) != 0) {
+		DPRINTF("ERROR allocating memory for L1 table\n");
+		goto fail_l1;
+	}
+	memcpy(tmp_ptr, l1_ptr, 4096);
+
+	/* Convert block to write to big endian */
+	for(i = 0; i < 4096 / sizeof(uint64_t); i++) {
+		cpu_to_be64s(&tmp_ptr[i]);
+	}
+
+	/*
+	 * Issue non-asynchronous L1 write.
+	 * For safety, we must ensure that
+	 * entry is written before blocks.
+	 */
+	if (pwrite(s->fd, tmp_ptr, 4096,
+		   s->l1_table_offset + (l1_sector << 12)) != 4096) {
+		free(tmp_ptr);
+		goto fail_l1;
+	}
+	free(tmp_ptr);
+
+	qcow_l2_install(s, l2, l1_index, l2_offset);
+	return l2;
+
+fail_l1:
+	s->l1_table[l1_index] = 0;
+fail:
+	qcow_l2_release(s, l2);
+	return NULL;
+}
+
+static struct qcow_l2 *qcow_l2_lookup(struct tdqcow_state *s,
+				      int l1_index, int allocate)
+{
+	uint64_t l2_offset;
+	struct qcow_l2 *l2;
+	size_t size;
+
+	l2 = s->l2_tables[l1_index];
+	if (l2) {
+		list_del(&l2->lru);
+		list_add_tail(&l2->lru, &s->l2_lru);
+		return l2;
+	}
+
+	l2_offset = s->l1_table[l1_index];
+	if (!l2_offset)
+		return (allocate ? qcow_l2_create(s, l1_index) : NULL);
+
+	l2 = qcow_l2_get_free(s);
+	if (!l2)
+		return NULL;
+
+	size = s->l2_size * sizeof(uint64_t);
+	if (pread(s->fd, l2->table, l2->pages << 12, l2_offset) < size) {
+		qcow_l2_release(s, l2);
+		return NULL;
+	}
+
+	qcow_l2_install(s, l2, l1_index, l2_offset);
+	return l2;
+}
+
 /* 'allocate' is:
  *
  * 0 to not allocate.
@@ -376,155 +815,41 @@ int qtruncate(int fd, off_t length, int sparse)
  * cluster_size 
  *
  * return 0 if not allocated.
+ *
+ * If the L2 table was changed, '*l2p' is set to it; the caller must
+ * then see that the table is written back.
  */
 static uint64_t get_cluster_offset(struct tdqcow_state *s,
                                    uint64_t offset, int allocate,
                                    int compressed_size,
-                                   int n_start, int n_end)
+                                   int n_start, int n_end,
+                                   struct qcow_l2 **l2p)
 {
-	int min_index, i, j, l1_index, l2_index, l2_sector, l1_sector;
-	char *tmp_ptr2, *l2_ptr, *l1_ptr;
-	uint64_t *tmp_ptr;
-	uint64_t l2_offset, *l2_table, cluster_offset, tmp;
-	uint32_t min_count;
-	int new_l2_table;
+	int i, l1_index, l2_index;
+	uint64_t l2_offset, *l2_table, cluster_offset;
+	struct qcow_l2 *l2;
+
+	if (l2p)
+		*l2p = NULL;
 
 	/*Check L1 table for the extent offset*/
 	l1_index = offset >> (s->l2_bits + s->cluster_bits);
 	l2_offset = s->l1_table[l1_index];
-	new_l2_table = 0;
-	if (!l2_offset) {
-		if (!allocate)
-			return 0;
-		/* 
-		 * allocating a new l2 entry + extent 
-		 * at the end of the file, we must also
-		 * update the L1 entry safely.
-		 */
-		l2_offset = s->fd_end;
-
-		/* round to cluster size */
-		l2_offset = (l2_offset + s->cluster_size - 1) 
-			& ~(s->cluster_size - 1);
-
-		/* update the L1 entry */
-		s->l1_table[l1_index] = l2_offset;
-		
-		/*Truncate file for L2 table 
-		 *(initialised to zero in case we crash)*/
-		if (qtruncate(s->fd, 
-			      l2_offset + (s->l2_size * sizeof(uint64_t)),
-			      s->sparse) != 0) {
-			DPRINTF("ERROR truncating file\n");
-			return 0;
-		}
-		s->fd_end = l2_offset + (s->l2_size * sizeof(uint64_t));
-
-		/*Update the L1 table entry on disk
-                 * (for O_DIRECT we write 4KByte blocks)*/
-		l1_sector = (l1_index * sizeof(uint64_t)) >> 12;
-		l1_ptr = (char *)s->l1_table + (l1_sector << 12);
-
-		if (posix_memalign((void **)&tmp_ptr, 4096, 4096) != 0) {
-			DPRINTF("ERROR allocating memory for L1 table\n");
-                        return 0;
-		}
-		memcpy(tmp_ptr, l1_ptr, 4096);
-
-		/* Convert block to write to big endian */
-		for(i = 0; i < 4096 / sizeof(uint64_t); i++) {
-			cpu_to_be64s(&tmp_ptr[i]);
-		}
-
-		/*
-		 * Issue non-asynchronous L1 write.
-		 * For safety, we must ensure that
-		 * entry is written before blocks.
-		 */
-		lseek(s->fd, s->l1_table_offset + (l1_sector << 12), SEEK_SET);
-		if (write(s->fd, tmp_ptr, 4096) != 4096) {
-			free(tmp_ptr);
-		 	return 0;
-		}
-		free(tmp_ptr);
+	l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
 
-		new_l2_table = 1;
-		goto cache_miss;
-	} else if (s->min_cluster_alloc == s->l2_size) {
+	if (l2_offset && s->min_cluster_alloc == s->l2_size) {
 		/*Fast-track the request*/
 		cluster_offset = l2_offset + (s->l2_size * sizeof(uint64_t));
-		l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
 		return cluster_offset + (l2_index * s->cluster_size);
 	}
 
-	/*Check to see if L2 entry is already cached*/
-	for (i = 0; i < L2_CACHE_SIZE; i++) {
-		if (l2_offset == s->l2_cache_offsets[i]) {
-			/* increment the hit count */
-			if (++s->l2_cache_counts[i] == 0xffffffff) {
-				for (j = 0; j < L2_CACHE_SIZE; j++) {
-					s->l2_cache_counts[j] >>= 1;
-				}
-			}
-			l2_table = s->l2_cache + (i << s->l2_bits);
-			goto found;
-		}
-	}
-
-cache_miss:
-	/* not found: load a new entry in the least used one */
-	min_index = 0;
-	min_count = 0xffffffff;
-	for (i = 0; i < L2_CACHE_SIZE; i++) {
-		if (s->l2_cache_counts[i] < min_count) {
-			min_count = s->l2_cache_counts[i];
-			min_index = i;
-		}
-	}
-	l2_table = s->l2_cache + (min_index << s->l2_bits);
-
-	/*If extent pre-allocated, read table from disk, 
-	 *otherwise write new table to disk*/
-	if (new_l2_table) {
-		/*Should we allocate the whole extent? Adjustable parameter.*/
-		if (s->cluster_alloc == s->l2_size) {
-			cluster_offset = l2_offset + 
-				(s->l2_size * sizeof(uint64_t));
-			cluster_offset = (cluster_offset + s->cluster_size - 1)
-				& ~(s->cluster_size - 1);
-			if (qtruncate(s->fd, cluster_offset + 
-				  (s->cluster_size * s->l2_size), 
-				      s->sparse) != 0) {
-				DPRINTF("ERROR truncating file\n");
-				return 0;
-			}
-			s->fd_end = cluster_offset + 
-				(s->cluster_size * s->l2_size);
-			for (i = 0; i < s->l2_size; i++) {
-				l2_table[i] = cpu_to_be64(cluster_offset + 
-							  (i*s->cluster_size));
-			}  
-		} else memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
-
-		lseek(s->fd, l2_offset, SEEK_SET);
-		if (write(s->fd, l2_table, s->l2_size * sizeof(uint64_t)) !=
-		   s->l2_size * sizeof(uint64_t))
-			return 0;
-	} else {
-		lseek(s->fd, l2_offset, SEEK_SET);
-		if (read(s->fd, l2_table, s->l2_size * sizeof(uint64_t)) != 
-		    s->l2_size * sizeof(uint64_t))
-			return 0;
-	}
-	
-	/*Update the cache entries*/ 
-	s->l2_cache_offsets[min_index] = l2_offset;
-	s->l2_cache_counts[min_index] = 1;
+	l2 = qcow_l2_lookup(s, l1_index, allocate);
+	if (!l2)
+		return 0;
 
-found:
 	/*The extent is split into 's->l2_size' blocks of 
 	 *size 's->cluster_size'*/
-	l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+	l2_table = l2->table;
 	cluster_offset = be64_to_cpu(l2_table[l2_index]);
 
 	if (!cluster_offset || 
@@ -539,17 +864,16 @@ found:
 			   overwritten */
 			if (decompress_cluster(s, cluster_offset) < 0)
 				return 0;
-			cluster_offset = lseek(s->fd, s->fd_end, SEEK_SET);
-			cluster_offset = (cluster_offset + s->cluster_size - 1)
+			cluster_offset = (s->fd_end + s->cluster_size - 1)
 				& ~(s->cluster_size - 1);
 			/* write the cluster content - not asynchronous */
-			lseek(s->fd, cluster_offset, SEEK_SET);
-			if (write(s->fd, s->cluster_cache, s->cluster_size) != 
-			    s->cluster_size)
-			    return -1;
+			if (pwrite(s->fd, s->cluster_cache, s->cluster_size,
+				   cluster_offset) != s->cluster_size)
+			    return 0;
+			s->fd_end = cluster_offset + s->cluster_size;
 		} else {
 			/* allocate a new cluster */
-			cluster_offset = lseek(s->fd, s->fd_end, SEEK_SET);
+			cluster_offset = s->fd_end;
 			if (allocate == 1) {
 				/* round to cluster size */
 				cluster_offset = 
@@ -579,9 +903,9 @@ found:
 									s->cluster_data, 
 									s->cluster_data + 512, 1, 1,
 									&s->aes_encrypt_key);
-							lseek(s->fd, cluster_offset + i * 512, SEEK_SET);
-							if (write(s->fd, s->cluster_data, 512) != 512)
-								return -1;
+							if (pwrite(s->fd, s->cluster_data, 512,
+								   cluster_offset + i * 512) != 512)
+								return 0;
 						}
 					}
 				}
@@ -592,25 +916,70 @@ found:
 			}
 		}
 		/* update L2 table */
-		tmp = cpu_to_be64(cluster_offset);
-		l2_table[l2_index] = tmp;
+		l2_table[l2_index] = cpu_to_be64(cluster_offset);
+		qcow_l2_set_dirty(l2, l2_index, 1);
+		if (l2p)
+			*l2p = l2;
+	}
+	return cluster_offset;
+}
 
-		/*For IO_DIRECT we write 4KByte blocks*/
-		l2_sector = (l2_index * sizeof(uint64_t)) >> 12;
-		l2_ptr = (char *)l2_table + (l2_sector << 12);
-		
-		if (posix_memalign((void **)&tmp_ptr2, 4096, 4096) != 0) {
-			DPRINTF("ERROR allocating memory for L1 table\n");
-                        return 0;
-		}
-		memcpy(tmp_ptr2, l2_ptr, 4096);
-		lseek(s->fd, l2_offset + (l2_sector << 12), SEEK_SET);
-		if (write(s->fd, tmp_ptr2, 4096) != 4096) {
-			free(tmp_ptr2);
-			return -1;
-		}
-		free(tmp_ptr2);
+/*
+ * Allocate the unallocated cluster at 'sector', together with as many
+ * of the clusters following it as the request also covers and which
+ * are unallocated in the same L2 table.  The run is laid out
+ * contiguously at the end of the file, so it takes one extension, one
+ * data write and one L2 update.  Returns the run's offset and length in
+ * sectors, or 0 on failure.
+ */
+static uint64_t qcow_allocate_run(struct tdqcow_state *s, uint64_t sector,
+				  uint64_t nb_sectors, int *n,
+				  struct qcow_l2 **l2p)
+{
+	int l1_index, l2_index, count, index_in_cluster;
+	uint64_t cluster_offset, secs, offset;
+	struct qcow_l2 *l2;
+
+	*l2p     = NULL;
+	offset   = sector << 9;
+	l1_index = offset >> (s->l2_bits + s->cluster_bits);
+	l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+
+	l2 = qcow_l2_lookup(s, l1_index, 1);
+	if (!l2)
+		return 0;
+
+	index_in_cluster = sector & (s->cluster_sectors - 1);
+	secs = MIN(s->cluster_sectors - index_in_cluster, nb_sectors);
+
+	/* a new table may come preallocated */
+	cluster_offset = be64_to_cpu(l2->table[l2_index]);
+	if (cluster_offset) {
+		*n = secs;
+		return cluster_offset;
 	}
+
+	for (count = 1; secs < nb_sectors &&
+		     l2_index + count < s->l2_size &&
+		     !l2->table[l2_index + count]; count++)
+		secs += MIN(s->cluster_sectors, nb_sectors - secs);
+
+	cluster_offset = (s->fd_end + s->cluster_size - 1)
+		& ~(s->cluster_size - 1);
+	if (qtruncate(s->fd, cluster_offset + 
+		      (uint64_t)count * s->cluster_size, s->sparse) != 0) {
+		DPRINTF("ERROR truncating file\n");
+		return 0;
+	}
+	s->fd_end = cluster_offset + (uint64_t)count * s->cluster_size;
+
+	for (offset = 0; offset < count; offset++)
+		l2->table[l2_index + offset] =
+			cpu_to_be64(cluster_offset + offset * s->cluster_size);
+	qcow_l2_set_dirty(l2, l2_index, count);
+
+	*n   = secs;
+	*l2p = l2;
 	return cluster_offset;
 }
 
@@ -620,7 +989,8 @@ static int qcow_is_allocated(struct tdqcow_state *s, int64_t sector_num,
 	int index_in_cluster, n;
 	uint64_t cluster_offset;
 
-	cluster_offset = get_cluster_offset(s, sector_num << 9, 0, 0, 0, 0);
+	cluster_offset = get_cluster_offset(s, sector_num << 9, 0, 0, 0, 0,
+					    NULL);
 	index_in_cluster = sector_num & (s->cluster_sectors - 1);
 	n = s->cluster_sectors - index_in_cluster;
 	if (n > nb_sectors)
@@ -884,6 +1254,7 @@ int tdqcow_open (td_driver_t *driver, const char *name, td_flag_t flags)
 	}
 
 	s->fd = fd;
+	s->driver = driver;
 	s->name = strdup(name);
 	if (!s->name)
 		goto fail;
@@ -930,9 +1301,8 @@ int tdqcow_open (td_driver_t *driver, const char *name, td_flag_t flags)
 		goto fail;
 
 	/* alloc L2 cache */
-	size = s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t);
-	ret = posix_memalign((void **)&s->l2_cache, 4096, size);
-	if(ret != 0) goto fail;
+	if (qcow_l2_init_cache(s))
+		goto fail;
 
 	size = s->cluster_size;
 	ret = posix_memalign((void **)&s->cluster_cache, 4096, size);
@@ -974,7 +1344,7 @@ fail:
 
 	free_aio_state(s);
 	free(s->l1_table);
-	free(s->l2_cache);
+	qcow_l2_free_cache(s);
 	free(s->cluster_cache);
 	free(s->cluster_data);
 	close(fd);
@@ -996,7 +1366,7 @@ void tdqcow_queue_read(td_driver_t *driver, td_request_t treq)
 	/*We store a local record of the request*/
 	while (nb_sectors > 0) {
 		cluster_offset = 
-			get_cluster_offset(s, sector << 9, 0, 0, 0, 0);
+			get_cluster_offset(s, sector << 9, 0, 0, 0, 0, NULL);
 		index_in_cluster = sector & (s->cluster_sectors - 1);
 		n = s->cluster_sectors - index_in_cluster;
 		if (n > nb_sectors)
@@ -1011,7 +1381,7 @@ void tdqcow_queue_read(td_driver_t *driver, td_request_t treq)
             int i;
             /* Forward entire request if possible. */
             for(i=0; i<nb_sectors; i++)
-                if(get_cluster_offset(s, (sector+i) << 9, 0, 0, 0, 0))
+                if(get_cluster_offset(s, (sector+i) << 9, 0, 0, 0, 0, NULL))
                     goto coalesce_failed;
             treq.buf  = buf;
             treq.sec  = sector;
@@ -1055,6 +1425,7 @@ void tdqcow_queue_write(td_driver_t *driver, td_request_t treq)
 	struct tdqcow_state   *s  = (struct tdqcow_state *)driver->data;
 	int ret = 0, index_in_cluster, n, i;
 	uint64_t cluster_offset, sector, nb_sectors;
+	struct qcow_l2 *l2;
 	td_callback_t cb;
 	struct qcow_prv* prv;
 	char* buf = treq.buf;
@@ -1075,15 +1446,27 @@ void tdqcow_queue_write(td_driver_t *driver, td_request_t treq)
 			return;
 		}
 
-		cluster_offset = get_cluster_offset(s, sector << 9, 1, 0,
-						    index_in_cluster, 
-						    index_in_cluster+n);
+		l2 = NULL;
+		cluster_offset = get_cluster_offset(s, sector << 9, 0, 0,
+						    0, 0, NULL);
+		if (!cluster_offset && !s->crypt_method)
+			cluster_offset = qcow_allocate_run(s, sector,
+							   nb_sectors, &n, &l2);
+		else if (!cluster_offset ||
+			 (cluster_offset & QCOW_OFLAG_COMPRESSED))
+			cluster_offset = get_cluster_offset(s, sector << 9, 1,
+							    0, index_in_cluster,
+							    index_in_cluster+n,
+							    &l2);
 		if (!cluster_offset) {
 			DPRINTF("Ooops, no write cluster offset!\n");
 			td_complete_request(treq, -EIO);
 			return;
 		}
 
+		if (!l2)
+			l2 = qcow_l2_unsettled(s, sector);
+
 		if (s->crypt_method) {
 			encrypt_sectors(s, sector, s->cluster_data, 
 					(unsigned char *)buf, n, 1,
@@ -1092,13 +1475,13 @@ void tdqcow_queue_write(td_driver_t *driver, td_request_t treq)
 			clone.buf  = buf;
 			clone.sec  = (cluster_offset>>9) + index_in_cluster;
 			clone.secs = n;
-			async_write(driver, clone);
+			async_write(driver, clone, l2);
 		} else {
 		  clone.buf  = buf;
 		  clone.sec  = (cluster_offset>>9) + index_in_cluster;
 		  clone.secs = n;
 
-		  async_write(driver, clone);
+		  async_write(driver, clone, l2);
 		}
 		
 		nb_sectors -= n;
@@ -1162,6 +1545,13 @@ out:
 int tdqcow_close(td_driver_t *driver)
 {
 	struct tdqcow_state *s = (struct tdqcow_state *)driver->data;
+	struct qcow_l2 *l2;
+
+	/*Write back any L2 updates no request waited for*/
+	list_for_each_entry(l2, &s->l2_lru, lru)
+		if (qcow_l2_flush(s, l2))
+			DPRINTF("failed to write L2 table at %"PRIu64"\n",
+				l2->offset);
 
 	/*Update the hdr cksum*/
 	tdqcow_update_checksum(s);
@@ -1169,7 +1559,7 @@ int tdqcow_close(td_driver_t *driver)
 	free_aio_state(s);
 	free(s->name);
 	free(s->l1_table);
-	free(s->l2_cache);
+	qcow_l2_free_cache(s);
 	free(s->cluster_cache);
 	free(s->cluster_data);
 	close(s->fd);	
@@ -1332,9 +1722,9 @@ static int qcow_make_empty(struct tdqcow_state *s)
 		return -1;
 	}
 
-	memset(s->l2_cache, 0, s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t));
-	memset(s->l2_cache_offsets, 0, L2_CACHE_SIZE * sizeof(uint64_t));
-	memset(s->l2_cache_counts, 0, L2_CACHE_SIZE * sizeof(uint32_t));
+	qcow_l2_free_cache(s);
+	if (qcow_l2_init_cache(s))
+		return -1;
 
 	return 0;
 }
@@ -1353,6 +1743,7 @@ static int qcow_compress_cluster(struct tdqcow_state *s, int64_t sector_num,
 	int ret, out_len;
 	uint8_t *out_buf;
 	uint64_t cluster_offset;
+	struct qcow_l2 *l2;
 
 	out_buf = malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
 	if (!out_buf)
@@ -1388,13 +1779,17 @@ static int qcow_compress_cluster(struct tdqcow_state *s, int64_t sector_num,
 		//tdqcow_queue_write(bs, sector_num, buf, s->cluster_sectors);
 	} else {
 		cluster_offset = get_cluster_offset(s, sector_num << 9, 2, 
-                                            out_len, 0, 0);
+                                            out_len, 0, 0, &l2);
 		cluster_offset &= s->cluster_offset_mask;
 		lseek(s->fd, cluster_offset, SEEK_SET);
 		if (write(s->fd, out_buf, out_len) != out_len) {
 			free(out_buf);
 			return -1;
 		}
+		if (l2 && qcow_l2_flush(s, l2)) {
+			free(out_buf);
+			return -1;
+		}
 	}
 	
 	free(out_buf);
@@ -29,6 +29,23 @@
  * After a commit request, the client must wait for a competion message:
  * 4. completion
  *    "done"      4
+ * 5. batch request
+ *    "breq"      4
+ *    header      16
+ *    payload     (see remus-batch.h)
+ *
+ * If TAPDISK_REMUS_BATCH_KB is set, the client sends the writes of each
+ * checkpoint epoch as batch requests rather than one write request each.
+ * A batch is shipped whenever it holds TAPDISK_REMUS_BATCH_KB of data,
+ * and at the commit request, so that most of an epoch is on the wire
+ * before the checkpoint is taken.  Batches are deflated at zlib level
+ * TAPDISK_REMUS_DEFLATE, if that is set.  A backup which predates batch
+ * requests drops the stream on the first one, so batching is off unless
+ * both ends are known to take it.
+ *
+ * TAPDISK_REMUS_PRIMARY_FD or TAPDISK_REMUS_BACKUP_FD hand the driver
+ * a connected replication stream to use in place of the address, so
+ * that tapdisk-bench can run both ends over a socketpair.
  */
 
 /* due to architectural choices in tapdisk, block-buffer is forced to
@@ -40,9 +57,12 @@
 #include "hashtable.h"
 #include "hashtable_itr.h"
 #include "hashtable_utility.h"
+#include "remus-batch.h"
+#include "list.h"
 
 #include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -50,6 +70,7 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -57,14 +78,22 @@
 #include <sys/sysctl.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <zlib.h>
 
 /* timeout for reads and writes in ms */
 #define HEARTBEAT_MS 1000
 #define RAMDISK_HASHSIZE 128
+/* writes the backup keeps queued on the underlying driver while flushing */
+#define RAMDISK_MAX_INFLIGHT MAX_REQUESTS
 
 /* connect retry timeout (seconds) */
 #define REMUS_CONNRETRY_TIMEOUT 10
 
+#define REMUS_BATCH_DEFAULT_KB 0
+/* block writes once this many batches are queued for the backup */
+#define REMUS_SEND_MAX_BATCHES 16
+#define REMUS_SEND_IOVS 64
+
 #define RPRINTF(_f, _a...) syslog (LOG_DEBUG, "remus: " _f, ## _a)
 
 enum tdremus_mode {
@@ -108,6 +137,11 @@ struct ramdisk {
 	struct hashtable* prev;
 	/* count of outstanding requests to the base driver */
 	size_t inflight;
+	/* set while ramdisk_flush is queueing, so callbacks do not recurse */
+	int flushing;
+	/* sorted sectors of prev not yet queued, resumed from next */
+	uint64_t *sectors;
+	int nsectors, next;
 	/* prev holds the requests to be flushed, while inprogress holds
 	 * requests being flushed. When requests complete, they are removed
 	 * from inprogress.
@@ -144,6 +178,14 @@ struct ramdisk_write_cbdata {
 
 typedef void (*queue_rw_t) (td_driver_t *driver, td_request_t treq);
 
+/* a message queued for the replication stream */
+struct remus_msg {
+	struct list_head next;
+	char* buf;
+	size_t len;
+	size_t off;
+};
+
 /* poll_fd type for blktap2 fd system. taken from block_log.c */
 typedef struct poll_fd {
 	int        fd;
@@ -172,6 +214,16 @@ struct tdremus_state {
 	/* queue write requests, batch-replicate at submit */
 	struct req_ring write_ring;
 
+	/* writes of the current epoch, unless batching is off (!batch.buf) */
+	struct remus_batch batch;
+	int batch_level;
+	/* messages not yet taken by the replication stream */
+	struct list_head send_queue;
+	size_t send_bytes;
+	event_id_t send_id;
+	/* commit requests awaiting "done" */
+	int commits;
+
 	/* ramdisk data*/
 	struct ramdisk ramdisk;
 
@@ -193,6 +245,7 @@ typedef struct tdremus_wire {
 #define TDREMUS_COMMIT "creq"
 #define TDREMUS_DONE "done"
 #define TDREMUS_FAIL "fail"
+#define TDREMUS_BATCH REMUS_BATCH_TAG
 
 /* primary read/write functions */
 static void primary_queue_read(td_driver_t *driver, td_request_t treq);
@@ -262,6 +315,10 @@ replicated_write_callback(td_request_t treq, int err)
 	}
 	free(treq.buf);
 
+	/* queue whatever the last flush could not */
+	if (s->ramdisk.prev && !s->ramdisk.flushing)
+		ramdisk_flush(s->tdremus_driver, s);
+
 	if (!s->ramdisk.inflight && !s->ramdisk.prev) {
 		/* TODO: the ramdisk has been flushed */
 	}
@@ -498,6 +555,13 @@ fail:
 	return rc;
 }
 
+static void ramdisk_drop_sectors(struct ramdisk *ramdisk)
+{
+	free(ramdisk->sectors);
+	ramdisk->sectors = NULL;
+	ramdisk->nsectors = ramdisk->next = 0;
+}
+
 /* The underlying driver may not handle having the whole ramdisk queued at
  * once. We queue what we can and let the callbacks attempt to queue more. */
 /* NOTE: may be called from callback, while dd->private still belongs to
@@ -511,8 +575,18 @@ static int ramdisk_flush(td_driver_t *driver, struct tdremus_state* s)
 
 	// RPRINTF("ramdisk flush\n");
 
-	if ((count = ramdisk_get_sectors(s->ramdisk.prev, &sectors)) <= 0)
-		return count;
+	if (!s->ramdisk.sectors) {
+		if ((count = ramdisk_get_sectors(s->ramdisk.prev, &sectors)) <= 0)
+			return count;
+
+		/* sort and merge sectors to improve disk performance */
+		qsort(sectors, count, sizeof(*sectors), uint64_compare);
+		s->ramdisk.sectors  = sectors;
+		s->ramdisk.nsectors = count;
+		s->ramdisk.next     = 0;
+	}
+	sectors = s->ramdisk.sectors;
+	count   = s->ramdisk.nsectors;
 
 	/* Create the inprogress table if empty */
 	if (!s->ramdisk.inprogress)
@@ -524,10 +598,13 @@ static int ramdisk_flush(td_driver_t *driver, struct tdremus_state* s)
 	  RPRINTF("ramdisk: flushing %d sectors\n", count);
 	*/
 
-	/* sort and merge sectors to improve disk performance */
-	qsort(sectors, count, sizeof(*sectors), uint64_compare);
+	s->ramdisk.flushing = 1;
+	for (i = s->ramdisk.next; i < count;) {
+		if (s->ramdisk.inflight >= RAMDISK_MAX_INFLIGHT) {
+			s->ramdisk.next = i;
+			break;
+		}
 
-	for (i = 0; i < count;) {
 		base = sectors[i++];
 		while (i < count && sectors[i] == sectors[i-1] + 1)
 			i++;
@@ -539,7 +616,8 @@ static int ramdisk_flush(td_driver_t *driver, struct tdremus_state* s)
 			RPRINTF("ramdisk_flush: merge_requests failed:%s\n",
 				j == -1? "OOM": (j==-2? "missing sector" : "WAW race"));
 			if (j == -3) continue;
-			free(sectors);
+			s->ramdisk.flushing = 0;
+			ramdisk_drop_sectors(&s->ramdisk);
 			return -1;
 		}
 
@@ -558,6 +636,11 @@ static int ramdisk_flush(td_driver_t *driver, struct tdremus_state* s)
 			base++;
 		}
 	}
+	s->ramdisk.flushing = 0;
+
+	/* anything skipped for a WAW race is picked up by a fresh scan */
+	if (i >= count)
+		ramdisk_drop_sectors(&s->ramdisk);
 
 	if (!hashtable_count(s->ramdisk.prev)) {
 		/* everything is in flight */
@@ -565,8 +648,6 @@ static int ramdisk_flush(td_driver_t *driver, struct tdremus_state* s)
 		s->ramdisk.prev = NULL;
 	}
 
-	free(sectors);
-
 	// RPRINTF("ramdisk flush done\n");
 	return 0;
 }
@@ -601,6 +682,8 @@ static int ramdisk_start_flush(td_driver_t *driver)
 					   s->ramdisk.sector_size);
 		}
 		free(sectors);
+		/* prev gained sectors the pending scan does not know about */
+		ramdisk_drop_sectors(&s->ramdisk);
 
 		hashtable_destroy (s->ramdisk.h, 0);
 	} else
@@ -729,14 +812,229 @@ static int mwrite(int fd, void* buf, size_t len)
 }
 
 
+static void remus_drop_queue(struct tdremus_state *s)
+{
+	struct remus_msg *msg, *tmp;
+
+	if (s->send_id >= 0) {
+		tapdisk_server_unregister_event(s->send_id);
+		s->send_id = -1;
+	}
+
+	list_for_each_entry_safe(msg, tmp, &s->send_queue, next) {
+		list_del(&msg->next);
+		free(msg->buf);
+		free(msg);
+	}
+	s->send_bytes = 0;
+}
+
 static void inline close_stream_fd(struct tdremus_state *s)
 {
+	remus_drop_queue(s);
+
 	/* XXX: -2 is magic. replace with macro perhaps? */
 	tapdisk_server_unregister_event(s->stream_fd.id);
 	close(s->stream_fd.fd);
 	s->stream_fd.fd = -2;
 }
 
+/* the replication stream is written asynchronously, from send_queue */
+static void remus_send_event(event_id_t id, char mode, void *private);
+
+static int remus_queue_msg(struct tdremus_state *s, char *buf, size_t len)
+{
+	struct remus_msg *msg;
+
+	if (!(msg = malloc(sizeof(*msg)))) {
+		free(buf);
+		return -ENOMEM;
+	}
+
+	msg->buf = buf;
+	msg->len = len;
+	msg->off = 0;
+	list_add_tail(&msg->next, &s->send_queue);
+	s->send_bytes += len;
+
+	return 0;
+}
+
+/* write as much of the queue as the socket takes, and have the rest
+ * sent when it becomes writable */
+static int remus_send(struct tdremus_state *s)
+{
+	struct iovec iov[REMUS_SEND_IOVS];
+	struct remus_msg *msg, *tmp;
+	size_t left;
+	ssize_t n;
+	int cnt;
+
+	while (!list_empty(&s->send_queue)) {
+		cnt = 0;
+		list_for_each_entry(msg, &s->send_queue, next) {
+			iov[cnt].iov_base = msg->buf + msg->off;
+			iov[cnt].iov_len  = msg->len - msg->off;
+			if (++cnt == REMUS_SEND_IOVS)
+				break;
+		}
+
+		n = writev(s->stream_fd.fd, iov, cnt);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				break;
+			RPRINTF("error during write: %s\n", strerror(errno));
+			return -errno;
+		}
+
+		list_for_each_entry_safe(msg, tmp, &s->send_queue, next) {
+			left = msg->len - msg->off;
+			if (n < left) {
+				msg->off += n;
+				break;
+			}
+
+			n -= left;
+			s->send_bytes -= msg->len;
+			list_del(&msg->next);
+			free(msg->buf);
+			free(msg);
+
+			if (!n)
+				break;
+		}
+	}
+
+	if (list_empty(&s->send_queue)) {
+		if (s->send_id >= 0) {
+			tapdisk_server_unregister_event(s->send_id);
+			s->send_id = -1;
+		}
+	} else if (s->send_id < 0) {
+		s->send_id = tapdisk_server_register_event(SCHEDULER_POLL_WRITE_FD,
+							   s->stream_fd.fd, 0,
+							   remus_send_event, s);
+		if (s->send_id < 0) {
+			RPRINTF("error registering send event handler: %d\n",
+				s->send_id);
+			return s->send_id;
+		}
+	}
+
+	return 0;
+}
+
+/* wait for the backup to take all queued messages */
+static int remus_send_drain(struct tdremus_state *s)
+{
+	fd_set wfds;
+	int rc;
+	struct timeval tv;
+
+	while (!list_empty(&s->send_queue)) {
+		tv.tv_sec = HEARTBEAT_MS / 1000;
+		tv.tv_usec = (HEARTBEAT_MS % 1000) * 1000;
+
+		FD_ZERO(&wfds);
+		FD_SET(s->stream_fd.fd, &wfds);
+		if (!(rc = select(s->stream_fd.fd + 1, NULL, &wfds, NULL, &tv))) {
+			RPRINTF("time out during write\n");
+			return -ETIMEDOUT;
+		} else if (rc < 0) {
+			RPRINTF("error during select: %d\n", errno);
+			return -errno;
+		}
+
+		if ((rc = remus_send(s)) < 0)
+			return rc;
+	}
+
+	return 0;
+}
+
+static void remus_send_event(event_id_t id, char mode, void *private)
+{
+	struct tdremus_state *s = (struct tdremus_state *)private;
+	int commits;
+
+	if (remus_send(s) >= 0)
+		return;
+
+	/* as for a failed flush: drop the stream and fail the checkpoint.
+	 * The next write finds the stream gone and goes unprotected. */
+	RPRINTF("error sending to backup\n");
+	commits = s->commits;
+	s->commits = 0;
+	close_stream_fd(s);
+	if (commits)
+		ctl_respond(s, TDREMUS_FAIL);
+}
+
+/* queue the current batch for the backup */
+static int remus_ship_batch(struct tdremus_state *s)
+{
+	char *msg;
+	size_t len;
+	int rc;
+
+	if (remus_batch_empty(&s->batch))
+		return 0;
+
+	if ((rc = remus_batch_seal(&s->batch, s->batch_level, &msg, &len)))
+		return rc;
+
+	if ((rc = remus_queue_msg(s, msg, len)))
+		return rc;
+
+	if ((rc = remus_send(s)) < 0)
+		return rc;
+
+	/* the backup is falling behind: stop taking writes until it catches up */
+	if (s->send_bytes > REMUS_SEND_MAX_BATCHES * s->batch.limit)
+		return remus_send_drain(s);
+
+	return 0;
+}
+
+static void remus_batch_start(td_driver_t *driver)
+{
+	struct tdremus_state *s = (struct tdremus_state *)driver->data;
+	const char *env;
+	long kb, level;
+
+	if (s->batch.buf)
+		return;
+
+	kb = REMUS_BATCH_DEFAULT_KB;
+	if ((env = getenv("TAPDISK_REMUS_BATCH_KB")))
+		kb = strtol(env, NULL, 10);
+	if (kb <= 0) {
+		RPRINTF("sending one message per write\n");
+		return;
+	}
+	if (kb > REMUS_BATCH_MAX_LIMIT >> 10) {
+		RPRINTF("TAPDISK_REMUS_BATCH_KB=%ld is more than the backup "
+			"accepts, using %dKB\n", kb, REMUS_BATCH_MAX_LIMIT >> 10);
+		kb = REMUS_BATCH_MAX_LIMIT >> 10;
+	}
+
+	level = 0;
+	if ((env = getenv("TAPDISK_REMUS_DEFLATE")))
+		level = strtol(env, NULL, 10);
+	if (level < 0 || level > Z_BEST_COMPRESSION)
+		level = Z_BEST_SPEED;
+
+	if (remus_batch_init(&s->batch, driver->info.sector_size, kb << 10)) {
+		RPRINTF("error allocating write batch, "
+			"sending one message per write\n");
+		remus_batch_free(&s->batch);
+		return;
+	}
+	s->batch_level = level;
+
+	RPRINTF("batching writes by %ldKB, deflate level %ld\n", kb, level);
+}
+
 /* primary functions */
 static void remus_client_event(event_id_t, char mode, void *private);
 static void remus_connect_event(event_id_t id, char mode, void *private);
@@ -776,12 +1074,37 @@ static int primary_do_connect(struct tdremus_state *state)
 	return 0;
 }
 
+/* take over a connected replication stream */
+static int primary_stream(struct tdremus_state *state, int fd)
+{
+	int id;
+	int flags;
+
+	/* make socket nonblocking */
+	if ((flags = fcntl(fd, F_GETFL, 0)) == -1)
+		flags = 0;
+	if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+	{
+		RPRINTF("error making socket nonblocking\n");
+		close(fd);
+		return -1;
+	}
+
+	if((id = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD, fd, 0, remus_client_event, state)) < 0) {
+		RPRINTF("error registering client event handler: %s\n", strerror(id));
+		close(fd);
+		return -1;
+	}
+
+	state->stream_fd.fd = fd;
+	state->stream_fd.id = id;
+	return 0;
+}
+
 static int primary_blocking_connect(struct tdremus_state *state)
 {
 	int fd;
-	int id;
 	int rc;
-	int flags;
 
 	RPRINTF("client connecting to %s:%d...\n", inet_ntoa(state->sa.sin_addr), ntohs(state->sa.sin_port));
 
@@ -807,25 +1130,7 @@ static int primary_blocking_connect(struct tdremus_state *state)
 
 	RPRINTF("client connected\n");
 
-	/* make socket nonblocking */
-	if ((flags = fcntl(fd, F_GETFL, 0)) == -1)
-		flags = 0;
-	if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
-	{
-		RPRINTF("error making socket nonblocking\n");
-		close(fd);
-		return -1;
-	}
-
-	if((id = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD, fd, 0, remus_client_event, state)) < 0) {
-		RPRINTF("error registering client event handler: %s\n", strerror(id));
-		close(fd);
-		return -1;
-	}
-
-	state->stream_fd.fd = fd;
-	state->stream_fd.id = id;
-	return 0;
+	return primary_stream(state, fd);
 }
 
 /* on read, just pass request through */
@@ -835,12 +1140,13 @@ static void primary_queue_read(td_driver_t *driver, td_request_t treq)
 	td_forward_request(treq);
 }
 
-/* TODO:
- * The primary uses mwrite() to write the contents of a write request to the
- * backup. This effectively blocks until all data has been copied into a system
- * buffer or a timeout has occured. We may wish to instead use tapdisk's
- * nonblocking i/o interface, tapdisk_server_register_event(), to set timeouts
- * and write data in an asynchronous fashion.
+/* With batching, writes are copied into the current batch and go out
+ * through the send queue, written to the backup as its socket permits.
+ * Writes only block when REMUS_SEND_MAX_BATCHES batches are queued.
+ *
+ * Without, the primary uses mwrite() to write the contents of a write
+ * request to the backup. This effectively blocks until all data has been
+ * copied into a system buffer or a timeout has occured.
  */
 static void primary_queue_write(td_driver_t *driver, td_request_t treq)
 {
@@ -858,6 +1164,18 @@ static void primary_queue_write(td_driver_t *driver, td_request_t treq)
 		primary_blocking_connect(s);
 	}
 
+	if (s->batch.buf) {
+		if (s->stream_fd.fd < 0)
+			goto fail;
+		if (remus_batch_add(&s->batch, treq.sec, treq.secs, treq.buf))
+			goto fail;
+		if (remus_batch_full(&s->batch) && remus_ship_batch(s))
+			goto fail;
+
+		td_forward_request(treq);
+		return;
+	}
+
 	*sectors = treq.secs;
 	*sector = treq.sec;
 
@@ -887,17 +1205,40 @@ static int client_flush(td_driver_t *driver)
 
 	// RPRINTF("committing output\n");
 
+	char *msg;
+
 	if (s->stream_fd.fd == -1)
 		/* connection not yet established, nothing to flush */
 		return 0;
 
-	if (mwrite(s->stream_fd.fd, TDREMUS_COMMIT, strlen(TDREMUS_COMMIT)) < 0) {
-		RPRINTF("error flushing output");
-		close_stream_fd(s);
-		return -1;
+	if (s->batch.buf) {
+		/* ship the rest of the epoch and the commit request, and
+		 * leave them to go out while the checkpoint proceeds */
+		if (s->stream_fd.fd < 0)
+			goto fail;
+		if (remus_ship_batch(s))
+			goto fail;
+		if (!(msg = strdup(TDREMUS_COMMIT)))
+			goto fail;
+		if (remus_queue_msg(s, msg, strlen(TDREMUS_COMMIT)))
+			goto fail;
+		s->commits++;
+		if (remus_send(s) < 0)
+			goto fail;
+
+		return 0;
 	}
 
+	if (mwrite(s->stream_fd.fd, TDREMUS_COMMIT, strlen(TDREMUS_COMMIT)) < 0)
+		goto fail;
+
 	return 0;
+
+ fail:
+	RPRINTF("error flushing output");
+	s->commits = 0;
+	close_stream_fd(s);
+	return -1;
 }
 
 static int server_flush(td_driver_t *driver)
@@ -922,6 +1263,8 @@ static int primary_start(td_driver_t *driver)
 	tapdisk_remus.td_queue_write = primary_queue_write;
 	s->queue_flush = client_flush;
 
+	remus_batch_start(driver);
+
 	s->stream_fd.fd = -1;
 	s->stream_fd.id = -1;
 
@@ -1039,10 +1382,12 @@ static void remus_client_event(event_id_t id, char mode, void *private)
 
 	req[4] = '\0';
 
-	if (!strcmp(req, TDREMUS_DONE))
+	if (!strcmp(req, TDREMUS_DONE)) {
 		/* checkpoint committed, inform msg_fd */
+		if (s->commits)
+			s->commits--;
 		ctl_respond(s, TDREMUS_DONE);
-	else {
+	} else {
 		RPRINTF("received unknown message: %s\n", req);
 		close_stream_fd(s);
 	}
@@ -1052,6 +1397,7 @@ static void remus_client_event(event_id_t id, char mode, void *private)
 
 /* backup functions */
 static void remus_server_event(event_id_t id, char mode, void *private);
+static int backup_stream(struct tdremus_state *s, int stream_fd);
 
 /* returns the socket that receives write requests */
 static void remus_server_accept(event_id_t id, char mode, void* private)
@@ -1071,6 +1417,14 @@ static void remus_server_accept(event_id_t id, char mode, void* private)
 	 * connection (or do something smarter) */
 	RPRINTF("server accepted connection\n");
 
+	backup_stream(s, stream_fd);
+}
+
+/* start receiving on a connected replication stream */
+static int backup_stream(struct tdremus_state *s, int stream_fd)
+{
+	event_id_t cid;
+
 	/* add tapdisk event for replication stream */
 	cid = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD, stream_fd, 0,
 					    remus_server_event, s);
@@ -1078,12 +1432,13 @@ static void remus_server_accept(event_id_t id, char mode, void* private)
 	if(cid < 0) {
 		RPRINTF("error registering connection event handler: %s\n", strerror(errno));
 		close(stream_fd);
-		return;
+		return -1;
 	}
 
 	/* store replication file descriptor */
 	s->stream_fd.fd = stream_fd;
 	s->stream_fd.id = cid;
+	return 0;
 }
 
 /* returns -2 if EADDRNOTAVAIL */
@@ -1238,6 +1593,53 @@ static int server_do_wreq(td_driver_t *driver)
 	return -1;
 }
 
+static int server_apply_extent(void *arg, uint64_t sector, int secs, char *buf)
+{
+	struct tdremus_state *s = (struct tdremus_state *)arg;
+
+	return ramdisk_write(&s->ramdisk, sector, secs, buf);
+}
+
+static int server_do_breq(td_driver_t *driver)
+{
+	struct tdremus_state *s = (struct tdremus_state *)driver->data;
+	struct remus_batch_hdr hdr;
+	char *payload = NULL;
+	int rc;
+
+	if (mread(s->stream_fd.fd, &hdr, sizeof(hdr)) < 0)
+		goto err;
+
+	if (hdr.wire_size > REMUS_BATCH_MAX_SIZE) {
+		RPRINTF("batch request too large: %u\n", hdr.wire_size);
+		goto err;
+	}
+
+	if (!(payload = malloc(hdr.wire_size ? hdr.wire_size : 1)))
+		goto err;
+
+	if (mread(s->stream_fd.fd, payload, hdr.wire_size) < 0)
+		goto err;
+
+	if ((rc = remus_batch_apply(&hdr, payload, s->ramdisk.sector_size,
+				    server_apply_extent, s))) {
+		RPRINTF("bad batch request of %u extents: %d\n",
+			hdr.extents, rc);
+		goto err;
+	}
+
+	free(payload);
+	return 0;
+
+ err:
+	/* should start failover */
+	free(payload);
+	RPRINTF("backup batch request error\n");
+	close_stream_fd(s);
+
+	return -1;
+}
+
 static int server_do_sreq(td_driver_t *driver)
 {
 	/*
@@ -1287,6 +1689,8 @@ static void remus_server_event(event_id_t id, char mode, void *private)
 
 	if (!strcmp(req, TDREMUS_WRITE))
 		server_do_wreq(driver);
+	else if (!strcmp(req, TDREMUS_BATCH))
+		server_do_breq(driver);
 	else if (!strcmp(req, TDREMUS_SUBMIT))
 		server_do_sreq(driver);
 	else if (!strcmp(req, TDREMUS_COMMIT))
@@ -1449,6 +1853,25 @@ static int get_args(td_driver_t *driver, const char* name)
 	return 0;
 }
 
+/* a stream fd passed down by whoever runs us, or -1 */
+static int remus_env_fd(const char *var)
+{
+	const char *env;
+	char *end;
+	long fd;
+
+	if (!(env = getenv(var)))
+		return -1;
+
+	fd = strtol(env, &end, 10);
+	if (*end || fd < 0 || fd > INT_MAX) {
+		RPRINTF("ignoring %s=%s\n", var, env);
+		return -1;
+	}
+
+	return fd;
+}
+
 static int switch_mode(td_driver_t *driver, enum tdremus_mode mode)
 {
 	struct tdremus_state *s = (struct tdremus_state *)driver->data;
@@ -1636,7 +2059,7 @@ static int tdremus_open(td_driver_t *driver, const char *name,
 			td_flag_t flags)
 {
 	struct tdremus_state *s = (struct tdremus_state *)driver->data;
-	int rc;
+	int rc, fd;
 
 	RPRINTF("opening %s\n", name);
 
@@ -1648,9 +2071,12 @@ static int tdremus_open(td_driver_t *driver, const char *name,
 
 	memset(s, 0, sizeof(*s));
 	s->server_fd.fd = -1;
+	s->server_fd.id = -1;
 	s->stream_fd.fd = -1;
 	s->ctl_fd.fd = -1;
 	s->msg_fd.fd = -1;
+	s->send_id = -1;
+	INIT_LIST_HEAD(&s->send_queue);
 
 	/* TODO: this is only needed so that the server can send writes down
 	 * the driver stack from the stream_fd event handler */
@@ -1672,7 +2098,13 @@ static int tdremus_open(td_driver_t *driver, const char *name,
 		return rc;
 	}
 
-	if (!(rc = remus_bind(s)))
+	if ((fd = remus_env_fd("TAPDISK_REMUS_BACKUP_FD")) >= 0) {
+		if (!(rc = switch_mode(driver, mode_backup)))
+			rc = backup_stream(s, fd);
+	} else if ((fd = remus_env_fd("TAPDISK_REMUS_PRIMARY_FD")) >= 0) {
+		if (!(rc = switch_mode(driver, mode_primary)))
+			rc = primary_stream(s, fd);
+	} else if (!(rc = remus_bind(s)))
 		rc = switch_mode(driver, mode_backup);
 	else if (rc == -2)
 		rc = switch_mode(driver, mode_primary);
@@ -1691,6 +2123,7 @@ static int tdremus_close(td_driver_t *driver)
 	RPRINTF("closing\n");
 	if (s->ramdisk.inprogress)
 		hashtable_destroy(s->ramdisk.inprogress, 0);
+	ramdisk_drop_sectors(&s->ramdisk);
 	
 	if (s->driver_data) {
 		free(s->driver_data);
@@ -1702,6 +2135,8 @@ static int tdremus_close(td_driver_t *driver)
 	}
 	if (s->stream_fd.fd >= 0)
 		close_stream_fd(s);
+	remus_drop_queue(s);
+	remus_batch_free(&s->batch);
 
 	ctl_close(driver);
 
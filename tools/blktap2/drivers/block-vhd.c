@@ -109,7 +109,11 @@ unsigned int SPB;
 #endif
 
 /******VHD DEFINES******/
-#define VHD_CACHE_SIZE               32
+#define VHD_CACHE_SIZE               32    /* minimum bitmap cache size */
+#define VHD_CACHE_DEFAULT_KB         4096  /* default bitmap cache budget */
+
+#define VHD_BM_RA_MIN                2     /* bitmap readahead window */
+#define VHD_BM_RA_MAX                32
 
 #define VHD_REQS_DATA                TAPDISK_DATA_REQUESTS
 #define VHD_REQS_META                (VHD_CACHE_SIZE + 2)
@@ -143,11 +147,13 @@ unsigned int SPB;
 #define VHD_FLAG_BM_WRITE_PENDING    2
 #define VHD_FLAG_BM_READ_PENDING     4
 #define VHD_FLAG_BM_LOCKED           8
+#define VHD_FLAG_BM_PREFETCHED       16
 
 #define VHD_FLAG_REQ_UPDATE_BAT      1
 #define VHD_FLAG_REQ_UPDATE_BITMAP   2
 #define VHD_FLAG_REQ_QUEUED          4
 #define VHD_FLAG_REQ_FINISHED        8
+#define VHD_FLAG_REQ_READAHEAD       16
 
 #define VHD_FLAG_TX_LIVE             1
 #define VHD_FLAG_TX_UPDATE_BAT       2
@@ -195,7 +201,6 @@ struct vhd_bat_state {
 
 struct vhd_bitmap {
 	u32                       blk;
-	u64                       seqno;       /* lru sequence number */
 	vhd_flag_t                status;
 
 	char                     *map;         /* map should only be modified
@@ -213,6 +218,9 @@ struct vhd_bitmap {
 					        * be serviced until this bitmap
 					        * is read from disk */
 	struct vhd_request        req;
+
+	struct vhd_bitmap        *hnext;       /* bm_hash chain */
+	struct list_head          lru;         /* on bm_lru, or bm_free */
 };
 
 struct vhd_state {
@@ -227,13 +235,17 @@ struct vhd_state {
 
 	struct vhd_bat_state      bat;
 
-	u64                       bm_lru;      /* lru sequence number */
 	u32                       bm_secs;     /* size of bitmap, in sectors */
-	struct vhd_bitmap        *bitmap[VHD_CACHE_SIZE];
+	int                       bm_max;      /* cache capacity, in bitmaps */
+	int                       bm_count;    /* bitmaps allocated so far */
+	u32                       bm_hash_mask;
+	struct vhd_bitmap       **bm_hash;     /* cached bitmaps, by block */
+	struct list_head          bm_lru;      /* cached bitmaps, lru first */
+	struct list_head          bm_free;     /* allocated, but not cached */
 
-	int                       bm_free_count;
-	struct vhd_bitmap        *bitmap_free[VHD_CACHE_SIZE];
-	struct vhd_bitmap         bitmap_list[VHD_CACHE_SIZE];
+	u32                       bm_last;     /* last block read on demand */
+	int                       bm_ra;       /* readahead window */
+	int                       bm_ra_pending; /* readahead reads in flight */
 
 	int                       vreq_free_count;
 	struct vhd_request       *vreq_free[VHD_REQS_DATA];
@@ -248,6 +260,13 @@ struct vhd_state {
 	uint64_t                  read_size;
 	uint64_t                  writes;
 	uint64_t                  write_size;
+
+	uint64_t                  bm_hits;
+	uint64_t                  bm_misses;
+	uint64_t                  bm_ra_reads;
+	uint64_t                  bm_ra_hits;
+	uint64_t                  bm_ra_wasted;
+	uint64_t                  bm_evictions;
 };
 
 #define test_vhd_flag(word, flag)  ((word) & (flag))
@@ -258,6 +277,7 @@ struct vhd_state {
 
 static void vhd_complete(void *, struct tiocb *, int);
 static void finish_data_transaction(struct vhd_state *, struct vhd_bitmap *);
+static void vhd_bitmap_readahead(struct vhd_state *, uint32_t);
 
 static struct vhd_state  *_vhd_master;
 static unsigned long      _vhd_zsize;
@@ -450,59 +470,104 @@ fail:
 	return err;
 }
 
-static void
-vhd_free_bitmap_cache(struct vhd_state *s)
+static struct vhd_bitmap *
+vhd_create_bitmap(struct vhd_state *s)
 {
-	int i;
 	struct vhd_bitmap *bm;
+	size_t map_size;
+
+	map_size = vhd_sectors_to_bytes(s->bm_secs);
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap_list + i;
-		free(bm->map);
-		free(bm->shadow);
-		s->bitmap_free[i] = NULL;
+	bm = calloc(1, sizeof(struct vhd_bitmap));
+	if (!bm)
+		return NULL;
+
+	/* map and shadow share one allocation */
+	if (posix_memalign((void **)&bm->map, 512, 2 * map_size)) {
+		free(bm);
+		return NULL;
 	}
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	bm->shadow = bm->map + map_size;
+
+	return bm;
 }
 
+static void
+vhd_destroy_bitmap(struct vhd_bitmap *bm)
+{
+	free(bm->map);
+	free(bm);
+}
+
+static void
+vhd_free_bitmap_cache(struct vhd_state *s)
+{
+	struct vhd_bitmap *bm, *tmp;
+
+	if (!s->bm_hash)
+		return;
+
+	list_for_each_entry_safe(bm, tmp, &s->bm_lru, lru)
+		vhd_destroy_bitmap(bm);
+	list_for_each_entry_safe(bm, tmp, &s->bm_free, lru)
+		vhd_destroy_bitmap(bm);
+
+	free(s->bm_hash);
+	s->bm_hash  = NULL;
+	s->bm_count = 0;
+}
+
+/*
+ * Bitmaps are allocated as the cache fills, up to a memory budget of
+ * TAPDISK_VHD_BITMAP_CACHE_KB (VHD_CACHE_DEFAULT_KB) per image.  The
+ * cache never holds fewer than VHD_CACHE_SIZE bitmaps, and never more
+ * than the image has blocks.
+ */
 static int
-vhd_initialize_bitmap_cache(struct vhd_state *s)
+vhd_bitmap_cache_size(struct vhd_state *s)
 {
-	int i, err, map_size;
-	struct vhd_bitmap *bm;
+	unsigned long kb;
+	const char *env;
+	uint64_t n;
 
-	memset(s->bitmap_list, 0, sizeof(struct vhd_bitmap) * VHD_CACHE_SIZE);
+	kb  = VHD_CACHE_DEFAULT_KB;
+	env = getenv("TAPDISK_VHD_BITMAP_CACHE_KB");
+	if (env)
+		kb = strtoul(env, NULL, 10);
 
-	s->bm_lru        = 0;
-	map_size         = vhd_sectors_to_bytes(s->bm_secs);
-	s->bm_free_count = VHD_CACHE_SIZE;
+	n = ((uint64_t)kb << 10) /
+		(2 * vhd_sectors_to_bytes(s->bm_secs) +
+		 sizeof(struct vhd_bitmap));
+	n = MIN(n, s->vhd.header.max_bat_size);
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap_list + i;
+	return MAX(n, VHD_CACHE_SIZE);
+}
 
-		err = posix_memalign((void **)&bm->map, 512, map_size);
-		if (err) {
-			bm->map = NULL;
-			goto fail;
-		}
+static int
+vhd_initialize_bitmap_cache(struct vhd_state *s)
+{
+	u32 buckets;
 
-		err = posix_memalign((void **)&bm->shadow, 512, map_size);
-		if (err) {
-			bm->shadow = NULL;
-			goto fail;
-		}
+	INIT_LIST_HEAD(&s->bm_lru);
+	INIT_LIST_HEAD(&s->bm_free);
 
-		memset(bm->map, 0, map_size);
-		memset(bm->shadow, 0, map_size);
-		s->bitmap_free[i] = bm;
-	}
+	s->bm_max   = vhd_bitmap_cache_size(s);
+	s->bm_count = 0;
+	s->bm_last  = DD_BLK_UNUSED;
+	s->bm_ra    = VHD_BM_RA_MIN;
+	s->bm_ra_pending = 0;
 
-	return 0;
+	for (buckets = 1; buckets < s->bm_max; buckets <<= 1)
+		;
 
-fail:
-	vhd_free_bitmap_cache(s);
-	return err;
+	s->bm_hash = calloc(buckets, sizeof(struct vhd_bitmap *));
+	if (!s->bm_hash)
+		return -ENOMEM;
+
+	s->bm_hash_mask = buckets - 1;
+
+	return 0;
 }
 
 static int
@@ -664,6 +729,8 @@ __vhd_open(td_driver_t *driver, const char *name, vhd_flag_t flags)
 		s->writes++;
 	}
 
+	td_register_file(s->vhd.fd);
+
         return 0;
 
  fail:
@@ -731,6 +798,9 @@ _vhd_close(td_driver_t *driver)
 	DBG(TLOG_WARN, "vhd_close\n");
 	s = (struct vhd_state *)driver->data;
 
+	/* the vbd defers close while readahead is in flight, see vhd_busy */
+	ASSERT(!s->bm_ra_pending);
+
 	/* don't write footer if tapdisk is read-only */
 	if (test_vhd_flag(s->flags, VHD_FLAG_OPEN_RDONLY))
 		goto free;
@@ -757,6 +827,7 @@ _vhd_close(td_driver_t *driver)
 	}
 
  free:
+	td_unregister_file(s->vhd.fd);
 	vhd_log_close(s);
 	vhd_free_bat(s);
 	vhd_free_bitmap_cache(s);
@@ -958,7 +1029,6 @@ static inline void
 init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
 	bm->blk    = 0;
-	bm->seqno  = 0;
 	bm->status = 0;
 	init_tx(&bm->tx);
 	clear_req_list(&bm->queue);
@@ -971,18 +1041,31 @@ init_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 static inline struct vhd_bitmap *
 get_bitmap(struct vhd_state *s, uint32_t block)
 {
-	int i;
 	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->blk == block)
+	if (!s->bm_hash)
+		return NULL;
+
+	for (bm = s->bm_hash[block & s->bm_hash_mask]; bm; bm = bm->hnext)
+		if (bm->blk == block)
 			return bm;
-	}
 
 	return NULL;
 }
 
+static inline void
+unhash_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
+{
+	struct vhd_bitmap **pp;
+
+	pp = &s->bm_hash[bm->blk & s->bm_hash_mask];
+	while (*pp != bm)
+		pp = &(*pp)->hnext;
+
+	*pp       = bm->hnext;
+	bm->hnext = NULL;
+}
+
 static inline void
 lock_bitmap(struct vhd_bitmap *bm)
 {
@@ -1030,40 +1113,56 @@ bitmap_full(struct vhd_state *s, struct vhd_bitmap *bm)
 	return 1;
 }
 
+static inline int
+bitmap_ra_max(struct vhd_state *s)
+{
+	return MIN(VHD_BM_RA_MAX, s->bm_max / 4);
+}
+
 static struct vhd_bitmap *
 remove_lru_bitmap(struct vhd_state *s)
 {
-	int i, idx = 0;
-	u64 seq = s->bm_lru;
-	struct vhd_bitmap *bm, *lru = NULL;
+	struct vhd_bitmap *bm;
 
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		bm = s->bitmap[i];
-		if (bm && bm->seqno < seq && !bitmap_locked(bm)) {
-			idx = i;
-			lru = bm;
-			seq = lru->seqno;
+	list_for_each_entry(bm, &s->bm_lru, lru) {
+		if (bitmap_locked(bm))
+			continue;
+
+		ASSERT(!bitmap_in_use(bm));
+
+		if (test_vhd_flag(bm->status, VHD_FLAG_BM_PREFETCHED)) {
+			/* read ahead for nothing: read less ahead */
+			s->bm_ra_wasted++;
+			s->bm_ra = MAX(s->bm_ra >> 1, VHD_BM_RA_MIN);
 		}
-	}
 
-	if (lru) {
-		s->bitmap[idx] = NULL;
-		ASSERT(!bitmap_in_use(lru));
+		unhash_bitmap(s, bm);
+		list_del(&bm->lru);
+		s->bm_evictions++;
+
+		return bm;
 	}
 
-	return  lru;
+	return NULL;
 }
 
 static int
 alloc_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap **bitmap, uint32_t blk)
 {
-	struct vhd_bitmap *bm;
+	struct vhd_bitmap *bm = NULL;
 	
 	*bitmap = NULL;
 
-	if (s->bm_free_count > 0) {
-		bm = s->bitmap_free[--s->bm_free_count];
-	} else {
+	if (!list_empty(&s->bm_free)) {
+		bm = list_entry(s->bm_free.next, struct vhd_bitmap, lru);
+		list_del(&bm->lru);
+	} else if (s->bm_count < s->bm_max) {
+		bm = vhd_create_bitmap(s);
+		if (bm)
+			s->bm_count++;
+	}
+
+	if (!bm) {
 		bm = remove_lru_bitmap(s);
 		if (!bm)
 			return -EBUSY;
@@ -1076,63 +1175,35 @@ alloc_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap **bitmap, uint32_t blk)
 	return 0;
 }
 
-static inline uint64_t
-__bitmap_lru_seqno(struct vhd_state *s)
-{
-	int i;
-	struct vhd_bitmap *bm;
-
-	if (s->bm_lru == 0xffffffff) {
-		s->bm_lru = 0;
-		for (i = 0; i < VHD_CACHE_SIZE; i++) {
-			bm = s->bitmap[i];
-			if (bm) {
-				bm->seqno >>= 1;
-				if (bm->seqno > s->bm_lru)
-					s->bm_lru = bm->seqno;
-			}
-		}
-	}
-
-	return ++s->bm_lru;
-}
-
 static inline void
 touch_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	bm->seqno = __bitmap_lru_seqno(s);
+	list_del(&bm->lru);
+	list_add_tail(&bm->lru, &s->bm_lru);
 }
 
 static inline void
 install_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		if (!s->bitmap[i]) {
-			touch_bitmap(s, bm);
-			s->bitmap[i] = bm;
-			return;
-		}
-	}
+	struct vhd_bitmap **head;
 
-	ASSERT(0);
+	head      = &s->bm_hash[bm->blk & s->bm_hash_mask];
+	bm->hnext = *head;
+	*head     = bm;
+
+	list_add_tail(&bm->lru, &s->bm_lru);
 }
 
 static inline void
 free_vhd_bitmap(struct vhd_state *s, struct vhd_bitmap *bm)
 {
-	int i;
-
-	for (i = 0; i < VHD_CACHE_SIZE; i++)
-		if (s->bitmap[i] == bm)
-			break;
-
 	ASSERT(!bitmap_locked(bm));
 	ASSERT(!bitmap_in_use(bm));
-	ASSERT(i < VHD_CACHE_SIZE);
+	ASSERT(get_bitmap(s, bm->blk) == bm);
 
-	s->bitmap[i] = NULL;
-	s->bitmap_free[s->bm_free_count++] = bm;
+	unhash_bitmap(s, bm);
+	list_del(&bm->lru);
+	list_add(&bm->lru, &s->bm_free);
 }
 
 static int
@@ -1174,6 +1245,22 @@ read_bitmap_cache(struct vhd_state *s, uint64_t sector, uint8_t op)
 	/* bump lru count */
 	touch_bitmap(s, bm);
 
+	if (test_vhd_flag(bm->status, VHD_FLAG_BM_PREFETCHED)) {
+		int locked = bitmap_locked(bm);
+
+		/* the stream reached the readahead: keep ahead of it */
+		clear_vhd_flag(bm->status, VHD_FLAG_BM_PREFETCHED);
+		s->bm_ra_hits++;
+		s->bm_ra   = MIN(s->bm_ra << 1, bitmap_ra_max(s));
+		s->bm_last = blk;
+
+		lock_bitmap(bm);
+		vhd_bitmap_readahead(s, blk);
+		if (!locked)
+			unlock_bitmap(bm);
+	} else
+		s->bm_hits++;
+
 	if (test_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING))
 		return VHD_BM_READ_PENDING;
 
@@ -1551,7 +1638,7 @@ schedule_data_write(struct vhd_state *s, td_request_t treq, vhd_flag_t flags)
 }
 
 static int 
-schedule_bitmap_read(struct vhd_state *s, uint32_t blk)
+__schedule_bitmap_read(struct vhd_state *s, uint32_t blk, int prefetch)
 {
 	int err;
 	u64 offset;
@@ -1581,10 +1668,17 @@ schedule_bitmap_read(struct vhd_state *s, uint32_t blk)
 	req->op        = VHD_OP_BITMAP_READ;
 	req->next      = NULL;
 
+	if (prefetch) {
+		set_vhd_flag(req->flags, VHD_FLAG_REQ_READAHEAD);
+		s->bm_ra_pending++;
+	}
+
 	aio_read(s, req, offset);
 	lock_bitmap(bm);
 	install_bitmap(s, bm);
 	set_vhd_flag(bm->status, VHD_FLAG_BM_READ_PENDING);
+	if (prefetch)
+		set_vhd_flag(bm->status, VHD_FLAG_BM_PREFETCHED);
 
 	DBG(TLOG_DBG, "%s: lsec: 0x%08"PRIx64", blk: 0x%04x, nr_secs: 0x%04x, "
 	    "offset: 0x%08"PRIx64"\n", s->vhd.file, req->treq.sec, blk,
@@ -1593,6 +1687,50 @@ schedule_bitmap_read(struct vhd_state *s, uint32_t blk)
 	return 0;
 }
 
+/*
+ * read the bitmaps of the next bm_ra allocated blocks not cached yet.
+ * the window doubles each time the stream reaches a bitmap read ahead,
+ * and halves each time one is evicted unused.
+ */
+static void
+vhd_bitmap_readahead(struct vhd_state *s, uint32_t blk)
+{
+	uint32_t i, end;
+
+	end = MIN((uint64_t)blk + s->bm_ra, s->bat.bat.entries - 1);
+
+	for (i = blk + 1; i <= end; i++) {
+		if (bat_entry(s, i) == DD_BLK_UNUSED ||
+		    test_batmap(s, i) || get_bitmap(s, i))
+			continue;
+
+		if (__schedule_bitmap_read(s, i, 1))
+			break;
+
+		s->bm_ra_reads++;
+	}
+}
+
+/*
+ * a miss on the block after the previous miss starts reading ahead.
+ */
+static int
+schedule_bitmap_read(struct vhd_state *s, uint32_t blk)
+{
+	int err;
+
+	err = __schedule_bitmap_read(s, blk, 0);
+	if (err)
+		return err;
+
+	s->bm_misses++;
+	if (blk == s->bm_last + 1)
+		vhd_bitmap_readahead(s, blk);
+	s->bm_last = blk;
+
+	return 0;
+}
+
 static void
 schedule_bitmap_write(struct vhd_state *s, uint32_t blk)
 {
@@ -2215,6 +2353,8 @@ vhd_complete(void *arg, struct tiocb *tiocb, int err)
 		break;
 
 	case VHD_OP_BITMAP_READ:
+		if (test_vhd_flag(req->flags, VHD_FLAG_REQ_READAHEAD))
+			s->bm_ra_pending--;
 		finish_bitmap_read(req);
 		break;
 
@@ -2240,6 +2380,7 @@ void
 vhd_debug(td_driver_t *driver)
 {
 	int i;
+	struct vhd_bitmap *bm;
 	struct vhd_state *s = (struct vhd_state *)driver->data;
 
 	DBG(TLOG_WARN, "%s: QUEUED: 0x%08"PRIx64", COMPLETED: 0x%08"PRIx64", "
@@ -2261,41 +2402,51 @@ vhd_debug(td_driver_t *driver)
 			    t->sec, r->flags, r, r->next, r->tx);
 	}
 
-	DBG(TLOG_WARN, "BITMAP CACHE:\n");
-	for (i = 0; i < VHD_CACHE_SIZE; i++) {
-		int qnum = 0, wnum = 0, rnum = 0;
-		struct vhd_bitmap *bm = s->bitmap[i];
-		struct vhd_transaction *tx;
-		struct vhd_request *r;
-
-		if (!bm)
-			continue;
+	DBG(TLOG_WARN, "BITMAP CACHE: %d of %d, hits: %"PRIu64", "
+	    "misses: %"PRIu64", readahead: %"PRIu64" (%"PRIu64" hit, "
+	    "%"PRIu64" wasted, window %d), evictions: %"PRIu64"\n",
+	    s->bm_count, s->bm_max, s->bm_hits, s->bm_misses,
+	    s->bm_ra_reads, s->bm_ra_hits, s->bm_ra_wasted, s->bm_ra,
+	    s->bm_evictions);
+
+	/* only bitmaps with work pending: there may be thousands */
+	if (s->bm_hash) {
+		i = -1;
+		list_for_each_entry(bm, &s->bm_lru, lru) {
+			int qnum = 0, wnum = 0, rnum = 0;
+			struct vhd_transaction *tx;
+			struct vhd_request *r;
+
+			i++;
+			if (!bitmap_in_use(bm) && !bitmap_locked(bm))
+				continue;
+
+			tx = &bm->tx;
+			r = bm->queue.head;
+			while (r) {
+				qnum++;
+				r = r->next;
+			}
 
-		tx = &bm->tx;
-		r = bm->queue.head;
-		while (r) {
-			qnum++;
-			r = r->next;
-		}
+			r = bm->waiting.head;
+			while (r) {
+				wnum++;
+				r = r->next;
+			}
 
-		r = bm->waiting.head;
-		while (r) {
-			wnum++;
-			r = r->next;
-		}
+			r = tx->requests.head;
+			while (r) {
+				rnum++;
+				r = r->next;
+			}
 
-		r = tx->requests.head;
-		while (r) {
-			rnum++;
-			r = r->next;
+			DBG(TLOG_WARN, "%d: blk: 0x%04x, status: 0x%08x, q: %p, qnum: %d, w: %p, "
+			    "wnum: %d, locked: %d, in use: %d, tx: %p, tx_error: %d, "
+			    "started: %d, finished: %d, status: %u, reqs: %p, nreqs: %d\n",
+			    i, bm->blk, bm->status, bm->queue.head, qnum, bm->waiting.head,
+			    wnum, bitmap_locked(bm), bitmap_in_use(bm), tx, tx->error,
+			    tx->started, tx->finished, tx->status, tx->requests.head, rnum);
 		}
-
-		DBG(TLOG_WARN, "%d: blk: 0x%04x, status: 0x%08x, q: %p, qnum: %d, w: %p, "
-		    "wnum: %d, locked: %d, in use: %d, tx: %p, tx_error: %d, "
-		    "started: %d, finished: %d, status: %u, reqs: %p, nreqs: %d\n",
-		    i, bm->blk, bm->status, bm->queue.head, qnum, bm->waiting.head,
-		    wnum, bitmap_locked(bm), bitmap_in_use(bm), tx, tx->error,
-		    tx->started, tx->finished, tx->status, tx->requests.head, rnum);
 	}
 
 	DBG(TLOG_WARN, "BAT: status: 0x%08x, pbw_blk: 0x%04x, "
@@ -2308,6 +2459,50 @@ vhd_debug(td_driver_t *driver)
 */
 }
 
+static int
+vhd_stats(td_driver_t *driver, char *buf, size_t size)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	return snprintf(buf, size,
+			"reads=%"PRIu64" writes=%"PRIu64" bm_cache=%d/%d "
+			"bm_hits=%"PRIu64" bm_misses=%"PRIu64" "
+			"ra_reads=%"PRIu64" ra_hits=%"PRIu64" "
+			"ra_wasted=%"PRIu64" ra_window=%d evictions=%"PRIu64,
+			s->reads, s->writes, s->bm_count, s->bm_max,
+			s->bm_hits, s->bm_misses, s->bm_ra_reads,
+			s->bm_ra_hits, s->bm_ra_wasted, s->bm_ra,
+			s->bm_evictions);
+}
+
+static int
+vhd_allocated(td_driver_t *driver, td_sector_t sec, int secs)
+{
+	uint32_t blk, last;
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	if (!vhd_type_dynamic(&s->vhd))
+		return 1;
+
+	last = (sec + secs - 1) / s->spb;
+	for (blk = sec / s->spb; blk <= last; blk++) {
+		if (blk >= s->bat.bat.entries)
+			break;
+		if (bat_entry(s, blk) != DD_BLK_UNUSED)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int
+vhd_busy(td_driver_t *driver)
+{
+	struct vhd_state *s = (struct vhd_state *)driver->data;
+
+	return s->bm_ra_pending != 0;
+}
+
 struct tap_disk tapdisk_vhd = {
 	.disk_type          = "tapdisk_vhd",
 	.flags              = 0,
@@ -2319,4 +2514,7 @@ struct tap_disk tapdisk_vhd = {
 	.td_get_parent_id   = vhd_get_parent_id,
 	.td_validate_parent = vhd_validate_parent,
 	.td_debug           = vhd_debug,
+	.td_stats           = vhd_stats,
+	.td_allocated       = vhd_allocated,
+	.td_busy            = vhd_busy,
 };
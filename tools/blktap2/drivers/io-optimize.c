@@ -30,6 +30,7 @@
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <inttypes.h>
 
@@ -56,6 +57,9 @@ opio_free(struct opioctx *ctx)
 	free(ctx->free_opios);
 	ctx->free_opios = NULL;
 
+	free(ctx->iovecs);
+	ctx->iovecs = NULL;
+
 	free(ctx->iocb_queue);
 	ctx->iocb_queue = NULL;
 
@@ -63,6 +67,40 @@ opio_free(struct opioctx *ctx)
 	ctx->event_queue = NULL;
 }
 
+static const char *opio_elevators[] = {
+	[OPIO_ELEVATOR_NOOP]  = "noop",
+	[OPIO_ELEVATOR_MERGE] = "merge",
+	[OPIO_ELEVATOR_SORT]  = "sort",
+};
+
+const char *
+opio_elevator_name(int elevator)
+{
+	if (elevator < 0 || elevator > OPIO_ELEVATOR_SORT)
+		return "unknown";
+	return opio_elevators[elevator];
+}
+
+static void
+opio_configure(struct opioctx *ctx)
+{
+	const char *env;
+	int i;
+
+	ctx->elevator  = OPIO_ELEVATOR_SORT;
+	ctx->max_bytes = 0;
+
+	env = getenv("TAPDISK_IO_ELEVATOR");
+	if (env)
+		for (i = 0; i <= OPIO_ELEVATOR_SORT; i++)
+			if (!strcmp(env, opio_elevators[i]))
+				ctx->elevator = i;
+
+	env = getenv("TAPDISK_IO_MERGE_KB");
+	if (env)
+		ctx->max_bytes = strtoul(env, NULL, 10) << 10;
+}
+
 int
 opio_init(struct opioctx *ctx, int num_iocbs)
 {
@@ -74,13 +112,17 @@ opio_init(struct opioctx *ctx, int num_iocbs)
 	ctx->free_opio_cnt = num_iocbs;
 	ctx->opios         = calloc(1, sizeof(struct opio) * num_iocbs);
 	ctx->free_opios    = calloc(1, sizeof(struct opio *) * num_iocbs);
+	ctx->iovecs        = calloc(num_iocbs * OPIO_MAX_IOVS,
+				    sizeof(struct iovec));
 	ctx->iocb_queue    = calloc(1, sizeof(struct iocb *) * num_iocbs);
 	ctx->event_queue   = calloc(1, sizeof(struct io_event) * num_iocbs);
 
-	if (!ctx->opios || !ctx->free_opios ||
+	if (!ctx->opios || !ctx->free_opios || !ctx->iovecs ||
 	    !ctx->iocb_queue || !ctx->event_queue)
 		goto fail;
 
+	opio_configure(ctx);
+
 	for (i = 0; i < num_iocbs; i++)
 		ctx->free_opios[i] = &ctx->opios[i];
 
@@ -111,9 +153,10 @@ restore_iocb(struct opio *op)
 {
 	struct iocb *io = op->iocb;
 
-	io->data        = op->data;
-	io->u.c.buf     = op->buf;
-	io->u.c.nbytes  = op->nbytes;
+	io->data           = op->data;
+	io->aio_lio_opcode = op->opcode;
+	io->u.c.buf        = op->buf;
+	io->u.c.nbytes     = op->nbytes;
 }
 
 static inline int
@@ -132,18 +175,57 @@ contiguous_sectors(struct iocb *l, struct iocb *r)
 	return (l->u.c.offset + l->u.c.nbytes == r->u.c.offset);
 }
 
+/*
+ * While merging, a head iocb keeps its total length in u.c.nbytes; its
+ * buffers are tracked by the head opio, and only folded into a vectored
+ * iocb once the batch is complete.
+ */
+static inline struct iovec *
+last_iov(struct opioctx *ctx, struct iocb *io)
+{
+	struct opio *op;
+
+	if (!iocb_optimized(ctx, io))
+		return NULL;
+
+	op = (struct opio *)io->data;
+	return &op->iov[op->iovcnt - 1];
+}
+
 static inline int
-contiguous_buffers(struct iocb *l, struct iocb *r)
+contiguous_buffers(struct opioctx *ctx, struct iocb *l, struct iocb *r)
 {
-	return (l->u.c.buf + l->u.c.nbytes == r->u.c.buf);
+	struct iovec *iov = last_iov(ctx, l);
+
+	if (!iov)
+		return (l->u.c.buf + l->u.c.nbytes == r->u.c.buf);
+
+	return ((char *)iov->iov_base + iov->iov_len == r->u.c.buf);
 }
 
 static inline int
-contiguous_iocbs(struct iocb *l, struct iocb *r)
+mergeable_iocbs(struct opioctx *ctx, struct iocb *l, struct iocb *r)
 {
-	return ((l->aio_fildes == r->aio_fildes) &&
-		contiguous_sectors(l, r) &&
-		contiguous_buffers(l, r));
+	struct opio *op;
+
+	if (l->aio_fildes != r->aio_fildes || !contiguous_sectors(l, r))
+		return 0;
+
+	if (ctx->max_bytes &&
+	    l->u.c.nbytes + r->u.c.nbytes > ctx->max_bytes)
+		return 0;
+
+	if (contiguous_buffers(ctx, l, r))
+		return 1;
+
+	if (ctx->elevator != OPIO_ELEVATOR_SORT)
+		return 0;
+
+	if (!iocb_optimized(ctx, l))
+		return 1;
+
+	op = (struct opio *)l->data;
+	return (op->iovcnt < OPIO_MAX_IOVS);
 }
 
 static inline void
@@ -164,10 +246,16 @@ opio_iocb_init(struct opioctx *ctx, struct iocb *io)
 	op->buf    = io->u.c.buf;
 	op->nbytes = io->u.c.nbytes;
 	op->offset = io->u.c.offset;
+	op->opcode = io->aio_lio_opcode;
 	op->data   = io->data;
 	op->iocb   = io;
 	io->data   = op;
 
+	op->iov    = ctx->iovecs + (op - ctx->opios) * OPIO_MAX_IOVS;
+	op->iov[0].iov_base = op->buf;
+	op->iov[0].iov_len  = op->nbytes;
+	op->iovcnt = 1;
+
 	init_opio_list(op);
 
 	return op;
@@ -195,6 +283,14 @@ merge_tail(struct opioctx *ctx, struct iocb *head, struct iocb *io)
 	if (!opio)
 		return -ENOMEM;
 
+	if (contiguous_buffers(ctx, head, io))
+		ophead->iov[ophead->iovcnt - 1].iov_len += io->u.c.nbytes;
+	else {
+		ophead->iov[ophead->iovcnt].iov_base = io->u.c.buf;
+		ophead->iov[ophead->iovcnt].iov_len  = io->u.c.nbytes;
+		ophead->iovcnt++;
+	}
+
 	opio->head        = ophead;
 	head->u.c.nbytes += io->u.c.nbytes;
 	ophead->list.tail = ophead->list.tail->next = opio;
@@ -208,32 +304,101 @@ merge(struct opioctx *ctx, struct iocb *head, struct iocb *io)
 	if (head->aio_lio_opcode != io->aio_lio_opcode)
 		return -EINVAL;
 
-	if (!contiguous_iocbs(head, io))
+	if (io->aio_lio_opcode != IO_CMD_PREAD &&
+	    io->aio_lio_opcode != IO_CMD_PWRITE)
+		return -EINVAL;
+
+	if (!mergeable_iocbs(ctx, head, io))
 		return -EINVAL;
 
 	return merge_tail(ctx, head, io);		
 }
 
+static inline int
+iocb_before(struct iocb *l, struct iocb *r)
+{
+	if (l->aio_fildes != r->aio_fildes)
+		return l->aio_fildes < r->aio_fildes;
+	if (l->aio_lio_opcode != r->aio_lio_opcode)
+		return l->aio_lio_opcode < r->aio_lio_opcode;
+	return l->u.c.offset < r->u.c.offset;
+}
+
+/*
+ * Stable insertion sort by file, direction and offset, so that reads
+ * and writes to overlapping ranges don't break up each other's runs
+ * (nothing orders iocbs within a batch anyway).  Batches are at most a
+ * queue's worth of iocbs, and mostly sorted already, since requests
+ * are split into ascending segments.
+ */
+static void
+sort_iocbs(struct iocb **q, int num)
+{
+	int i, j;
+	struct iocb *io;
+
+	for (i = 1; i < num; i++) {
+		io = q[i];
+		for (j = i; j > 0 && iocb_before(io, q[j - 1]); j--)
+			q[j] = q[j - 1];
+		q[j] = io;
+	}
+}
+
+/*
+ * Once merging is done, turn heads with more than one buffer into
+ * vectored iocbs.  The iovecs live in the head opio until io_split().
+ */
+static void
+finish_merged_iocb(struct opioctx *ctx, struct iocb *io)
+{
+	struct opio *op;
+
+	if (!iocb_optimized(ctx, io))
+		return;
+
+	op       = (struct opio *)io->data;
+	op->size = io->u.c.nbytes;
+
+	if (op->iovcnt == 1)
+		return;
+
+	io->aio_lio_opcode = (op->opcode == IO_CMD_PWRITE ?
+			      IO_CMD_PWRITEV : IO_CMD_PREADV);
+	io->u.c.buf        = (void *)op->iov;
+	io->u.c.nbytes     = op->iovcnt;
+}
+
 int
 io_merge(struct opioctx *ctx, struct iocb **queue, int num)
 {
 	int i, on_queue;
 	struct iocb *io, **q;
-	struct opio *ophead;
 	
 	if (!num)
 		return 0;
 
+	if (ctx->elevator == OPIO_ELEVATOR_NOOP)
+		return num;
+
 	on_queue = 0;
 	q = ctx->iocb_queue;
 	memcpy(q, queue, num * sizeof(struct iocb *));
 
+	if (ctx->elevator == OPIO_ELEVATOR_SORT) {
+		sort_iocbs(q, num);
+		queue[0] = q[0];
+	}
+
 	for (i = 1; i < num; i++) {
 		io = q[i];
 		if (merge(ctx, queue[on_queue], io) != 0)
 			queue[++on_queue] = io;
 	}
 
+	for (i = 0; i <= on_queue; i++)
+		finish_merged_iocb(ctx, queue[i]);
+
 #if (defined(TEST) || defined(DEBUG))
 	print_merged_iocbs(ctx, queue, on_queue + 1);
 #endif
@@ -297,7 +462,7 @@ expand_event(struct opioctx *ctx,
 	ophead = (struct opio *)io->data;
 	op     = ophead;
 
-	if (event->res == io->u.c.nbytes)
+	if (event->res == ophead->size)
 		err = 0;
 	else if ((int)event->res < 0)
 		err = (int)event->res;
@@ -350,7 +515,23 @@ __print_iocb(struct opioctx *ctx, struct iocb *io, char *prefix)
 {
 	char *type;
 
-	type = (io->aio_lio_opcode == IO_CMD_PREAD ? "read" : "write");
+	switch (io->aio_lio_opcode) {
+	case IO_CMD_PREAD:
+		type = "read";
+		break;
+	case IO_CMD_PWRITE:
+		type = "write";
+		break;
+	case IO_CMD_PREADV:
+		type = "readv";
+		break;
+	case IO_CMD_PWRITEV:
+		type = "writev";
+		break;
+	default:
+		type = "unknown";
+		break;
+	}
 
 	DBG(ctx, "%soff: %08llx, nbytes: %04lx, buf: %p, type: %s, data: %08lx,"
 	    " optimized: %d\n", prefix, io->u.c.offset, io->u.c.nbytes, 
@@ -438,7 +619,10 @@ static void
 usage(void)
 {
 	fprintf(stderr, "usage: io_optimize [-n num_runs] "
-		"[-i num_iocbs] [-s num_secs] [-r random_seed]\n");
+		"[-i num_iocbs] [-s num_secs] [-r random_seed] "
+		"[-e noop|merge|sort] [-S]\n"
+		"  -S: a sequential write stream, with requests queued "
+		"out of order\n");
 	exit(-1);
 }
 
@@ -463,19 +647,64 @@ xfree(void *buf)
 }
 
 static void
-randomize_iocbs(struct iocb **iocbs, int num_iocbs, int num_secs)
+shuffle_requests(struct iocb **iocbs, int num_iocbs)
+{
+	int i, j, n, *start;
+	struct iocb **q;
+
+	start = malloc((num_iocbs + 1) * sizeof(int));
+	q     = malloc(num_iocbs * sizeof(struct iocb *));
+	if (!start || !q) {
+		fprintf(stderr, "shuffle failed\n");
+		exit(ENOMEM);
+	}
+
+	for (i = 0, n = 0; i < num_iocbs; i++)
+		if (data_is_head(iocbs[i]->data))
+			start[n++] = i;
+	start[n] = num_iocbs;
+
+	for (i = n - 1; i > 0; i--) {
+		int k = random() % (i + 1), t;
+		t = start[i]; start[i] = start[k]; start[k] = t;
+	}
+
+	for (i = 0, j = 0; i < n; i++) {
+		int s = start[i], e = s + 1;
+		while (e < num_iocbs && !data_is_head(iocbs[e]->data))
+			e++;
+		while (s < e)
+			q[j++] = iocbs[s++];
+	}
+
+	memcpy(iocbs, q, num_iocbs * sizeof(struct iocb *));
+	free(start);
+	free(q);
+}
+
+static void
+randomize_iocbs(struct iocb **iocbs, int num_iocbs, int num_secs,
+		int sequential)
 {
 	int i, j;
+	uint64_t next;
 
-	i = 0;
+	i    = 0;
+	next = ((random() % num_secs) << 9);
 	while (i < num_iocbs) {
 		char *buf;
 		short type;
 		int segs, sparse_mem;
 		uint64_t offset, nbytes;
 		
-		type   = (random() % 10 < 5 ? IO_CMD_PREAD : IO_CMD_PWRITE);
-		offset = ((random() % num_secs) << 9);
+		if (sequential) {
+			type   = IO_CMD_PWRITE;
+			offset = next;
+		} else {
+			type   = (random() % 10 < 5 ?
+				  IO_CMD_PREAD : IO_CMD_PWRITE);
+			offset = ((random() % num_secs) << 9);
+		}
 
 		if (random() % 10 < 4) {
 			segs   = 1;
@@ -511,8 +740,46 @@ randomize_iocbs(struct iocb **iocbs, int num_iocbs, int num_secs)
 				buf += nbytes;
 		}
 
-		i += segs;
+		i   += segs;
+		next = offset;
+	}
+
+	if (sequential)
+		shuffle_requests(iocbs, num_iocbs);
+}
+
+static unsigned long
+iocb_bytes(struct iocb *io)
+{
+	struct iovec *iov;
+	unsigned long i, bytes;
+
+	if (io->aio_lio_opcode != IO_CMD_PREADV &&
+	    io->aio_lio_opcode != IO_CMD_PWRITEV)
+		return io->u.c.nbytes;
+
+	iov = io->u.c.buf;
+	for (i = 0, bytes = 0; i < io->u.c.nbytes; i++)
+		bytes += iov[i].iov_len;
+
+	return bytes;
+}
+
+/* sectors the head travels, servicing iocbs in queue order */
+static uint64_t
+seek_distance(struct iocb **iocbs, int num_iocbs)
+{
+	int i;
+	uint64_t dist;
+	long long pos;
+
+	for (i = 0, dist = 0, pos = 0; i < num_iocbs; i++) {
+		long long off = iocbs[i]->u.c.offset;
+		dist += (off > pos ? off - pos : pos - off) >> 9;
+		pos   = off + iocb_bytes(iocbs[i]);
 	}
+
+	return dist;
 }
 
 static int
@@ -531,7 +798,7 @@ simulate_io(struct iocb **iocbs, struct io_event *events, int num_iocbs)
 		io      = iocbs[i];
 		ep      = &events[i];
 		ep->obj = io;
-		ep->res = (random() % 10 < 8 ? io->u.c.nbytes : 0);
+		ep->res = (random() % 10 < 8 ? iocb_bytes(io) : 0);
 	}
 
 	return done;
@@ -574,18 +841,23 @@ init_optest(struct iocb *iocb_list,
 int
 main(int argc, char **argv)
 {
-	uint64_t num_secs;
+	uint64_t num_secs, seeks_in, seeks_out;
 	struct opioctx ctx;
 	struct io_event *events;
-	int i, c, num_runs, num_iocbs, seed;
+	int i, c, num_runs, num_iocbs, seed, sequential, elevator;
+	long total_in, total_out;
 	struct iocb *iocb_list, **iocbs, **ioqueue;
 
-	num_runs  = 1;
-	num_iocbs = 300;
-	seed      = time(NULL);
-	num_secs  = ((4ULL << 20) >> 9); /* 4GB disk */
+	num_runs   = 1;
+	num_iocbs  = 300;
+	seed       = time(NULL);
+	num_secs   = ((4ULL << 20) >> 9); /* 4GB disk */
+	sequential = 0;
+	elevator   = -1;
+	total_in   = total_out = 0;
+	seeks_in   = seeks_out = 0;
 
-	while ((c = getopt(argc, argv, "n:i:s:r:h")) != -1) {
+	while ((c = getopt(argc, argv, "n:i:s:r:e:Sh")) != -1) {
 		switch (c) {
 		case 'n':
 			num_runs  = atoi(optarg);
@@ -599,6 +871,18 @@ main(int argc, char **argv)
 		case 'r':
 			seed      = atoi(optarg);
 			break;
+		case 'e':
+			for (elevator = OPIO_ELEVATOR_SORT;
+			     elevator >= 0; elevator--)
+				if (!strcmp(optarg,
+					    opio_elevator_name(elevator)))
+					break;
+			if (elevator < 0)
+				usage();
+			break;
+		case 'S':
+			sequential = 1;
+			break;
 		case 'h':
 			usage();
 		case '?':
@@ -621,17 +905,24 @@ main(int argc, char **argv)
 		exit(ENOMEM);
 	}
 
+	if (elevator >= 0)
+		ctx.elevator = elevator;
+
 	for (i = 0; i < num_runs; i++) {
 		int op_rem, op_done, num_split, num_events, num_done;
 
 		ioqueue = iocbs;
 		init_optest(iocb_list, ioqueue, events, num_iocbs);
-		randomize_iocbs(ioqueue, num_iocbs, num_secs);
+		randomize_iocbs(ioqueue, num_iocbs, num_secs, sequential);
 		print_iocbs(&ctx, ioqueue, num_iocbs);
+		seeks_in += seek_distance(ioqueue, num_iocbs);
 
 		op_done  = 0;
 		num_done = 0;
 		op_rem   = io_merge(&ctx, ioqueue, num_iocbs);
+		seeks_out += seek_distance(ioqueue, op_rem);
+		total_in  += num_iocbs;
+		total_out += op_rem;
 		print_iocbs(&ctx, ioqueue, op_rem);
 		print_merged_iocbs(&ctx, ioqueue, op_rem);
 		
@@ -661,6 +952,11 @@ main(int argc, char **argv)
 		xalloc_cnt = xfree_cnt = 0;
 	}
 
+	printf("elevator %s: %ld iocbs submitted as %ld (%.1f%%), "
+	       "seek distance %"PRIu64" -> %"PRIu64" sectors\n",
+	       opio_elevator_name(ctx.elevator), total_in, total_out,
+	       100.0 * total_out / total_in, seeks_in, seeks_out);
+
 	free(iocbs);
 	free(events);
 	free(iocb_list);
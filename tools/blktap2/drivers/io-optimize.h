@@ -30,6 +30,25 @@
 #define __IO_OPTIMIZE_H__
 
 #include <libaio.h>
+#include <sys/uio.h>
+
+/*
+ * Elevators, set with TAPDISK_IO_ELEVATOR:
+ *
+ *   noop:  submit iocbs as they were queued
+ *   merge: merge neighbouring iocbs that are contiguous on disk and in
+ *          memory
+ *   sort:  sort each batch by file, direction and offset, then merge
+ *          everything that is contiguous on disk, gathering
+ *          discontiguous buffers into a vectored iocb (default)
+ *
+ * TAPDISK_IO_MERGE_KB caps the size of a merged iocb (0: no limit).
+ */
+#define OPIO_ELEVATOR_NOOP  0
+#define OPIO_ELEVATOR_MERGE 1
+#define OPIO_ELEVATOR_SORT  2
+
+#define OPIO_MAX_IOVS       16
 
 struct opio;
 
@@ -42,19 +61,28 @@ struct opio {
 	char               *buf;
 	unsigned long       nbytes;
 	long long           offset;
+	short               opcode;
 	void               *data;
 	struct iocb        *iocb;
 	struct io_event     event;
 	struct opio        *head;
 	struct opio        *next;
 	struct opio_list    list;
+
+	/* heads only */
+	struct iovec       *iov;
+	int                 iovcnt;
+	unsigned long       size;
 };
 
 struct opioctx {
 	int                 num_opios;
 	int                 free_opio_cnt;
+	int                 elevator;
+	unsigned long       max_bytes;
 	struct opio        *opios;
 	struct opio       **free_opios;
+	struct iovec       *iovecs;
 	struct iocb       **iocb_queue;
 	struct io_event    *event_queue;
 };
@@ -64,5 +92,6 @@ void opio_free(struct opioctx *ctx);
 int io_merge(struct opioctx *ctx, struct iocb **queue, int num);
 int io_split(struct opioctx *ctx, struct io_event *events, int num);
 int io_expand_iocbs(struct opioctx *ctx, struct iocb **queue, int idx, int num);
+const char *opio_elevator_name(int elevator);
 
 #endif
@@ -30,6 +30,7 @@
 #define _QCOW_H_
 
 #include "aes.h"
+#include "list.h"
 /**************************************************************/
 /* QEMU COW block driver with compression and encryption support */
 
@@ -79,7 +80,11 @@ uint32_t gen_cksum(char *ptr, int len);
 int get_filesize(char *filename, uint64_t *size, struct stat *st);
 int qtruncate(int fd, off_t length, int sparse);
 
-#define L2_CACHE_SIZE 16  /*Fixed allocation in Qemu*/
+#define QCOW_L2_CACHE_MIN        16    /*Never cache fewer L2 tables*/
+#define QCOW_L2_CACHE_DEFAULT_KB 1024  /*Default L2 cache budget*/
+
+struct td_driver_handle;
+struct qcow_l2;
 
 struct tdqcow_state {
         int fd;                        /*Main Qcow file descriptor */
@@ -104,10 +109,10 @@ struct tdqcow_state {
 	uint64_t l1_table_offset;      /*L1 table offset from beginning of 
 					*file*/
 	uint64_t *l1_table;            /*L1 table entries*/
-	uint64_t *l2_cache;            /*We maintain a cache of size 
-					*L2_CACHE_SIZE of most read entries*/
-	uint64_t l2_cache_offsets[L2_CACHE_SIZE];     /*L2 cache entries*/
-	uint32_t l2_cache_counts[L2_CACHE_SIZE];      /*Cache access record*/
+	struct qcow_l2 **l2_tables;    /*Cached L2 tables, by L1 index*/
+	struct list_head l2_lru;       /*Cached L2 tables, lru first*/
+	int l2_cached;                 /*Number of L2 tables allocated*/
+	int l2_cache_max;              /*L2 cache budget, in tables*/
 	uint8_t *cluster_cache;          
 	uint8_t *cluster_data;
 	uint64_t cluster_cache_offset; /**/
@@ -123,6 +128,7 @@ struct tdqcow_state {
 	struct qcow_request   *aio_requests;
 	struct qcow_request  **aio_free_list;
 
+	struct td_driver_handle *driver;
 };
 
 int qcow_create(const char *filename, uint64_t total_size,
@@ -0,0 +1,250 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "remus-batch.h"
+
+/* tag and header, ahead of the data in remus_batch.buf */
+#define REMUS_BATCH_HEAD (REMUS_BATCH_TAG_SIZE + sizeof(struct remus_batch_hdr))
+
+static int
+remus_batch_grow(struct remus_batch *batch, size_t size)
+{
+	char *buf;
+
+	if (size <= batch->size)
+		return 0;
+
+	if (size < batch->size * 2)
+		size = batch->size * 2;
+
+	buf = realloc(batch->buf, REMUS_BATCH_HEAD + size);
+	if (!buf)
+		return -ENOMEM;
+
+	batch->buf  = buf;
+	batch->size = size;
+	return 0;
+}
+
+int
+remus_batch_init(struct remus_batch *batch, size_t sector_size, size_t limit)
+{
+	memset(batch, 0, sizeof(*batch));
+
+	batch->sector_size = sector_size;
+	batch->limit       = limit;
+
+	batch->buf = malloc(REMUS_BATCH_HEAD + limit);
+	if (!batch->buf)
+		return -ENOMEM;
+	batch->size = limit;
+
+	return 0;
+}
+
+void
+remus_batch_free(struct remus_batch *batch)
+{
+	free(batch->buf);
+	free(batch->ext);
+	memset(batch, 0, sizeof(*batch));
+}
+
+int
+remus_batch_add(struct remus_batch *batch, uint64_t sector,
+		int secs, const char *buf)
+{
+	struct remus_extent *ext;
+	size_t len;
+	int err, max;
+
+	len = (size_t)secs * batch->sector_size;
+
+	err = remus_batch_grow(batch, batch->used + len);
+	if (err)
+		return err;
+
+	ext = batch->extents ? batch->ext + batch->extents - 1 : NULL;
+	if (ext && ext->sector + ext->secs == sector &&
+	    ext->secs <= UINT32_MAX - secs)
+		ext->secs += secs;
+	else {
+		if (batch->extents == batch->max_extents) {
+			max = batch->max_extents ? batch->max_extents * 2 : 64;
+			ext = realloc(batch->ext, max * sizeof(*ext));
+			if (!ext)
+				return -ENOMEM;
+			batch->ext         = ext;
+			batch->max_extents = max;
+		}
+
+		ext = batch->ext + batch->extents++;
+		ext->sector = sector;
+		ext->secs   = secs;
+		ext->pad    = 0;
+	}
+
+	memcpy(batch->buf + REMUS_BATCH_HEAD + batch->used, buf, len);
+	batch->used += len;
+
+	return 0;
+}
+
+int
+remus_batch_seal(struct remus_batch *batch, int level, char **msg, size_t *len)
+{
+	struct remus_batch_hdr hdr;
+	size_t table;
+	uLongf zlen;
+	char *out, *buf;
+	int err;
+
+	table = batch->extents * sizeof(struct remus_extent);
+
+	err = remus_batch_grow(batch, batch->used + table);
+	if (err)
+		return err;
+
+	memcpy(batch->buf + REMUS_BATCH_HEAD + batch->used, batch->ext, table);
+
+	hdr.flags     = 0;
+	hdr.extents   = batch->extents;
+	hdr.size      = batch->used + table;
+	hdr.wire_size = hdr.size;
+
+	out = NULL;
+
+	if (level > 0) {
+		zlen = compressBound(hdr.size);
+		out  = malloc(REMUS_BATCH_HEAD + zlen);
+		if (out &&
+		    compress2((Bytef *)out + REMUS_BATCH_HEAD, &zlen,
+			      (Bytef *)batch->buf + REMUS_BATCH_HEAD,
+			      hdr.size, level) == Z_OK &&
+		    zlen < hdr.size) {
+			hdr.flags    |= REMUS_BATCH_DEFLATE;
+			hdr.wire_size = zlen;
+		} else {
+			free(out);
+			out = NULL;
+		}
+	}
+
+	if (!out) {
+		/* hand out the buffer itself, and start over in a new one */
+		buf = malloc(REMUS_BATCH_HEAD + batch->limit);
+		if (!buf)
+			return -ENOMEM;
+
+		out         = batch->buf;
+		batch->buf  = buf;
+		batch->size = batch->limit;
+	}
+
+	memcpy(out, REMUS_BATCH_TAG, REMUS_BATCH_TAG_SIZE);
+	memcpy(out + REMUS_BATCH_TAG_SIZE, &hdr, sizeof(hdr));
+
+	*msg = out;
+	*len = REMUS_BATCH_HEAD + hdr.wire_size;
+
+	batch->used    = 0;
+	batch->extents = 0;
+
+	return 0;
+}
+
+int
+remus_batch_apply(const struct remus_batch_hdr *hdr, char *payload,
+		  size_t sector_size, remus_extent_cb_t cb, void *arg)
+{
+	struct remus_extent ext;
+	size_t table, data, off;
+	char *raw, *tbl;
+	uLongf len;
+	uint32_t i;
+	int err;
+
+	if (hdr->size > REMUS_BATCH_MAX_SIZE ||
+	    hdr->wire_size > REMUS_BATCH_MAX_SIZE)
+		return -EINVAL;
+
+	table = (size_t)hdr->extents * sizeof(struct remus_extent);
+	if (table > hdr->size)
+		return -EINVAL;
+
+	raw = payload;
+
+	if (hdr->flags & REMUS_BATCH_DEFLATE) {
+		raw = malloc(hdr->size ? hdr->size : 1);
+		if (!raw)
+			return -ENOMEM;
+
+		len = hdr->size;
+		if (uncompress((Bytef *)raw, &len, (Bytef *)payload,
+			       hdr->wire_size) != Z_OK || len != hdr->size) {
+			err = -EIO;
+			goto out;
+		}
+	} else if (hdr->wire_size != hdr->size)
+		return -EINVAL;
+
+	data = hdr->size - table;
+	tbl  = raw + data;
+
+	/* check the whole table first, so as not to apply half a batch */
+	for (off = 0, i = 0; i < hdr->extents; i++) {
+		memcpy(&ext, tbl + i * sizeof(ext), sizeof(ext));
+		off += (size_t)ext.secs * sector_size;
+		if (off > data) {
+			err = -EINVAL;
+			goto out;
+		}
+	}
+
+	if (off != data) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	for (err = 0, off = 0, i = 0; i < hdr->extents; i++) {
+		memcpy(&ext, tbl + i * sizeof(ext), sizeof(ext));
+
+		err = cb(arg, ext.sector, ext.secs, raw + off);
+		if (err)
+			break;
+
+		off += (size_t)ext.secs * sector_size;
+	}
+
+out:
+	if (raw != payload)
+		free(raw);
+	return err;
+}
@@ -0,0 +1,121 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _REMUS_BATCH_H_
+#define _REMUS_BATCH_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Write batches of the remus replication stream.  The writes of a
+ * checkpoint epoch are collected into one buffer, writes that continue
+ * the previous one merged into a single extent, and shipped as
+ *
+ *    "breq"      4
+ *    header      16 (struct remus_batch_hdr)
+ *    payload     wire_size
+ *
+ * The payload is the data of all extents followed by the extent table,
+ * deflated with zlib if REMUS_BATCH_DEFLATE is set.  Extents are applied
+ * in order, so later writes to a sector replace earlier ones.
+ */
+
+#define REMUS_BATCH_TAG          "breq"
+#define REMUS_BATCH_TAG_SIZE     4
+
+#define REMUS_BATCH_DEFLATE      0x1
+
+/* refuse payloads larger than this from the wire */
+#define REMUS_BATCH_MAX_SIZE     (64 << 20)
+
+/*
+ * largest batch limit a sender may use.  a batch overruns its limit by
+ * the write that fills it and by the extent table (at most 16 bytes per
+ * sector), so half the maximum payload leaves ample room.
+ */
+#define REMUS_BATCH_MAX_LIMIT    (REMUS_BATCH_MAX_SIZE / 2)
+
+struct remus_batch_hdr {
+	uint32_t                 flags;
+	uint32_t                 extents;
+	uint32_t                 size;      /* payload, uncompressed */
+	uint32_t                 wire_size; /* payload, as sent */
+};
+
+struct remus_extent {
+	uint64_t                 sector;
+	uint32_t                 secs;
+	uint32_t                 pad;
+};
+
+struct remus_batch {
+	size_t                   sector_size;
+	size_t                   limit;     /* seal when data exceeds this */
+
+	char                    *buf;       /* tag, header, data */
+	size_t                   used;      /* data bytes */
+	size_t                   size;      /* data bytes allocated */
+
+	struct remus_extent     *ext;
+	int                      extents;
+	int                      max_extents;
+};
+
+int remus_batch_init(struct remus_batch *, size_t sector_size, size_t limit);
+void remus_batch_free(struct remus_batch *);
+int remus_batch_add(struct remus_batch *, uint64_t sector,
+		    int secs, const char *buf);
+
+static inline int
+remus_batch_empty(struct remus_batch *batch)
+{
+	return !batch->extents;
+}
+
+static inline int
+remus_batch_full(struct remus_batch *batch)
+{
+	return batch->used >= batch->limit;
+}
+
+/*
+ * Hand out the batch as a message of *len bytes, deflated with zlib at
+ * the given level if that makes it smaller (0 to never deflate), and
+ * start a new one.  The caller frees the message.
+ */
+int remus_batch_seal(struct remus_batch *, int level, char **msg, size_t *len);
+
+typedef int (*remus_extent_cb_t)(void *arg, uint64_t sector,
+				 int secs, char *buf);
+
+/*
+ * Apply a batch received as @hdr and @payload (of hdr->wire_size
+ * bytes), calling @cb for each extent in order.
+ */
+int remus_batch_apply(const struct remus_batch_hdr *hdr, char *payload,
+		      size_t sector_size, remus_extent_cb_t cb, void *arg);
+
+#endif
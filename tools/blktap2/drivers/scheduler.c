@@ -41,6 +41,16 @@
 				     SCHEDULER_POLL_WRITE_FD |	\
 				     SCHEDULER_POLL_EXCEPT_FD)
 
+/*
+ * What select() reports for the poll events of a file, so that the
+ * callbacks see the same readiness they did before the switch to epoll.
+ */
+#define SCHEDULER_EPOLL_READ        (EPOLLIN | EPOLLRDNORM | EPOLLRDBAND | \
+				     EPOLLHUP | EPOLLERR)
+#define SCHEDULER_EPOLL_WRITE       (EPOLLOUT | EPOLLWRNORM | EPOLLWRBAND | \
+				     EPOLLERR)
+#define SCHEDULER_EPOLL_EXCEPT      (EPOLLPRI)
+
 #define MIN(a, b)                   ((a) <= (b) ? (a) : (b))
 #define MAX(a, b)                   ((a) >= (b) ? (a) : (b))
 
@@ -49,114 +59,470 @@
 
 typedef struct event {
 	char                         mode;
+	char                         dead;
 	event_id_t                   id;
+	unsigned long long           seq;
 
 	int                          fd;
 	int                          timeout;
 	int                          deadline;
+	int                          heap;
+	int                          pass;
 
 	event_cb_t                   cb;
 	void                        *private;
 
 	struct list_head             next;
+	struct list_head             fd_next;
 } event_t;
 
+/*
+ * The events watching one fd.  Each fd is registered with epoll once,
+ * for the union of the modes of its events, and stays registered until
+ * the last of them goes away.
+ */
+struct scheduler_fd {
+	int                          fd;
+	char                         mode;
+	char                         ready;
+	int                          unpollable;
+
+	struct list_head             events;
+	struct list_head             next;
+};
+
+static int
+scheduler_grow(void **array, int *size, int need, size_t elem)
+{
+	void *p;
+	int new;
+
+	if (need <= *size)
+		return 0;
+
+	new = MAX(need, MAX(*size * 2, 16));
+	p = realloc(*array, new * elem);
+	if (!p)
+		return -ENOMEM;
+
+	memset((char *)p + *size * elem, 0, (new - *size) * elem);
+	*array = p;
+	*size  = new;
+
+	return 0;
+}
+
+static int
+scheduler_timer_before(event_t *a, event_t *b)
+{
+	if (a->deadline != b->deadline)
+		return a->deadline < b->deadline;
+	return a->seq < b->seq;
+}
+
+static void
+scheduler_timer_set(scheduler_t *s, int i, event_t *event)
+{
+	s->timers[i] = event;
+	event->heap  = i;
+}
+
+static void
+scheduler_timer_sift(scheduler_t *s, int i)
+{
+	event_t *event = s->timers[i];
+	int child;
+
+	while (i > 0 &&
+	       scheduler_timer_before(event, s->timers[(i - 1) / 2])) {
+		scheduler_timer_set(s, i, s->timers[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= s->nr_timers)
+			break;
+		if (child + 1 < s->nr_timers &&
+		    scheduler_timer_before(s->timers[child + 1],
+					   s->timers[child]))
+			child++;
+		if (!scheduler_timer_before(s->timers[child], event))
+			break;
+		scheduler_timer_set(s, i, s->timers[child]);
+		i = child;
+	}
+
+	scheduler_timer_set(s, i, event);
+}
+
+static int
+scheduler_add_timer(scheduler_t *s, event_t *event)
+{
+	int err;
+
+	err = scheduler_grow((void **)&s->timers, &s->timers_size,
+			     s->nr_timers + 1, sizeof(event_t *));
+	if (err)
+		return err;
+
+	scheduler_timer_set(s, s->nr_timers++, event);
+	scheduler_timer_sift(s, event->heap);
+
+	return 0;
+}
+
+static void
+scheduler_del_timer(scheduler_t *s, event_t *event)
+{
+	int i = event->heap;
+
+	event->heap = -1;
+	if (i < 0)
+		return;
+
+	if (i != --s->nr_timers) {
+		scheduler_timer_set(s, i, s->timers[s->nr_timers]);
+		scheduler_timer_sift(s, i);
+	}
+}
+
+static int
+scheduler_epoll_ctl(scheduler_t *s, struct scheduler_fd *sfd, char mode)
+{
+	struct epoll_event ev;
+	int op, err;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.data.fd = sfd->fd;
+	if (mode & SCHEDULER_POLL_READ_FD)
+		ev.events |= EPOLLIN;
+	if (mode & SCHEDULER_POLL_WRITE_FD)
+		ev.events |= EPOLLOUT;
+	if (mode & SCHEDULER_POLL_EXCEPT_FD)
+		ev.events |= EPOLLPRI;
+
+	if (!mode)
+		op = EPOLL_CTL_DEL;
+	else if (sfd->mode)
+		op = EPOLL_CTL_MOD;
+	else
+		op = EPOLL_CTL_ADD;
+
+	if (sfd->unpollable) {
+		if (!mode) {
+			list_del(&sfd->next);
+			sfd->unpollable = 0;
+		}
+		return 0;
+	}
+
+	err = epoll_ctl(s->epoll_fd, op, sfd->fd, &ev);
+
+	/*
+	 * The fd may have been closed and reused behind our back, which
+	 * drops it from the epoll set.
+	 */
+	if (err && errno == ENOENT && op == EPOLL_CTL_MOD)
+		err = epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, sfd->fd, &ev);
+	else if (err && errno == EEXIST && op == EPOLL_CTL_ADD)
+		err = epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, sfd->fd, &ev);
+
+	if (!mode) {
+		s->nr_polled--;
+		return 0;
+	}
+
+	if (err && errno == EPERM && op == EPOLL_CTL_ADD) {
+		/* Regular files: select() always found them ready. */
+		sfd->unpollable = 1;
+		list_add_tail(&sfd->next, &s->unpollable);
+		return 0;
+	}
+
+	if (err)
+		return -errno;
+
+	if (op == EPOLL_CTL_ADD)
+		s->nr_polled++;
+
+	return 0;
+}
+
+static int
+scheduler_update_fd(scheduler_t *s, struct scheduler_fd *sfd)
+{
+	event_t *event;
+	char mode = 0;
+	int err;
+
+	list_for_each_entry(event, &sfd->events, fd_next)
+		mode |= event->mode & SCHEDULER_POLL_FD;
+
+	if (mode != sfd->mode) {
+		err = scheduler_epoll_ctl(s, sfd, mode);
+		if (err)
+			return err;
+		sfd->mode = mode;
+	}
+
+	if (!mode) {
+		s->fds[sfd->fd] = NULL;
+		free(sfd);
+	}
+
+	return 0;
+}
+
+static int
+scheduler_open_epoll(scheduler_t *s)
+{
+	if (s->epoll_fd < 0) {
+		s->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (s->epoll_fd < 0)
+			return -errno;
+	}
+
+	return 0;
+}
+
+static int
+scheduler_add_fd_event(scheduler_t *s, event_t *event)
+{
+	struct scheduler_fd *sfd;
+	int err;
+
+	if (event->fd < 0)
+		return -EBADF;
+
+	err = scheduler_open_epoll(s);
+	if (err)
+		return err;
+
+	err = scheduler_grow((void **)&s->fds, &s->fds_size,
+			     event->fd + 1, sizeof(struct scheduler_fd *));
+	if (err)
+		return err;
+
+	sfd = s->fds[event->fd];
+	if (!sfd) {
+		sfd = calloc(1, sizeof(*sfd));
+		if (!sfd)
+			return -ENOMEM;
+
+		sfd->fd = event->fd;
+		INIT_LIST_HEAD(&sfd->events);
+		INIT_LIST_HEAD(&sfd->next);
+		s->fds[event->fd] = sfd;
+	}
+
+	list_add_tail(&event->fd_next, &sfd->events);
+
+	err = scheduler_update_fd(s, sfd);
+	if (err) {
+		list_del(&event->fd_next);
+		scheduler_update_fd(s, sfd);
+	}
+
+	return err;
+}
+
+static void
+scheduler_del_fd_event(scheduler_t *s, event_t *event)
+{
+	struct scheduler_fd *sfd = s->fds[event->fd];
+
+	list_del(&event->fd_next);
+	scheduler_update_fd(s, sfd);
+}
+
 static void
 scheduler_prepare_events(scheduler_t *s)
 {
 	int diff;
 	struct timeval now;
-	event_t *event, *tmp;
-
-	FD_ZERO(&s->read_fds);
-	FD_ZERO(&s->write_fds);
-	FD_ZERO(&s->except_fds);
 
-	s->max_fd  = 0;
 	s->timeout = SCHEDULER_MAX_TIMEOUT;
 
 	gettimeofday(&now, NULL);
 
-	scheduler_for_each_event(s, event, tmp) {
-		if (event->mode & SCHEDULER_POLL_READ_FD) {
-			FD_SET(event->fd, &s->read_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
+	if (s->nr_timers) {
+		diff = s->timers[0]->deadline - now.tv_sec;
+		if (diff > 0)
+			s->timeout = MIN(s->timeout, diff);
+		else
+			s->timeout = 0;
+	}
 
-		if (event->mode & SCHEDULER_POLL_WRITE_FD) {
-			FD_SET(event->fd, &s->write_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
+	if (!list_empty(&s->unpollable))
+		s->timeout = 0;
 
-		if (event->mode & SCHEDULER_POLL_EXCEPT_FD) {
-			FD_SET(event->fd, &s->except_fds);
-			s->max_fd = MAX(event->fd, s->max_fd);
-		}
+	s->timeout = MIN(s->timeout, s->max_timeout);
+}
 
-		if (event->mode & SCHEDULER_POLL_TIMEOUT) {
-			diff = event->deadline - now.tv_sec;
-			if (diff > 0)
-				s->timeout = MIN(s->timeout, diff);
-			else
-				s->timeout = 0;
-		}
+static void
+scheduler_queue_event(scheduler_t *s, event_t *event)
+{
+	if (event->pass == s->pass)
+		return;
+
+	if (scheduler_grow((void **)&s->pending, &s->pending_size,
+			   s->nr_pending + 1, sizeof(event_t *))) {
+		tlog_write(TLOG_WARN, "no memory to run event %d\n",
+			   event->id);
+		return;
 	}
 
-	s->timeout = MIN(s->timeout, s->max_timeout);
+	event->pass = s->pass;
+	s->pending[s->nr_pending++] = event;
+}
+
+static void
+scheduler_queue_fd(scheduler_t *s, struct scheduler_fd *sfd, char ready)
+{
+	event_t *event;
+
+	sfd->ready |= ready & sfd->mode;
+	if (!sfd->ready)
+		return;
+
+	list_for_each_entry(event, &sfd->events, fd_next)
+		scheduler_queue_event(s, event);
 }
 
 static void
-scheduler_event_callback(event_t *event, char mode)
+scheduler_queue_timers(scheduler_t *s, int i, time_t now)
+{
+	if (i >= s->nr_timers || s->timers[i]->deadline > now)
+		return;
+
+	scheduler_queue_event(s, s->timers[i]);
+	scheduler_queue_timers(s, 2 * i + 1, now);
+	scheduler_queue_timers(s, 2 * i + 2, now);
+}
+
+static int
+scheduler_event_order(const void *a, const void *b)
+{
+	const event_t *x = *(event_t * const *)a;
+	const event_t *y = *(event_t * const *)b;
+
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static void
+scheduler_event_callback(scheduler_t *s, event_t *event, char mode)
 {
 	if (event->mode & SCHEDULER_POLL_TIMEOUT) {
 		struct timeval now;
 		gettimeofday(&now, NULL);
 		event->deadline = now.tv_sec + event->timeout;
+		scheduler_timer_sift(s, event->heap);
 	}
 
 	event->cb(event->id, mode, event->private);
 }
 
+/*
+ * Only the events on ready fds and expired timers are looked at, but
+ * they are run as the select() loop ran them: in the order they were
+ * registered, with at most one callback each, and with the readiness of
+ * an fd going to the first event to ask for it.
+ */
 static void
-scheduler_run_events(scheduler_t *s)
+scheduler_run_events(scheduler_t *s, int nr_polled)
 {
+	struct scheduler_fd *sfd;
 	struct timeval now;
 	event_t *event, *tmp;
+	int i;
 
 	gettimeofday(&now, NULL);
 
- again:
-	s->restart = 0;
+	s->pass++;
+	s->nr_pending = 0;
+
+	for (i = 0; i < nr_polled; i++) {
+		struct epoll_event *ev = &s->polled[i];
+		char ready = 0;
+
+		if (ev->events & SCHEDULER_EPOLL_READ)
+			ready |= SCHEDULER_POLL_READ_FD;
+		if (ev->events & SCHEDULER_EPOLL_WRITE)
+			ready |= SCHEDULER_POLL_WRITE_FD;
+		if (ev->events & SCHEDULER_EPOLL_EXCEPT)
+			ready |= SCHEDULER_POLL_EXCEPT_FD;
+
+		sfd = s->fds[ev->data.fd];
+		if (sfd)
+			scheduler_queue_fd(s, sfd, ready);
+	}
+
+	list_for_each_entry(sfd, &s->unpollable, next)
+		scheduler_queue_fd(s, sfd,
+				   SCHEDULER_POLL_READ_FD |
+				   SCHEDULER_POLL_WRITE_FD);
+
+	scheduler_queue_timers(s, 0, now.tv_sec);
+
+	qsort(s->pending, s->nr_pending, sizeof(event_t *),
+	      scheduler_event_order);
+
+	s->running = 1;
 
-	scheduler_for_each_event(s, event, tmp) {
-		if ((event->mode & SCHEDULER_POLL_READ_FD) &&
-		    FD_ISSET(event->fd, &s->read_fds)) {
-			FD_CLR(event->fd, &s->read_fds);
-			scheduler_event_callback(event, SCHEDULER_POLL_READ_FD);
-			goto next;
+	for (i = 0; i < s->nr_pending; i++) {
+		event = s->pending[i];
+		if (event->dead)
+			continue;
+
+		sfd = NULL;
+		if (event->mode & SCHEDULER_POLL_FD)
+			sfd = s->fds[event->fd];
+
+		if (sfd && (event->mode & SCHEDULER_POLL_READ_FD) &&
+		    (sfd->ready & SCHEDULER_POLL_READ_FD)) {
+			sfd->ready &= ~SCHEDULER_POLL_READ_FD;
+			scheduler_event_callback(s, event,
+						 SCHEDULER_POLL_READ_FD);
+			continue;
 		}
 
-		if ((event->mode & SCHEDULER_POLL_WRITE_FD) &&
-		    FD_ISSET(event->fd, &s->write_fds)) {
-			FD_CLR(event->fd, &s->write_fds);
-			scheduler_event_callback(event, SCHEDULER_POLL_WRITE_FD);
-			goto next;
+		if (sfd && (event->mode & SCHEDULER_POLL_WRITE_FD) &&
+		    (sfd->ready & SCHEDULER_POLL_WRITE_FD)) {
+			sfd->ready &= ~SCHEDULER_POLL_WRITE_FD;
+			scheduler_event_callback(s, event,
+						 SCHEDULER_POLL_WRITE_FD);
+			continue;
 		}
 
-		if ((event->mode & SCHEDULER_POLL_EXCEPT_FD) &&
-		    FD_ISSET(event->fd, &s->except_fds)) {
-			FD_CLR(event->fd, &s->except_fds);
-			scheduler_event_callback(event, SCHEDULER_POLL_EXCEPT_FD);
-			goto next;
+		if (sfd && (event->mode & SCHEDULER_POLL_EXCEPT_FD) &&
+		    (sfd->ready & SCHEDULER_POLL_EXCEPT_FD)) {
+			sfd->ready &= ~SCHEDULER_POLL_EXCEPT_FD;
+			scheduler_event_callback(s, event,
+						 SCHEDULER_POLL_EXCEPT_FD);
+			continue;
 		}
 
 		if ((event->mode & SCHEDULER_POLL_TIMEOUT) &&
 		    (event->deadline <= now.tv_sec))
-		    scheduler_event_callback(event, SCHEDULER_POLL_TIMEOUT);
+			scheduler_event_callback(s, event,
+						 SCHEDULER_POLL_TIMEOUT);
+	}
 
-	next:
-		if (s->restart)
-			goto again;
+	s->running = 0;
+
+	for (i = 0; i < nr_polled; i++) {
+		sfd = s->fds[s->polled[i].data.fd];
+		if (sfd)
+			sfd->ready = 0;
+	}
+
+	list_for_each_entry(sfd, &s->unpollable, next)
+		sfd->ready = 0;
+
+	list_for_each_entry_safe(event, tmp, &s->zombies, next) {
+		list_del(&event->next);
+		free(event);
 	}
 }
 
@@ -166,6 +532,7 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 {
 	event_t *event;
 	struct timeval now;
+	int err;
 
 	if (!cb)
 		return -EINVAL;
@@ -180,6 +547,7 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	gettimeofday(&now, NULL);
 
 	INIT_LIST_HEAD(&event->next);
+	INIT_LIST_HEAD(&event->fd_next);
 
 	event->mode     = mode;
 	event->fd       = fd;
@@ -187,7 +555,25 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	event->deadline = now.tv_sec + timeout;
 	event->cb       = cb;
 	event->private  = private;
-	event->id       = s->uuid++;
+	event->heap     = -1;
+	event->seq      = s->seq++;
+
+	if (mode & SCHEDULER_POLL_FD) {
+		err = scheduler_add_fd_event(s, event);
+		if (err)
+			goto fail;
+	}
+
+	if (mode & SCHEDULER_POLL_TIMEOUT) {
+		err = scheduler_add_timer(s, event);
+		if (err) {
+			if (mode & SCHEDULER_POLL_FD)
+				scheduler_del_fd_event(s, event);
+			goto fail;
+		}
+	}
+
+	event->id = s->uuid++;
 
 	if (!s->uuid)
 		s->uuid++;
@@ -195,6 +581,10 @@ scheduler_register_event(scheduler_t *s, char mode, int fd,
 	list_add_tail(&event->next, &s->events);
 
 	return event->id;
+
+fail:
+	free(event);
+	return err;
 }
 
 void
@@ -208,8 +598,17 @@ scheduler_unregister_event(scheduler_t *s, event_id_t id)
 	scheduler_for_each_event(s, event, tmp)
 		if (event->id == id) {
 			list_del(&event->next);
-			free(event);
-			s->restart = 1;
+
+			if (event->mode & SCHEDULER_POLL_FD)
+				scheduler_del_fd_event(s, event);
+			scheduler_del_timer(s, event);
+
+			/* The event may still be queued to run in this pass. */
+			if (s->running) {
+				event->dead = 1;
+				list_add_tail(&event->next, &s->zombies);
+			} else
+				free(event);
 			break;
 		}
 }
@@ -224,28 +623,32 @@ scheduler_set_max_timeout(scheduler_t *s, int timeout)
 int
 scheduler_wait_for_events(scheduler_t *s)
 {
-	int ret;
-	struct timeval tv;
+	int ret, err;
 
 	scheduler_prepare_events(s);
 
-	tv.tv_sec  = s->timeout;
-	tv.tv_usec = 0;
-
 	DBG("timeout: %d, max_timeout: %d\n",
 	    s->timeout, s->max_timeout);
 
-	ret = select(s->max_fd + 1, &s->read_fds,
-		     &s->write_fds, &s->except_fds, &tv);
+	err = scheduler_open_epoll(s);
+	if (!err)
+		err = scheduler_grow((void **)&s->polled, &s->polled_size,
+				     MAX(s->nr_polled, 1),
+				     sizeof(struct epoll_event));
+	if (err) {
+		errno = -err;
+		ret   = -1;
+	} else
+		ret = epoll_wait(s->epoll_fd, s->polled, s->polled_size,
+				 s->timeout * 1000);
 
-	s->restart     = 0;
 	s->timeout     = SCHEDULER_MAX_TIMEOUT;
 	s->max_timeout = SCHEDULER_MAX_TIMEOUT;
 
 	if (ret < 0)
 		return ret;
 
-	scheduler_run_events(s);
+	scheduler_run_events(s, ret);
 
 	return ret;
 }
@@ -255,11 +658,10 @@ scheduler_initialize(scheduler_t *s)
 {
 	memset(s, 0, sizeof(scheduler_t));
 
-	s->uuid = 1;
-
-	FD_ZERO(&s->read_fds);
-	FD_ZERO(&s->write_fds);
-	FD_ZERO(&s->except_fds);
+	s->uuid     = 1;
+	s->epoll_fd = -1;
 
 	INIT_LIST_HEAD(&s->events);
+	INIT_LIST_HEAD(&s->zombies);
+	INIT_LIST_HEAD(&s->unpollable);
 }
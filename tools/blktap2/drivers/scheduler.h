@@ -28,7 +28,7 @@
 #ifndef _SCHEDULER_H_
 #define _SCHEDULER_H_
 
-#include <sys/select.h>
+#include <sys/epoll.h>
 
 #include "list.h"
 
@@ -40,17 +40,35 @@
 typedef int                          event_id_t;
 typedef void (*event_cb_t)          (event_id_t id, char mode, void *private);
 
+struct event;
+struct scheduler_fd;
+
 typedef struct scheduler {
-	fd_set                       read_fds;
-	fd_set                       write_fds;
-	fd_set                       except_fds;
+	int                          epoll_fd;
+	struct epoll_event          *polled;
+	int                          polled_size;
+
+	struct scheduler_fd        **fds;           /* indexed by fd */
+	int                          fds_size;
+	int                          nr_polled;
+	struct list_head             unpollable;
+
+	struct event               **timers;        /* heap of deadlines */
+	int                          nr_timers;
+	int                          timers_size;
+
+	struct event               **pending;       /* events to run */
+	int                          nr_pending;
+	int                          pending_size;
 
 	struct list_head             events;
+	struct list_head             zombies;
 
 	int                          uuid;
-	int                          max_fd;
+	unsigned long long           seq;
+	int                          pass;
+	int                          running;
 	int                          timeout;
-	int                          restart;
 	int                          max_timeout;
 } scheduler_t;
 
@@ -0,0 +1,794 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * tapdisk-bench: act as the frontend of a blkif ring in local memory,
+ * and drive one or more images through the regular vbd, image and
+ * driver stack, as a guest would.  Images are given as for tap-ctl
+ * (type:/path, or a '|' separated stack).  Reports IOPS, latency and
+ * CPU time per request for each image in turn.
+ *
+ * With -r, the image is a remus stack.  Its backup runs in a child
+ * tapdisk-bench on the other end of a socketpair, and a checkpoint is
+ * taken every -e requests through the remus control fifo.  The time
+ * each one takes to come back "done" is reported as well.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "list.h"
+#include "scheduler.h"
+#include "tapdisk-vbd.h"
+#include "tapdisk-server.h"
+#include "tapdisk-disktype.h"
+#include "tapdisk-utils.h"
+
+struct bench {
+	td_vbd_t                        *vbd;
+	char                            *mem;
+	blkif_front_ring_t               front;
+
+	int                              depth;
+	int                              segs;
+	int                              writes;
+	int                              sequential;
+	int                              cache;
+
+	uint64_t                         blocks;
+	uint64_t                         next;
+	uint64_t                         seed;
+
+	long                             total;
+	long                             issued;
+	long                             done;
+	long                             errors;
+	uint64_t                        *lat;
+	struct timespec                  start[MAX_REQUESTS];
+
+	/* remus: requests per checkpoint, and the backup */
+	long                             epoch;
+	long                             epoch_end;
+	long                             checkpoints;
+	uint64_t                        *cp_lat;
+	pid_t                            backup_pid;
+	int                              stream_fd;
+	int                              stop_fd;
+	int                              ctl_fd;
+	int                              msg_fd;
+};
+
+static char *program;
+
+static void
+usage(FILE *stream)
+{
+	fprintf(stream, "usage: %s [-q depth] [-g segments] [-n requests] "
+		"[-w write%%] [-s] [-c] [-r backup stack [-e requests]] "
+		"<type:/path/to/image> ...\n"
+		"  -q: requests in flight, up to %d (default 32)\n"
+		"  -g: 4k segments per request, up to %d (default 1)\n"
+		"  -s: sequential rather than random offsets\n"
+		"  -c: open read-only images with a block cache\n"
+		"  -r: replicate one remus stack to this one, in a child\n"
+		"      (give the two remus addresses different ports)\n"
+		"  -e: requests per remus checkpoint (default 1000)\n",
+		program, (int)MAX_REQUESTS, BLKIF_MAX_SEGMENTS_PER_REQUEST);
+}
+
+static inline uint64_t
+bench_rand(struct bench *b)
+{
+	b->seed ^= b->seed << 13;
+	b->seed ^= b->seed >> 7;
+	b->seed ^= b->seed << 17;
+	return b->seed;
+}
+
+static inline uint64_t
+ts_ns(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+/* stop at the end of each remus epoch until it is checkpointed */
+static inline int
+bench_may_issue(struct bench *b)
+{
+	if (b->issued >= b->total)
+		return 0;
+
+	return !b->epoch || b->issued < b->epoch_end;
+}
+
+static void
+bench_queue_request(struct bench *b, int id)
+{
+	blkif_request_t *req;
+	uint64_t blk;
+	int i, psecs;
+
+	if (b->sequential) {
+		blk = b->next++;
+		if (b->next >= b->blocks)
+			b->next = 0;
+	} else
+		blk = bench_rand(b) % b->blocks;
+
+	psecs = getpagesize() >> SECTOR_SHIFT;
+
+	req = RING_GET_REQUEST(&b->front, b->front.req_prod_pvt);
+	req->id            = id;
+	req->handle        = 0;
+	req->nr_segments   = b->segs;
+	req->sector_number = blk * b->segs * psecs;
+	req->operation     = ((bench_rand(b) % 100) < b->writes ?
+			      BLKIF_OP_WRITE : BLKIF_OP_READ);
+
+	for (i = 0; i < b->segs; i++) {
+		req->seg[i].gref       = 0;
+		req->seg[i].first_sect = 0;
+		req->seg[i].last_sect  = psecs - 1;
+	}
+
+	b->front.req_prod_pvt++;
+	clock_gettime(CLOCK_MONOTONIC, &b->start[id]);
+	b->issued++;
+}
+
+/*
+ * With a blktap device, the ring event runs within a server iteration,
+ * before the I/O it queued is submitted.  Here, the next iteration
+ * must not sleep before submitting it.
+ */
+static void
+bench_push_requests(struct bench *b)
+{
+	int notify;
+
+	RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&b->front, notify);
+	tapdisk_vbd_poll_ring(b->vbd);
+	tapdisk_server_set_max_timeout(0);
+}
+
+static int
+bench_get_responses(struct bench *b)
+{
+	blkif_response_t *rsp;
+	struct timespec now;
+	RING_IDX rc, rp;
+	int n;
+
+	rp = b->front.sring->rsp_prod;
+	xen_rmb();
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	for (n = 0, rc = b->front.rsp_cons; rc != rp; rc++, n++) {
+		rsp = RING_GET_RESPONSE(&b->front, rc);
+
+		b->lat[b->done++] = ts_ns(&now) - ts_ns(&b->start[rsp->id]);
+		if (rsp->status != BLKIF_RSP_OKAY)
+			b->errors++;
+
+		if (bench_may_issue(b))
+			bench_queue_request(b, rsp->id);
+	}
+
+	b->front.rsp_cons = rc;
+
+	return n;
+}
+
+/*
+ * Requests on the ram driver, cache hits and rwio complete without
+ * any I/O to wait for, so don't sleep while their responses are still
+ * to be written either.
+ */
+static void
+bench_iterate(struct bench *b)
+{
+	td_vbd_t *vbd = b->vbd;
+
+	if (!list_empty(&vbd->new_requests) ||
+	    !list_empty(&vbd->completed_requests))
+		tapdisk_server_set_max_timeout(0);
+
+	tapdisk_server_iterate();
+
+	if (bench_get_responses(b))
+		bench_push_requests(b);
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double
+percentile(const uint64_t *lat, long n, double p)
+{
+	long i = (long)(p * (n - 1) / 100.0 + 0.5);
+	return lat[i] / 1000.0;
+}
+
+static void
+bench_report(struct bench *b, const char *name,
+	     const struct timespec *t0, const struct timespec *t1,
+	     const struct rusage *r0, const struct rusage *r1)
+{
+	double secs, cpu, avg;
+	size_t bytes;
+	long i, n;
+
+	n     = b->done;
+	bytes = (size_t)b->segs * getpagesize();
+	secs  = (ts_ns(t1) - ts_ns(t0)) / 1e9;
+	cpu   = (r1->ru_utime.tv_sec - r0->ru_utime.tv_sec +
+		 r1->ru_stime.tv_sec - r0->ru_stime.tv_sec) * 1e6 +
+		(r1->ru_utime.tv_usec - r0->ru_utime.tv_usec +
+		 r1->ru_stime.tv_usec - r0->ru_stime.tv_usec);
+
+	for (avg = 0, i = 0; i < n; i++)
+		avg += b->lat[i];
+	avg /= n * 1000.0;
+
+	qsort(b->lat, n, sizeof(b->lat[0]), cmp_u64);
+
+	printf("%s\n  %9.0f IOPS %8.1f MB/s  lat us: avg %7.1f "
+	       "p50 %7.1f p99 %7.1f p99.9 %7.1f  cpu %6.2f us/io  "
+	       "errors %ld\n",
+	       name, n / secs, n * (double)bytes / secs / (1 << 20),
+	       avg, percentile(b->lat, n, 50), percentile(b->lat, n, 99),
+	       percentile(b->lat, n, 99.9), cpu / n, b->errors);
+}
+
+static void
+bench_report_checkpoints(struct bench *b)
+{
+	double avg;
+	long i, n;
+
+	n = b->checkpoints;
+	if (!n)
+		return;
+
+	for (avg = 0, i = 0; i < n; i++)
+		avg += b->cp_lat[i];
+	avg /= n * 1000.0;
+
+	qsort(b->cp_lat, n, sizeof(b->cp_lat[0]), cmp_u64);
+
+	printf("  %9ld checkpoints every %ld requests  lat us: avg %7.1f "
+	       "p50 %7.1f p99 %7.1f max %7.1f\n",
+	       n, b->epoch, avg, percentile(b->cp_lat, n, 50),
+	       percentile(b->cp_lat, n, 99), b->cp_lat[n - 1] / 1000.0);
+}
+
+static int
+bench_open(struct bench *b, int id, const char *params)
+{
+	image_t image;
+	td_flag_t flags;
+	int err, psize;
+
+	err = tapdisk_vbd_initialize(id);
+	if (err)
+		return err;
+
+	b->vbd = tapdisk_server_get_vbd(id);
+	if (!b->vbd)
+		return -ENODEV;
+
+	flags = (b->writes ? 0 : TD_OPEN_RDONLY);
+	if (b->cache)
+		flags |= TD_OPEN_ADD_CACHE;
+
+	err = tapdisk_namedup(&b->vbd->name, params);
+	if (err)
+		return err;
+
+	err = tapdisk_vbd_parse_stack(b->vbd, params);
+	if (err) {
+		fprintf(stderr, "invalid image %s: %d\n", params, err);
+		return err;
+	}
+
+	err = tapdisk_vbd_open_stack(b->vbd, TAPDISK_STORAGE_TYPE_DEFAULT,
+				     flags);
+	if (err) {
+		fprintf(stderr, "failed to open %s: %d\n", params, err);
+		return err;
+	}
+
+	b->vbd->reopened = 1;
+
+	err = tapdisk_vbd_get_image_info(b->vbd, &image);
+	if (err)
+		return err;
+
+	psize     = getpagesize();
+	b->blocks = image.size / (b->segs * (psize >> SECTOR_SHIFT));
+	if (!b->blocks) {
+		fprintf(stderr, "%s: smaller than one request\n", params);
+		return -EINVAL;
+	}
+
+	err = posix_memalign((void **)&b->mem, psize,
+			     (size_t)psize * BLKTAP_MMAP_REGION_SIZE);
+	if (err) {
+		b->mem = NULL;
+		return -err;
+	}
+	memset(b->mem, 0x5a, (size_t)psize * BLKTAP_MMAP_REGION_SIZE);
+
+	SHARED_RING_INIT((blkif_sring_t *)b->mem);
+	FRONT_RING_INIT(&b->front, (blkif_sring_t *)b->mem, psize);
+
+	return tapdisk_vbd_attach_local(b->vbd, b->mem);
+}
+
+static void
+bench_close(struct bench *b)
+{
+	td_vbd_t *vbd = b->vbd;
+
+	if (vbd) {
+		while (tapdisk_vbd_busy(vbd))
+			tapdisk_server_iterate();
+		tapdisk_vbd_close_vdi(vbd);
+		tapdisk_vbd_detach(vbd);
+		tapdisk_server_remove_vbd(vbd);
+		tapdisk_vbd_free(vbd);
+		b->vbd = NULL;
+	}
+
+	free(b->mem);
+	b->mem = NULL;
+}
+
+/*
+ * block-remus takes commands on a fifo named after its address, as
+ * remus would send them, and answers on a second one.
+ */
+static int
+bench_remus_fifos(struct bench *b, const char *params)
+{
+	char *addr, *path, *p;
+	int err;
+
+	if (strncmp(params, "remus:", 6)) {
+		fprintf(stderr, "%s: not a remus stack\n", params);
+		return -EINVAL;
+	}
+
+	params += 6;
+	addr = strndup(params, strcspn(params, "|"));
+	if (!addr)
+		return -ENOMEM;
+
+	err = asprintf(&path, BLKTAP_CTRL_DIR "/remus_%s", addr);
+	free(addr);
+	if (err < 0)
+		return -ENOMEM;
+
+	for (p = path + strlen(BLKTAP_CTRL_DIR) + 1; *p; p++)
+		if (strchr(":/", *p))
+			*p = '_';
+
+	err = 0;
+
+	b->ctl_fd = open(path, O_WRONLY | O_NONBLOCK);
+	if (b->ctl_fd == -1) {
+		err = -errno;
+		fprintf(stderr, "opening %s: %d\n", path, err);
+		goto out;
+	}
+
+	p = path;
+	err = asprintf(&path, "%s.msg", p);
+	free(p);
+	if (err < 0) {
+		path = NULL;
+		err = -ENOMEM;
+		goto out;
+	}
+
+	err = 0;
+
+	b->msg_fd = open(path, O_RDONLY | O_NONBLOCK);
+	if (b->msg_fd == -1) {
+		err = -errno;
+		fprintf(stderr, "opening %s: %d\n", path, err);
+	}
+
+out:
+	free(path);
+	return err;
+}
+
+/* ask block-remus for a checkpoint and wait for the backup to commit it */
+static int
+bench_checkpoint(struct bench *b)
+{
+	struct timespec t0, t1;
+	char msg[5];
+	ssize_t n;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	if (write(b->ctl_fd, "flush", 5) != 5)
+		return -errno;
+
+	do {
+		tapdisk_server_iterate();
+		n = read(b->msg_fd, msg, sizeof(msg) - 1);
+	} while (n == -1 && (errno == EAGAIN || errno == EINTR));
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	if (n != sizeof(msg) - 1)
+		return n == -1 ? -errno : -EIO;
+
+	msg[n] = '\0';
+	if (strcmp(msg, "done")) {
+		fprintf(stderr, "checkpoint %ld: %s\n", b->checkpoints, msg);
+		return -EIO;
+	}
+
+	b->cp_lat[b->checkpoints++] = ts_ns(&t1) - ts_ns(&t0);
+
+	return 0;
+}
+
+static int
+bench_run(struct bench *b, int id, const char *params)
+{
+	struct timespec t0, t1;
+	struct rusage r0, r1;
+	char fd[16];
+	int i, err;
+
+	if (b->backup_pid) {
+		snprintf(fd, sizeof(fd), "%d", b->stream_fd);
+		setenv("TAPDISK_REMUS_PRIMARY_FD", fd, 1);
+	}
+
+	err = bench_open(b, id, params);
+	unsetenv("TAPDISK_REMUS_PRIMARY_FD");
+	if (err)
+		goto out;
+
+	if (b->backup_pid) {
+		err = bench_remus_fifos(b, params);
+		if (err)
+			goto out;
+	}
+
+	b->seed        = 0x9e3779b97f4a7c15ULL;
+	b->next        = 0;
+	b->issued      = 0;
+	b->done        = 0;
+	b->errors      = 0;
+	b->epoch_end   = b->epoch;
+	b->checkpoints = 0;
+
+	getrusage(RUSAGE_SELF, &r0);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	for (i = 0; i < b->depth && bench_may_issue(b); i++)
+		bench_queue_request(b, i);
+	bench_push_requests(b);
+
+	while (b->done < b->total) {
+		bench_iterate(b);
+
+		if (!b->epoch || b->done != b->issued ||
+		    (b->done != b->epoch_end && b->done != b->total))
+			continue;
+
+		err = bench_checkpoint(b);
+		if (err)
+			goto out;
+
+		b->epoch_end += b->epoch;
+		for (i = 0; i < b->depth && bench_may_issue(b); i++)
+			bench_queue_request(b, i);
+		bench_push_requests(b);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	getrusage(RUSAGE_SELF, &r1);
+
+	bench_report(b, params, &t0, &t1, &r0, &r1);
+	bench_report_checkpoints(b);
+
+out:
+	bench_close(b);
+	return err;
+}
+
+static void
+bench_stop_event(event_id_t id, char mode, void *private)
+{
+	*(int *)private = 1;
+}
+
+/*
+ * the backup end, in the child: block-remus looks for its vbd as 0,
+ * and takes the image to write its checkpoints to from the first read,
+ * as blkback's would be.  runs until the parent closes stop_fd.
+ */
+static int
+bench_backup(const char *params, int stream_fd, int stop_fd)
+{
+	struct bench b;
+	event_id_t id;
+	char fd[16];
+	int err, stop;
+
+	memset(&b, 0, sizeof(b));
+	b.depth  = 1;
+	b.segs   = 1;
+	b.total  = 1;
+	b.writes = 100;
+	b.seed   = 0x9e3779b97f4a7c15ULL;
+	b.lat    = calloc(1, sizeof(uint64_t));
+	if (!b.lat)
+		return -ENOMEM;
+
+	snprintf(fd, sizeof(fd), "%d", stream_fd);
+	setenv("TAPDISK_REMUS_BACKUP_FD", fd, 1);
+	err = bench_open(&b, 0, params);
+	unsetenv("TAPDISK_REMUS_BACKUP_FD");
+	if (err)
+		goto out;
+
+	stop = 0;
+	id = tapdisk_server_register_event(SCHEDULER_POLL_READ_FD, stop_fd, 0,
+					   bench_stop_event, &stop);
+	if (id < 0) {
+		err = id;
+		goto out;
+	}
+
+	b.writes = 0;
+	bench_queue_request(&b, 0);
+	bench_push_requests(&b);
+
+	while (!stop)
+		bench_iterate(&b);
+
+	tapdisk_server_unregister_event(id);
+
+out:
+	bench_close(&b);
+	free(b.lat);
+	return err;
+}
+
+/* before the server starts, so that the child sets up its own */
+static int
+bench_fork_backup(struct bench *b, const char *params)
+{
+	int sv[2], stop[2];
+	pid_t pid;
+	int err;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+		return -errno;
+
+	if (pipe(stop)) {
+		err = -errno;
+		close(sv[0]);
+		close(sv[1]);
+		return err;
+	}
+
+	pid = fork();
+	if (pid == -1) {
+		err = -errno;
+		close(sv[0]);
+		close(sv[1]);
+		close(stop[0]);
+		close(stop[1]);
+		return err;
+	}
+
+	if (!pid) {
+		close(sv[0]);
+		close(stop[1]);
+
+		err = tapdisk_server_initialize();
+		if (!err)
+			err = bench_backup(params, sv[1], stop[0]);
+		if (err)
+			fprintf(stderr, "backup %s: %d\n", params, err);
+		_exit(err ? 1 : 0);
+	}
+
+	close(sv[1]);
+	close(stop[0]);
+
+	b->backup_pid = pid;
+	b->stream_fd  = sv[0];
+	b->stop_fd    = stop[1];
+
+	return 0;
+}
+
+static int
+bench_wait_backup(struct bench *b)
+{
+	int status;
+
+	close(b->stop_fd);
+
+	if (waitpid(b->backup_pid, &status, 0) == -1)
+		return -errno;
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		return -EIO;
+
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct bench b;
+	const char *backup;
+	int c, i, err;
+
+	program = basename(argv[0]);
+
+	memset(&b, 0, sizeof(b));
+	b.depth  = 32;
+	b.segs   = 1;
+	b.total  = 100000;
+	b.ctl_fd = -1;
+	b.msg_fd = -1;
+	backup   = NULL;
+
+	while ((c = getopt(argc, argv, "q:g:n:w:scr:e:h")) != -1) {
+		switch (c) {
+		case 'q':
+			b.depth = atoi(optarg);
+			break;
+		case 'g':
+			b.segs = atoi(optarg);
+			break;
+		case 'n':
+			b.total = atol(optarg);
+			break;
+		case 'w':
+			b.writes = atoi(optarg);
+			break;
+		case 's':
+			b.sequential = 1;
+			break;
+		case 'c':
+			b.cache = 1;
+			break;
+		case 'r':
+			backup = optarg;
+			break;
+		case 'e':
+			b.epoch = atol(optarg);
+			if (b.epoch <= 0)
+				goto fail_usage;
+			break;
+		case 'h':
+			usage(stdout);
+			return 0;
+		default:
+			goto fail_usage;
+		}
+	}
+
+	if (optind == argc || b.total <= 0 ||
+	    b.depth <= 0 || b.depth > MAX_REQUESTS ||
+	    b.segs <= 0 || b.segs > BLKIF_MAX_SEGMENTS_PER_REQUEST ||
+	    b.writes < 0 || b.writes > 100)
+		goto fail_usage;
+
+	if (backup) {
+		if (argc - optind != 1)
+			goto fail_usage;
+		if (!b.epoch)
+			b.epoch = 1000;
+	} else if (b.epoch)
+		goto fail_usage;
+
+	b.lat = calloc(b.total, sizeof(uint64_t));
+	if (!b.lat)
+		return 1;
+
+	if (b.epoch) {
+		b.cp_lat = calloc(b.total / b.epoch + 1, sizeof(uint64_t));
+		if (!b.cp_lat)
+			return 1;
+	}
+
+	tapdisk_start_logging("tapdisk-bench");
+
+	if (backup) {
+		/* a dead backup shows up as a failed checkpoint instead */
+		signal(SIGPIPE, SIG_IGN);
+
+		err = bench_fork_backup(&b, backup);
+		if (err) {
+			fprintf(stderr, "failed to start the backup: %d\n", err);
+			goto out;
+		}
+	}
+
+	err = tapdisk_server_initialize();
+	if (err) {
+		fprintf(stderr, "failed to initialize the server: %d\n", err);
+		goto out;
+	}
+
+	printf("%s, %d x 4k segments, depth %d, %d%% writes, "
+	       "%ld requests\n", b.sequential ? "sequential" : "random",
+	       b.segs, b.depth, b.writes, b.total);
+
+	for (i = optind; i < argc; i++) {
+		err = bench_run(&b, i - optind, argv[i]);
+		if (err)
+			break;
+	}
+
+out:
+	if (b.backup_pid && bench_wait_backup(&b) && !err) {
+		fprintf(stderr, "the backup failed\n");
+		err = -EIO;
+	}
+	if (b.ctl_fd != -1)
+		close(b.ctl_fd);
+	if (b.msg_fd != -1)
+		close(b.msg_fd);
+	tapdisk_stop_logging();
+	free(b.cp_lat);
+	free(b.lat);
+	return err ? 1 : 0;
+
+fail_usage:
+	usage(stderr);
+	return 1;
+}
@@ -46,6 +46,7 @@
 #include "tapdisk-utils.h"
 #include "tapdisk-server.h"
 #include "tapdisk-message.h"
+#include "tapdisk-interface.h"
 #include "tapdisk-disktype.h"
 
 struct tapdisk_control {
@@ -291,6 +292,57 @@ tapdisk_control_list(struct tapdisk_control_connection *connection,
 	tapdisk_control_close_connection(connection);
 }
 
+/*
+ * one response per image of the vbd, leaf first, with the statistics
+ * of its driver as text; a response with a count of zero ends the list.
+ */
+static void
+tapdisk_control_stats(struct tapdisk_control_connection *connection,
+		      tapdisk_message_t *request)
+{
+	td_vbd_t *vbd;
+	td_image_t *image;
+	tapdisk_message_t response;
+	int count;
+
+	memset(&response, 0, sizeof(response));
+	response.cookie = request->cookie;
+
+	vbd = tapdisk_server_get_vbd(request->cookie);
+	if (!vbd) {
+		response.type = TAPDISK_MESSAGE_ERROR;
+		response.u.response.error = EINVAL;
+		goto out;
+	}
+
+	response.type = TAPDISK_MESSAGE_STATS_RSP;
+
+	count = 0;
+	list_for_each_entry(image, &vbd->images, next)
+		count++;
+
+	list_for_each_entry(image, &vbd->images, next) {
+		response.u.stats.count = count--;
+
+		snprintf(response.u.stats.path,
+			 sizeof(response.u.stats.path), "%s:%s",
+			 tapdisk_disk_types[image->type]->name, image->name);
+		td_stats(image, response.u.stats.text,
+			 sizeof(response.u.stats.text));
+
+		tapdisk_control_write_message(connection->socket,
+					      &response, 2);
+	}
+
+	response.u.stats.count   = 0;
+	response.u.stats.path[0] = 0;
+	response.u.stats.text[0] = 0;
+
+out:
+	tapdisk_control_write_message(connection->socket, &response, 2);
+	tapdisk_control_close_connection(connection);
+}
+
 static void
 tapdisk_control_get_pid(struct tapdisk_control_connection *connection,
 			tapdisk_message_t *request)
@@ -513,7 +565,7 @@ tapdisk_control_close_image(struct tapdisk_control_connection *connection,
 		goto out;
 	}
 
-	if (!list_empty(&vbd->pending_requests)) {
+	if (tapdisk_vbd_busy(vbd)) {
 		err = -EAGAIN;
 		goto out;
 	}
@@ -664,6 +716,8 @@ tapdisk_control_handle_request(event_id_t id, char mode, void *private)
 		return tapdisk_control_resume_vbd(connection, &message);
 	case TAPDISK_MESSAGE_CLOSE:
 		return tapdisk_control_close_image(connection, &message);
+	case TAPDISK_MESSAGE_STATS:
+		return tapdisk_control_stats(connection, &message);
 	default: {
 		tapdisk_message_t response;
 	fail:
@@ -99,3 +99,41 @@ tapdisk_driver_debug(td_driver_t *driver)
 	if (driver->ops->td_debug)
 		driver->ops->td_debug(driver);
 }
+
+int
+tapdisk_driver_stats(td_driver_t *driver, char *buf, size_t size)
+{
+	if (size)
+		buf[0] = 0;
+
+	if (driver->ops->td_stats)
+		return driver->ops->td_stats(driver, buf, size);
+
+	return 0;
+}
+
+/*
+ * 0 if none of the sectors can hold data in this image, non-zero if
+ * some may.  drivers which can't tell hold everything.
+ */
+int
+tapdisk_driver_allocated(td_driver_t *driver, td_sector_t sec, int secs)
+{
+	if (driver->ops->td_allocated)
+		return driver->ops->td_allocated(driver, sec, secs);
+
+	return 1;
+}
+
+/*
+ * non-zero while the driver has i/o in flight which no vbd request
+ * accounts for.  the image must not be closed until it drops to 0.
+ */
+int
+tapdisk_driver_busy(td_driver_t *driver)
+{
+	if (driver->ops->td_busy)
+		return driver->ops->td_busy(driver);
+
+	return 0;
+}
@@ -58,5 +58,8 @@ void tapdisk_driver_free(td_driver_t *);
 void tapdisk_driver_queue_tiocb(td_driver_t *, struct tiocb *);
 
 void tapdisk_driver_debug(td_driver_t *);
+int tapdisk_driver_stats(td_driver_t *, char *, size_t);
+int tapdisk_driver_allocated(td_driver_t *, td_sector_t, int);
+int tapdisk_driver_busy(td_driver_t *);
 
 #endif
@@ -245,6 +245,22 @@ td_prep_write(struct tiocb *tiocb, int fd, char *buf, size_t bytes,
 	tapdisk_prep_tiocb(tiocb, fd, 1, buf, bytes, offset, cb, arg);
 }
 
+/*
+ * Drivers register the fds they pass to td_prep_read/write once
+ * opened, and unregister them before closing.  Optional.
+ */
+void
+td_register_file(int fd)
+{
+	tapdisk_server_register_file(fd);
+}
+
+void
+td_unregister_file(int fd)
+{
+	tapdisk_server_unregister_file(fd);
+}
+
 void
 td_debug(td_image_t *image)
 {
@@ -257,3 +273,42 @@ td_debug(td_image_t *image)
 
 	tapdisk_driver_debug(driver);
 }
+
+int
+td_stats(td_image_t *image, char *buf, size_t size)
+{
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver || !td_flag_test(driver->state, TD_DRIVER_OPEN)) {
+		if (size)
+			buf[0] = 0;
+		return 0;
+	}
+
+	return tapdisk_driver_stats(driver, buf, size);
+}
+
+int
+td_allocated(td_image_t *image, td_sector_t sec, int secs)
+{
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver || !td_flag_test(driver->state, TD_DRIVER_OPEN))
+		return 1;
+
+	return tapdisk_driver_allocated(driver, sec, secs);
+}
+
+int
+td_busy(td_image_t *image)
+{
+	td_driver_t *driver;
+
+	driver = image->driver;
+	if (!driver || !td_flag_test(driver->state, TD_DRIVER_OPEN))
+		return 0;
+
+	return tapdisk_driver_busy(driver);
+}
@@ -0,0 +1,394 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * tapdisk-qbench: drive a file or block device through the tapdisk I/O
+ * queue, with each of the given queue drivers in turn, and report IOPS,
+ * latency and CPU time per request.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "scheduler.h"
+#include "tapdisk-queue.h"
+#include "tapdisk-server.h"
+#include "tapdisk-utils.h"
+
+extern tapdisk_server_t server;
+
+struct qbench;
+
+struct qbench_req {
+	struct tiocb                     tiocb;
+	char                            *buf;
+	struct timespec                  start;
+	struct qbench                   *bench;
+};
+
+struct qbench {
+	struct tqueue                    queue;
+
+	int                              fd;
+	uint64_t                         blocks;
+	size_t                           bsize;
+	int                              depth;
+	int                              writes;
+	int                              sequential;
+	int                              no_register;
+
+	char                            *mem;
+	struct qbench_req               *reqs;
+
+	uint64_t                         next;
+	uint64_t                         seed;
+	long                             total;
+	long                             issued;
+	long                             done;
+	long                             errors;
+	uint64_t                        *lat;
+};
+
+static char *program;
+
+static void
+usage(FILE *stream)
+{
+	fprintf(stream, "usage: %s [-d driver[,driver...]] [-q depth] "
+		"[-b bytes] [-n requests] [-w write%%] [-s] [-R] <file>\n"
+		"  drivers: lio, rwio, uring, uring-sqpoll "
+		"(default lio,uring)\n"
+		"  -s: sequential rather than random offsets\n"
+		"  -R: don't register the file and buffers with the queue\n",
+		program);
+}
+
+static inline uint64_t
+qbench_rand(struct qbench *b)
+{
+	b->seed ^= b->seed << 13;
+	b->seed ^= b->seed >> 7;
+	b->seed ^= b->seed << 17;
+	return b->seed;
+}
+
+static inline uint64_t
+ts_ns(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static void qbench_complete(void *, struct tiocb *, int);
+
+static void
+qbench_issue(struct qbench *b, struct qbench_req *req)
+{
+	uint64_t blk;
+	int rw;
+
+	if (b->sequential) {
+		blk = b->next++;
+		if (b->next >= b->blocks)
+			b->next = 0;
+	} else
+		blk = qbench_rand(b) % b->blocks;
+
+	rw = (qbench_rand(b) % 100) < b->writes;
+
+	tapdisk_prep_tiocb(&req->tiocb, b->fd, rw, req->buf, b->bsize,
+			   blk * b->bsize, qbench_complete, req);
+	clock_gettime(CLOCK_MONOTONIC, &req->start);
+	tapdisk_queue_tiocb(&b->queue, &req->tiocb);
+
+	b->issued++;
+}
+
+static void
+qbench_complete(void *arg, struct tiocb *tiocb, int err)
+{
+	struct qbench_req *req = arg;
+	struct qbench *b = req->bench;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	b->lat[b->done++] = ts_ns(&now) - ts_ns(&req->start);
+
+	if (err)
+		b->errors++;
+
+	if (b->issued < b->total)
+		qbench_issue(b, req);
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double
+percentile(const uint64_t *lat, long n, double p)
+{
+	long i = (long)(p * (n - 1) / 100.0 + 0.5);
+	return lat[i] / 1000.0;
+}
+
+static int
+qbench_run(struct qbench *b, const char *name)
+{
+	struct timespec t0, t1;
+	struct rusage r0, r1;
+	double secs, cpu, avg;
+	int i, drv, err;
+	long n;
+
+	drv = tapdisk_queue_driver(name);
+	if (drv < 0) {
+		fprintf(stderr, "unknown queue driver '%s'\n", name);
+		return drv;
+	}
+
+	err = tapdisk_init_queue(&b->queue, b->depth, drv, NULL);
+	if (err) {
+		fprintf(stderr, "%s: cannot set up queue: %s\n",
+			name, strerror(-err));
+		return err;
+	}
+
+	if (!b->no_register) {
+		tapdisk_queue_register_file(&b->queue, b->fd);
+		tapdisk_queue_register_buffer(&b->queue, b->mem,
+					      (size_t)b->depth * b->bsize);
+	}
+
+	b->seed   = 0x9e3779b97f4a7c15ULL;
+	b->next   = 0;
+	b->issued = 0;
+	b->done   = 0;
+	b->errors = 0;
+
+	getrusage(RUSAGE_SELF, &r0);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	for (i = 0; i < b->depth && b->issued < b->total; i++)
+		qbench_issue(b, b->reqs + i);
+
+	while (b->done < b->total) {
+		tapdisk_submit_all_tiocbs(&b->queue);
+		if (b->done < b->total)
+			scheduler_wait_for_events(&server.scheduler);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	getrusage(RUSAGE_SELF, &r1);
+
+	if (!b->no_register) {
+		tapdisk_queue_unregister_buffer(&b->queue, b->mem);
+		tapdisk_queue_unregister_file(&b->queue, b->fd);
+	}
+	tapdisk_free_queue(&b->queue);
+
+	n    = b->done;
+	secs = (ts_ns(&t1) - ts_ns(&t0)) / 1e9;
+	cpu  = (r1.ru_utime.tv_sec - r0.ru_utime.tv_sec +
+		r1.ru_stime.tv_sec - r0.ru_stime.tv_sec) * 1e6 +
+		(r1.ru_utime.tv_usec - r0.ru_utime.tv_usec +
+		 r1.ru_stime.tv_usec - r0.ru_stime.tv_usec);
+
+	for (avg = 0, i = 0; i < n; i++)
+		avg += b->lat[i];
+	avg /= n * 1000.0;
+
+	qsort(b->lat, n, sizeof(b->lat[0]), cmp_u64);
+
+	printf("%-13s %9.0f IOPS %8.1f MB/s  lat us: avg %7.1f "
+	       "p50 %7.1f p99 %7.1f p99.9 %7.1f  cpu %6.2f us/io  "
+	       "errors %ld\n",
+	       name, n / secs, n * (double)b->bsize / secs / (1 << 20),
+	       avg, percentile(b->lat, n, 50), percentile(b->lat, n, 99),
+	       percentile(b->lat, n, 99.9), cpu / n, b->errors);
+
+	return 0;
+}
+
+static int
+qbench_open(struct qbench *b, const char *path)
+{
+	struct stat st;
+	uint64_t size;
+	int flags;
+
+	flags = (b->writes ? O_RDWR : O_RDONLY) | O_LARGEFILE;
+
+	b->fd = open(path, flags | O_DIRECT);
+	if (b->fd == -1 && errno == EINVAL) {
+		fprintf(stderr, "%s: no O_DIRECT, using the page cache\n",
+			path);
+		b->fd = open(path, flags);
+	}
+	if (b->fd == -1) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -errno;
+	}
+
+	if (fstat(b->fd, &st))
+		return -errno;
+
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(b->fd, BLKGETSIZE64, &size))
+			return -errno;
+	} else
+		size = st.st_size;
+
+	b->blocks = size / b->bsize;
+	if (!b->blocks) {
+		fprintf(stderr, "%s: smaller than one request\n", path);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *drivers = "lio,uring";
+	char *list, *name, *save;
+	struct qbench b;
+	int c, i, err;
+
+	program = basename(argv[0]);
+
+	memset(&b, 0, sizeof(b));
+	b.fd    = -1;
+	b.depth = 32;
+	b.bsize = 4096;
+	b.total = 100000;
+
+	while ((c = getopt(argc, argv, "d:q:b:n:w:sRh")) != -1) {
+		switch (c) {
+		case 'd':
+			drivers = optarg;
+			break;
+		case 'q':
+			b.depth = atoi(optarg);
+			break;
+		case 'b':
+			b.bsize = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			b.total = atol(optarg);
+			break;
+		case 'w':
+			b.writes = atoi(optarg);
+			break;
+		case 's':
+			b.sequential = 1;
+			break;
+		case 'R':
+			b.no_register = 1;
+			break;
+		case 'h':
+			usage(stdout);
+			return 0;
+		default:
+			goto fail_usage;
+		}
+	}
+
+	if (optind != argc - 1 || b.depth <= 0 || b.total <= 0 ||
+	    !b.bsize || b.bsize % 512 || b.writes < 0 || b.writes > 100)
+		goto fail_usage;
+
+	err = qbench_open(&b, argv[optind]);
+	if (err)
+		goto out;
+
+	err = posix_memalign((void **)&b.mem, 4096,
+			     (size_t)b.depth * b.bsize);
+	if (err) {
+		err = -err;
+		goto out;
+	}
+	memset(b.mem, 0x5a, (size_t)b.depth * b.bsize);
+
+	b.reqs = calloc(b.depth, sizeof(struct qbench_req));
+	b.lat  = calloc(b.total, sizeof(uint64_t));
+	if (!b.reqs || !b.lat) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < b.depth; i++) {
+		b.reqs[i].buf   = b.mem + (size_t)i * b.bsize;
+		b.reqs[i].bench = &b;
+	}
+
+	tapdisk_server_init();
+
+	printf("%s: %s, %zu bytes, depth %d, %d%% writes, %ld requests\n",
+	       argv[optind], b.sequential ? "sequential" : "random",
+	       b.bsize, b.depth, b.writes, b.total);
+
+	list = strdup(drivers);
+	if (!list) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (name = strtok_r(list, ",", &save); name;
+	     name = strtok_r(NULL, ",", &save)) {
+		err = qbench_run(&b, name);
+		if (err)
+			break;
+	}
+
+	free(list);
+
+out:
+	free(b.lat);
+	free(b.reqs);
+	free(b.mem);
+	if (b.fd != -1)
+		close(b.fd);
+
+	return err ? 1 : 0;
+
+fail_usage:
+	usage(stderr);
+	return 1;
+}
@@ -27,9 +27,14 @@
 */
 
 #include <errno.h>
+#include <sched.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <libaio.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
 #ifdef __linux__
 #include <linux/version.h>
 #endif
@@ -44,6 +49,14 @@
 #include "libaio-compat.h"
 #include "atomicio.h"
 
+#if defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+/* needs the 5.11 uapi: IORING_OP_READ/WRITE, probing, SQPOLL w/o fixed files */
+#ifdef IORING_FEAT_SQPOLL_NONFIXED
+#define TD_HAVE_URING
+#endif
+#endif
+
 #define WARN(_f, _a...) tlog_write(TLOG_WARN, _f, ##_a)
 #define DBG(_f, _a...) tlog_write(TLOG_DBG, _f, ##_a)
 #define ERR(_err, _f, _a...) tlog_error(_err, _f, ##_a)
@@ -210,16 +223,31 @@ tapdisk_rwio_rw(const struct iocb *iocb)
 	char *buf     = iocb->u.c.buf;
 	long long off = iocb->u.c.offset;
 	size_t size   = iocb->u.c.nbytes;
+	int opcode    = iocb->aio_lio_opcode;
 	ssize_t (*func)(int, void *, size_t) = 
-		(iocb->aio_lio_opcode == IO_CMD_PWRITE ? vwrite : read);
+		(opcode == IO_CMD_PWRITE || opcode == IO_CMD_PWRITEV ?
+		 vwrite : read);
+	const struct iovec *iov;
+	size_t done;
+	int i;
 
 	if (lseek(fd, off, SEEK_SET) == (off_t)-1)
 		return -errno;
 
-	if (atomicio(func, fd, buf, size) != size)
-		return -errno;
+	if (opcode == IO_CMD_PREAD || opcode == IO_CMD_PWRITE) {
+		if (atomicio(func, fd, buf, size) != size)
+			return -errno;
+		return size;
+	}
 
-	return size;
+	/* vectored iocbs from io_merge(): nbytes is the iovec count */
+	iov = (const struct iovec *)buf;
+	for (i = 0, done = 0; i < size; done += iov[i].iov_len, i++)
+		if (atomicio(func, fd, iov[i].iov_base,
+			     iov[i].iov_len) != iov[i].iov_len)
+			return -errno;
+
+	return done;
 }
 
 static int
@@ -262,9 +290,9 @@ tapdisk_rwio_submit(struct tqueue *queue)
 
 static const struct tio td_tio_rwio = {
 	.name        = "rwio",
-	.data_size   = 0,
-	.tio_setup   = NULL,
-	.tio_destroy = NULL,
+	.data_size   = sizeof(struct rwio),
+	.tio_setup   = tapdisk_rwio_setup,
+	.tio_destroy = tapdisk_rwio_destroy,
 	.tio_submit  = tapdisk_rwio_submit
 };
 
@@ -547,6 +575,760 @@ static const struct tio td_tio_lio = {
 	.tio_submit  = tapdisk_lio_submit,
 };
 
+/*
+ * io_uring
+ *
+ * Requests are prepared straight into the shared submission ring and
+ * handed to the kernel with a single io_uring_enter() per batch, or none
+ * at all with a kernel submission thread (SQPOLL).  Completions are read
+ * from the completion ring after an eventfd wakeup, the same way lio
+ * does it.  Image fds and the VBD data area may be pre-registered, in
+ * which case requests use fixed files and buffers.
+ */
+
+#ifdef TD_HAVE_URING
+
+#define URING_MAX_FILES         64
+#define URING_MAX_BUFS          64
+#define URING_SQ_IDLE_MS        50
+
+struct uring_buf {
+	char                *base;
+	size_t               size;
+};
+
+struct uring {
+	int                  ring_fd;
+	int                  event_fd;
+	event_id_t           event_id;
+	int                  flags;
+
+	void                *sq_ptr;
+	size_t               sq_len;
+	unsigned            *sq_head;
+	unsigned            *sq_tail;
+	unsigned            *sq_mask;
+	unsigned            *sq_entries;
+	unsigned            *sq_flags;
+	struct io_uring_sqe *sqes;
+	size_t               sqes_len;
+
+	void                *cq_ptr;
+	size_t               cq_len;
+	unsigned            *cq_head;
+	unsigned            *cq_tail;
+	unsigned            *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	struct io_event     *aio_events;
+
+	int                  files[URING_MAX_FILES];
+	int                  nr_files;
+
+	struct uring_buf     bufs[URING_MAX_BUFS];
+	int                  nr_bufs;
+};
+
+#define URING_FLAG_SQPOLL       (1<<0)
+#define URING_FLAG_FILES        (1<<1)
+#define URING_FLAG_BUFS         (1<<2)
+
+static inline int
+sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int
+sys_io_uring_enter(int fd, unsigned to_submit,
+		   unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static inline int
+sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+static inline unsigned
+uring_load_acquire(const unsigned *p)
+{
+	unsigned v = *(volatile const unsigned *)p;
+	__sync_synchronize();
+	return v;
+}
+
+static inline void
+uring_store_release(unsigned *p, unsigned v)
+{
+	__sync_synchronize();
+	*(volatile unsigned *)p = v;
+}
+
+static int
+tapdisk_uring_probe(struct uring *uring)
+{
+	static const int ops[] = { IORING_OP_READ, IORING_OP_WRITE,
+				   IORING_OP_READV, IORING_OP_WRITEV,
+				   IORING_OP_READ_FIXED,
+				   IORING_OP_WRITE_FIXED };
+	struct io_uring_probe *probe;
+	size_t size;
+	int i, err;
+
+	size  = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	probe = calloc(1, size);
+	if (!probe)
+		return -errno;
+
+	err = sys_io_uring_register(uring->ring_fd, IORING_REGISTER_PROBE,
+				    probe, 256);
+	if (err < 0) {
+		err = -errno;
+		goto out;
+	}
+
+	for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+		if (ops[i] > probe->last_op ||
+		    !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+			err = -EOPNOTSUPP;
+			goto out;
+		}
+
+	err = 0;
+out:
+	free(probe);
+	return err;
+}
+
+static int
+tapdisk_uring_map_rings(struct uring *uring, struct io_uring_params *p)
+{
+	int fd = uring->ring_fd;
+
+	uring->sq_len = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	uring->cq_len = p->cq_off.cqes +
+		p->cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (uring->cq_len > uring->sq_len)
+			uring->sq_len = uring->cq_len;
+		uring->cq_len = uring->sq_len;
+	}
+
+	uring->sq_ptr = mmap(NULL, uring->sq_len, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (uring->sq_ptr == MAP_FAILED) {
+		uring->sq_ptr = NULL;
+		return -errno;
+	}
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP)
+		uring->cq_ptr = uring->sq_ptr;
+	else {
+		uring->cq_ptr = mmap(NULL, uring->cq_len,
+				     PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, fd,
+				     IORING_OFF_CQ_RING);
+		if (uring->cq_ptr == MAP_FAILED) {
+			uring->cq_ptr = NULL;
+			return -errno;
+		}
+	}
+
+	uring->sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = mmap(NULL, uring->sqes_len, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (uring->sqes == MAP_FAILED) {
+		uring->sqes = NULL;
+		return -errno;
+	}
+
+	uring->sq_head    = uring->sq_ptr + p->sq_off.head;
+	uring->sq_tail    = uring->sq_ptr + p->sq_off.tail;
+	uring->sq_mask    = uring->sq_ptr + p->sq_off.ring_mask;
+	uring->sq_entries = uring->sq_ptr + p->sq_off.ring_entries;
+	uring->sq_flags   = uring->sq_ptr + p->sq_off.flags;
+
+	uring->cq_head    = uring->cq_ptr + p->cq_off.head;
+	uring->cq_tail    = uring->cq_ptr + p->cq_off.tail;
+	uring->cq_mask    = uring->cq_ptr + p->cq_off.ring_mask;
+	uring->cqes       = uring->cq_ptr + p->cq_off.cqes;
+
+	return 0;
+}
+
+static void
+tapdisk_uring_destroy(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+
+	if (!uring)
+		return;
+
+	if (uring->event_id >= 0) {
+		tapdisk_server_unregister_event(uring->event_id);
+		uring->event_id = -1;
+	}
+
+	if (uring->sqes) {
+		munmap(uring->sqes, uring->sqes_len);
+		uring->sqes = NULL;
+	}
+
+	if (uring->cq_ptr && uring->cq_ptr != uring->sq_ptr)
+		munmap(uring->cq_ptr, uring->cq_len);
+	uring->cq_ptr = NULL;
+
+	if (uring->sq_ptr) {
+		munmap(uring->sq_ptr, uring->sq_len);
+		uring->sq_ptr = NULL;
+	}
+
+	if (uring->ring_fd >= 0) {
+		close(uring->ring_fd);
+		uring->ring_fd = -1;
+	}
+
+	if (uring->event_fd >= 0) {
+		close(uring->event_fd);
+		uring->event_fd = -1;
+	}
+
+	free(uring->aio_events);
+	uring->aio_events = NULL;
+}
+
+static void
+tapdisk_uring_ack_event(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+	uint64_t val;
+
+	read_exact(uring->event_fd, &val, sizeof(val));
+}
+
+static int
+tapdisk_uring_reap(struct uring *uring, struct io_event *events, int max)
+{
+	unsigned head, tail, mask;
+	struct io_uring_cqe *cqe;
+	struct io_event *ep;
+	int n;
+
+	head = *uring->cq_head;
+	tail = uring_load_acquire(uring->cq_tail);
+	mask = *uring->cq_mask;
+
+	for (n = 0; head != tail && n < max; head++, n++) {
+		cqe = uring->cqes + (head & mask);
+		ep  = events + n;
+
+		ep->obj  = (struct iocb *)(unsigned long)cqe->user_data;
+		ep->res  = (long)cqe->res;
+		ep->res2 = 0;
+	}
+
+	uring_store_release(uring->cq_head, head);
+
+	return n;
+}
+
+static void
+tapdisk_uring_event(event_id_t id, char mode, void *private)
+{
+	struct tqueue *queue = private;
+	struct uring *uring;
+	int i, ret, split;
+	struct iocb *iocb;
+	struct tiocb *tiocb;
+	struct io_event *ep;
+
+	tapdisk_uring_ack_event(queue);
+
+	uring = queue->tio_data;
+	ret   = tapdisk_uring_reap(uring, uring->aio_events, queue->size);
+	split = io_split(&queue->opioctx, uring->aio_events, ret);
+	tapdisk_filter_events(queue->filter, uring->aio_events, split);
+
+	DBG("events: %d, tiocbs: %d\n", ret, split);
+
+	queue->iocbs_pending  -= ret;
+	queue->tiocbs_pending -= split;
+
+	for (i = split, ep = uring->aio_events; i-- > 0; ep++) {
+		iocb  = ep->obj;
+		tiocb = iocb->data;
+		complete_tiocb(queue, tiocb, ep->res);
+	}
+
+	queue_deferred_tiocbs(queue);
+}
+
+static int
+__tapdisk_uring_setup(struct tqueue *queue, int qlen)
+{
+	struct uring *uring = queue->tio_data;
+	struct io_uring_params p;
+	unsigned i;
+	int err;
+
+	uring->ring_fd  = -1;
+	uring->event_fd = -1;
+	uring->event_id = -1;
+
+	memset(&p, 0, sizeof(p));
+	if (uring->flags & URING_FLAG_SQPOLL) {
+		p.flags         |= IORING_SETUP_SQPOLL;
+		p.sq_thread_idle = URING_SQ_IDLE_MS;
+	}
+
+	uring->ring_fd = sys_io_uring_setup(qlen, &p);
+	if (uring->ring_fd < 0) {
+		err = -errno;
+		DPRINTF("io_uring_setup(%d) failed: %d\n", qlen, err);
+		goto fail;
+	}
+
+	if ((uring->flags & URING_FLAG_SQPOLL) &&
+	    !(p.features & IORING_FEAT_SQPOLL_NONFIXED)) {
+		DPRINTF("io_uring: SQPOLL needs kernel support for "
+			"non-registered files\n");
+		err = -EOPNOTSUPP;
+		goto fail;
+	}
+
+	err = tapdisk_uring_probe(uring);
+	if (err) {
+		DPRINTF("io_uring: kernel lacks read/write opcodes: %d\n",
+			err);
+		goto fail;
+	}
+
+	err = tapdisk_uring_map_rings(uring, &p);
+	if (err)
+		goto fail;
+
+	/* requests never wait in the ring: use a 1:1 index array */
+	for (i = 0; i < p.sq_entries; i++)
+		((unsigned *)(uring->sq_ptr + p.sq_off.array))[i] = i;
+
+	uring->event_fd = tapdisk_sys_eventfd(0);
+	if (uring->event_fd < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = sys_io_uring_register(uring->ring_fd, IORING_REGISTER_EVENTFD,
+				    &uring->event_fd, 1);
+	if (err < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	for (i = 0; i < URING_MAX_FILES; i++)
+		uring->files[i] = -1;
+
+	if (sys_io_uring_register(uring->ring_fd, IORING_REGISTER_FILES,
+				  uring->files, URING_MAX_FILES) == 0)
+		uring->flags |= URING_FLAG_FILES;
+
+	uring->event_id =
+		tapdisk_server_register_event(SCHEDULER_POLL_READ_FD,
+					      uring->event_fd, 0,
+					      tapdisk_uring_event,
+					      queue);
+	err = uring->event_id;
+	if (err < 0)
+		goto fail;
+
+	uring->aio_events = calloc(qlen, sizeof(struct io_event));
+	if (!uring->aio_events) {
+		err = -errno;
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	tapdisk_uring_destroy(queue);
+	return err;
+}
+
+static int
+tapdisk_uring_setup(struct tqueue *queue, int qlen)
+{
+	return __tapdisk_uring_setup(queue, qlen);
+}
+
+static int
+tapdisk_uring_sqpoll_setup(struct tqueue *queue, int qlen)
+{
+	struct uring *uring = queue->tio_data;
+
+	uring->flags |= URING_FLAG_SQPOLL;
+
+	return __tapdisk_uring_setup(queue, qlen);
+}
+
+static inline int
+tapdisk_uring_find_file(struct uring *uring, int fd)
+{
+	int i;
+
+	for (i = 0; i < uring->nr_files; i++)
+		if (uring->files[i] == fd)
+			return i;
+
+	return -1;
+}
+
+static inline int
+tapdisk_uring_find_buf(struct uring *uring, const char *buf, size_t size)
+{
+	struct uring_buf *b;
+	int i;
+
+	if (!(uring->flags & URING_FLAG_BUFS))
+		return -1;
+
+	for (i = 0; i < uring->nr_bufs; i++) {
+		b = uring->bufs + i;
+		if (buf >= b->base && buf + size <= b->base + b->size)
+			return i;
+	}
+
+	return -1;
+}
+
+static void
+tapdisk_uring_prep_sqe(struct uring *uring,
+		       struct io_uring_sqe *sqe, struct iocb *iocb)
+{
+	int opcode = iocb->aio_lio_opcode;
+	int write  = (opcode == IO_CMD_PWRITE || opcode == IO_CMD_PWRITEV);
+	int file, buf;
+
+	memset(sqe, 0, sizeof(*sqe));
+
+	file = tapdisk_uring_find_file(uring, iocb->aio_fildes);
+	if (file >= 0) {
+		sqe->fd     = file;
+		sqe->flags |= IOSQE_FIXED_FILE;
+	} else
+		sqe->fd     = iocb->aio_fildes;
+
+	/*
+	 * Vectored iocbs come from io_merge(), and keep their iovecs
+	 * until completion, so the SQPOLL thread may pick them up late.
+	 */
+	if (opcode == IO_CMD_PREADV || opcode == IO_CMD_PWRITEV)
+		sqe->opcode    = write ? IORING_OP_WRITEV : IORING_OP_READV;
+	else if ((buf = tapdisk_uring_find_buf(uring, iocb->u.c.buf,
+					       iocb->u.c.nbytes)) >= 0) {
+		sqe->opcode    = write ?
+			IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->buf_index = buf;
+	} else
+		sqe->opcode    = write ? IORING_OP_WRITE : IORING_OP_READ;
+
+	sqe->off       = iocb->u.c.offset;
+	sqe->addr      = (unsigned long)iocb->u.c.buf;
+	sqe->len       = iocb->u.c.nbytes;
+	sqe->user_data = (unsigned long)iocb;
+}
+
+/*
+ * Without SQPOLL the kernel consumes the whole ring in io_uring_enter(),
+ * and at most queue->size requests are in flight, so there is always
+ * room.  The SQPOLL thread may lag behind, though.
+ */
+static void
+tapdisk_uring_wait_sq(struct uring *uring, int n)
+{
+	unsigned tail = *uring->sq_tail;
+
+	if (!(uring->flags & URING_FLAG_SQPOLL))
+		return;
+
+	while (tail - uring_load_acquire(uring->sq_head) + n >
+	       *uring->sq_entries)
+		sys_io_uring_enter(uring->ring_fd, 0, 0,
+				   IORING_ENTER_SQ_WAKEUP |
+				   IORING_ENTER_SQ_WAIT);
+}
+
+/*
+ * Make sure the SQPOLL thread has picked up all prepared requests,
+ * before buffer indices change under them.
+ */
+static void
+tapdisk_uring_drain_sq(struct uring *uring)
+{
+	if (!(uring->flags & URING_FLAG_SQPOLL))
+		return;
+
+	while (uring_load_acquire(uring->sq_head) != *uring->sq_tail) {
+		sys_io_uring_enter(uring->ring_fd, 0, 0,
+				   IORING_ENTER_SQ_WAKEUP);
+		sched_yield();
+	}
+}
+
+static int
+tapdisk_uring_enter(struct uring *uring, int n)
+{
+	int ret;
+
+	if (uring->flags & URING_FLAG_SQPOLL) {
+		__sync_synchronize();
+		if (*(volatile unsigned *)uring->sq_flags &
+		    IORING_SQ_NEED_WAKEUP)
+			sys_io_uring_enter(uring->ring_fd, 0, 0,
+					   IORING_ENTER_SQ_WAKEUP);
+		return n;
+	}
+
+	do {
+		ret = sys_io_uring_enter(uring->ring_fd, n, 0, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < n) {
+		/*
+		 * nothing else consumes the ring: take back whatever
+		 * the kernel left, so it is not submitted twice.
+		 */
+		ret = ret < 0 ? -errno : ret;
+		uring_store_release(uring->sq_tail, *uring->sq_head);
+	}
+
+	return ret;
+}
+
+static int
+tapdisk_uring_submit(struct tqueue *queue)
+{
+	struct uring *uring = queue->tio_data;
+	int i, merged, submitted, err = 0;
+	unsigned tail, mask;
+
+	if (!queue->queued)
+		return 0;
+
+	tapdisk_filter_iocbs(queue->filter, queue->iocbs, queue->queued);
+	merged = io_merge(&queue->opioctx, queue->iocbs, queue->queued);
+
+	tapdisk_uring_wait_sq(uring, merged);
+
+	tail = *uring->sq_tail;
+	mask = *uring->sq_mask;
+	for (i = 0; i < merged; i++, tail++)
+		tapdisk_uring_prep_sqe(uring, uring->sqes + (tail & mask),
+				       queue->iocbs[i]);
+	uring_store_release(uring->sq_tail, tail);
+
+	submitted = tapdisk_uring_enter(uring, merged);
+
+	DBG("queued: %d, merged: %d, submitted: %d\n",
+	    queue->queued, merged, submitted);
+
+	if (submitted < 0) {
+		err = submitted;
+		submitted = 0;
+	} else if (submitted < merged)
+		err = -EIO;
+
+	queue->iocbs_pending  += submitted;
+	queue->tiocbs_pending += queue->queued;
+	queue->queued          = 0;
+
+	if (err)
+		queue->tiocbs_pending -=
+			fail_tiocbs(queue, submitted, merged, err);
+
+	return submitted;
+}
+
+static int
+tapdisk_uring_update_file(struct uring *uring, int slot, int fd)
+{
+	struct io_uring_files_update up;
+	int err;
+
+	memset(&up, 0, sizeof(up));
+	up.offset = slot;
+	up.fds    = (unsigned long)&fd;
+
+	err = sys_io_uring_register(uring->ring_fd,
+				    IORING_REGISTER_FILES_UPDATE, &up, 1);
+	if (err < 0)
+		return -errno;
+
+	uring->files[slot] = fd;
+
+	return 0;
+}
+
+static int
+tapdisk_uring_register_file(struct tqueue *queue, int fd)
+{
+	struct uring *uring = queue->tio_data;
+	int i, err;
+
+	if (!(uring->flags & URING_FLAG_FILES))
+		return -EOPNOTSUPP;
+
+	if (tapdisk_uring_find_file(uring, fd) >= 0)
+		return 0;
+
+	for (i = 0; i < URING_MAX_FILES; i++)
+		if (uring->files[i] == -1)
+			break;
+
+	if (i == URING_MAX_FILES)
+		return -ENOSPC;
+
+	err = tapdisk_uring_update_file(uring, i, fd);
+	if (err)
+		return err;
+
+	if (i >= uring->nr_files)
+		uring->nr_files = i + 1;
+
+	return 0;
+}
+
+static void
+tapdisk_uring_unregister_file(struct tqueue *queue, int fd)
+{
+	struct uring *uring = queue->tio_data;
+	int i;
+
+	i = tapdisk_uring_find_file(uring, fd);
+	if (i < 0)
+		return;
+
+	if (tapdisk_uring_update_file(uring, i, -1))
+		WARN("io_uring: cannot unregister fd %d\n", fd);
+
+	/* don't leave a stale fd in the table either way */
+	uring->files[i] = -1;
+
+	while (uring->nr_files && uring->files[uring->nr_files - 1] == -1)
+		uring->nr_files--;
+}
+
+static int
+tapdisk_uring_update_buffers(struct uring *uring)
+{
+	struct iovec iov[URING_MAX_BUFS];
+	int i, err;
+
+	tapdisk_uring_drain_sq(uring);
+
+	if (uring->flags & URING_FLAG_BUFS) {
+		sys_io_uring_register(uring->ring_fd,
+				      IORING_UNREGISTER_BUFFERS, NULL, 0);
+		uring->flags &= ~URING_FLAG_BUFS;
+	}
+
+	if (!uring->nr_bufs)
+		return 0;
+
+	for (i = 0; i < uring->nr_bufs; i++) {
+		iov[i].iov_base = uring->bufs[i].base;
+		iov[i].iov_len  = uring->bufs[i].size;
+	}
+
+	err = sys_io_uring_register(uring->ring_fd, IORING_REGISTER_BUFFERS,
+				    iov, uring->nr_bufs);
+	if (err < 0)
+		return -errno;
+
+	uring->flags |= URING_FLAG_BUFS;
+
+	return 0;
+}
+
+/*
+ * The kernel pins registered buffers.  It refuses some mappings
+ * (e.g. file-backed ones), in which case requests on that range simply
+ * use the non-fixed opcodes.
+ */
+static int
+tapdisk_uring_register_buffer(struct tqueue *queue, void *buf, size_t size)
+{
+	struct uring *uring = queue->tio_data;
+	int err;
+
+	if (uring->nr_bufs == URING_MAX_BUFS)
+		return -ENOSPC;
+
+	uring->bufs[uring->nr_bufs].base = buf;
+	uring->bufs[uring->nr_bufs].size = size;
+	uring->nr_bufs++;
+
+	err = tapdisk_uring_update_buffers(uring);
+	if (err) {
+		DPRINTF("io_uring: cannot register buffer %p, %zu bytes: %d\n",
+			buf, size, err);
+		uring->nr_bufs--;
+		tapdisk_uring_update_buffers(uring);
+	}
+
+	return err;
+}
+
+static void
+tapdisk_uring_unregister_buffer(struct tqueue *queue, void *buf)
+{
+	struct uring *uring = queue->tio_data;
+	int i;
+
+	for (i = 0; i < uring->nr_bufs; i++)
+		if (uring->bufs[i].base == buf)
+			break;
+
+	if (i == uring->nr_bufs)
+		return;
+
+	memmove(uring->bufs + i, uring->bufs + i + 1,
+		(uring->nr_bufs - i - 1) * sizeof(struct uring_buf));
+	uring->nr_bufs--;
+
+	if (tapdisk_uring_update_buffers(uring))
+		WARN("io_uring: cannot re-register buffers\n");
+}
+
+static const struct tio td_tio_uring = {
+	.name                  = "uring",
+	.data_size             = sizeof(struct uring),
+	.tio_setup             = tapdisk_uring_setup,
+	.tio_destroy           = tapdisk_uring_destroy,
+	.tio_submit            = tapdisk_uring_submit,
+	.tio_register_file     = tapdisk_uring_register_file,
+	.tio_unregister_file   = tapdisk_uring_unregister_file,
+	.tio_register_buffer   = tapdisk_uring_register_buffer,
+	.tio_unregister_buffer = tapdisk_uring_unregister_buffer,
+};
+
+static const struct tio td_tio_uring_sqpoll = {
+	.name                  = "uring-sqpoll",
+	.data_size             = sizeof(struct uring),
+	.tio_setup             = tapdisk_uring_sqpoll_setup,
+	.tio_destroy           = tapdisk_uring_destroy,
+	.tio_submit            = tapdisk_uring_submit,
+	.tio_register_file     = tapdisk_uring_register_file,
+	.tio_unregister_file   = tapdisk_uring_unregister_file,
+	.tio_register_buffer   = tapdisk_uring_register_buffer,
+	.tio_unregister_buffer = tapdisk_uring_unregister_buffer,
+};
+
+#endif /* TD_HAVE_URING */
+
 static void
 tapdisk_queue_free_io(struct tqueue *queue)
 {
@@ -575,6 +1357,19 @@ tapdisk_queue_init_io(struct tqueue *queue, int drv)
 	case TIO_DRV_RWIO:
 		tio = &td_tio_rwio;
 		break;
+#ifdef TD_HAVE_URING
+	case TIO_DRV_URING:
+		tio = &td_tio_uring;
+		break;
+	case TIO_DRV_URING_SQPOLL:
+		tio = &td_tio_uring_sqpoll;
+		break;
+#else
+	case TIO_DRV_URING:
+	case TIO_DRV_URING_SQPOLL:
+		err = -ENOSYS;
+		goto fail;
+#endif
 	default:
 		err = -EINVAL;
 		goto fail;
@@ -604,6 +1399,21 @@ fail:
 	return err;
 }
 
+int
+tapdisk_queue_driver(const char *name)
+{
+	if (!strcmp(name, "lio"))
+		return TIO_DRV_LIO;
+	if (!strcmp(name, "rwio"))
+		return TIO_DRV_RWIO;
+	if (!strcmp(name, "uring"))
+		return TIO_DRV_URING;
+	if (!strcmp(name, "uring-sqpoll"))
+		return TIO_DRV_URING_SQPOLL;
+
+	return -EINVAL;
+}
+
 int
 tapdisk_init_queue(struct tqueue *queue, int size,
 		   int drv, struct tfilter *filter)
@@ -660,6 +1470,9 @@ tapdisk_debug_queue(struct tqueue *queue)
 	     "tiocbs_pending: %d, tiocbs_deferred: %d, deferrals: %"PRIx64"\n",
 	     queue->size, queue->tio->name, queue->queued, queue->iocbs_pending,
 	     queue->tiocbs_pending, queue->tiocbs_deferred, queue->deferrals);
+	WARN("elevator: %s, max merge: %lu\n",
+	     opio_elevator_name(queue->opioctx.elevator),
+	     queue->opioctx.max_bytes);
 
 	if (tiocb) {
 		WARN("deferred:\n");
@@ -741,3 +1554,35 @@ tapdisk_cancel_all_tiocbs(struct tqueue *queue)
 
 	return cancelled;
 }
+
+int
+tapdisk_queue_register_file(struct tqueue *queue, int fd)
+{
+	if (!queue->tio || !queue->tio->tio_register_file)
+		return 0;
+
+	return queue->tio->tio_register_file(queue, fd);
+}
+
+void
+tapdisk_queue_unregister_file(struct tqueue *queue, int fd)
+{
+	if (queue->tio && queue->tio->tio_unregister_file)
+		queue->tio->tio_unregister_file(queue, fd);
+}
+
+int
+tapdisk_queue_register_buffer(struct tqueue *queue, void *buf, size_t size)
+{
+	if (!queue->tio || !queue->tio->tio_register_buffer)
+		return 0;
+
+	return queue->tio->tio_register_buffer(queue, buf, size);
+}
+
+void
+tapdisk_queue_unregister_buffer(struct tqueue *queue, void *buf)
+{
+	if (queue->tio && queue->tio->tio_unregister_buffer)
+		queue->tio->tio_unregister_buffer(queue, buf);
+}
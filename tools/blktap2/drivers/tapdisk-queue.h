@@ -91,11 +91,20 @@ struct tio {
 	int  (*tio_setup)    (struct tqueue *queue, int qlen);
 	void (*tio_destroy)  (struct tqueue *queue);
 	int  (*tio_submit)   (struct tqueue *queue);
+
+	/* optional: pre-register image fds and data buffers */
+	int  (*tio_register_file)    (struct tqueue *queue, int fd);
+	void (*tio_unregister_file)  (struct tqueue *queue, int fd);
+	int  (*tio_register_buffer)  (struct tqueue *queue,
+				      void *buf, size_t size);
+	void (*tio_unregister_buffer)(struct tqueue *queue, void *buf);
 };
 
 enum {
 	TIO_DRV_LIO     = 1,
 	TIO_DRV_RWIO    = 2,
+	TIO_DRV_URING   = 3,
+	TIO_DRV_URING_SQPOLL = 4,
 };
 
 /*
@@ -122,4 +131,17 @@ int tapdisk_cancel_all_tiocbs(struct tqueue *);
 void tapdisk_prep_tiocb(struct tiocb *, int, int, char *, size_t,
 			long long, td_queue_callback_t, void *);
 
+/*
+ * Registration hints for drivers which can set up fds and buffers
+ * once instead of per request (io_uring).  Registering is optional:
+ * unregistered fds and buffers still work, and drivers without
+ * support ignore these.  Unregister an fd before closing it.
+ */
+int tapdisk_queue_register_file(struct tqueue *, int fd);
+void tapdisk_queue_unregister_file(struct tqueue *, int fd);
+int tapdisk_queue_register_buffer(struct tqueue *, void *buf, size_t size);
+void tapdisk_queue_unregister_buffer(struct tqueue *, void *buf);
+
+int tapdisk_queue_driver(const char *name);
+
 #endif
@@ -101,6 +101,30 @@ tapdisk_server_queue_tiocb(struct tiocb *tiocb)
 	tapdisk_queue_tiocb(&server.aio_queue, tiocb);
 }
 
+int
+tapdisk_server_register_file(int fd)
+{
+	return tapdisk_queue_register_file(&server.aio_queue, fd);
+}
+
+void
+tapdisk_server_unregister_file(int fd)
+{
+	tapdisk_queue_unregister_file(&server.aio_queue, fd);
+}
+
+int
+tapdisk_server_register_buffer(void *buf, size_t size)
+{
+	return tapdisk_queue_register_buffer(&server.aio_queue, buf, size);
+}
+
+void
+tapdisk_server_unregister_buffer(void *buf)
+{
+	tapdisk_queue_unregister_buffer(&server.aio_queue, buf);
+}
+
 void
 tapdisk_server_debug(void)
 {
@@ -205,11 +229,37 @@ tapdisk_server_stop_vbds(void)
 		tapdisk_vbd_kill_queue(vbd);
 }
 
+/*
+ * TAPDISK_QUEUE_DRIVER=lio|rwio|uring|uring-sqpoll selects the I/O
+ * queue driver.  Anything but lio falls back to lio if it cannot be
+ * set up.
+ */
 static int
 tapdisk_server_init_aio(void)
 {
-	return tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
-				  TIO_DRV_LIO, NULL);
+	const char *name;
+	int drv, err;
+
+	drv  = TIO_DRV_LIO;
+	name = getenv("TAPDISK_QUEUE_DRIVER");
+	if (name) {
+		drv = tapdisk_queue_driver(name);
+		if (drv < 0) {
+			EPRINTF("unknown queue driver '%s'\n", name);
+			drv = TIO_DRV_LIO;
+		}
+	}
+
+	err = tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
+				 drv, NULL);
+	if (err && drv != TIO_DRV_LIO) {
+		EPRINTF("queue driver '%s' unavailable (%d), using lio\n",
+			name, err);
+		err = tapdisk_init_queue(&server.aio_queue, TAPDISK_TIOCBS,
+					 TIO_DRV_LIO, NULL);
+	}
+
+	return err;
 }
 
 static void
@@ -42,6 +42,10 @@ void tapdisk_server_add_vbd(td_vbd_t *);
 void tapdisk_server_remove_vbd(td_vbd_t *);
 
 void tapdisk_server_queue_tiocb(struct tiocb *);
+int tapdisk_server_register_file(int);
+void tapdisk_server_unregister_file(int);
+int tapdisk_server_register_buffer(void *, size_t);
+void tapdisk_server_unregister_buffer(void *);
 
 void tapdisk_server_check_state(void);
 
@@ -0,0 +1,708 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The segment holds a header, a hash of slot indices, the slots and
+ * then the pages themselves.  One process-shared mutex guards it all:
+ * tapdisk is single threaded and a hit or insert holds it for one
+ * page copy.  The mutex is robust, so a tapdisk dying while holding
+ * it makes the next locker empty the cache rather than trust a half
+ * finished update.
+ *
+ * Creating and checking the segment is serialized by an flock on the
+ * segment itself, so a tapdisk only ever sees it either empty or fully
+ * set up.  One left half made by a tapdisk which died creating it is
+ * set up again in place.  One with another layout version is unlinked
+ * and replaced: tapdisks still attached to it keep their mapping.
+ *
+ * Pages are keyed by image identity and a generation which changes
+ * with the image contents, see tapdisk_shmcache_image_id().
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "blk.h"
+#include "libvhd.h"
+#include "tapdisk.h"
+#include "tapdisk-shmcache.h"
+
+#define SHMCACHE_MAGIC         0x74647363 /* tdsc */
+#define SHMCACHE_VERSION       2
+#define SHMCACHE_NONE          ((uint32_t)-1)
+#define SHMCACHE_ALIGN(x, a)   (((x) + (a) - 1) & ~((uint64_t)(a) - 1))
+
+struct shmcache_slot {
+	tapdisk_shmcache_id_t        id;
+	uint64_t                     page;
+	uint32_t                     hnext;
+	uint32_t                     prev;       /* more recently used */
+	uint32_t                     next;       /* less recently used */
+	uint32_t                     valid;
+};
+
+struct shmcache_header {
+	uint32_t                     magic;
+	uint32_t                     version;
+	uint64_t                     size;
+	uint32_t                     nr_pages;
+	uint32_t                     nr_buckets;
+
+	pthread_mutex_t              lock;
+	uint32_t                     lru_head;   /* most recently used */
+	uint32_t                     lru_tail;   /* next to be reused */
+
+	tapdisk_shmcache_stats_t     stats;
+};
+
+struct tapdisk_shmcache {
+	int                          refcnt;
+	size_t                       size;
+	struct shmcache_header      *hdr;
+	uint32_t                    *buckets;
+	struct shmcache_slot        *slots;
+	char                        *data;
+};
+
+/* one mapping per process, shared by all its block caches */
+static tapdisk_shmcache_t shmcache;
+
+static void
+shmcache_layout(tapdisk_shmcache_t *c, uint32_t pages, uint32_t buckets,
+		uint64_t *end)
+{
+	uint64_t off;
+	char *base = (char *)c->hdr;
+
+	off = SHMCACHE_ALIGN(sizeof(struct shmcache_header), 64);
+	c->buckets = (uint32_t *)(base + off);
+
+	off = SHMCACHE_ALIGN(off + (uint64_t)buckets * sizeof(uint32_t), 64);
+	c->slots = (struct shmcache_slot *)(base + off);
+
+	off = SHMCACHE_ALIGN(off + (uint64_t)pages *
+			     sizeof(struct shmcache_slot),
+			     TAPDISK_SHMCACHE_PAGE_SIZE);
+	c->data = base + off;
+
+	*end = off + ((uint64_t)pages << TAPDISK_SHMCACHE_PAGE_SHIFT);
+}
+
+static void
+shmcache_reset(tapdisk_shmcache_t *c)
+{
+	struct shmcache_header *hdr = c->hdr;
+	uint32_t i;
+
+	for (i = 0; i < hdr->nr_buckets; i++)
+		c->buckets[i] = SHMCACHE_NONE;
+
+	for (i = 0; i < hdr->nr_pages; i++) {
+		c->slots[i].valid = 0;
+		c->slots[i].hnext = SHMCACHE_NONE;
+		c->slots[i].prev  = i ? i - 1 : SHMCACHE_NONE;
+		c->slots[i].next  = i + 1 < hdr->nr_pages ? i + 1 : SHMCACHE_NONE;
+	}
+
+	hdr->lru_head   = 0;
+	hdr->lru_tail   = hdr->nr_pages - 1;
+	hdr->stats.used = 0;
+}
+
+static int
+shmcache_init(tapdisk_shmcache_t *c)
+{
+	struct shmcache_header *hdr = c->hdr;
+	pthread_mutexattr_t attr;
+	uint32_t pages, buckets;
+	uint64_t end;
+	int err;
+
+	pages = c->size / (TAPDISK_SHMCACHE_PAGE_SIZE +
+			   sizeof(struct shmcache_slot) +
+			   2 * sizeof(uint32_t));
+	for (;;) {
+		if (pages < 2)
+			return -EINVAL;
+
+		for (buckets = 1; buckets < pages; buckets <<= 1)
+			;
+
+		shmcache_layout(c, pages, buckets, &end);
+		if (end <= c->size)
+			break;
+
+		pages--;
+	}
+
+	hdr->version    = SHMCACHE_VERSION;
+	hdr->size       = c->size;
+	hdr->nr_pages   = pages;
+	hdr->nr_buckets = buckets;
+
+	memset(&hdr->stats, 0, sizeof(hdr->stats));
+	hdr->stats.size  = c->size;
+	hdr->stats.pages = pages;
+
+	err = pthread_mutexattr_init(&attr);
+	if (err)
+		return -err;
+
+	err = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	if (!err)
+		err = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	if (!err)
+		err = pthread_mutex_init(&hdr->lock, &attr);
+
+	pthread_mutexattr_destroy(&attr);
+	if (err)
+		return -err;
+
+	shmcache_reset(c);
+
+	__sync_synchronize();
+	hdr->magic = SHMCACHE_MAGIC;
+
+	return 0;
+}
+
+static int
+shmcache_check(tapdisk_shmcache_t *c)
+{
+	struct shmcache_header *hdr = c->hdr;
+	uint64_t end;
+
+	if (hdr->version != SHMCACHE_VERSION || hdr->size != c->size)
+		return -ESTALE;
+
+	shmcache_layout(c, hdr->nr_pages, hdr->nr_buckets, &end);
+	if (end > c->size)
+		return -ESTALE;
+
+	return 0;
+}
+
+/*
+ * open and lock the segment.  another tapdisk may replace it while we
+ * wait for the lock, in which case we go for the new one.
+ */
+static int
+shmcache_open(struct stat *st)
+{
+	struct stat cur;
+	int fd, cfd, err;
+
+	for (;;) {
+		fd = shm_open(TAPDISK_SHMCACHE_NAME, O_RDWR | O_CREAT, 0600);
+		if (fd == -1)
+			return -errno;
+
+		/* held until the segment is set up, released if we die */
+		if (flock(fd, LOCK_EX) || fstat(fd, st)) {
+			err = -errno;
+			close(fd);
+			return err;
+		}
+
+		cfd = shm_open(TAPDISK_SHMCACHE_NAME, O_RDWR, 0600);
+		if (cfd != -1) {
+			err = fstat(cfd, &cur) ? -errno : 0;
+			close(cfd);
+			if (err) {
+				close(fd);
+				return err;
+			}
+
+			if (cur.st_dev == st->st_dev &&
+			    cur.st_ino == st->st_ino)
+				return fd;
+		} else if (errno != ENOENT) {
+			err = -errno;
+			close(fd);
+			return err;
+		}
+
+		close(fd);
+	}
+}
+
+static int
+shmcache_map(tapdisk_shmcache_t *c, size_t want)
+{
+	struct stat st;
+	int fd, err, replaced;
+	size_t size;
+
+	replaced = 0;
+
+again:
+	fd = shmcache_open(&st);
+	if (fd < 0)
+		return fd;
+
+	if (st.st_size && st.st_size < sizeof(struct shmcache_header)) {
+		err = -ESTALE;
+		goto out;
+	}
+
+	size = st.st_size;
+	if (!size) {
+		size = want;
+		if (ftruncate(fd, size)) {
+			err = -errno;
+			goto out;
+		}
+	}
+
+	c->hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (c->hdr == MAP_FAILED) {
+		c->hdr = NULL;
+		err = -errno;
+		goto out;
+	}
+
+	/* a block cache without us may have set MCL_FUTURE */
+	munlock(c->hdr, size);
+
+	c->size = size;
+
+	/*
+	 * no magic means nobody finished setting it up, and so nobody
+	 * attached to it either: it is ours to (re)initialize.
+	 */
+	if (c->hdr->magic != SHMCACHE_MAGIC) {
+		if (st.st_size)
+			EPRINTF("reinitializing %s\n", TAPDISK_SHMCACHE_NAME);
+		err = shmcache_init(c);
+	} else
+		err = shmcache_check(c);
+
+	if (err) {
+		munmap(c->hdr, c->size);
+		c->hdr  = NULL;
+		c->size = 0;
+	}
+
+out:
+	/*
+	 * left by another build, or broken: start a new one.  whoever is
+	 * attached to the old one keeps it until they detach.
+	 */
+	if (err == -ESTALE && !replaced) {
+		EPRINTF("replacing stale %s\n", TAPDISK_SHMCACHE_NAME);
+		replaced = 1;
+		if (!shm_unlink(TAPDISK_SHMCACHE_NAME) || errno == ENOENT) {
+			flock(fd, LOCK_UN);
+			close(fd);
+			goto again;
+		}
+		err = -errno;
+	}
+
+	/* the mapping keeps the file open, so close alone won't unlock */
+	flock(fd, LOCK_UN);
+	close(fd);
+	return err;
+}
+
+/*
+ * TAPDISK_SHARED_CACHE_MB sizes the cache when the first tapdisk on the
+ * host creates it; the others use it as it is.  NULL if it is unset or
+ * the cache can't be used.
+ */
+tapdisk_shmcache_t *
+tapdisk_shmcache_attach(void)
+{
+	tapdisk_shmcache_t *c = &shmcache;
+	unsigned long mb;
+	const char *env;
+	int err;
+
+	if (c->refcnt) {
+		c->refcnt++;
+		return c;
+	}
+
+	env = getenv("TAPDISK_SHARED_CACHE_MB");
+	if (!env)
+		return NULL;
+
+	mb = strtoul(env, NULL, 10);
+	if (!mb)
+		return NULL;
+
+	err = shmcache_map(c, (size_t)mb << 20);
+	if (err) {
+		EPRINTF("shared cache unavailable: %d\n", err);
+		return NULL;
+	}
+
+	DPRINTF("shared cache: %"PRIu64" bytes, %u pages\n",
+		c->hdr->size, c->hdr->nr_pages);
+
+	c->refcnt = 1;
+	return c;
+}
+
+void
+tapdisk_shmcache_detach(tapdisk_shmcache_t *c)
+{
+	if (!c || --c->refcnt)
+		return;
+
+	munmap(c->hdr, c->size);
+	memset(c, 0, sizeof(*c));
+}
+
+static inline uint64_t
+shmcache_fnv(uint64_t h, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+#define SHMCACHE_FNV_INIT      0xcbf29ce484222325ULL
+
+/*
+ * a vhd is its uuid.  the generation covers the footer, header, BAT and
+ * batmap, which change whenever blocks are allocated, filled or written
+ * by a coalesce (which touches the footer, see vhd-util-coalesce.c), so
+ * that a recycled or rewritten parent never matches its old pages.
+ */
+static int
+shmcache_vhd_id(const char *path, tapdisk_shmcache_id_t *id)
+{
+	vhd_context_t vhd;
+	vhd_footer_t footer;
+	unsigned char *uuid;
+	uint64_t h;
+	int err;
+
+	err = vhd_open(&vhd, path, VHD_OPEN_RDONLY | VHD_OPEN_IGNORE_DISABLED);
+	if (err)
+		return err;
+
+	/* marking a parent hidden doesn't change what it holds */
+	footer          = vhd.footer;
+	footer.hidden   = 0;
+	footer.checksum = 0;
+
+	uuid = (unsigned char *)&vhd.footer.uuid;
+	memcpy(&id->dev, uuid, sizeof(id->dev));
+	memcpy(&id->ino, uuid + sizeof(id->dev), sizeof(id->ino));
+
+	h = shmcache_fnv(SHMCACHE_FNV_INIT, &footer, sizeof(footer));
+
+	if (vhd_type_dynamic(&vhd)) {
+		h = shmcache_fnv(h, &vhd.header, sizeof(vhd.header));
+
+		err = vhd_get_bat(&vhd);
+		if (err)
+			goto out;
+
+		h = shmcache_fnv(h, vhd.bat.bat,
+				 vhd.bat.entries * sizeof(uint32_t));
+
+		if (vhd_has_batmap(&vhd)) {
+			err = vhd_get_batmap(&vhd);
+			if (err)
+				goto out;
+
+			h = shmcache_fnv(h, vhd.batmap.map,
+					 vhd.batmap.header.batmap_size <<
+					 VHD_SECTOR_SHIFT);
+		}
+	}
+
+	id->version = h;
+
+out:
+	vhd_close(&vhd);
+	return err;
+}
+
+/*
+ * anything else: a file by its inode and mtime, a block device by its
+ * device number, size and the first and last page.  stat times mean
+ * nothing for block devices, whose minors are reused as well.
+ */
+static int
+shmcache_raw_id(const char *path, tapdisk_shmcache_id_t *id)
+{
+	char buf[2][TAPDISK_SHMCACHE_PAGE_SIZE];
+	struct stat st;
+	uint64_t size;
+	int fd, err;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -errno;
+
+	if (fstat(fd, &st)) {
+		err = -errno;
+		goto out;
+	}
+
+	if (!S_ISBLK(st.st_mode)) {
+		id->dev     = st.st_dev;
+		id->ino     = st.st_ino;
+		id->version = ((uint64_t)st.st_mtim.tv_sec * 1000000000ULL +
+			       st.st_mtim.tv_nsec) ^
+			((uint64_t)st.st_size << 20);
+		err = 0;
+		goto out;
+	}
+
+	err = blk_getimagesize(fd, &size);
+	if (err)
+		goto out;
+
+	size <<= SECTOR_SHIFT;
+	if (size < sizeof(buf)) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	if (pread(fd, buf[0], sizeof(buf[0]), 0) != sizeof(buf[0]) ||
+	    pread(fd, buf[1], sizeof(buf[1]), size - sizeof(buf[1])) !=
+	    sizeof(buf[1])) {
+		err = -EIO;
+		goto out;
+	}
+
+	id->dev     = st.st_rdev;
+	id->ino     = 0;
+	id->version = shmcache_fnv(shmcache_fnv(SHMCACHE_FNV_INIT,
+						&size, sizeof(size)),
+				   buf, sizeof(buf));
+
+out:
+	close(fd);
+	return err;
+}
+
+int
+tapdisk_shmcache_image_id(const char *path, tapdisk_shmcache_id_t *id)
+{
+	memset(id, 0, sizeof(*id));
+
+	if (!shmcache_vhd_id(path, id))
+		return 0;
+
+	return shmcache_raw_id(path, id);
+}
+
+static int
+shmcache_lock(tapdisk_shmcache_t *c)
+{
+	int err;
+
+	err = pthread_mutex_lock(&c->hdr->lock);
+	if (err == EOWNERDEAD) {
+		shmcache_reset(c);
+		c->hdr->stats.resets++;
+		pthread_mutex_consistent(&c->hdr->lock);
+		err = 0;
+	}
+
+	return -err;
+}
+
+static inline void
+shmcache_unlock(tapdisk_shmcache_t *c)
+{
+	pthread_mutex_unlock(&c->hdr->lock);
+}
+
+static inline uint32_t
+shmcache_hash(tapdisk_shmcache_t *c, const tapdisk_shmcache_id_t *id,
+	      uint64_t page)
+{
+	uint64_t h;
+
+	h  = (id->ino ^ id->version) * 0x9e3779b97f4a7c15ULL;
+	h ^= (id->dev + page) * 0xff51afd7ed558ccdULL;
+	h ^= h >> 32;
+
+	return h & (c->hdr->nr_buckets - 1);
+}
+
+static uint32_t
+shmcache_lookup(tapdisk_shmcache_t *c, const tapdisk_shmcache_id_t *id,
+		uint64_t page)
+{
+	struct shmcache_slot *slot;
+	uint32_t i;
+
+	i = c->buckets[shmcache_hash(c, id, page)];
+	while (i != SHMCACHE_NONE) {
+		slot = c->slots + i;
+		if (slot->page == page && !memcmp(&slot->id, id, sizeof(*id)))
+			break;
+		i = slot->hnext;
+	}
+
+	return i;
+}
+
+static void
+shmcache_unhash(tapdisk_shmcache_t *c, uint32_t i)
+{
+	struct shmcache_slot *slot = c->slots + i;
+	uint32_t *p;
+
+	p = &c->buckets[shmcache_hash(c, &slot->id, slot->page)];
+	while (*p != i)
+		p = &c->slots[*p].hnext;
+
+	*p = slot->hnext;
+	slot->hnext = SHMCACHE_NONE;
+}
+
+/* make slot i the most recently used */
+static void
+shmcache_touch(tapdisk_shmcache_t *c, uint32_t i)
+{
+	struct shmcache_header *hdr = c->hdr;
+	struct shmcache_slot *slot = c->slots + i;
+
+	if (hdr->lru_head == i)
+		return;
+
+	c->slots[slot->prev].next = slot->next;
+	if (slot->next != SHMCACHE_NONE)
+		c->slots[slot->next].prev = slot->prev;
+	else
+		hdr->lru_tail = slot->prev;
+
+	slot->prev = SHMCACHE_NONE;
+	slot->next = hdr->lru_head;
+	c->slots[hdr->lru_head].prev = i;
+	hdr->lru_head = i;
+}
+
+/*
+ * copy len bytes at off in a cached page to buf: 0, or -ENOENT if the
+ * page isn't cached.
+ */
+int
+tapdisk_shmcache_read(tapdisk_shmcache_t *c, const tapdisk_shmcache_id_t *id,
+		      uint64_t page, char *buf, size_t off, size_t len)
+{
+	uint32_t i;
+	int err;
+
+	if (shmcache_lock(c))
+		return -ENOENT;
+
+	c->hdr->stats.lookups++;
+
+	i = shmcache_lookup(c, id, page);
+	if (i == SHMCACHE_NONE) {
+		err = -ENOENT;
+		goto out;
+	}
+
+	memcpy(buf, c->data + ((uint64_t)i << TAPDISK_SHMCACHE_PAGE_SHIFT) +
+	       off, len);
+	shmcache_touch(c, i);
+	c->hdr->stats.hits++;
+	err = 0;
+
+out:
+	shmcache_unlock(c);
+	return err;
+}
+
+/* cache a page in place of the least recently used one */
+void
+tapdisk_shmcache_insert(tapdisk_shmcache_t *c, const tapdisk_shmcache_id_t *id,
+			uint64_t page, const char *data)
+{
+	struct shmcache_header *hdr;
+	struct shmcache_slot *slot;
+	uint32_t i, *head;
+
+	if (shmcache_lock(c))
+		return;
+
+	hdr = c->hdr;
+
+	/* another tapdisk may have read it meanwhile */
+	if (shmcache_lookup(c, id, page) != SHMCACHE_NONE)
+		goto out;
+
+	i    = hdr->lru_tail;
+	slot = c->slots + i;
+
+	if (slot->valid) {
+		shmcache_unhash(c, i);
+		hdr->stats.evictions++;
+	} else
+		hdr->stats.used++;
+
+	slot->id    = *id;
+	slot->page  = page;
+	slot->valid = 1;
+	memcpy(c->data + ((uint64_t)i << TAPDISK_SHMCACHE_PAGE_SHIFT), data,
+	       TAPDISK_SHMCACHE_PAGE_SIZE);
+
+	head        = &c->buckets[shmcache_hash(c, id, page)];
+	slot->hnext = *head;
+	*head       = i;
+
+	shmcache_touch(c, i);
+	hdr->stats.inserts++;
+
+out:
+	shmcache_unlock(c);
+}
+
+void
+tapdisk_shmcache_get_stats(tapdisk_shmcache_t *c,
+			   tapdisk_shmcache_stats_t *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+
+	if (shmcache_lock(c))
+		return;
+
+	*stats = c->hdr->stats;
+	shmcache_unlock(c);
+}
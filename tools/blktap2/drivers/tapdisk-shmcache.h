@@ -0,0 +1,76 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of XenSource Inc. nor the names of its contributors
+ *       may be used to endorse or promote products derived from this software
+ *       without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER
+ * OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TAPDISK_SHMCACHE_H_
+#define _TAPDISK_SHMCACHE_H_
+
+#include <inttypes.h>
+
+/*
+ * Host-wide page cache for read-only images, in POSIX shared memory
+ * so that every tapdisk process serving a clone of the same parent
+ * shares one copy of its hot blocks.
+ */
+
+#define TAPDISK_SHMCACHE_NAME        "/tapdisk-shared-cache"
+#define TAPDISK_SHMCACHE_PAGE_SHIFT  12
+#define TAPDISK_SHMCACHE_PAGE_SIZE   (1 << TAPDISK_SHMCACHE_PAGE_SHIFT)
+
+typedef struct tapdisk_shmcache       tapdisk_shmcache_t;
+typedef struct tapdisk_shmcache_id    tapdisk_shmcache_id_t;
+typedef struct tapdisk_shmcache_stats tapdisk_shmcache_stats_t;
+
+/* identifies one version of an image on this host */
+struct tapdisk_shmcache_id {
+	uint64_t                     dev;        /* or a vhd's uuid, */
+	uint64_t                     ino;        /* both halves */
+	uint64_t                     version;    /* content generation */
+};
+
+struct tapdisk_shmcache_stats {
+	uint64_t                     size;       /* in bytes */
+	uint32_t                     pages;
+	uint32_t                     used;
+	uint64_t                     lookups;
+	uint64_t                     hits;
+	uint64_t                     inserts;
+	uint64_t                     evictions;
+	uint64_t                     resets;     /* after a holder died */
+};
+
+tapdisk_shmcache_t *tapdisk_shmcache_attach(void);
+void tapdisk_shmcache_detach(tapdisk_shmcache_t *);
+
+int tapdisk_shmcache_image_id(const char *path, tapdisk_shmcache_id_t *);
+
+int tapdisk_shmcache_read(tapdisk_shmcache_t *, const tapdisk_shmcache_id_t *,
+			  uint64_t page, char *buf, size_t off, size_t len);
+void tapdisk_shmcache_insert(tapdisk_shmcache_t *,
+			     const tapdisk_shmcache_id_t *,
+			     uint64_t page, const char *data);
+void tapdisk_shmcache_get_stats(tapdisk_shmcache_t *,
+				tapdisk_shmcache_stats_t *);
+
+#endif
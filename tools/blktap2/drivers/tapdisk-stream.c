@@ -373,6 +373,8 @@ tapdisk_stream_close_image(struct tapdisk_stream *s)
 
 	vbd = tapdisk_server_get_vbd(s->id);
 	if (vbd) {
+		while (tapdisk_vbd_busy(vbd))
+			tapdisk_server_iterate();
 		tapdisk_vbd_close_vdi(vbd);
 		tapdisk_server_remove_vbd(vbd);
 		free((void *)vbd->ring.vstart);
@@ -68,6 +68,7 @@
 #define TD_VBD_WATCHDOG_TIMEOUT     10
 
 static void tapdisk_vbd_ring_event(event_id_t, char, void *);
+static void tapdisk_vbd_pull_ring_requests(td_vbd_t *);
 static void tapdisk_vbd_callback(void *, blkif_response_t *);
 
 /* 
@@ -179,11 +180,166 @@ tapdisk_vbd_validate_chain(td_vbd_t *vbd)
 	return 0;
 }
 
+/*
+ * chain index: reads forwarded down a chain skip the parents which
+ * hold none of their data.
+ *
+ * vbd->index maps each TD_VBD_INDEX_SECS block of the disk to the
+ * first level of the chain, from index_base on, which may hold any of
+ * it -- stored as level + 1, 0 until a read first needs it.  levels
+ * from index_base on can say what they hold (td_allocated); a level
+ * of nr_levels means none of them holds the block.  parents never
+ * change, so entries go stale only when the leaf gains data: writes
+ * reset them to index_base.
+ */
+static void
+tapdisk_vbd_free_index(td_vbd_t *vbd)
+{
+	free(vbd->index);
+	free(vbd->levels);
+
+	vbd->index        = NULL;
+	vbd->index_blocks = 0;
+	vbd->levels       = NULL;
+	vbd->nr_levels    = 0;
+}
+
+static void
+tapdisk_vbd_build_index(td_vbd_t *vbd)
+{
+	int n, base;
+	td_image_t *image, *tmp;
+
+	tapdisk_vbd_free_index(vbd);
+
+	n    = 0;
+	base = -1;
+	tapdisk_vbd_for_each_image(vbd, image, tmp) {
+		if (base == -1 && image->driver &&
+		    image->driver->ops->td_allocated)
+			base = n;
+		n++;
+	}
+
+	/* nothing to skip, or too deep for a byte per block */
+	if (base == -1 || n - base < 2 || n >= 255)
+		return;
+
+	vbd->levels = calloc(n, sizeof(td_image_t *));
+	if (!vbd->levels)
+		goto fail;
+
+	n = 0;
+	tapdisk_vbd_for_each_image(vbd, image, tmp)
+		vbd->levels[n++] = image;
+
+	vbd->nr_levels    = n;
+	vbd->index_base   = base;
+	vbd->index_blocks = (vbd->levels[0]->info.size +
+			     TD_VBD_INDEX_SECS - 1) >> TD_VBD_INDEX_SHIFT;
+
+	vbd->index = calloc(vbd->index_blocks, sizeof(uint8_t));
+	if (!vbd->index)
+		goto fail;
+
+	return;
+
+fail:
+	EPRINTF("%s: no memory for chain index\n", vbd->name);
+	tapdisk_vbd_free_index(vbd);
+}
+
+static int
+tapdisk_vbd_index_owner(td_vbd_t *vbd, uint64_t blk)
+{
+	int level;
+	td_image_t *image;
+	td_sector_t sec, end;
+
+	sec = blk << TD_VBD_INDEX_SHIFT;
+	end = sec + TD_VBD_INDEX_SECS;
+	if (end > vbd->levels[0]->info.size)
+		end = vbd->levels[0]->info.size;
+
+	for (level = vbd->index_base; level < vbd->nr_levels; level++) {
+		image = vbd->levels[level];
+
+		/* a parent smaller than the disk zero-fills: don't skip it */
+		if (image->info.size < end)
+			break;
+
+		if (td_allocated(image, sec, end - sec))
+			break;
+	}
+
+	return level;
+}
+
+/*
+ * where to forward a read which @parent would see next: @parent
+ * itself, a level further down, or NULL if no level holds its data.
+ */
+static td_image_t *
+tapdisk_vbd_index_parent(td_vbd_t *vbd, td_image_t *parent,
+			 td_request_t *treq)
+{
+	uint64_t blk, last;
+	int level, owner;
+
+	if (!vbd->index)
+		return parent;
+
+	for (level = vbd->index_base; level < vbd->nr_levels; level++)
+		if (vbd->levels[level] == parent)
+			break;
+
+	if (level == vbd->nr_levels)
+		return parent;
+
+	blk   = treq->sec >> TD_VBD_INDEX_SHIFT;
+	last  = (treq->sec + treq->secs - 1) >> TD_VBD_INDEX_SHIFT;
+	owner = vbd->nr_levels;
+
+	for (; blk <= last; blk++) {
+		if (blk >= vbd->index_blocks)
+			return parent;
+
+		if (!vbd->index[blk])
+			vbd->index[blk] = tapdisk_vbd_index_owner(vbd, blk) + 1;
+
+		if (vbd->index[blk] - 1 < owner)
+			owner = vbd->index[blk] - 1;
+	}
+
+	if (owner <= level)
+		return parent;
+
+	vbd->index_skips += owner - level;
+
+	return owner < vbd->nr_levels ? vbd->levels[owner] : NULL;
+}
+
+static void
+tapdisk_vbd_index_write(td_vbd_t *vbd, td_sector_t sec, int secs)
+{
+	uint64_t blk, last;
+
+	if (!vbd->index)
+		return;
+
+	last = (sec + secs - 1) >> TD_VBD_INDEX_SHIFT;
+	for (blk = sec >> TD_VBD_INDEX_SHIFT;
+	     blk <= last && blk < vbd->index_blocks; blk++)
+		vbd->index[blk] = vbd->index_base + 1;
+}
+
 void
 tapdisk_vbd_close_vdi(td_vbd_t *vbd)
 {
 	td_image_t *image, *tmp;
 
+	tapdisk_vbd_free_index(vbd);
+
 	tapdisk_vbd_for_each_image(vbd, image, tmp) {
 		td_close(image);
 		tapdisk_image_free(image);
@@ -432,6 +588,8 @@ __tapdisk_vbd_open_vdi(td_vbd_t *vbd, td_flag_t extra_flags)
 	if (err)
 		goto fail;
 
+	tapdisk_vbd_build_index(vbd);
+
 	td_flag_clear(vbd->state, TD_VBD_CLOSED);
 
 	return 0;
@@ -631,6 +789,10 @@ tapdisk_vbd_map_device(td_vbd_t *vbd, const char *devname)
 
 	ioctl(ring->fd, BLKTAP_IOCTL_SETMODE, BLKTAP_MODE_INTERPOSE);
 
+	/* best effort: requests on the data area may use fixed buffers */
+	tapdisk_server_register_buffer((void *)ring->vstart,
+				       MMAP_PAGES * psize);
+
 	return 0;
 
 fail:
@@ -650,8 +812,17 @@ tapdisk_vbd_unmap_device(td_vbd_t *vbd)
 
 	psize = getpagesize();
 
-	if (vbd->ring.fd != -1)
-		close(vbd->ring.fd);
+	if (vbd->ring.mem > 0)
+		tapdisk_server_unregister_buffer((void *)vbd->ring.vstart);
+
+	/* a local ring has no device, and its memory isn't ours */
+	if (vbd->ring.fd == -1) {
+		vbd->ring.mem   = NULL;
+		vbd->ring.sring = NULL;
+		return 0;
+	}
+
+	close(vbd->ring.fd);
 	if (vbd->ring.mem > 0)
 		munmap(vbd->ring.mem, psize * BLKTAP_MMAP_REGION_SIZE);
 
@@ -691,6 +862,44 @@ fail:
 	return err;
 }
 
+/*
+ * Attach to a ring in local memory instead of a blktap device, for
+ * tools acting as their own frontend.  @mem is laid out like the blktap
+ * mmap region: the shared ring page, then the data area.  There is no
+ * device to poll, so the frontend calls tapdisk_vbd_poll_ring() after
+ * pushing requests.
+ */
+int
+tapdisk_vbd_attach_local(td_vbd_t *vbd, void *mem)
+{
+	int psize;
+	td_ring_t *ring;
+
+	ring  = &vbd->ring;
+	psize = getpagesize();
+
+	if (ring->sring)
+		return -EBUSY;
+
+	ring->fd     = -1;
+	ring->mem    = mem;
+	ring->sring  = (blkif_sring_t *)mem;
+	ring->vstart = (unsigned long)mem + (BLKTAP_RING_PAGES * psize);
+	BACK_RING_INIT(&ring->fe_ring, ring->sring, psize);
+
+	tapdisk_server_register_buffer((void *)ring->vstart,
+				       MMAP_PAGES * psize);
+
+	return 0;
+}
+
+void
+tapdisk_vbd_poll_ring(td_vbd_t *vbd)
+{
+	tapdisk_vbd_pull_ring_requests(vbd);
+	tapdisk_vbd_issue_requests(vbd);
+}
+
 int
 tapdisk_vbd_open(td_vbd_t *vbd, const char *name, uint16_t type,
 		 uint16_t storage, int minor, const char *ring, td_flag_t flags)
@@ -745,12 +954,31 @@ tapdisk_vbd_queue_count(td_vbd_t *vbd, int *new,
 	*completed = c;
 }
 
+/*
+ * requests in the aio layer, or driver i/o (e.g. readahead) which
+ * isn't tied to a request.  images can't be closed until both drain.
+ */
+int
+tapdisk_vbd_busy(td_vbd_t *vbd)
+{
+	td_image_t *image, *tmp;
+
+	if (!list_empty(&vbd->pending_requests))
+		return 1;
+
+	tapdisk_vbd_for_each_image(vbd, image, tmp)
+		if (td_busy(image))
+			return 1;
+
+	return 0;
+}
+
 static int
 tapdisk_vbd_shutdown(td_vbd_t *vbd)
 {
 	int new, pending, failed, completed;
 
-	if (!list_empty(&vbd->pending_requests))
+	if (tapdisk_vbd_busy(vbd))
 		return -EAGAIN;
 
 	tapdisk_vbd_kick(vbd);
@@ -782,7 +1010,7 @@ tapdisk_vbd_close(td_vbd_t *vbd)
 	/*
 	 * don't close if any requests are pending in the aio layer
 	 */
-	if (!list_empty(&vbd->pending_requests))
+	if (tapdisk_vbd_busy(vbd))
 		goto fail;
 
 	/* 
@@ -823,6 +1051,10 @@ tapdisk_vbd_debug(td_vbd_t *vbd)
 	    vbd->ts.tv_sec, (unsigned long long)vbd->ts.tv_usec,
 	    vbd->errors, vbd->retries,
 	    vbd->received, vbd->returned, vbd->kicked);
+	DBG(TLOG_WARN, "%s: chain index: %s, levels: %d, base: %d, "
+	    "levels skipped: %"PRIu64"\n", vbd->name,
+	    vbd->index ? "on" : "off", vbd->nr_levels, vbd->index_base,
+	    vbd->index_skips);
 
 	tapdisk_vbd_for_each_image(vbd, image, tmp)
 		td_debug(image);
@@ -881,7 +1113,7 @@ tapdisk_vbd_lock(td_vbd_t *vbd)
 int
 tapdisk_vbd_quiesce_queue(td_vbd_t *vbd)
 {
-	if (!list_empty(&vbd->pending_requests)) {
+	if (tapdisk_vbd_busy(vbd)) {
 		td_flag_set(vbd->state, TD_VBD_QUIESCE_REQUESTED);
 		return -EAGAIN;
 	}
@@ -946,6 +1178,8 @@ tapdisk_vbd_close_and_reopen_image(td_vbd_t *vbd, td_image_t *image)
 
 	if (err)
 		td_flag_set(vbd->state, TD_VBD_CLOSED);
+	else
+		tapdisk_vbd_build_index(vbd);
 
 	return err;
 }
@@ -1025,7 +1259,8 @@ tapdisk_vbd_kick(td_vbd_t *vbd)
 
 	vbd->kicked += n;
 	RING_PUSH_RESPONSES(&ring->fe_ring);
-	ioctl(ring->fd, BLKTAP_IOCTL_KICK_FE, 0);
+	if (ring->fd != -1)
+		ioctl(ring->fd, BLKTAP_IOCTL_KICK_FE, 0);
 
 	DBG(TLOG_INFO, "kicking %d: rec: 0x%08"PRIx64", ret: 0x%08"PRIx64", kicked: "
 	    "0x%08"PRIx64"\n", n, vbd->received, vbd->returned, vbd->kicked);
@@ -1247,13 +1482,16 @@ __tapdisk_vbd_reissue_td_request(td_vbd_t *vbd,
 
 	vreq->submitting++;
 
-	if (tapdisk_vbd_is_last_image(vbd, image)) {
-		memset(treq.buf, 0, treq.secs << SECTOR_SHIFT);
-		td_complete_request(treq, 0);
-		goto done;
+	if (tapdisk_vbd_is_last_image(vbd, image))
+		goto zero;
+
+	parent = tapdisk_vbd_next_image(image);
+	if (treq.op == TD_OP_READ) {
+		parent = tapdisk_vbd_index_parent(vbd, parent, &treq);
+		if (!parent)
+			goto zero;
 	}
 
-	parent     = tapdisk_vbd_next_image(image);
 	treq.image = parent;
 
 	/* return zeros for requests that extend beyond end of parent image */
@@ -1307,6 +1545,12 @@ __tapdisk_vbd_reissue_td_request(td_vbd_t *vbd,
 		break;
 	}
 
+	goto done;
+
+zero:
+	memset(treq.buf, 0, treq.secs << SECTOR_SHIFT);
+	td_complete_request(treq, 0);
+
 done:
 	vreq->submitting--;
 	if (!vreq->secs_pending)
@@ -1411,6 +1655,7 @@ tapdisk_vbd_issue_request(td_vbd_t *vbd, td_vbd_request_t *vreq)
 		switch (req->operation)	{
 		case BLKIF_OP_WRITE:
 			treq.op = TD_OP_WRITE;
+			tapdisk_vbd_index_write(vbd, treq.sec, treq.secs);
 			td_queue_write(image, treq);
 			break;
 
@@ -50,6 +50,9 @@
 #define TD_VBD_RETRY_NEEDED         0x0100
 #define TD_VBD_LOG_DROPPED          0x0200
 
+#define TD_VBD_INDEX_SHIFT          12      /* 2MB chain index blocks */
+#define TD_VBD_INDEX_SECS           (1ULL << TD_VBD_INDEX_SHIFT)
+
 typedef struct td_ring              td_ring_t;
 typedef struct td_vbd_request       td_vbd_request_t;
 typedef struct td_vbd_driver_info   td_vbd_driver_info_t;
@@ -102,6 +105,14 @@ struct td_vbd_handle {
 
 	struct list_head            images;
 
+	/* chain index: which level holds each block */
+	td_image_t                **levels;
+	int                         nr_levels;
+	int                         index_base;
+	uint8_t                    *index;
+	uint64_t                    index_blocks;
+	uint64_t                    index_skips;
+
 	struct list_head            new_requests;
 	struct list_head            pending_requests;
 	struct list_head            failed_requests;
@@ -175,6 +186,7 @@ int tapdisk_vbd_parse_stack(td_vbd_t *vbd, const char *path);
 int tapdisk_vbd_open(td_vbd_t *, const char *, uint16_t,
 		     uint16_t, int, const char *, td_flag_t);
 int tapdisk_vbd_close(td_vbd_t *);
+int tapdisk_vbd_busy(td_vbd_t *);
 void tapdisk_vbd_free(td_vbd_t *);
 void tapdisk_vbd_free_stack(td_vbd_t *);
 
@@ -184,7 +196,9 @@ int tapdisk_vbd_open_vdi(td_vbd_t *, const char *,
 void tapdisk_vbd_close_vdi(td_vbd_t *);
 
 int tapdisk_vbd_attach(td_vbd_t *, const char *, int);
+int tapdisk_vbd_attach_local(td_vbd_t *, void *);
 void tapdisk_vbd_detach(td_vbd_t *);
+void tapdisk_vbd_poll_ring(td_vbd_t *);
 
 void tapdisk_vbd_forward_request(td_request_t);
 
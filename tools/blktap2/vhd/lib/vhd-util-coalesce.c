@@ -28,130 +28,605 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
 
 #include "libvhd.h"
 
+/*
+ * Coalescing streams the child into its parent a few extents at a time.
+ * The child BAT is planned into extents of blocks which are adjacent both
+ * virtually and on disk, so each extent is fetched (bitmaps included) with
+ * a single large read.  Missing parent blocks are allocated up front, in
+ * block order, so that extents usually land contiguously in the parent
+ * too.  Sector runs are then gathered into vectored writes, and several
+ * worker threads keep extents in flight.  The parent BAT and batmap are
+ * written once, after all data has been moved.
+ */
+
+#define VHD_COALESCE_THREADS       4
+#define VHD_COALESCE_EXTENT_MB     16
+#define VHD_COALESCE_IOVS          256
+
+struct vhd_coalesce_extent {
+	uint32_t                   block;
+	uint32_t                   count;
+};
+
+struct vhd_coalesce;
+
+struct vhd_coalesce_worker {
+	struct vhd_coalesce       *c;
+	pthread_t                  thread;
+
+	char                      *buf;
+	char                      *maps;
+	uint64_t                   bytes;
+
+	int                        fd;
+	off_t                      off;
+	size_t                     size;
+	int                        cnt;
+	struct iovec               iov[VHD_COALESCE_IOVS];
+};
+
+struct vhd_coalesce {
+	vhd_context_t             *vhd;
+	vhd_context_t             *parent;
+	int                        parent_fd;
+
+	struct vhd_coalesce_extent *extents;
+	uint32_t                   n_extents;
+	uint32_t                   max_blocks;
+	uint32_t                   allocated;
+	char                      *new_blocks;
+	char                      *full_blocks;
+
+	pthread_mutex_t            lock;
+	pthread_cond_t             cond;
+	uint32_t                   next;
+	int                        running;
+	int                        err;
+	uint64_t                   total_blocks;
+	uint64_t                   blocks_done;
+	uint64_t                   bytes_done;
+};
+
+static inline double
+vhd_coalesce_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 static int
-__raw_io_write(int fd, char* buf, uint64_t sec, uint32_t secs)
+vhd_coalesce_plan(struct vhd_coalesce *c)
 {
-	off_t off;
-	size_t ret;
+	uint32_t i, blk, stride;
+	vhd_context_t *vhd;
+	struct vhd_coalesce_extent *e;
+
+	vhd    = c->vhd;
+	stride = vhd->bm_secs + vhd->spb;
+	e      = NULL;
+
+	c->extents = calloc(vhd->bat.entries, sizeof(*c->extents));
+	if (!c->extents)
+		return -ENOMEM;
+
+	for (i = 0; i < vhd->bat.entries; i++) {
+		blk = vhd->bat.bat[i];
+		if (blk == DD_BLK_UNUSED) {
+			e = NULL;
+			continue;
+		}
+
+		if (c->parent && i >= c->parent->bat.entries) {
+			printf("block 0x%x is beyond the end of the parent\n", i);
+			return -ERANGE;
+		}
+
+		c->total_blocks++;
+
+		if (e && e->count < c->max_blocks &&
+		    vhd->bat.bat[i - 1] + stride == blk) {
+			e->count++;
+			continue;
+		}
 
-	errno = 0;
-	off = lseek(fd, vhd_sectors_to_bytes(sec), SEEK_SET);
-	if (off == (off_t)-1) {
-		printf("raw parent: seek(0x%08"PRIx64") failed: %d\n",
-		       vhd_sectors_to_bytes(sec), -errno);
-		return -errno;
+		e = c->extents + c->n_extents++;
+		e->block = i;
+		e->count = 1;
 	}
 
-	ret = write(fd, buf, vhd_sectors_to_bytes(secs));
-	if (ret == vhd_sectors_to_bytes(secs))
+	return 0;
+}
+
+/*
+ * allocate every parent block the child will populate, laid out like
+ * __vhd_io_allocate_block would, but with a single footer update.  the
+ * BAT is only written once the data is in place, so an interrupted
+ * coalesce leaves the parent's view of its own data unchanged.
+ */
+static int
+vhd_coalesce_allocate(struct vhd_coalesce *c)
+{
+	int err, spp;
+	off_t eod;
+	uint32_t i;
+	uint64_t next;
+	vhd_context_t *vhd, *parent;
+
+	vhd    = c->vhd;
+	parent = c->parent;
+	spp    = getpagesize() >> VHD_SECTOR_SHIFT;
+
+	c->new_blocks  = calloc(1, parent->bat.entries);
+	c->full_blocks = calloc(1, parent->bat.entries);
+	if (!c->new_blocks || !c->full_blocks)
+		return -ENOMEM;
+
+	err = vhd_end_of_data(parent, &eod);
+	if (err)
+		return err;
+
+	next = eod >> VHD_SECTOR_SHIFT;
+
+	for (i = 0; i < vhd->bat.entries; i++) {
+		if (vhd->bat.bat[i] == DD_BLK_UNUSED ||
+		    parent->bat.bat[i] != DD_BLK_UNUSED)
+			continue;
+
+		/* data region of segment should begin on page boundary */
+		if ((next + parent->bm_secs) % spp)
+			next += spp - ((next + parent->bm_secs) % spp);
+
+		parent->bat.bat[i] = next;
+		c->new_blocks[i]   = 1;
+		c->allocated++;
+
+		next += parent->bm_secs + parent->spb;
+	}
+
+	if (!c->allocated)
 		return 0;
 
-	printf("raw parent: write of 0x%"PRIx64" returned %zd, errno: %d\n",
-	       vhd_sectors_to_bytes(secs), ret, -errno);
-	return (errno ? -errno : -EIO);
+	return vhd_write_footer(parent, &parent->footer);
+}
+
+static int
+vhd_coalesce_flush(struct vhd_coalesce_worker *w)
+{
+	ssize_t ret;
+
+	if (!w->cnt)
+		return 0;
+
+	ret = pwritev(w->fd, w->iov, w->cnt, w->off);
+	if (ret != w->size) {
+		int err = (ret == -1 ? -errno : -EIO);
+		printf("parent: write of 0x%zx at 0x%08"PRIx64" returned %zd, "
+		       "errno: %d\n", w->size, (uint64_t)w->off, ret, err);
+		return err;
+	}
+
+	w->cnt  = 0;
+	w->size = 0;
+	return 0;
+}
+
+static int
+vhd_coalesce_write(struct vhd_coalesce_worker *w,
+		   off_t off, char *buf, size_t size)
+{
+	int err;
+	struct iovec *iov;
+
+	if (w->cnt && off != w->off + w->size) {
+		err = vhd_coalesce_flush(w);
+		if (err)
+			return err;
+	}
+
+	if (w->cnt) {
+		iov = w->iov + w->cnt - 1;
+		if ((char *)iov->iov_base + iov->iov_len == buf) {
+			iov->iov_len += size;
+			w->size      += size;
+			return 0;
+		}
+
+		if (w->cnt == VHD_COALESCE_IOVS) {
+			err = vhd_coalesce_flush(w);
+			if (err)
+				return err;
+		}
+	}
+
+	if (!w->cnt)
+		w->off = off;
+
+	iov = w->iov + w->cnt++;
+	iov->iov_base = buf;
+	iov->iov_len  = size;
+	w->size      += size;
+
+	return 0;
 }
 
 /*
- * Use 'parent' if the parent is VHD, and 'parent_fd' if the parent is raw
+ * merge the child's bitmap for @block into the parent's, returning the
+ * map to write back, or NULL if the parent block is already full.
  */
 static int
-vhd_util_coalesce_block(vhd_context_t *vhd, vhd_context_t *parent,
-		int parent_fd, uint64_t block)
+vhd_coalesce_parent_bitmap(struct vhd_coalesce *c, uint32_t block,
+			   char *map, char *pmap, char **out)
+{
+	int i;
+	ssize_t ret;
+	size_t size;
+	vhd_context_t *parent;
+
+	parent = c->parent;
+	size   = vhd_sectors_to_bytes(parent->bm_secs);
+	*out   = NULL;
+
+	if (c->new_blocks[block]) {
+		memcpy(pmap, map, size);
+		goto out;
+	}
+
+	if (vhd_has_batmap(parent) &&
+	    vhd_batmap_test(parent, &parent->batmap, block))
+		return 0;
+
+	ret = pread(parent->fd, pmap, size,
+		    vhd_sectors_to_bytes(parent->bat.bat[block]));
+	if (ret != size) {
+		printf("%s: bitmap read of block 0x%x failed: %d\n",
+		       parent->file, block, ret == -1 ? -errno : -EIO);
+		return (ret == -1 ? -errno : -EIO);
+	}
+
+	for (i = 0; i < size; i++)
+		pmap[i] |= map[i];
+
+out:
+	for (i = 0; i < parent->spb; i++)
+		if (!vhd_bitmap_test(parent, pmap, i))
+			break;
+
+	c->full_blocks[block] = (i == parent->spb);
+	*out = pmap;
+	return 0;
+}
+
+static int
+vhd_coalesce_extent(struct vhd_coalesce_worker *w,
+		    struct vhd_coalesce_extent *e)
+{
+	int err;
+	ssize_t ret;
+	uint32_t n, i, secs, block;
+	uint64_t sec;
+	size_t stride, bm_size;
+	char *map, *pmap, *data;
+	vhd_context_t *vhd, *parent;
+	struct vhd_coalesce *c;
+
+	c       = w->c;
+	vhd     = c->vhd;
+	parent  = c->parent;
+	bm_size = vhd_sectors_to_bytes(vhd->bm_secs);
+	stride  = vhd_sectors_to_bytes(vhd->bm_secs + vhd->spb);
+
+	ret = pread(vhd->fd, w->buf, e->count * stride,
+		    vhd_sectors_to_bytes(vhd->bat.bat[e->block]));
+	if (ret != e->count * stride) {
+		err = (ret == -1 ? -errno : -EIO);
+		printf("%s: read of blocks 0x%x-0x%x failed: %d\n",
+		       vhd->file, e->block, e->block + e->count - 1, err);
+		return err;
+	}
+
+	for (n = 0; n < e->count; n++) {
+		block = e->block + n;
+		map   = w->buf + n * stride;
+		data  = map + bm_size;
+
+		if (vhd_has_batmap(vhd) &&
+		    vhd_batmap_test(vhd, &vhd->batmap, block))
+			memset(map, 0xff, vhd->spb >> 3);
+
+		if (parent) {
+			err = vhd_coalesce_parent_bitmap(c, block, map,
+							 w->maps + n * bm_size,
+							 &pmap);
+			if (err)
+				return err;
+
+			sec = parent->bat.bat[block];
+			if (pmap) {
+				err = vhd_coalesce_write(w,
+						vhd_sectors_to_bytes(sec),
+						pmap, bm_size);
+				if (err)
+					return err;
+			}
+
+			sec += parent->bm_secs;
+		} else
+			sec = (uint64_t)block * vhd->spb;
+
+		for (i = 0; i < vhd->spb; i++) {
+			if (!vhd_bitmap_test(vhd, map, i))
+				continue;
+
+			for (secs = 0; i + secs < vhd->spb; secs++)
+				if (!vhd_bitmap_test(vhd, map, i + secs))
+					break;
+
+			err = vhd_coalesce_write(w,
+					vhd_sectors_to_bytes(sec + i),
+					data + vhd_sectors_to_bytes(i),
+					vhd_sectors_to_bytes(secs));
+			if (err)
+				return err;
+
+			w->bytes += vhd_sectors_to_bytes(secs);
+			i += secs;
+		}
+	}
+
+	return vhd_coalesce_flush(w);
+}
+
+static void *
+vhd_coalesce_thread(void *arg)
 {
-	int i, err;
-	char *buf, *map;
-	uint64_t sec, secs;
+	int err;
+	struct vhd_coalesce_worker *w;
+	struct vhd_coalesce_extent *e;
+	struct vhd_coalesce *c;
+
+	w = arg;
+	c = w->c;
+
+	for (;;) {
+		pthread_mutex_lock(&c->lock);
+		if (c->err || c->next == c->n_extents) {
+			pthread_mutex_unlock(&c->lock);
+			break;
+		}
+		e = c->extents + c->next++;
+		pthread_mutex_unlock(&c->lock);
+
+		w->bytes = 0;
+		err = vhd_coalesce_extent(w, e);
+
+		pthread_mutex_lock(&c->lock);
+		if (err && !c->err)
+			c->err = err;
+		c->blocks_done += e->count;
+		c->bytes_done  += w->bytes;
+		pthread_mutex_unlock(&c->lock);
+	}
 
-	buf = NULL;
-	map = NULL;
-	sec = block * vhd->spb;
+	pthread_mutex_lock(&c->lock);
+	c->running--;
+	pthread_cond_signal(&c->cond);
+	pthread_mutex_unlock(&c->lock);
 
-	if (vhd->bat.bat[block] == DD_BLK_UNUSED)
+	return NULL;
+}
+
+static int
+vhd_coalesce_run(struct vhd_coalesce *c, int threads, int progress)
+{
+	int i, err, started;
+	size_t size;
+	double start, secs;
+	struct timespec ts;
+	struct vhd_coalesce_worker *workers, *w;
+
+	if (threads > c->n_extents)
+		threads = c->n_extents;
+	if (!threads)
 		return 0;
 
-	err = posix_memalign((void **)&buf, 4096, vhd->header.block_size);
-	if (err)
-		return -err;
+	workers = calloc(threads, sizeof(*workers));
+	if (!workers)
+		return -ENOMEM;
 
-	err = vhd_io_read(vhd, buf, sec, vhd->spb);
-	if (err)
-		goto done;
+	size = vhd_sectors_to_bytes(c->vhd->bm_secs + c->vhd->spb);
 
-	if (vhd_has_batmap(vhd) && vhd_batmap_test(vhd, &vhd->batmap, block)) {
-		if (parent->file)
-			err = vhd_io_write(parent, buf, sec, vhd->spb);
-		else
-			err = __raw_io_write(parent_fd, buf, sec, vhd->spb);
-		goto done;
+	for (i = 0; i < threads; i++) {
+		w     = workers + i;
+		w->c  = c;
+		w->fd = c->parent ? c->parent->fd : c->parent_fd;
+
+		err = posix_memalign((void **)&w->buf, 4096,
+				     c->max_blocks * size);
+		if (err) {
+			w->buf = NULL;
+			err    = -err;
+			goto out;
+		}
+
+		err = posix_memalign((void **)&w->maps, 4096,
+				     c->max_blocks *
+				     vhd_sectors_to_bytes(c->vhd->bm_secs));
+		if (err) {
+			w->maps = NULL;
+			err     = -err;
+			goto out;
+		}
 	}
 
-	err = vhd_read_bitmap(vhd, block, &map);
-	if (err)
-		goto done;
+	start = vhd_coalesce_now();
+
+	pthread_mutex_lock(&c->lock);
+
+	for (i = 0; i < threads; i++) {
+		err = pthread_create(&workers[i].thread, NULL,
+				     vhd_coalesce_thread, workers + i);
+		if (err) {
+			c->err = -err;
+			break;
+		}
+		c->running++;
+	}
+	started = i;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec++;
 
-	for (i = 0; i < vhd->spb; i++) {
-		if (!vhd_bitmap_test(vhd, map, i))
+	while (c->running) {
+		if (pthread_cond_timedwait(&c->cond,
+					   &c->lock, &ts) != ETIMEDOUT)
 			continue;
 
-		for (secs = 0; i + secs < vhd->spb; secs++)
-			if (!vhd_bitmap_test(vhd, map, i + secs))
-				break;
-
-		if (parent->file)
-			err = vhd_io_write(parent,
-					   buf + vhd_sectors_to_bytes(i),
-					   sec + i, secs);
-		else
-			err = __raw_io_write(parent_fd,
-					     buf + vhd_sectors_to_bytes(i),
-					     sec + i, secs);
-		if (err)
-			goto done;
+		ts.tv_sec++;
 
-		i += secs;
+		if (progress) {
+			secs = vhd_coalesce_now() - start;
+			printf("%"PRIu64"/%"PRIu64" blocks (%d%%), %.1f MB/s\n",
+			       c->blocks_done, c->total_blocks,
+			       (int)(c->blocks_done * 100 / c->total_blocks),
+			       c->bytes_done / secs / (1 << 20));
+			fflush(stdout);
+		}
 	}
 
-	err = 0;
+	pthread_mutex_unlock(&c->lock);
+
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	err = c->err;
+
+	if (progress && !err) {
+		secs = vhd_coalesce_now() - start;
+		printf("coalesced %"PRIu64" blocks, %.1f MB in %.2f s "
+		       "(%.1f MB/s, %u extents, %d threads)\n",
+		       c->blocks_done, c->bytes_done / (double)(1 << 20), secs,
+		       c->bytes_done / secs / (1 << 20), c->n_extents, started);
+	}
 
-done:
-	free(buf);
-	free(map);
+out:
+	for (i = 0; i < threads; i++) {
+		free(workers[i].buf);
+		free(workers[i].maps);
+	}
+	free(workers);
 	return err;
 }
 
+/*
+ * commit the parent's metadata, or on failure forget the blocks we
+ * allocated and put the footer back where the old BAT expects it.
+ *
+ * the footer timestamp moves on even when no metadata changed: it is
+ * how readers which cache the parent's contents, like tapdisk's shared
+ * cache, tell that blocks were overwritten in place.
+ */
+static int
+vhd_coalesce_finish(struct vhd_coalesce *c, int err)
+{
+	uint32_t i, now;
+	int dirty;
+	vhd_context_t *parent;
+
+	parent = c->parent;
+	if (!parent)
+		return err;
+
+	if (err) {
+		if (!c->allocated)
+			return err;
+
+		for (i = 0; i < parent->bat.entries; i++)
+			if (c->new_blocks[i])
+				parent->bat.bat[i] = DD_BLK_UNUSED;
+
+		vhd_write_footer(parent, &parent->footer);
+		return err;
+	}
+
+	if (c->allocated) {
+		err = vhd_write_bat(parent, &parent->bat);
+		if (err)
+			return err;
+	}
+
+	if (vhd_has_batmap(parent)) {
+		for (dirty = 0, i = 0; i < parent->bat.entries; i++)
+			if (c->full_blocks[i]) {
+				vhd_batmap_set(parent, &parent->batmap, i);
+				dirty = 1;
+			}
+
+		if (dirty) {
+			err = vhd_write_batmap(parent, &parent->batmap);
+			if (err)
+				return err;
+		}
+	}
+
+	now = vhd_time(time(NULL));
+	if (now <= parent->footer.timestamp)
+		now = parent->footer.timestamp + 1;
+	parent->footer.timestamp = now;
+
+	return vhd_write_footer(parent, &parent->footer);
+}
+
 int
 vhd_util_coalesce(int argc, char **argv)
 {
-	int err, c;
-	uint64_t i;
+	int err, c, threads, extent_mb, progress;
 	char *name, *pname;
 	vhd_context_t vhd, parent;
+	struct vhd_coalesce co;
 	int parent_fd = -1;
 
-	name  = NULL;
-	pname = NULL;
+	name      = NULL;
+	pname     = NULL;
 	parent.file = NULL;
+	threads   = VHD_COALESCE_THREADS;
+	extent_mb = VHD_COALESCE_EXTENT_MB;
+	progress  = 0;
 
 	if (!argc || !argv)
 		goto usage;
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "n:h")) != -1) {
+	while ((c = getopt(argc, argv, "n:t:b:ph")) != -1) {
 		switch (c) {
 		case 'n':
 			name = optarg;
 			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'b':
+			extent_mb = atoi(optarg);
+			break;
+		case 'p':
+			progress = 1;
+			break;
 		case 'h':
 		default:
 			goto usage;
 		}
 	}
 
-	if (!name || optind != argc)
+	if (!name || optind != argc || threads <= 0 || extent_mb <= 0)
 		goto usage;
 
 	err = vhd_open(&vhd, name, VHD_OPEN_RDONLY);
@@ -185,6 +660,16 @@ vhd_util_coalesce(int argc, char **argv)
 		}
 	}
 
+	memset(&co, 0, sizeof(co));
+	co.vhd        = &vhd;
+	co.parent     = parent.file ? &parent : NULL;
+	co.parent_fd  = parent_fd;
+	co.max_blocks = ((uint64_t)extent_mb << 20) / vhd.header.block_size;
+	if (!co.max_blocks)
+		co.max_blocks = 1;
+	pthread_mutex_init(&co.lock, NULL);
+	pthread_cond_init(&co.cond, NULL);
+
 	err = vhd_get_bat(&vhd);
 	if (err)
 		goto done;
@@ -195,15 +680,44 @@ vhd_util_coalesce(int argc, char **argv)
 			goto done;
 	}
 
-	for (i = 0; i < vhd.bat.entries; i++) {
-		err = vhd_util_coalesce_block(&vhd, &parent, parent_fd, i);
+	if (co.parent) {
+		if (parent.header.block_size != vhd.header.block_size) {
+			printf("%s and %s have different block sizes\n",
+			       name, pname);
+			err = -EINVAL;
+			goto done;
+		}
+
+		err = vhd_get_bat(&parent);
+		if (err)
+			goto done;
+
+		if (vhd_has_batmap(&parent)) {
+			err = vhd_get_batmap(&parent);
+			if (err)
+				goto done;
+		}
+	}
+
+	err = vhd_coalesce_plan(&co);
+	if (err)
+		goto done;
+
+	if (co.parent) {
+		err = vhd_coalesce_allocate(&co);
 		if (err)
 			goto done;
 	}
 
-	err = 0;
+	err = vhd_coalesce_run(&co, threads, progress);
+	err = vhd_coalesce_finish(&co, err);
 
  done:
+	free(co.extents);
+	free(co.new_blocks);
+	free(co.full_blocks);
+	pthread_cond_destroy(&co.cond);
+	pthread_mutex_destroy(&co.lock);
 	free(pname);
 	vhd_close(&vhd);
 	if (parent.file)
@@ -213,6 +727,7 @@ vhd_util_coalesce(int argc, char **argv)
 	return err;
 
 usage:
-	printf("options: <-n name> [-h help]\n");
+	printf("options: <-n name> [-t threads] [-b extent size in MB] "
+	       "[-p progress] [-h help]\n");
 	return -EINVAL;
 }
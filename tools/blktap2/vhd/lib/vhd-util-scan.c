@@ -34,6 +34,7 @@
 #include <unistd.h>
 #include <fnmatch.h>
 #include <libgen.h>	/* for basename() */
+#include <pthread.h>
 #include <sys/stat.h>
 
 #include "list.h"
@@ -47,6 +48,9 @@
 #define VHD_SCAN_VERBOSE     0x10
 #define VHD_SCAN_PARENTS     0x20
 
+#define VHD_SCAN_THREADS     8
+#define VHD_SCAN_CACHE_MAGIC "vhd-util-scan-cache 2"
+
 #define VHD_TYPE_RAW_FILE    0x01
 #define VHD_TYPE_VHD_FILE    0x02
 #define VHD_TYPE_RAW_VOLUME  0x04
@@ -71,6 +75,10 @@ struct target {
 	uint64_t             start;
 	uint64_t             end;
 	uint8_t              type;
+
+	uint64_t             dev;
+	uint64_t             ino;
+	struct timespec      mtime;
 };
 
 struct iterator {
@@ -96,6 +104,65 @@ struct vhd_image {
 	struct vhd_image    *parent_image;
 };
 
+/*
+ * targets are probed a wave at a time by a pool of threads, and the
+ * results are then reported in target order, so that the output is the
+ * same as that of a serial scan.  each wave is whatever the iterator
+ * holds at the time: the requested targets first, then any parents they
+ * added with -a, and so on.
+ */
+struct vhd_scan_result {
+	int                  idx;
+	int                  err;
+	int                  ret;
+	int                  own_name;
+	uint8_t              parent_raw;
+	struct vhd_image     image;
+};
+
+struct vhd_scan_pool {
+	struct iterator     *itr;
+	struct vhd_scan_result *results;
+	int                  cnt;
+	int                  next;
+	pthread_mutex_t      lock;
+};
+
+/*
+ * with -C, the results for vhd files are kept in a cache file keyed by
+ * path, device, inode, size and mtime, and a later scan reuses them
+ * rather than opening files which have not changed since.  the file is
+ * rewritten with the results of each scan that ran to the end, so it
+ * follows the most recent one.
+ */
+struct vhd_scan_cache_entry {
+	char                *target;
+	uint64_t             dev;
+	uint64_t             ino;
+	uint64_t             size;
+	struct timespec      mtime;
+	int                  flags;
+
+	char                *name;
+	char                *parent;
+	uint64_t             capacity;
+	uint8_t              hidden;
+	uint8_t              parent_raw;
+};
+
+struct vhd_scan_cache {
+	const char          *path;
+
+	int                  cnt;
+	struct vhd_scan_cache_entry *entries;
+
+	int                  new_cnt;
+	int                  new_size;
+	struct vhd_scan_cache_entry *new_entries;
+
+	int                  incomplete;  /* the scan stopped early */
+};
+
 struct vhd_scan {
 	int                  cur;
 	int                  size;
@@ -108,8 +175,10 @@ struct vhd_scan {
 };
 
 static int flags;
+static int threads;
 static struct vg vg;
 static struct vhd_scan scan;
+static struct vhd_scan_cache cache;
 
 static int
 vhd_util_scan_pretty_allocate_list(int cnt)
@@ -762,6 +831,9 @@ vhd_util_scan_init_file_target(struct target *target,
 	target->start = 0;
 	target->size  = stats.st_size;
 	target->end   = stats.st_size;
+	target->dev   = stats.st_dev;
+	target->ino   = stats.st_ino;
+	target->mtime = stats.st_mtim;
 
 	return 0;
 }
@@ -912,12 +984,12 @@ iterator_free(struct iterator *itr)
 
 static void
 vhd_util_scan_add_parent(struct iterator *itr,
-			 vhd_context_t *vhd, struct vhd_image *image)
+			 struct vhd_image *image, int parent_raw)
 {
 	int err;
 	uint8_t type;
 
-	if (vhd_parent_raw(vhd))
+	if (parent_raw)
 		type = target_volume(image->target->type) ? 
 			VHD_TYPE_RAW_VOLUME : VHD_TYPE_RAW_FILE;
 	else
@@ -930,75 +1002,510 @@ vhd_util_scan_add_parent(struct iterator *itr,
 }
 
 static int
-vhd_util_scan_targets(int cnt, struct target *targets)
+vhd_util_scan_cache_compare(const void *lhs, const void *rhs)
 {
-	int ret, err;
-	vhd_context_t vhd;
-	struct iterator itr;
-	struct target *target;
-	struct vhd_image image;
+	const struct vhd_scan_cache_entry *l = lhs, *r = rhs;
 
-	ret = 0;
-	err = 0;
+	return strcmp(l->target, r->target);
+}
 
-	err = iterator_init(&itr, cnt, targets);
-	if (err)
-		return err;
+static void
+vhd_util_scan_cache_free_entries(struct vhd_scan_cache_entry *entries,
+				 int cnt)
+{
+	int i;
 
-	while ((target = iterator_next(&itr))) {
-		memset(&vhd, 0, sizeof(vhd));
-		memset(&image, 0, sizeof(image));
+	for (i = 0; i < cnt; i++) {
+		free(entries[i].target);
+		free(entries[i].name);
+		free(entries[i].parent);
+	}
 
-		image.target = target;
+	free(entries);
+}
 
-		err = vhd_util_scan_open(&vhd, &image);
-		if (err) {
-			ret = -EAGAIN;
-			goto end;
+static int
+vhd_util_scan_cache_parse(char *line, struct vhd_scan_cache_entry *entry)
+{
+	char *field[11], *end;
+	int i;
+
+	for (i = 0; i < 11; i++) {
+		field[i] = strsep(&line, "\t");
+		if (!field[i])
+			return -EINVAL;
+	}
+
+	if (line || !*field[0] || !*field[6])
+		return -EINVAL;
+
+	memset(entry, 0, sizeof(*entry));
+
+	entry->dev           = strtoull(field[1], NULL, 10);
+	entry->ino           = strtoull(field[2], NULL, 10);
+	entry->size          = strtoull(field[3], NULL, 10);
+	entry->mtime.tv_sec  = strtol(field[4], &end, 10);
+	if (*end != '.')
+		return -EINVAL;
+	entry->mtime.tv_nsec = strtol(end + 1, NULL, 10);
+	entry->flags         = atoi(field[5]);
+	entry->capacity      = strtoull(field[8], NULL, 10);
+	entry->hidden        = atoi(field[9]);
+	entry->parent_raw    = atoi(field[10]);
+
+	entry->target = strdup(field[0]);
+	entry->name   = strdup(field[6]);
+	if (*field[7])
+		entry->parent = strdup(field[7]);
+
+	if (!entry->target || !entry->name || (*field[7] && !entry->parent)) {
+		free(entry->target);
+		free(entry->name);
+		free(entry->parent);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void
+vhd_util_scan_cache_load(void)
+{
+	FILE *f;
+	char *line;
+	size_t len;
+	ssize_t ret;
+	int size, err;
+	struct vhd_scan_cache_entry *entries, *new;
+
+	line    = NULL;
+	len     = 0;
+	size    = 0;
+	entries = NULL;
+
+	f = fopen(cache.path, "r");
+	if (!f)
+		return;
+
+	ret = getline(&line, &len, f);
+	if (ret <= 0 || strcmp(line, VHD_SCAN_CACHE_MAGIC "\n"))
+		goto out;
+
+	while ((ret = getline(&line, &len, f)) > 0) {
+		if (line[ret - 1] != '\n')
+			break;
+		line[ret - 1] = '\0';
+
+		if (cache.cnt == size) {
+			size = size ? size * 2 : 256;
+			new  = realloc(entries, size * sizeof(*entries));
+			if (!new)
+				break;
+			entries = new;
 		}
 
-		err = vhd_util_scan_get_size(&vhd, &image);
-		if (err) {
-			ret           = -EAGAIN;
-			image.message = "getting physical size";
-			image.error   = err;
-			goto end;
+		err = vhd_util_scan_cache_parse(line, entries + cache.cnt);
+		if (!err)
+			cache.cnt++;
+	}
+
+	qsort(entries, cache.cnt, sizeof(*entries),
+	      vhd_util_scan_cache_compare);
+	cache.entries = entries;
+	entries = NULL;
+
+out:
+	free(entries);
+	free(line);
+	fclose(f);
+}
+
+static inline int
+vhd_util_scan_cache_flags(void)
+{
+	return flags & (VHD_SCAN_FAST | VHD_SCAN_PRETTY);
+}
+
+/*
+ * a slow scan only reports the parent path it finds when the parent
+ * exists, so an entry only stands while that is still true.
+ */
+static inline int
+vhd_util_scan_cache_parent_valid(const char *parent)
+{
+	struct stat stats;
+
+	if (!parent || (flags & VHD_SCAN_FAST))
+		return 1;
+
+	return !stat(parent, &stats);
+}
+
+static struct vhd_scan_cache_entry *
+vhd_util_scan_cache_lookup(struct target *target)
+{
+	struct vhd_scan_cache_entry key, *entry;
+
+	if (!cache.cnt || target->type != VHD_TYPE_VHD_FILE)
+		return NULL;
+
+	key.target = target->name;
+	entry = bsearch(&key, cache.entries, cache.cnt, sizeof(key),
+			vhd_util_scan_cache_compare);
+	if (!entry)
+		return NULL;
+
+	if (entry->dev != target->dev ||
+	    entry->ino != target->ino ||
+	    entry->size != target->size ||
+	    entry->mtime.tv_sec != target->mtime.tv_sec ||
+	    entry->mtime.tv_nsec != target->mtime.tv_nsec ||
+	    entry->flags != vhd_util_scan_cache_flags())
+		return NULL;
+
+	if (!vhd_util_scan_cache_parent_valid(entry->parent))
+		return NULL;
+
+	return entry;
+}
+
+static inline int
+vhd_util_scan_cache_name_valid(const char *name)
+{
+	return !strpbrk(name, "\t\n");
+}
+
+static void
+vhd_util_scan_cache_add(struct target *target, struct vhd_scan_result *r)
+{
+	struct vhd_scan_cache_entry *entry, *new;
+
+	if (!cache.path || target->type != VHD_TYPE_VHD_FILE || r->err)
+		return;
+
+	if (!vhd_util_scan_cache_name_valid(target->name) ||
+	    !vhd_util_scan_cache_name_valid(r->image.name) ||
+	    (r->image.parent &&
+	     !vhd_util_scan_cache_name_valid(r->image.parent)))
+		return;
+
+	if (!vhd_util_scan_cache_parent_valid(r->image.parent))
+		return;
+
+	if (cache.new_cnt == cache.new_size) {
+		int size = cache.new_size ? cache.new_size * 2 : 256;
+
+		new = realloc(cache.new_entries, size * sizeof(*new));
+		if (!new)
+			return;
+
+		cache.new_entries = new;
+		cache.new_size    = size;
+	}
+
+	entry = cache.new_entries + cache.new_cnt;
+	memset(entry, 0, sizeof(*entry));
+
+	entry->target     = strdup(target->name);
+	entry->name       = strdup(r->image.name);
+	entry->parent     = r->image.parent ? strdup(r->image.parent) : NULL;
+	entry->dev        = target->dev;
+	entry->ino        = target->ino;
+	entry->size       = target->size;
+	entry->mtime      = target->mtime;
+	entry->flags      = vhd_util_scan_cache_flags();
+	entry->capacity   = r->image.capacity;
+	entry->hidden     = r->image.hidden;
+	entry->parent_raw = r->parent_raw;
+
+	if (!entry->target || !entry->name ||
+	    (r->image.parent && !entry->parent)) {
+		free(entry->target);
+		free(entry->name);
+		free(entry->parent);
+		return;
+	}
+
+	cache.new_cnt++;
+}
+
+static void
+vhd_util_scan_cache_save(void)
+{
+	int i, fd, err;
+	FILE *f;
+	char *tmp;
+	struct vhd_scan_cache_entry *e;
+
+	/* keep the results of the last complete scan */
+	if (cache.incomplete)
+		return;
+
+	/* a name of our own, so that concurrent scans can't mix their output */
+	if (asprintf(&tmp, "%s.XXXXXX", cache.path) == -1)
+		return;
+
+	fd = mkstemp(tmp);
+	if (fd == -1)
+		goto out;
+
+	f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+
+	fprintf(f, VHD_SCAN_CACHE_MAGIC "\n");
+
+	for (i = 0; i < cache.new_cnt; i++) {
+		e = cache.new_entries + i;
+		fprintf(f, "%s\t%"PRIu64"\t%"PRIu64"\t%"PRIu64"\t%ld.%09ld\t"
+			"%d\t%s\t%s\t%"PRIu64"\t%u\t%u\n",
+			e->target, e->dev, e->ino, e->size,
+			(long)e->mtime.tv_sec, e->mtime.tv_nsec, e->flags,
+			e->name, e->parent ? : "", e->capacity, e->hidden,
+			e->parent_raw);
+	}
+
+	err = ferror(f);
+	if (fclose(f) || err || rename(tmp, cache.path))
+		unlink(tmp);
+
+out:
+	free(tmp);
+}
+
+static void
+vhd_util_scan_cache_free(void)
+{
+	vhd_util_scan_cache_free_entries(cache.entries, cache.cnt);
+	vhd_util_scan_cache_free_entries(cache.new_entries, cache.new_cnt);
+	memset(&cache, 0, sizeof(cache));
+}
+
+static int
+vhd_util_scan_probe_cached(struct target *target, struct vhd_scan_result *r)
+{
+	struct vhd_scan_cache_entry *entry;
+
+	entry = vhd_util_scan_cache_lookup(target);
+	if (!entry)
+		return 0;
+
+	r->image.name = strdup(entry->name);
+	if (!r->image.name)
+		return 0;
+
+	if (entry->parent) {
+		r->image.parent = strdup(entry->parent);
+		if (!r->image.parent) {
+			free(r->image.name);
+			r->image.name = NULL;
+			return 0;
 		}
+	}
+
+	r->image.size     = target->size;
+	r->image.capacity = entry->capacity;
+	r->image.hidden   = entry->hidden;
+	r->parent_raw     = entry->parent_raw;
+	r->own_name       = 1;
+
+	return 1;
+}
+
+static void
+vhd_util_scan_probe(struct target *target, struct vhd_scan_result *r)
+{
+	int err;
+	vhd_context_t vhd;
+	struct vhd_image *image;
+
+	image = &r->image;
+	image->target = target;
+
+	if (vhd_util_scan_probe_cached(target, r))
+		return;
 
-		err = vhd_util_scan_get_hidden(&vhd, &image);
+	memset(&vhd, 0, sizeof(vhd));
+
+	err = vhd_util_scan_open(&vhd, image);
+	if (err) {
+		r->ret = -EAGAIN;
+		goto end;
+	}
+
+	err = vhd_util_scan_get_size(&vhd, image);
+	if (err) {
+		r->ret         = -EAGAIN;
+		image->message = "getting physical size";
+		image->error   = err;
+		goto end;
+	}
+
+	err = vhd_util_scan_get_hidden(&vhd, image);
+	if (err) {
+		r->ret         = -EAGAIN;
+		image->message = "checking 'hidden' field";
+		image->error   = err;
+		goto end;
+	}
+
+	if (vhd.footer.type == HD_TYPE_DIFF) {
+		err = vhd_util_scan_get_parent(&vhd, image);
 		if (err) {
-			ret           = -EAGAIN;
-			image.message = "checking 'hidden' field";
-			image.error   = err;
+			r->ret         = -EAGAIN;
+			image->message = "getting parent";
+			image->error   = err;
 			goto end;
 		}
+	}
 
-		if (vhd.footer.type == HD_TYPE_DIFF) {
-			err = vhd_util_scan_get_parent(&vhd, &image);
-			if (err) {
-				ret           = -EAGAIN;
-				image.message = "getting parent";
-				image.error   = err;
-				goto end;
-			}
-		}
+end:
+	r->err        = err;
+	r->parent_raw = vhd_parent_raw(&vhd);
+	r->own_name   = (image->name != target->name);
+
+	if (vhd.file)
+		vhd_close(&vhd);
+}
 
-	end:
-		vhd_util_scan_print_image(&image);
+static void *
+vhd_util_scan_probe_thread(void *arg)
+{
+	int i;
+	struct vhd_scan_pool *pool;
+	struct vhd_scan_result *r;
 
-		if (flags & VHD_SCAN_PARENTS && image.parent)
-			vhd_util_scan_add_parent(&itr, &vhd, &image);
+	pool = arg;
 
-		if (vhd.file)
-			vhd_close(&vhd);
-		if (image.name != target->name)
-			free(image.name);
-		free(image.parent);
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		i = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (i >= pool->cnt)
+			break;
 
-		if (err && !(flags & VHD_SCAN_NOFAIL))
+		r = pool->results + i;
+		vhd_util_scan_probe(pool->itr->targets + r->idx, r);
+	}
+
+	return NULL;
+}
+
+static void
+vhd_util_scan_probe_targets(struct iterator *itr,
+			    struct vhd_scan_result *results, int cnt)
+{
+	int i, n, err;
+	pthread_t *tids;
+	struct vhd_scan_pool pool;
+
+	memset(&pool, 0, sizeof(pool));
+	pool.itr     = itr;
+	pool.results = results;
+	pool.cnt     = cnt;
+	pthread_mutex_init(&pool.lock, NULL);
+
+	n    = (threads < cnt ? threads : cnt);
+	tids = (n > 1 ? calloc(n, sizeof(pthread_t)) : NULL);
+
+	for (i = 0; tids && i < n; i++) {
+		err = pthread_create(tids + i, NULL,
+				     vhd_util_scan_probe_thread, &pool);
+		if (err)
 			break;
 	}
 
+	/* the calling thread takes its share, or all of it */
+	vhd_util_scan_probe_thread(&pool);
+
+	while (tids && i--)
+		pthread_join(tids[i], NULL);
+
+	free(tids);
+	pthread_mutex_destroy(&pool.lock);
+}
+
+static void
+vhd_util_scan_free_result(struct vhd_scan_result *r)
+{
+	if (r->own_name)
+		free(r->image.name);
+	free(r->image.parent);
+	r->image.name   = NULL;
+	r->image.parent = NULL;
+}
+
+static int
+vhd_util_scan_targets(int cnt, struct target *targets)
+{
+	int i, n, ret, err, done;
+	struct iterator itr;
+	struct target *target;
+	struct vhd_scan_result *results, *r;
+
+	ret  = 0;
+	err  = 0;
+	done = 0;
+
+	err = iterator_init(&itr, cnt, targets);
+	if (err)
+		return err;
+
+	while (!done && itr.cur < itr.cur_size) {
+		n = itr.cur_size - itr.cur;
+
+		results = calloc(n, sizeof(*results));
+		if (!results) {
+			err = -ENOMEM;
+			ret = err;
+			cache.incomplete = 1;
+			break;
+		}
+
+		for (i = 0; i < n; i++)
+			results[i].idx = itr.cur + i;
+
+		vhd_util_scan_probe_targets(&itr, results, n);
+
+		for (i = 0; i < n; i++) {
+			r      = results + i;
+			target = iterator_next(&itr);
+
+			/* the parents of earlier results may have moved us */
+			r->image.target = target;
+			if (!r->own_name)
+				r->image.name = target->name;
+
+			err = r->err;
+			if (r->ret)
+				ret = r->ret;
+
+			vhd_util_scan_print_image(&r->image);
+			vhd_util_scan_cache_add(target, r);
+
+			if (flags & VHD_SCAN_PARENTS && r->image.parent)
+				vhd_util_scan_add_parent(&itr, &r->image,
+							 r->parent_raw);
+
+			vhd_util_scan_free_result(r);
+
+			if (err && !(flags & VHD_SCAN_NOFAIL)) {
+				cache.incomplete = 1;
+				done = 1;
+				break;
+			}
+		}
+
+		while (++i < n)
+			vhd_util_scan_free_result(results + i);
+
+		free(results);
+	}
+
 	iterator_free(&itr);
 
 	if (flags & VHD_SCAN_NOFAIL)
@@ -1246,9 +1753,12 @@ vhd_util_scan(int argc, char **argv)
 	filter  = NULL;
 	volume  = NULL;
 	targets = NULL;
+	threads = VHD_SCAN_THREADS;
+
+	memset(&cache, 0, sizeof(cache));
 
 	optind = 0;
-	while ((c = getopt(argc, argv, "m:fcl:pavh")) != -1) {
+	while ((c = getopt(argc, argv, "m:fcl:pavt:C:h")) != -1) {
 		switch (c) {
 		case 'm':
 			filter = optarg;
@@ -1272,6 +1782,12 @@ vhd_util_scan(int argc, char **argv)
 		case 'v':
 			flags |= VHD_SCAN_VERBOSE;
 			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'C':
+			cache.path = optarg;
+			break;
 		case 'h':
 			goto usage;
 		default:
@@ -1280,7 +1796,7 @@ vhd_util_scan(int argc, char **argv)
 		}
 	}
 
-	if (!filter && argc - optind == 0) {
+	if ((!filter && argc - optind == 0) || threads <= 0) {
 		err = -EINVAL;
 		goto usage;
 	}
@@ -1298,11 +1814,19 @@ vhd_util_scan(int argc, char **argv)
 	if (!cnt)
 		return 0;
 
+	if (cache.path)
+		vhd_util_scan_cache_load();
+
 	if (flags & VHD_SCAN_PRETTY)
 		err = vhd_util_scan_targets_pretty(cnt, targets);
 	else
 		err = vhd_util_scan_targets(cnt, targets);
 
+	if (cache.path) {
+		vhd_util_scan_cache_save();
+		vhd_util_scan_cache_free();
+	}
+
 	free(targets);
 	lvm_free_vg(&vg);
 
@@ -1312,6 +1836,6 @@ usage:
 	printf("usage: [OPTIONS] FILES\n"
 	       "options: [-m match filter] [-f fast] [-c continue on failure] "
 	       "[-l LVM volume] [-p pretty print] [-a scan parents] "
-	       "[-v verbose] [-h help]\n");
+	       "[-v verbose] [-t threads] [-C cache file] [-h help]\n");
 	return err;
 }
@@ -1533,6 +1533,20 @@ int xc_tbuf_set_cpu_mask(xc_interface *xch, xc_cpumap_t mask);
 
 int xc_tbuf_set_evt_mask(xc_interface *xch, uint32_t mask);
 
+/**
+ * Set the finer grained trace filters (per domain, event range, sampling)
+ * applied after the event and cpu masks.  Passing flags == 0 removes them.
+ */
+int xc_tbuf_set_filter(xc_interface *xch,
+                       const struct xen_sysctl_tbuf_filter *filter);
+
+/**
+ * Set or get the trace record format, XEN_SYSCTL_TBUF_FORMAT_*.  It can
+ * only be set while tracing is disabled.
+ */
+int xc_tbuf_set_format(xc_interface *xch, uint32_t format);
+int xc_tbuf_get_format(xc_interface *xch, uint32_t *format);
+
 int xc_domctl(xc_interface *xch, struct xen_domctl *domctl);
 int xc_sysctl(xc_interface *xch, struct xen_sysctl *sysctl);
 
@@ -170,3 +170,44 @@ int xc_tbuf_set_evt_mask(xc_interface *xch, uint32_t mask)
     return do_sysctl(xch, &sysctl);
 }
 
+
+int xc_tbuf_set_filter(xc_interface *xch,
+                       const struct xen_sysctl_tbuf_filter *filter)
+{
+    DECLARE_SYSCTL;
+
+    sysctl.cmd = XEN_SYSCTL_tbuf_op;
+    sysctl.interface_version = XEN_SYSCTL_INTERFACE_VERSION;
+    sysctl.u.tbuf_op.cmd  = XEN_SYSCTL_TBUFOP_set_filter;
+    sysctl.u.tbuf_op.filter = *filter;
+
+    return do_sysctl(xch, &sysctl);
+}
+
+int xc_tbuf_set_format(xc_interface *xch, uint32_t format)
+{
+    DECLARE_SYSCTL;
+
+    sysctl.cmd = XEN_SYSCTL_tbuf_op;
+    sysctl.interface_version = XEN_SYSCTL_INTERFACE_VERSION;
+    sysctl.u.tbuf_op.cmd  = XEN_SYSCTL_TBUFOP_set_format;
+    sysctl.u.tbuf_op.format = format;
+
+    return do_sysctl(xch, &sysctl);
+}
+
+int xc_tbuf_get_format(xc_interface *xch, uint32_t *format)
+{
+    DECLARE_SYSCTL;
+    int rc;
+
+    sysctl.cmd = XEN_SYSCTL_tbuf_op;
+    sysctl.interface_version = XEN_SYSCTL_INTERFACE_VERSION;
+    sysctl.u.tbuf_op.cmd  = XEN_SYSCTL_TBUFOP_get_info;
+
+    rc = do_sysctl(xch, &sysctl);
+    if ( rc == 0 )
+        *format = sysctl.u.tbuf_op.format;
+
+    return rc;
+}
@@ -60,6 +60,7 @@ int libxl_ctx_alloc(libxl_ctx **pctx, int version,
     ctx->osevent_hooks = 0;
 
     ctx->poller_app = 0;
+    ctx->poller_app_used = 0;
     LIBXL_LIST_INIT(&ctx->pollers_event);
     LIBXL_LIST_INIT(&ctx->pollers_idle);
     LIBXL_LIST_INIT(&ctx->pollers_fds_changed);
@@ -77,6 +78,9 @@ int libxl_ctx_alloc(libxl_ctx **pctx, int version,
 
     LIBXL_LIST_INIT(&ctx->aos_inprogress);
 
+    LIBXL_LIST_INIT(&ctx->qmp_handlers);
+    ctx->qmp_connecting = 0;
+
     LIBXL_TAILQ_INIT(&ctx->death_list);
     libxl__ev_xswatch_init(&ctx->death_watch);
 
@@ -169,6 +173,8 @@ int libxl_ctx_free(libxl_ctx *ctx)
     while ((eject = LIBXL_LIST_FIRST(&CTX->disk_eject_evgens)))
         libxl__evdisable_disk_eject(gc, eject);
 
+    libxl__qmp_close_all(gc);
+
     libxl_childproc_setmode(CTX,0,0);
     for (i = 0; i < ctx->watch_nslots; i++)
         assert(!libxl__watch_slot_contents(gc, i));
@@ -198,6 +204,12 @@ int libxl_ctx_free(libxl_ctx *ctx)
         free(poller);
     }
 
+#ifdef HAVE_SYS_EPOLL_H
+    for (i = 0; i < ctx->efd_slots_allocd; i++)
+        free(ctx->efd_slots[i]);
+    free(ctx->efd_slots);
+#endif
+
     free(ctx->watch_slots);
 
     discard_events(&ctx->occurred);
@@ -682,6 +682,16 @@ typedef struct libxl__ctx libxl_ctx;
  */
 #define LIBXL_HAVE_DOMAIN_CREATE_RESTORE_SEND_BACK_FD 1
 
+/*
+ * LIBXL_HAVE_DOMAIN_CREATE_NEW_MANY 1
+ *
+ * If this is defined, libxl_domain_create_new_many() is available to
+ * create several domains concurrently within a single asynchronous
+ * operation, and libxl_domain_create_timing reports the time spent in
+ * each phase of the creation of each domain.
+ */
+#define LIBXL_HAVE_DOMAIN_CREATE_NEW_MANY 1
+
 /*
  * LIBXL_HAVE_CREATEINFO_PVH
  * If this is defined, then libxl supports creation of a PVH guest.
@@ -1234,6 +1244,24 @@ int libxl_domain_create_restore(libxl_ctx *ctx, libxl_domain_config *d_config,
                                 const libxl_asyncprogress_how *aop_console_how)
                                 LIBXL_EXTERNAL_CALLERS_ONLY;
 
+/*
+ * Creates nr_doms domains, one from each of d_configs[0..nr_doms-1],
+ * with their creations running concurrently in one ao.  domids[i] is
+ * set as libxl_domain_create_new would set *domid for domain i.
+ * If rcs is non-NULL, rcs[i] is set to the result of creating
+ * domain i; if timings is non-NULL, timings[i] receives the per-phase
+ * timing of domain i.  All arrays must remain valid until the ao
+ * completes.  The overall result is the first failure seen, or 0 if
+ * every domain was created.  Successfully created domains are left in
+ * place (and paused) even if others fail.
+ */
+int libxl_domain_create_new_many(libxl_ctx *ctx, int nr_doms,
+                                 libxl_domain_config *d_configs,
+                                 uint32_t *domids, int *rcs,
+                                 libxl_domain_create_timing *timings,
+                                 const libxl_asyncop_how *ao_how)
+                                 LIBXL_EXTERNAL_CALLERS_ONLY;
+
 #if defined(LIBXL_API_VERSION) && LIBXL_API_VERSION < 0x040400
 
 static inline int libxl_domain_create_restore_0x040200(
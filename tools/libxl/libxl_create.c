@@ -776,6 +776,19 @@ static void domcreate_destruction_cb(libxl__egc *egc,
                                      libxl__domain_destroy_state *dds,
                                      int rc);
 
+/* Charges the time since the previous phase boundary to *phase_us
+ * and starts timing the next phase. */
+static void domcreate_phase_done(libxl__domain_create_state *dcs,
+                                 uint64_t *phase_us)
+{
+    struct timeval now, elapsed;
+
+    gettimeofday(&now, NULL);
+    timersub(&now, &dcs->phase_start, &elapsed);
+    *phase_us = (uint64_t)elapsed.tv_sec * 1000000 + elapsed.tv_usec;
+    dcs->phase_start = now;
+}
+
 static void initiate_domain_create(libxl__egc *egc,
                                    libxl__domain_create_state *dcs)
 {
@@ -793,6 +806,10 @@ static void initiate_domain_create(libxl__egc *egc,
 
     domid = dcs->domid_soft_reset;
 
+    libxl_domain_create_timing_init(&dcs->timing);
+    gettimeofday(&dcs->create_start, NULL);
+    dcs->phase_start = dcs->create_start;
+
     if (d_config->c_info.ssid_label) {
         char *s = d_config->c_info.ssid_label;
         ret = libxl_flask_context_to_sid(ctx, s, strlen(s),
@@ -904,6 +921,7 @@ static void initiate_domain_create(libxl__egc *egc,
 
     dcs->guest_domid = domid;
     dcs->sdss.dm.guest_domid = 0; /* means we haven't spawned */
+    domcreate_phase_done(dcs, &dcs->timing.make_us);
 
     ret = libxl__domain_build_info_setdefault(gc, &d_config->b_info);
     if (ret) {
@@ -1226,6 +1244,7 @@ static void domcreate_rebuild_done(libxl__egc *egc,
     }
 
     store_libxl_entry(gc, domid, &d_config->b_info);
+    domcreate_phase_done(dcs, &dcs->timing.build_us);
 
     libxl__multidev_begin(ao, &dcs->multidev);
     dcs->multidev.callback = domcreate_launch_dm;
@@ -1255,6 +1274,7 @@ static void domcreate_launch_dm(libxl__egc *egc, libxl__multidev *multidev,
         LOG(ERROR, "unable to add disk devices");
         goto error_out;
     }
+    domcreate_phase_done(dcs, &dcs->timing.disks_us);
 
     for (i = 0; i < d_config->b_info.num_ioports; i++) {
         libxl_ioport_range *io = &d_config->b_info.ioports[i];
@@ -1422,6 +1442,7 @@ static void domcreate_devmodel_started(libxl__egc *egc,
         LOG(ERROR, "device model did not start: %d", ret);
         goto error_out;
     }
+    domcreate_phase_done(dcs, &dcs->timing.devmodel_us);
 
     if (dcs->sdss.dm.guest_domid) {
         if (d_config->b_info.device_model_version
@@ -1624,10 +1645,16 @@ static void domcreate_complete(libxl__egc *egc,
     STATE_AO_GC(dcs->ao);
     libxl_domain_config *const d_config = dcs->guest_config;
     libxl_domain_config *d_config_saved = &dcs->guest_config_saved;
+    struct timeval total_start = dcs->create_start;
 
     libxl__file_reference_unmap(&dcs->build_state.pv_kernel);
     libxl__file_reference_unmap(&dcs->build_state.pv_ramdisk);
 
+    if (!rc)
+        domcreate_phase_done(dcs, &dcs->timing.devices_us);
+    dcs->phase_start = total_start;
+    domcreate_phase_done(dcs, &dcs->timing.total_us);
+
     if (!rc && d_config->b_info.exec_ssidref)
         rc = xc_flask_relabel_domain(CTX->xch, dcs->guest_domid, d_config->b_info.exec_ssidref);
 
@@ -1893,6 +1920,120 @@ static void domain_create_cb(libxl__egc *egc,
 }
 
 
+/*----- batch domain creation -----*/
+
+typedef struct libxl__domain_create_batch_state
+    libxl__domain_create_batch_state;
+
+typedef struct {
+    libxl__domain_create_state dcs;
+    libxl__domain_create_batch_state *batch;
+    int idx;
+} libxl__batch_domain_create_state;
+
+struct libxl__domain_create_batch_state {
+    libxl__ao *ao;
+    int nr_doms;
+    int outstanding;
+    int rc; /* first failure, if any */
+    uint32_t *domids;
+    int *rcs;
+    libxl_domain_create_timing *timings;
+};
+
+static void batch_domain_create_cb(libxl__egc *egc,
+                                   libxl__domain_create_state *dcs,
+                                   int rc, uint32_t domid)
+{
+    libxl__batch_domain_create_state *bdcs = CONTAINER_OF(dcs, *bdcs, dcs);
+    libxl__domain_create_batch_state *batch = bdcs->batch;
+    STATE_AO_GC(batch->ao);
+
+    batch->domids[bdcs->idx] = domid;
+    if (batch->rcs)
+        batch->rcs[bdcs->idx] = rc;
+    if (batch->timings)
+        batch->timings[bdcs->idx] = dcs->timing;
+
+    if (rc) {
+        LOG(ERROR, "creation of domain %d of %d in batch failed: %d",
+            bdcs->idx, batch->nr_doms, rc);
+        if (!batch->rc)
+            batch->rc = rc;
+    }
+
+    assert(batch->outstanding > 0);
+    if (--batch->outstanding)
+        return;
+
+    libxl__ao_complete(egc, ao, batch->rc);
+}
+
+static void unset_disk_colo_restore(libxl_domain_config *d_config);
+
+int libxl_domain_create_new_many(libxl_ctx *ctx, int nr_doms,
+                                 libxl_domain_config *d_configs,
+                                 uint32_t *domids, int *rcs,
+                                 libxl_domain_create_timing *timings,
+                                 const libxl_asyncop_how *ao_how)
+{
+    AO_CREATE(ctx, 0, ao_how);
+    libxl__domain_create_batch_state *batch;
+    libxl__batch_domain_create_state *bdcss;
+    int i, rc;
+
+    if (nr_doms <= 0) {
+        LOG(ERROR, "invalid number of domains to create: %d", nr_doms);
+        rc = ERROR_INVAL;
+        goto out;
+    }
+
+    GCNEW(batch);
+    batch->ao = ao;
+    batch->nr_doms = nr_doms;
+    batch->domids = domids;
+    batch->rcs = rcs;
+    batch->timings = timings;
+    GCNEW_ARRAY(bdcss, nr_doms);
+
+    for (i = 0; i < nr_doms; i++) {
+        libxl__domain_create_state *dcs = &bdcss[i].dcs;
+
+        domids[i] = INVALID_DOMID;
+        unset_disk_colo_restore(&d_configs[i]);
+
+        bdcss[i].batch = batch;
+        bdcss[i].idx = i;
+        dcs->ao = ao;
+        dcs->guest_config = &d_configs[i];
+        libxl_domain_config_init(&dcs->guest_config_saved);
+        libxl_domain_config_copy(ctx, &dcs->guest_config_saved,
+                                 &d_configs[i]);
+        dcs->restore_fd = dcs->libxc_fd = -1;
+        dcs->send_back_fd = -1;
+        dcs->callback = batch_domain_create_cb;
+        dcs->domid_soft_reset = INVALID_DOMID;
+        libxl__ao_progress_gethow(&dcs->aop_console_how, NULL);
+    }
+
+    /*
+     * All the creations run interleaved in this ao.  The steps which
+     * make placement decisions (libxl__domain_make, NUMA placement in
+     * libxl__build_pre) are synchronous, so each domain's placement
+     * already accounts for the domains started before it in the batch.
+     * The count must cover the whole batch before any of them starts,
+     * as an early failure calls back synchronously.
+     */
+    batch->outstanding = nr_doms;
+    for (i = 0; i < nr_doms; i++)
+        initiate_domain_create(egc, &bdcss[i].dcs);
+
+    return AO_INPROGRESS;
+
+ out:
+    return AO_CREATE_FAIL(rc);
+}
+
 static void set_disk_colo_restore(libxl_domain_config *d_config)
 {
     int i;
@@ -596,6 +596,7 @@ void libxl__prepare_ao_device(libxl__ao *ao, libxl__ao_device *aodev)
     /* We init this here because we might call device_hotplug_done
      * without actually calling any hotplug script */
     libxl__async_exec_init(&aodev->aes);
+    memset(&aodev->hotplug, 0, sizeof(aodev->hotplug));
     libxl__ev_child_init(&aodev->child);
 }
 
@@ -866,6 +867,9 @@ static void device_hotplug_child_death_cb(libxl__egc *egc,
                                           libxl__async_exec_state *aes,
                                           int rc, int status);
 
+static void device_hotplug_exec_done(libxl__egc *egc,
+                                     libxl__ao_device *aodev, int rc);
+
 static void device_destroy_be_watch_cb(libxl__egc *egc,
                                        libxl__xswait_state *xswait,
                                        int rc, const char *data);
@@ -1166,13 +1170,24 @@ static void device_hotplug(libxl__egc *egc, libxl__ao_device *aodev)
         goto out;
     }
 
-    LOG(DEBUG, "calling hotplug script: %s %s", args[0], args[1]);
+    rc = libxl__hotplug_builtin(gc, aodev, &args, &env);
+    if (rc < 0 || rc == 1) {
+        LOG(DEBUG, "hotplug script %s %s run in-process", args[0], args[1]);
+        device_hotplug_exec_done(egc, aodev, rc < 0 ? rc : 0);
+        return;
+    }
 
-    nullfd = open("/dev/null", O_RDONLY);
-    if (nullfd < 0) {
-        LOG(ERROR, "unable to open /dev/null for hotplug script");
-        rc = ERROR_FAIL;
-        goto out;
+    if (aodev->hotplug.input) {
+        LOG(DEBUG, "calling hotplug helper: %s %s", args[0], args[1]);
+    } else {
+        LOG(DEBUG, "calling hotplug script: %s %s", args[0], args[1]);
+
+        nullfd = open("/dev/null", O_RDONLY);
+        if (nullfd < 0) {
+            LOG(ERROR, "unable to open /dev/null for hotplug script");
+            rc = ERROR_FAIL;
+            goto out;
+        }
     }
 
     aes->ao = ao;
@@ -1181,7 +1196,8 @@ static void device_hotplug(libxl__egc *egc, libxl__ao_device *aodev)
     aes->args = args;
     aes->callback = device_hotplug_child_death_cb;
     aes->timeout_ms = LIBXL_HOTPLUG_TIMEOUT * 1000;
-    aes->stdfds[0] = nullfd;
+    aes->stdfds[0] = aodev->hotplug.input ?
+                     libxl__carefd_fd(aodev->hotplug.input) : nullfd;
     aes->stdfds[1] = 2;
     aes->stdfds[2] = -1;
 
@@ -1189,7 +1205,7 @@ static void device_hotplug(libxl__egc *egc, libxl__ao_device *aodev)
     if (rc)
         goto out;
 
-    close(nullfd);
+    if (nullfd >= 0) close(nullfd);
     assert(libxl__async_exec_inuse(&aodev->aes));
 
     return;
@@ -1210,9 +1226,12 @@ static void device_hotplug_child_death_cb(libxl__egc *egc,
     char *be_path = libxl__device_backend_path(gc, aodev->dev);
     char *hotplug_error;
 
-    device_hotplug_clean(gc, aodev);
-
-    if (status && !rc) {
+    if (aodev->hotplug.input) {
+        /* Like the scripts, carry on without whatever the helper did */
+        if (rc || status)
+            LOG(ERROR, "%s failed, this may affect the device", aes->what);
+        rc = 0;
+    } else if (status && !rc) {
         hotplug_error = libxl__xs_read(gc, XBT_NULL,
                                        GCSPRINTF("%s/hotplug-error", be_path));
         if (hotplug_error)
@@ -1220,6 +1239,16 @@ static void device_hotplug_child_death_cb(libxl__egc *egc,
         rc = ERROR_FAIL;
     }
 
+    device_hotplug_exec_done(egc, aodev, rc);
+}
+
+static void device_hotplug_exec_done(libxl__egc *egc,
+                                     libxl__ao_device *aodev, int rc)
+{
+    STATE_AO_GC(aodev->ao);
+
+    device_hotplug_clean(gc, aodev);
+
     if (rc) {
         if (!aodev->rc)
             aodev->rc = rc;
@@ -1294,6 +1323,7 @@ static void device_hotplug_clean(libxl__gc *gc, libxl__ao_device *aodev)
     libxl__ev_time_deregister(gc, &aodev->timeout);
     libxl__xswait_stop(gc, &aodev->xswait);
     assert(!libxl__async_exec_inuse(&aodev->aes));
+    libxl__hotplug_builtin_done(gc, aodev);
 }
 
 static void devices_remove_callback(libxl__egc *egc,
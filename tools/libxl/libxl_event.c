@@ -169,6 +169,182 @@ static void osevent_hook_failed_noop(libxl__gc *gc, void *ev,
                                      libxl__osevent_hook_nexus **nexus) { }
 
 
+/*
+ * fd slots and pollers' epoll sets
+ */
+
+#ifdef HAVE_SYS_EPOLL_H
+
+/*
+ * Every registered libxl__ev_fd is on the list in CTX->efd_slots[fd],
+ * and each slot's events is the union of the events of its ev_fds.
+ * Whenever that union changes we update the epoll set of every poller
+ * (other than poller_app, which has none), so that a poller never
+ * needs to look at fds which are not ready.  See the comment in
+ * libxl__poller.
+ */
+
+#define LIBXL__POLLER_EPOLL_MAXEVENTS 256
+
+static uint32_t epoll_events_from_poll(short events)
+{
+    uint32_t r = 0;
+
+    if (events & POLLIN)  r |= EPOLLIN;
+    if (events & POLLPRI) r |= EPOLLPRI;
+    if (events & POLLOUT) r |= EPOLLOUT;
+    return r;
+}
+
+static short poll_events_from_epoll(uint32_t events)
+{
+    short r = 0;
+
+    if (events & EPOLLIN)  r |= POLLIN;
+    if (events & EPOLLPRI) r |= POLLPRI;
+    if (events & EPOLLOUT) r |= POLLOUT;
+    if (events & EPOLLERR) r |= POLLERR;
+    if (events & EPOLLHUP) r |= POLLHUP;
+    return r;
+}
+
+static void poller_epoll_ctl(libxl__gc *gc, libxl__poller *p,
+                             int op, int fd, short events)
+{
+    struct epoll_event ev;
+    int r;
+
+    if (!p->epoll_ok)
+        return;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = epoll_events_from_poll(events);
+    ev.data.fd = fd;
+
+    r = epoll_ctl(p->epoll_fd, op, fd, &ev);
+    if (r && op == EPOLL_CTL_DEL && (errno == EBADF || errno == ENOENT))
+        /* the fd has been closed, which removed it from the set */
+        return;
+    if (r) {
+        /* Eg, EPERM because fd is a regular file, or EEXIST because
+         * fd was closed and reused behind our back.  The set will be
+         * rebuilt, or if that fails too we will use poll. */
+        LOGE(DEBUG, "poller %p: epoll_ctl op=%d fd=%d events=%#x failed",
+             p, op, fd, events);
+        p->epoll_ok = 0;
+    }
+}
+
+static void efd_slot_update(libxl__gc *gc, int fd)
+{
+    libxl__ev_fd_slot *slot = CTX->efd_slots[fd];
+    libxl__ev_fd *efd;
+    libxl__poller *poller;
+    short events = 0;
+    int op;
+
+    LIBXL_LIST_FOREACH(efd, &slot->efds, slot_entry)
+        events |= efd->events;
+
+    if (events == slot->events)
+        return;
+
+    op = !slot->events ? EPOLL_CTL_ADD :
+         !events       ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+    slot->events = events;
+    CTX->efd_slots_gen++;
+
+    /* All the pollers which are not idle are on pollers_fds_changed */
+    LIBXL_LIST_FOREACH(poller, &CTX->pollers_fds_changed, fds_changed_entry)
+        poller_epoll_ctl(gc, poller, op, fd, events);
+    LIBXL_LIST_FOREACH(poller, &CTX->pollers_idle, entry)
+        poller_epoll_ctl(gc, poller, op, fd, events);
+}
+
+static void efd_slot_add(libxl__gc *gc, libxl__ev_fd *ev)
+{
+    int fd = ev->fd;
+
+    if (fd >= CTX->efd_slots_allocd) {
+        int newallocd = CTX->efd_slots_allocd * 2;
+
+        if (newallocd <= fd)
+            newallocd = fd + 1;
+        assert(ARRAY_SIZE_OK(CTX->efd_slots, newallocd));
+        CTX->efd_slots = libxl__realloc(NOGC, CTX->efd_slots,
+                                        newallocd * sizeof(*CTX->efd_slots));
+        memset(CTX->efd_slots + CTX->efd_slots_allocd, 0,
+               (newallocd - CTX->efd_slots_allocd)
+                 * sizeof(*CTX->efd_slots));
+        CTX->efd_slots_allocd = newallocd;
+    }
+
+    if (!CTX->efd_slots[fd]) {
+        CTX->efd_slots[fd] = libxl__zalloc(NOGC, sizeof(libxl__ev_fd_slot));
+        LIBXL_LIST_INIT(&CTX->efd_slots[fd]->efds);
+    }
+
+    /* not eligible for a dispatch which is already in progress */
+    ev->dispatch_gen = CTX->efd_dispatch_gen;
+    LIBXL_LIST_INSERT_HEAD(&CTX->efd_slots[fd]->efds, ev, slot_entry);
+    efd_slot_update(gc, fd);
+}
+
+static void efd_slot_modified(libxl__gc *gc, libxl__ev_fd *ev)
+{
+    efd_slot_update(gc, ev->fd);
+}
+
+static void efd_slot_remove(libxl__gc *gc, libxl__ev_fd *ev)
+{
+    LIBXL_LIST_REMOVE(ev, slot_entry);
+    efd_slot_update(gc, ev->fd);
+}
+
+static void poller_epoll_rebuild(libxl__gc *gc, libxl__poller *p)
+{
+    int fd;
+
+    assert(!p->epoll_ok);
+
+    /* start from a fresh set, so that no stale entries survive */
+    if (p->epoll_fd >= 0)
+        close(p->epoll_fd);
+    p->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (p->epoll_fd < 0) {
+        LOGE(DEBUG, "poller %p: epoll_create1 failed", p);
+        goto failed;
+    }
+
+    if (!p->epoll_evs)
+        p->epoll_evs = libxl__calloc(NOGC, LIBXL__POLLER_EPOLL_MAXEVENTS,
+                                     sizeof(*p->epoll_evs));
+
+    p->epoll_ok = 1;
+    poller_epoll_ctl(gc, p, EPOLL_CTL_ADD, p->wakeup_pipe[0], POLLIN);
+    for (fd = 0; fd < CTX->efd_slots_allocd && p->epoll_ok; fd++) {
+        libxl__ev_fd_slot *slot = CTX->efd_slots[fd];
+
+        if (slot && slot->events)
+            poller_epoll_ctl(gc, p, EPOLL_CTL_ADD, fd, slot->events);
+    }
+    if (p->epoll_ok)
+        return;
+
+ failed:
+    /* Don't try again until the set of fds changes. */
+    p->epoll_failed = 1;
+    p->epoll_failed_gen = CTX->efd_slots_gen;
+}
+
+#else /* !HAVE_SYS_EPOLL_H */
+
+static void efd_slot_add(libxl__gc *gc, libxl__ev_fd *ev) { }
+static void efd_slot_modified(libxl__gc *gc, libxl__ev_fd *ev) { }
+static void efd_slot_remove(libxl__gc *gc, libxl__ev_fd *ev) { }
+
+#endif
+
 /*
  * fd events
  */
@@ -194,6 +370,7 @@ int libxl__ev_fd_register(libxl__gc *gc, libxl__ev_fd *ev,
     ev->func = func;
 
     LIBXL_LIST_INSERT_HEAD(&CTX->efds, ev, entry);
+    efd_slot_add(gc, ev);
 
     rc = 0;
 
@@ -215,6 +392,7 @@ int libxl__ev_fd_modify(libxl__gc *gc, libxl__ev_fd *ev, short events)
     if (rc) goto out;
 
     ev->events = events;
+    efd_slot_modified(gc, ev);
 
     rc = 0;
  out:
@@ -236,6 +414,7 @@ void libxl__ev_fd_deregister(libxl__gc *gc, libxl__ev_fd *ev)
 
     OSEVENT_HOOK_VOID(fd,deregister, release, ev->fd, ev->nexus->for_app_reg);
     LIBXL_LIST_REMOVE(ev, entry);
+    efd_slot_remove(gc, ev);
     ev->fd = -1;
 
     LIBXL_LIST_FOREACH(poller, &CTX->pollers_fds_changed, fds_changed_entry)
@@ -311,8 +490,18 @@ static int time_register_finite(libxl__gc *gc, libxl__ev_time *ev,
 
     ev->infinite = 0;
     ev->abs = absolute;
-    LIBXL_TAILQ_INSERT_SORTED(&CTX->etimes, entry, ev, evsearch, /*empty*/,
-                              timercmp(&ev->abs, &evsearch->abs, >));
+
+    /* New timeouts are usually later than all the existing ones, so
+     * search for the insertion point from the end.  As before, a new
+     * timeout goes in front of any others with the same deadline. */
+    LIBXL_TAILQ_FOREACH_REVERSE(evsearch, &CTX->etimes,
+                                libxl__ev_time_list, entry)
+        if (timercmp(&evsearch->abs, &ev->abs, <))
+            break;
+    if (evsearch)
+        LIBXL_TAILQ_INSERT_AFTER(&CTX->etimes, evsearch, ev, entry);
+    else
+        LIBXL_TAILQ_INSERT_HEAD(&CTX->etimes, ev, entry);
 
     return 0;
 }
@@ -425,6 +614,38 @@ int libxl__ev_time_register_rel(libxl__ao *ao, libxl__ev_time *ev,
     return rc;
 }
 
+int libxl__ev_time_register_rel_noao(libxl__gc *gc, libxl__ev_time *ev,
+                                     libxl__ev_time_callback *func,
+                                     int milliseconds /* as for poll(2) */)
+{
+    struct timeval absolute;
+    int rc;
+
+    CTX_LOCK;
+
+    DBG("ev_time=%p register noao ms=%d", ev, milliseconds);
+
+    libxl__ao_abortable_init(&ev->abrt);
+
+    if (milliseconds < 0) {
+        ev->infinite = 1;
+    } else {
+        rc = time_rel_to_abs(gc, milliseconds, &absolute);
+        if (rc) goto out;
+
+        rc = time_register_finite(gc, ev, absolute);
+        if (rc) goto out;
+    }
+
+    ev->func = func;
+    rc = 0;
+
+ out:
+    time_done_debug(gc,__func__,ev,rc);
+    CTX_UNLOCK;
+    return rc;
+}
+
 void libxl__ev_time_deregister(libxl__gc *gc, libxl__ev_time *ev)
 {
     CTX_LOCK;
@@ -1004,6 +1225,29 @@ int libxl__domaindeathcheck_start(libxl__ao *ao,
  * osevent poll
  */
 
+static void beforepoll_timeout(libxl__gc *gc, int *timeout_upd,
+                               struct timeval now)
+{
+    libxl__ev_time *etime = LIBXL_TAILQ_FIRST(&CTX->etimes);
+    if (etime) {
+        int our_timeout;
+        struct timeval rel;
+        static struct timeval zero;
+
+        timersub(&etime->abs, &now, &rel);
+
+        if (timercmp(&rel, &zero, <)) {
+            our_timeout = 0;
+        } else if (rel.tv_sec >= 2000000) {
+            our_timeout = 2000000000;
+        } else {
+            our_timeout = rel.tv_sec * 1000 + (rel.tv_usec + 999) / 1000;
+        }
+        if (*timeout_upd < 0 || our_timeout < *timeout_upd)
+            *timeout_upd = our_timeout;
+    }
+}
+
 static int beforepoll_internal(libxl__gc *gc, libxl__poller *poller,
                                int *nfds_io, struct pollfd *fds,
                                int *timeout_upd, struct timeval now)
@@ -1110,24 +1354,7 @@ static int beforepoll_internal(libxl__gc *gc, libxl__poller *poller,
 
     poller->fds_changed = 0;
 
-    libxl__ev_time *etime = LIBXL_TAILQ_FIRST(&CTX->etimes);
-    if (etime) {
-        int our_timeout;
-        struct timeval rel;
-        static struct timeval zero;
-
-        timersub(&etime->abs, &now, &rel);
-
-        if (timercmp(&rel, &zero, <)) {
-            our_timeout = 0;
-        } else if (rel.tv_sec >= 2000000) {
-            our_timeout = 2000000000;
-        } else {
-            our_timeout = rel.tv_sec * 1000 + (rel.tv_usec + 999) / 1000;
-        }
-        if (*timeout_upd < 0 || our_timeout < *timeout_upd)
-            *timeout_upd = our_timeout;
-    }
+    beforepoll_timeout(gc, timeout_upd, now);
 
     return rc;
 }
@@ -1138,6 +1365,7 @@ int libxl_osevent_beforepoll(libxl_ctx *ctx, int *nfds_io,
 {
     EGC_INIT(ctx);
     CTX_LOCK;
+    ctx->poller_app_used = 1;
     int rc = beforepoll_internal(gc, ctx->poller_app,
                                  nfds_io, fds, timeout_upd, now);
     CTX_UNLOCK;
@@ -1200,6 +1428,8 @@ static void fd_occurs(libxl__egc *egc, libxl__ev_fd *efd, short revents_ign)
         efd->func(egc, efd, efd->fd, efd->events, revents_current);
 }
 
+static void afterpoll_timeouts(libxl__egc *egc, struct timeval now);
+
 static void afterpoll_internal(libxl__egc *egc, libxl__poller *poller,
                                int nfds, const struct pollfd *fds,
                                struct timeval now)
@@ -1270,6 +1500,13 @@ static void afterpoll_internal(libxl__egc *egc, libxl__poller *poller,
         if (e) LIBXL__EVENT_DISASTER(egc, "read wakeup", e, 0);
     }
 
+    afterpoll_timeouts(egc, now);
+}
+
+static void afterpoll_timeouts(libxl__egc *egc, struct timeval now)
+{
+    EGC_GC;
+
     for (;;) {
         libxl__ev_time *etime = LIBXL_TAILQ_FIRST(&CTX->etimes);
         if (!etime)
@@ -1603,6 +1840,12 @@ int libxl__poller_init(libxl__gc *gc, libxl__poller *p)
     p->fd_polls = 0;
     p->fd_rindices = 0;
     p->fds_changed = 0;
+#ifdef HAVE_SYS_EPOLL_H
+    p->epoll_fd = -1;
+    p->epoll_ok = 0;
+    p->epoll_failed = 0;
+    p->epoll_evs = 0;
+#endif
 
     rc = libxl__pipe_nonblock(CTX, p->wakeup_pipe);
     if (rc) goto out;
@@ -1619,6 +1862,10 @@ void libxl__poller_dispose(libxl__poller *p)
     libxl__pipe_close(p->wakeup_pipe);
     free(p->fd_polls);
     free(p->fd_rindices);
+#ifdef HAVE_SYS_EPOLL_H
+    if (p->epoll_fd >= 0) close(p->epoll_fd);
+    free(p->epoll_evs);
+#endif
 }
 
 libxl__poller *libxl__poller_get(libxl__gc *gc)
@@ -1661,6 +1908,82 @@ void libxl__poller_wakeup(libxl__egc *egc, libxl__poller *p)
  * Main event loop iteration
  */
 
+#ifdef HAVE_SYS_EPOLL_H
+
+static void efd_slot_occurs(libxl__egc *egc, int fd, short revents)
+{
+    EGC_GC;
+    libxl__ev_fd *efd;
+    unsigned gen = ++CTX->efd_dispatch_gen;
+
+    for (;;) {
+        /* As in afterpoll_internal, we restart the scan whenever we
+         * call a callback, since it may have made arbitrary changes
+         * to the ev_fds.  dispatch_gen stops us calling any ev_fd
+         * twice, or one registered since we went into epoll_wait. */
+        LIBXL_LIST_FOREACH(efd, &CTX->efd_slots[fd]->efds, slot_entry) {
+            if (efd->dispatch_gen == gen || !efd->events)
+                continue;
+            if (revents & (efd->events | POLLERR | POLLHUP))
+                goto found_fd_event;
+        }
+        return;
+
+    found_fd_event:
+        efd->dispatch_gen = gen;
+        fd_occurs(egc, efd, revents);
+    }
+}
+
+static int eventloop_iteration_epoll(libxl__egc *egc, libxl__poller *poller,
+                                     struct timeval now)
+{
+    /* Like eventloop_iteration, but using the poller's epoll set. */
+    EGC_GC;
+    int rc, nevents, i;
+    int timeout = -1;
+
+    beforepoll_timeout(gc, &timeout, now);
+
+    CTX_UNLOCK;
+    nevents = epoll_wait(poller->epoll_fd, poller->epoll_evs,
+                         LIBXL__POLLER_EPOLL_MAXEVENTS, timeout);
+    CTX_LOCK;
+
+    if (nevents < 0) {
+        if (errno == EINTR)
+            return 0; /* will go round again if caller requires */
+
+        LOGEV(ERROR, errno, "epoll_wait failed");
+        return ERROR_FAIL;
+    }
+
+    rc = libxl__gettimeofday(gc, &now);
+    if (rc) return rc;
+
+    for (i = 0; i < nevents; i++) {
+        int fd = poller->epoll_evs[i].data.fd;
+        short revents = poll_events_from_epoll(poller->epoll_evs[i].events);
+
+        if (fd == poller->wakeup_pipe[0]) {
+            int e = libxl__self_pipe_eatall(fd);
+            if (e) LIBXL__EVENT_DISASTER(egc, "read wakeup", e, 0);
+            continue;
+        }
+
+        /* The slot cannot have gone away, although all its ev_fds
+         * may have been deregistered by an earlier callback. */
+        assert(fd < CTX->efd_slots_allocd && CTX->efd_slots[fd]);
+        efd_slot_occurs(egc, fd, revents);
+    }
+
+    afterpoll_timeouts(egc, now);
+
+    return 0;
+}
+
+#endif
+
 static int eventloop_iteration(libxl__egc *egc, libxl__poller *poller) {
     /* The CTX must be locked EXACTLY ONCE so that this function
      * can unlock it when it polls.
@@ -1672,6 +1995,14 @@ static int eventloop_iteration(libxl__egc *egc, libxl__poller *poller) {
     rc = libxl__gettimeofday(gc, &now);
     if (rc) goto out;
 
+#ifdef HAVE_SYS_EPOLL_H
+    if (!poller->epoll_ok &&
+        !(poller->epoll_failed && poller->epoll_failed_gen == CTX->efd_slots_gen))
+        poller_epoll_rebuild(gc, poller);
+    if (poller->epoll_ok)
+        return eventloop_iteration_epoll(egc, poller, now);
+#endif
+
     int timeout;
 
     for (;;) {
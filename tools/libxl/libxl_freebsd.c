@@ -227,6 +227,17 @@ out:
     return rc;
 }
 
+int libxl__hotplug_builtin(libxl__gc *gc, libxl__ao_device *aodev,
+                           char ***args, char ***env)
+{
+    /* Always execute the hotplug scripts */
+    return 0;
+}
+
+void libxl__hotplug_builtin_done(libxl__gc *gc, libxl__ao_device *aodev)
+{
+}
+
 libxl_device_model_version libxl__default_device_model(libxl__gc *gc)
 {
     return LIBXL_DEVICE_MODEL_VERSION_QEMU_XEN;
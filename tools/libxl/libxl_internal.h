@@ -47,6 +47,9 @@
 #include <sys/socket.h>
 #include <sys/file.h>
 #include <sys/ioctl.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
 #include <xenevtchn.h>
 #include <xenstore.h>
@@ -223,8 +226,20 @@ struct libxl__ev_fd {
     /* remainder is private for libxl__ev_fd... */
     LIBXL_LIST_ENTRY(libxl__ev_fd) entry;
     libxl__osevent_hook_nexus *nexus;
+#ifdef HAVE_SYS_EPOLL_H
+    LIBXL_LIST_ENTRY(libxl__ev_fd) slot_entry;
+    unsigned dispatch_gen;
+#endif
 };
 
+#ifdef HAVE_SYS_EPOLL_H
+typedef struct libxl__ev_fd_slot {
+    /* see libxl_event.c:efd_slot_update */
+    LIBXL_LIST_HEAD(, libxl__ev_fd) efds; /* all ev_fds for this fd */
+    short events; /* union of efds' events, as in the pollers' epoll sets */
+} libxl__ev_fd_slot;
+#endif
+
 
 typedef struct libxl__ao_abortable libxl__ao_abortable;
 typedef void libxl__ao_abortable_callback(libxl__egc *egc,
@@ -407,6 +422,24 @@ struct libxl__poller {
      */
     LIBXL_LIST_ENTRY(libxl__poller) fds_changed_entry;
     bool fds_changed;
+
+#ifdef HAVE_SYS_EPOLL_H
+    /*
+     * A poller used by libxl's own event loop (ie, any poller but
+     * poller_app) waits with epoll rather than poll.  Its epoll set
+     * persistently contains its wakeup pipe and every fd with a
+     * nonzero CTX->efd_slots[fd]->events, and is updated as ev_fds
+     * are registered, modified and deregistered, whether or not the
+     * poller is idle.  If epoll_ok is false the set is out of date
+     * (or was never made); it is rebuilt before the next wait, and if
+     * that fails the poller falls back to poll for that iteration.
+     */
+    int epoll_fd; /* -1 means none */
+    bool epoll_ok;
+    bool epoll_failed;         /* the last rebuild failed, when      */
+    unsigned epoll_failed_gen; /*  CTX->efd_slots_gen had this value */
+    struct epoll_event *epoll_evs; /* LIBXL__POLLER_EPOLL_MAXEVENTS */
+#endif
 };
 
 struct libxl__gc {
@@ -447,13 +480,20 @@ struct libxl__ctx {
        * for restrictions on the use of the osevent fields. */
 
     libxl__poller *poller_app; /* libxl_osevent_beforepoll and _afterpoll */
+    bool poller_app_used; /* libxl_osevent_beforepoll has been called */
     LIBXL_LIST_HEAD(, libxl__poller) pollers_event, pollers_idle;
     LIBXL_LIST_HEAD(, libxl__poller) pollers_fds_changed;
 
     LIBXL_SLIST_HEAD(libxl__osevent_hook_nexi, libxl__osevent_hook_nexus)
         hook_fd_nexi_idle, hook_timeout_nexi_idle;
     LIBXL_LIST_HEAD(, libxl__ev_fd) efds;
-    LIBXL_TAILQ_HEAD(, libxl__ev_time) etimes;
+    LIBXL_TAILQ_HEAD(libxl__ev_time_list, libxl__ev_time) etimes;
+#ifdef HAVE_SYS_EPOLL_H
+    libxl__ev_fd_slot **efd_slots; /* indexed by fd; entries may be 0 */
+    int efd_slots_allocd;
+    unsigned efd_slots_gen; /* incremented when any slot's events change */
+    unsigned efd_dispatch_gen;
+#endif
 
     libxl__ev_watch_slot *watch_slots;
     int watch_nslots, nwatches;
@@ -474,6 +514,10 @@ struct libxl__ctx {
     
     LIBXL_LIST_HEAD(, libxl_evgen_disk_eject) disk_eject_evgens;
 
+    /* QMP connections kept open for reuse, see libxl_qmp.c */
+    LIBXL_LIST_HEAD(, struct libxl__qmp_handler) qmp_handlers;
+    int qmp_connecting; /* threads opening a QMP connection */
+
     const libxl_childproc_hooks *childproc_hooks;
     void *childproc_user;
     int sigchld_selfpipe[2]; /* [0]==-1 means handler not installed */
@@ -911,6 +955,12 @@ _hidden int libxl__ev_time_register_rel(libxl__ao*, libxl__ev_time *ev_out,
 _hidden int libxl__ev_time_register_abs(libxl__ao*, libxl__ev_time *ev_out,
                                         libxl__ev_time_callback*,
                                         struct timeval);
+/* For timeouts which do not belong to any ao.  They cannot be aborted,
+ * so rc in the callback is always ERROR_TIMEDOUT.  They must be
+ * deregistered before the ctx is freed. */
+_hidden int libxl__ev_time_register_rel_noao(libxl__gc*, libxl__ev_time *ev_out,
+                                        libxl__ev_time_callback*,
+                                        int milliseconds /* as for poll(2) */);
 _hidden int libxl__ev_time_modify_rel(libxl__gc*, libxl__ev_time *ev,
                                       int milliseconds /* as for poll(2) */);
 _hidden int libxl__ev_time_modify_abs(libxl__gc*, libxl__ev_time *ev,
@@ -1823,8 +1873,10 @@ _hidden void libxl__qmp_close(libxl__qmp_handler *qmp);
 /* remove the socket file, if the file has already been removed,
  * nothing happen */
 _hidden void libxl__qmp_cleanup(libxl__gc *gc, uint32_t domid);
+/* close all the QMP connections the ctx keeps open for reuse */
+_hidden void libxl__qmp_close_all(libxl__gc *gc);
 
-/* this helper calls qmp_initialize, query_serial and qmp_close */
+/* this helper queries the serial ports and sets up VNC */
 _hidden int libxl__qmp_initializations(libxl__gc *gc, uint32_t domid,
                                        const libxl_domain_config *guest_config);
 
@@ -2379,6 +2431,17 @@ typedef void libxl__device_callback(libxl__egc*, libxl__ao_device*);
  */
 _hidden void libxl__prepare_ao_device(libxl__ao *ao, libxl__ao_device *aodev);
 
+/*
+ * A hotplug action carried out in-process may leave a helper command
+ * to be run in place of the script, see libxl__hotplug_builtin.
+ */
+typedef struct {
+    libxl__carefd *input;   /* the helper's stdin; NULL if no helper */
+    libxl__carefd *lock;    /* hotplug lock held until the helper exits */
+    const char *lockname;
+    const char *be_path;    /* report hotplug success here when done */
+} libxl__hotplug_builtin_state;
+
 struct libxl__ao_device {
     /* filled in by user */
     libxl__ao *ao;
@@ -2400,6 +2463,7 @@ struct libxl__ao_device {
     int num_exec;
     /* for calling hotplug scripts */
     libxl__async_exec_state aes;
+    libxl__hotplug_builtin_state hotplug;
     /* If we need to update JSON config */
     bool update_json;
     /* for asynchronous execution of synchronous-only syscalls etc. */
@@ -2704,6 +2768,24 @@ _hidden int libxl__get_hotplug_script_info(libxl__gc *gc, libxl__device *dev,
                                            libxl__device_action action,
                                            int num_exec);
 
+/*
+ * libxl__hotplug_builtin may carry out the action of a hotplug script
+ * in-process instead, given the args and env returned by
+ * libxl__get_hotplug_script_info.  It returns:
+ * < 0: Error (the script would have failed)
+ * 0: Not handled, execute the hotplug script
+ * 1: Done, the script must not be executed
+ * 2: Done but for a helper command, which replaces *args and *env and
+ *    is executed instead of the script, with aodev->hotplug.input as
+ *    its stdin.  Its failure is not an error.
+ * libxl__hotplug_builtin_done must be called once the helper, if any,
+ * has exited.
+ */
+_hidden int libxl__hotplug_builtin(libxl__gc *gc, libxl__ao_device *aodev,
+                                   char ***args, char ***env);
+_hidden void libxl__hotplug_builtin_done(libxl__gc *gc,
+                                         libxl__ao_device *aodev);
+
 /*----- local disk attach: attach a disk locally to run the bootloader -----*/
 
 typedef struct libxl__disk_local_state libxl__disk_local_state;
@@ -3577,6 +3659,9 @@ struct libxl__domain_create_state {
     /* necessary if the domain creation failed and we have to destroy it */
     libxl__domain_destroy_state dds;
     libxl__multidev multidev;
+    /* per-phase timing, valid when callback is called */
+    libxl_domain_create_timing timing;
+    struct timeval create_start, phase_start;
 };
 
 /*----- Domain suspend (save) functions -----*/
@@ -3881,6 +3966,37 @@ _hidden int libxl__get_numa_candidate(libxl__gc *gc,
                                       libxl__numa_candidate *cndt_out,
                                       int *cndt_found);
 
+/*
+ * The search libxl__get_numa_candidate performs, once it has collected
+ * the host topology and load, runs on the following per-node summary.
+ * It is separate so that it can be exercised on synthetic topologies.
+ *
+ * nodes[] has nr_nodes entries; a node with nr_cpus == 0 is not
+ * considered at all.  dists, if not NULL, is the nr_nodes x nr_nodes
+ * distance matrix (row major).  Sizes for which there are more than
+ * max_combinations candidates are not searched exhaustively: candidates
+ * are instead grown greedily from each node in turn, by adding the node
+ * closest to the ones already picked.  Everything else is as for
+ * libxl__get_numa_candidate, including min_nodes being 0 meaning 1.
+ */
+typedef struct {
+    int nr_cpus;          /* suitable cpus on the node */
+    int nr_vcpus;         /* vcpus able to run on the node */
+    uint32_t free_memkb;
+} libxl__numa_node_load;
+
+#define LIBXL__NUMA_MAX_COMBINATIONS 1024
+
+_hidden int libxl__numa_candidate_search(libxl__gc *gc, int nr_nodes,
+                                const libxl__numa_node_load *nodes,
+                                const uint32_t *dists,
+                                uint32_t min_free_memkb, int min_cpus,
+                                int min_nodes, int max_nodes,
+                                unsigned long max_combinations,
+                                libxl__numa_candidate_cmpf numa_cmpf,
+                                libxl__numa_candidate *cndt_out,
+                                int *cndt_found);
+
 /* Initialization, allocation and deallocation for placement candidates */
 static inline void libxl__numa_candidate_init(libxl__numa_candidate *cndt)
 {
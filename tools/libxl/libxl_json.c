@@ -28,6 +28,10 @@ struct libxl__yajl_ctx {
     yajl_handle hand;
     libxl__json_object *head;
     libxl__json_object *current;
+    /* Parse tree arena, see json_arena_zalloc. */
+    char *arena_next;
+    size_t arena_left;
+    size_t arena_chunk;
 #ifdef DEBUG_ANSWER
     yajl_gen g;
 #endif
@@ -439,6 +443,9 @@ int libxl__string_parse_json(libxl__gc *gc, const libxl__json_object *o,
     return 0;
 }
 
+static void json_array_append(libxl__yajl_ctx *ctx, flexarray_t *array,
+                              void *ptr);
+
 /*
  * libxl__json_object helper functions
  */
@@ -483,7 +490,7 @@ int libxl__json_object_append_to(libxl__gc *gc, libxl__json_object *obj,
             break;
         }
         case JSON_ARRAY:
-            flexarray_append(dst->u.array, obj);
+            json_array_append(ctx, dst->u.array, obj);
             break;
         default:
             LIBXL__LOG(libxl__gc_owner(gc), LIBXL__LOG_ERROR,
@@ -679,6 +686,129 @@ yajl_status libxl__json_object_to_yajl_gen(libxl__gc *gc,
 }
 
 
+/*
+ * Parse tree allocation
+ *
+ * A parsed document consists of a very large number of tiny objects
+ * (nodes, map nodes, keys, strings and the arrays holding the children
+ * of maps and arrays) which all share the lifetime of the caller's gc.
+ * Registering each of them with the gc is costly, so they are carved
+ * out of larger chunks instead, and only the chunks are registered.
+ * Chunks double in size as the document grows, so a parse registers a
+ * logarithmic number of allocations with the gc.
+ *
+ * The flexarrays of such a tree do not autogrow: their data is not a
+ * gc allocation, so flexarray_grow cannot be used on it.  Nothing
+ * modifies a parsed tree.
+ *
+ * With NOGC, the caller frees the tree with libxl__json_object_free,
+ * which needs every object to be an individual allocation, so the
+ * arena is bypassed.
+ */
+
+#define JSON_ARENA_CHUNK_MIN  8192
+#define JSON_ARENA_CHUNK_MAX  (1 << 20)
+#define JSON_ARENA_ALIGN      16
+#define JSON_ARRAY_MIN        4
+
+static void *json_arena_zalloc(libxl__yajl_ctx *ctx, size_t size)
+{
+    libxl__gc *gc = ctx->gc;
+    void *p;
+
+    /* Anything bigger than an eighth of a chunk gets its own allocation. */
+    if (!libxl__gc_is_real(gc) ||
+        size > (ctx->arena_chunk ? : JSON_ARENA_CHUNK_MIN) / 8)
+        return libxl__zalloc(gc, size);
+
+    size = (size + JSON_ARENA_ALIGN - 1) & ~(size_t)(JSON_ARENA_ALIGN - 1);
+    if (size > ctx->arena_left) {
+        if (!ctx->arena_chunk)
+            ctx->arena_chunk = JSON_ARENA_CHUNK_MIN;
+        else if (ctx->arena_chunk < JSON_ARENA_CHUNK_MAX)
+            ctx->arena_chunk *= 2;
+
+        /* The tail of the previous chunk, if any, is wasted. */
+        ctx->arena_next = libxl__malloc(gc, ctx->arena_chunk);
+        ctx->arena_left = ctx->arena_chunk;
+    }
+
+    p = ctx->arena_next;
+    ctx->arena_next += size;
+    ctx->arena_left -= size;
+
+    return memset(p, 0, size);
+}
+
+static char *json_arena_strndup(libxl__yajl_ctx *ctx,
+                                const unsigned char *str,
+                                libxl_yajl_length len)
+{
+    char *t = json_arena_zalloc(ctx, len + 1);
+
+    memcpy(t, str, len);
+    t[len] = 0;
+
+    return t;
+}
+
+static flexarray_t *json_array_make(libxl__yajl_ctx *ctx)
+{
+    flexarray_t *array;
+
+    if (!libxl__gc_is_real(ctx->gc))
+        return flexarray_make(ctx->gc, 1, 1);
+
+    array = json_arena_zalloc(ctx, sizeof(*array));
+    array->size = JSON_ARRAY_MIN;
+    array->autogrow = 0;
+    array->gc = ctx->gc;
+    array->data = json_arena_zalloc(ctx, array->size * sizeof(*array->data));
+
+    return array;
+}
+
+static void json_array_append(libxl__yajl_ctx *ctx, flexarray_t *array,
+                              void *ptr)
+{
+    void **data;
+
+    if (!libxl__gc_is_real(ctx->gc)) {
+        flexarray_append(array, ptr);
+        return;
+    }
+
+    if (array->count == array->size) {
+        /* The old data is left behind in the arena. */
+        data = json_arena_zalloc(ctx, 2 * array->size * sizeof(*data));
+        memcpy(data, array->data, array->count * sizeof(*data));
+        array->data = data;
+        array->size *= 2;
+    }
+
+    array->data[array->count++] = ptr;
+}
+
+static libxl__json_object *json_object_alloc(libxl__yajl_ctx *ctx,
+                                             libxl__json_node_type type)
+{
+    libxl__json_object *obj;
+
+    obj = json_arena_zalloc(ctx, sizeof(*obj));
+    obj->type = type;
+
+    if (type == JSON_MAP || type == JSON_ARRAY) {
+        flexarray_t *array = json_array_make(ctx);
+        if (type == JSON_MAP)
+            obj->u.map = array;
+        else
+            obj->u.array = array;
+    }
+
+    return obj;
+}
+
+
 /*
  * JSON callbacks
  */
@@ -690,7 +820,7 @@ static int json_callback_null(void *opaque)
 
     DEBUG_GEN(ctx, null);
 
-    obj = libxl__json_object_alloc(ctx->gc, JSON_NULL);
+    obj = json_object_alloc(ctx, JSON_NULL);
 
     if (libxl__json_object_append_to(ctx->gc, obj, ctx))
         return 0;
@@ -705,7 +835,7 @@ static int json_callback_boolean(void *opaque, int boolean)
 
     DEBUG_GEN_VALUE(ctx, bool, boolean);
 
-    obj = libxl__json_object_alloc(ctx->gc, JSON_BOOL);
+    obj = json_object_alloc(ctx, JSON_BOOL);
     obj->u.b = boolean;
 
     if (libxl__json_object_append_to(ctx->gc, obj, ctx))
@@ -728,7 +858,6 @@ static int json_callback_number(void *opaque, const char *s, libxl_yajl_length l
 {
     libxl__yajl_ctx *ctx = opaque;
     libxl__json_object *obj = NULL;
-    char *t = NULL;
 
     DEBUG_GEN_NUMBER(ctx, s, len);
 
@@ -739,7 +868,7 @@ static int json_callback_number(void *opaque, const char *s, libxl_yajl_length l
             goto error;
         }
 
-        obj = libxl__json_object_alloc(ctx->gc, JSON_DOUBLE);
+        obj = json_object_alloc(ctx, JSON_DOUBLE);
         obj->u.d = d;
     } else {
         long long i = strtoll(s, NULL, 10);
@@ -748,20 +877,15 @@ static int json_callback_number(void *opaque, const char *s, libxl_yajl_length l
             goto error;
         }
 
-        obj = libxl__json_object_alloc(ctx->gc, JSON_INTEGER);
+        obj = json_object_alloc(ctx, JSON_INTEGER);
         obj->u.i = i;
     }
     goto out;
 
 error:
     /* If the conversion fail, we just store the original string. */
-    obj = libxl__json_object_alloc(ctx->gc, JSON_NUMBER);
-
-    t = libxl__zalloc(ctx->gc, len + 1);
-    strncpy(t, s, len);
-    t[len] = 0;
-
-    obj->u.string = t;
+    obj = json_object_alloc(ctx, JSON_NUMBER);
+    obj->u.string = json_arena_strndup(ctx, (const unsigned char *)s, len);
 
 out:
     if (libxl__json_object_append_to(ctx->gc, obj, ctx))
@@ -774,18 +898,12 @@ static int json_callback_string(void *opaque, const unsigned char *str,
                                 libxl_yajl_length len)
 {
     libxl__yajl_ctx *ctx = opaque;
-    char *t = NULL;
     libxl__json_object *obj = NULL;
 
-    t = libxl__zalloc(ctx->gc, len + 1);
-
     DEBUG_GEN_STRING(ctx, str, len);
 
-    strncpy(t, (const char *) str, len);
-    t[len] = 0;
-
-    obj = libxl__json_object_alloc(ctx->gc, JSON_STRING);
-    obj->u.string = t;
+    obj = json_object_alloc(ctx, JSON_STRING);
+    obj->u.string = json_arena_strndup(ctx, str, len);
 
     if (libxl__json_object_append_to(ctx->gc, obj, ctx))
         return 0;
@@ -797,25 +915,18 @@ static int json_callback_map_key(void *opaque, const unsigned char *str,
                                  libxl_yajl_length len)
 {
     libxl__yajl_ctx *ctx = opaque;
-    char *t = NULL;
     libxl__json_object *obj = ctx->current;
-    libxl__gc *gc = ctx->gc;
-
-    t = libxl__zalloc(gc, len + 1);
 
     DEBUG_GEN_STRING(ctx, str, len);
 
-    strncpy(t, (const char *) str, len);
-    t[len] = 0;
-
     if (libxl__json_object_is_map(obj)) {
         libxl__json_map_node *node;
 
-        GCNEW(node);
-        node->map_key = t;
+        node = json_arena_zalloc(ctx, sizeof(*node));
+        node->map_key = json_arena_strndup(ctx, str, len);
         node->obj = NULL;
 
-        flexarray_append(obj->u.map, node);
+        json_array_append(ctx, obj->u.map, node);
     } else {
         LIBXL__LOG(libxl__gc_owner(ctx->gc), LIBXL__LOG_ERROR,
                    "Current json object is not a map");
@@ -832,7 +943,7 @@ static int json_callback_start_map(void *opaque)
 
     DEBUG_GEN(ctx, map_open);
 
-    obj = libxl__json_object_alloc(ctx->gc, JSON_MAP);
+    obj = json_object_alloc(ctx, JSON_MAP);
 
     if (libxl__json_object_append_to(ctx->gc, obj, ctx))
         return 0;
@@ -864,7 +975,7 @@ static int json_callback_start_array(void *opaque)
 
     DEBUG_GEN(ctx, array_open);
 
-    obj = libxl__json_object_alloc(ctx->gc, JSON_ARRAY);
+    obj = json_object_alloc(ctx, JSON_ARRAY);
 
     if (libxl__json_object_append_to(ctx->gc, obj, ctx))
         return 0;
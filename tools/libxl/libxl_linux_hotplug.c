@@ -0,0 +1,663 @@
+/*
+ * In-process implementations of the stock Linux hotplug scripts.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation; version 2.1 only. with the special
+ * exception on linking described in file LICENSE.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ */
+
+#include "libxl_osdeps.h" /* must come before any other headers */
+
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/sysmacros.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <linux/sockios.h>
+#include <mntent.h>
+
+#include "libxl_internal.h"
+
+/*
+ * Each time a vif or a phy disk is plugged, the stock scripts spend
+ * most of their time starting bash, sourcing the helper libraries and
+ * forking brctl, ip, stat and xenstore-* several times over.  When
+ * LIBXL_HOTPLUG_BUILTIN is set to a non-zero value in the environment
+ * we carry out the common cases of vif-bridge and block ourselves
+ * instead.  Anything we do not reproduce exactly (bridge guessing,
+ * antispoofing rules, vif-post.d hooks, loopback files, custom
+ * scripts) is left to the script.  The iptables rules of vif-bridge
+ * are installed by running iptables-restore once, as a helper command
+ * in place of the script.
+ *
+ * The args and env we get are exactly the ones the script would have
+ * been given, and results are reported through xenstore in the same
+ * way: hotplug-status and hotplug-error in the backend directory.
+ */
+
+#define HOTPLUG_LOCK_DIR "/var/run/xen-hotplug"
+#define HOTPLUG_DUMMY_MAC "\xfe\xff\xff\xff\xff\xff"
+
+static bool hotplug_builtin_enabled(void)
+{
+    const char *s = getenv("LIBXL_HOTPLUG_BUILTIN");
+
+    return s && strcmp(s, "") && strcmp(s, "0");
+}
+
+static const char *hotplug_env(char **env, const char *name)
+{
+    for (; env && env[0]; env += 2)
+        if (!strcmp(env[0], name))
+            return env[1];
+    return NULL;
+}
+
+static bool hotplug_is_stock_script(libxl__gc *gc, const char *script,
+                                    const char *name)
+{
+    return !strcmp(script,
+                   GCSPRINTF("%s/%s", libxl__xen_script_dir_path(), name));
+}
+
+/* Equivalent of the scripts' fatal/ebusy helpers. */
+static int hotplug_fail(libxl__gc *gc, const char *be_path,
+                        const char *status, const char *msg)
+{
+    LOG(ERROR, "%s: %s", be_path, msg);
+    libxl__xs_printf(gc, XBT_NULL, GCSPRINTF("%s/hotplug-error", be_path),
+                     "%s", msg);
+    libxl__xs_printf(gc, XBT_NULL, GCSPRINTF("%s/hotplug-status", be_path),
+                     "%s", status);
+    return ERROR_FAIL;
+}
+
+static int hotplug_success(libxl__gc *gc, const char *be_path)
+{
+    return libxl__xs_printf(gc, XBT_NULL,
+                            GCSPRINTF("%s/hotplug-status", be_path),
+                            "connected");
+}
+
+/*
+ * Same protocol as claim_lock/release_lock in locking.sh, so that we
+ * exclude concurrent runs of the scripts as well as of ourselves.
+ *
+ * We run with the ctx locked, so we must not wait for the lock.  If
+ * someone else holds it we return ERROR_LOCK_FAIL, and the caller
+ * leaves the work to the script, which can wait in a process of its
+ * own.
+ */
+static int hotplug_lock(libxl__gc *gc, const char *name,
+                        libxl__carefd **lock_r)
+{
+    const char *lockfile = GCSPRINTF("%s/%s", HOTPLUG_LOCK_DIR, name);
+    struct stat stab, fstab;
+    libxl__carefd *cfd;
+    int fd;
+
+    if (mkdir(HOTPLUG_LOCK_DIR, 0755) && errno != EEXIST) {
+        LOGE(ERROR, "cannot create %s", HOTPLUG_LOCK_DIR);
+        return ERROR_FAIL;
+    }
+
+    for (;;) {
+        libxl__carefd_begin();
+        fd = open(lockfile, O_RDWR|O_CREAT, 0666);
+        if (fd < 0) LOGE(ERROR, "cannot open lockfile %s", lockfile);
+        cfd = libxl__carefd_opened(CTX, fd);
+        if (fd < 0) return ERROR_FAIL;
+
+        while (flock(fd, LOCK_EX|LOCK_NB)) {
+            if (errno == EINTR) continue;
+            if (errno == EWOULDBLOCK) {
+                LOG(DEBUG, "%s is busy, leaving it to the script", lockfile);
+                libxl__carefd_close(cfd);
+                return ERROR_LOCK_FAIL;
+            }
+            LOGE(ERROR, "cannot lock %s", lockfile);
+            libxl__carefd_close(cfd);
+            return ERROR_FAIL;
+        }
+
+        if (fstat(fd, &fstab)) {
+            LOGE(ERROR, "cannot fstat %s", lockfile);
+            libxl__carefd_close(cfd);
+            return ERROR_FAIL;
+        }
+        if (!stat(lockfile, &stab) &&
+            stab.st_dev == fstab.st_dev && stab.st_ino == fstab.st_ino)
+            break;
+
+        libxl__carefd_close(cfd);
+    }
+
+    *lock_r = cfd;
+    return 0;
+}
+
+static void hotplug_unlock(libxl__gc *gc, const char *name,
+                           libxl__carefd *lock)
+{
+    /* Unlink before closing, see libxl__unlock_domain_userdata */
+    unlink(GCSPRINTF("%s/%s", HOTPLUG_LOCK_DIR, name));
+    libxl__carefd_close(lock);
+}
+
+/*----- vif-bridge -----*/
+
+static int netdev_ioctl(libxl__gc *gc, int sock, unsigned long req,
+                        struct ifreq *ifr, const char *what)
+{
+    if (ioctl(sock, req, ifr) < 0) {
+        LOGE(DEBUG, "%s on %s failed", what, ifr->ifr_name);
+        return ERROR_FAIL;
+    }
+    return 0;
+}
+
+static int netdev_set_up(libxl__gc *gc, int sock, const char *dev, bool up)
+{
+    struct ifreq ifr;
+    int rc;
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, dev, IFNAMSIZ - 1);
+    rc = netdev_ioctl(gc, sock, SIOCGIFFLAGS, &ifr, "SIOCGIFFLAGS");
+    if (rc) return rc;
+
+    if (up)
+        ifr.ifr_flags |= IFF_UP;
+    else
+        ifr.ifr_flags &= ~IFF_UP;
+    return netdev_ioctl(gc, sock, SIOCSIFFLAGS, &ifr, "SIOCSIFFLAGS");
+}
+
+/* setup_virtual_bridge_port and set_mtu; failures are not fatal. */
+static void netdev_setup_port(libxl__gc *gc, int sock, const char *bridge,
+                              const char *dev)
+{
+    struct ifreq ifr;
+
+    netdev_set_up(gc, sock, dev, false);
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, dev, IFNAMSIZ - 1);
+    ifr.ifr_hwaddr.sa_family = ARPHRD_ETHER;
+    memcpy(ifr.ifr_hwaddr.sa_data, HOTPLUG_DUMMY_MAC, 6);
+    netdev_ioctl(gc, sock, SIOCSIFHWADDR, &ifr, "SIOCSIFHWADDR");
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, bridge, IFNAMSIZ - 1);
+    if (netdev_ioctl(gc, sock, SIOCGIFMTU, &ifr, "SIOCGIFMTU") ||
+        ifr.ifr_mtu <= 0)
+        return;
+    strncpy(ifr.ifr_name, dev, IFNAMSIZ - 1);
+    netdev_ioctl(gc, sock, SIOCSIFMTU, &ifr, "SIOCSIFMTU");
+}
+
+static int netdev_bridge_port(libxl__gc *gc, int sock, unsigned long req,
+                              const char *bridge, const char *dev)
+{
+    struct ifreq ifr;
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, bridge, IFNAMSIZ - 1);
+    ifr.ifr_ifindex = if_nametoindex(dev);
+    if (!ifr.ifr_ifindex) {
+        LOGE(DEBUG, "no such interface %s", dev);
+        return ERROR_FAIL;
+    }
+    return netdev_ioctl(gc, sock, req, &ifr,
+                        req == SIOCBRADDIF ? "SIOCBRADDIF" : "SIOCBRDELIF");
+}
+
+static bool vif_has_hooks(libxl__gc *gc)
+{
+    const char *dir = GCSPRINTF("%s/vif-post.d", libxl__xen_script_dir_path());
+    struct dirent *de;
+    size_t len;
+    bool found = false;
+    DIR *d;
+
+    d = opendir(dir);
+    if (!d) return false;
+    while (!found && (de = readdir(d))) {
+        len = strlen(de->d_name);
+        if (len > 5 && !strcmp(de->d_name + len - 5, ".hook") &&
+            !access(GCSPRINTF("%s/%s", dir, de->d_name), X_OK))
+            found = true;
+    }
+    closedir(d);
+    return found;
+}
+
+/*
+ * handle_iptable gives up quietly when iptables does not work.  We
+ * cannot fork "iptables -L" here, so look for iptables-restore on the
+ * PATH instead, once.
+ */
+static bool vif_iptables_available(libxl__gc *gc)
+{
+    static int available = -1;
+    const char *path, *end;
+    size_t len;
+
+    if (available >= 0)
+        return available;
+
+    path = getenv("PATH");
+    if (!path) path = "/usr/sbin:/sbin:/usr/bin:/bin";
+
+    available = 0;
+    for (; *path; path = *end ? end + 1 : end) {
+        end = strchrnul(path, ':');
+        len = end - path;
+        if (len &&
+            !access(GCSPRINTF("%.*s/iptables-restore", (int)len, path), X_OK)) {
+            available = 1;
+            break;
+        }
+    }
+
+    if (!available)
+        LOG(DEBUG, "iptables-restore not found, not setting iptables rules");
+    return available;
+}
+
+/*
+ * frob_iptable without any ip: let everything through the bridge to
+ * and from the vif, or stop doing so.  Returns the input for
+ * iptables-restore, or NULL.
+ */
+static libxl__carefd *vif_iptables_input(libxl__gc *gc, const char *vif,
+                                         bool add)
+{
+    const char *c = add ? "-I" : "-D";
+    const char *rules;
+    libxl__carefd *rd, *wr;
+    int fds[2], r;
+
+    rules = GCSPRINTF("*filter\n"
+        "%s FORWARD -m physdev --physdev-is-bridged --physdev-in %s -j ACCEPT\n"
+        "%s FORWARD -m physdev --physdev-is-bridged --physdev-out %s -j ACCEPT\n"
+        "COMMIT\n", c, vif, c, vif);
+
+    libxl__carefd_begin();
+    if (libxl_pipe(CTX, fds)) {
+        libxl__carefd_unlock();
+        return NULL;
+    }
+    rd = libxl__carefd_record(CTX, fds[0]);
+    wr = libxl__carefd_record(CTX, fds[1]);
+    libxl__carefd_unlock();
+
+    /* A few hundred bytes, well within what a pipe buffers */
+    r = libxl_write_exactly(CTX, fds[1], rules, strlen(rules),
+                            "iptables rules", vif);
+    libxl__carefd_close(wr);
+    if (r) {
+        libxl__carefd_close(rd);
+        return NULL;
+    }
+
+    return rd;
+}
+
+static int hotplug_vif_bridge(libxl__gc *gc, libxl__ao_device *aodev,
+                              char ***args_r, char ***env_r)
+{
+    libxl__device *dev = aodev->dev;
+    char **args = *args_r, **env = *env_r;
+    const char *be_path = libxl__device_backend_path(gc, dev);
+    const char *command = args[1];
+    bool tap = args[2] && !strcmp(args[2], "type_if=tap");
+    const char *vif, *bridge, *ip;
+    bool online = !strcmp(command, "online");
+    bool add = online || !strcmp(command, "add");
+    libxl__carefd *lock = NULL;
+    int sock = -1, rc;
+
+    vif = hotplug_env(env, tap ? "INTERFACE" : "vif");
+    if (!vif) return 0;
+
+    rc = libxl__xs_read_checked(gc, XBT_NULL,
+                                GCSPRINTF("%s/bridge", be_path), &bridge);
+    if (rc) return rc;
+    rc = libxl__xs_read_checked(gc, XBT_NULL,
+                                GCSPRINTF("%s/ip", be_path), &ip);
+    if (rc) return rc;
+
+    /* Bridge guessing, antispoofing and hooks are the script's job */
+    if (!bridge || !*bridge || (ip && *ip) || vif_has_hooks(gc))
+        return 0;
+
+    if (access(GCSPRINTF("/sys/class/net/%s", bridge), F_OK) &&
+        !strncmp(bridge, "xenbr", 5)) {
+        const char *eth = GCSPRINTF("eth%s", bridge + 5);
+        if (!access(GCSPRINTF("/sys/class/net/%s/bridge", eth), F_OK))
+            bridge = eth;
+    }
+
+    if (!if_nametoindex(bridge))
+        return hotplug_fail(gc, be_path, "error",
+                    GCSPRINTF("Could not find bridge device %s", bridge));
+
+    /* handle_iptable's lock, held until the helper has run */
+    if (vif_iptables_available(gc)) {
+        rc = hotplug_lock(gc, "iptables", &lock);
+        if (rc) return rc == ERROR_LOCK_FAIL ? 0 : rc;
+    }
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        LOGE(ERROR, "unable to open socket for %s", vif);
+        rc = ERROR_FAIL;
+        goto out;
+    }
+    libxl_fd_set_cloexec(CTX, sock, 1);
+
+    if (add) {
+        netdev_setup_port(gc, sock, bridge, vif);
+
+        if (access(GCSPRINTF("/sys/class/net/%s/brif/%s", bridge, vif),
+                   F_OK)) {
+            rc = netdev_bridge_port(gc, sock, SIOCBRADDIF, bridge, vif);
+            if (rc) {
+                rc = hotplug_fail(gc, be_path, "error",
+                    GCSPRINTF("Unable to add %s to bridge %s", vif, bridge));
+                goto out;
+            }
+        }
+
+        rc = netdev_set_up(gc, sock, vif, true);
+        if (rc) {
+            rc = hotplug_fail(gc, be_path, "error",
+                              GCSPRINTF("Unable to bring up %s", vif));
+            goto out;
+        }
+    } else if (!strcmp(command, "offline")) {
+        netdev_bridge_port(gc, sock, SIOCBRDELIF, bridge, vif);
+        netdev_set_up(gc, sock, vif, false);
+    }
+
+    LOG(DEBUG, "builtin vif-bridge %s for %s, bridge %s", command, vif, bridge);
+
+    if (!lock) {
+        rc = (!tap && online) ? hotplug_success(gc, be_path) : 0;
+        if (!rc) rc = 1;
+        goto out;
+    }
+
+    aodev->hotplug.input = vif_iptables_input(gc, vif, add);
+    if (!aodev->hotplug.input) {
+        rc = ERROR_FAIL;
+        goto out;
+    }
+    aodev->hotplug.lock = lock;
+    aodev->hotplug.lockname = "iptables";
+    lock = NULL;
+    /* Like the script, report success after the rules are in place */
+    if (!tap && online)
+        aodev->hotplug.be_path = be_path;
+
+    GCNEW_ARRAY(*args_r, 3);
+    (*args_r)[0] = "iptables-restore";
+    (*args_r)[1] = "--noflush";
+    (*args_r)[2] = NULL;
+    *env_r = NULL;
+    rc = 2;
+
+out:
+    if (lock) hotplug_unlock(gc, "iptables", lock);
+    if (sock >= 0) close(sock);
+    return rc;
+}
+
+/*----- block -----*/
+
+/* canonicalise_mode */
+static char block_mode(const char *mode)
+{
+    if (!mode || !strchr(mode, 'w')) return 'r';
+    if (!strchr(mode, '!')) return 'w';
+    return '!';
+}
+
+static const char *block_domain_vm(libxl__gc *gc, const char *domid)
+{
+    const char *vm;
+
+    if (!domid ||
+        libxl__xs_read_checked(gc, XBT_NULL,
+                               GCSPRINTF("/local/domain/%s/vm", domid), &vm))
+        return NULL;
+    return vm;
+}
+
+static const char *block_target_vm(libxl__gc *gc, const char *domid)
+{
+    const char *target;
+
+    if (libxl__xs_read_checked(gc, XBT_NULL,
+                               GCSPRINTF("/local/domain/%s/target", domid),
+                               &target))
+        return NULL;
+    return block_domain_vm(gc, target);
+}
+
+static bool block_vm_eq(const char *a, const char *b)
+{
+    return a && b && !strcmp(a, b);
+}
+
+/* same_vm: does otherdom belong to the same guest as frontend_id? */
+static bool block_same_vm(libxl__gc *gc, const char *frontend_id,
+                          const char *otherdom)
+{
+    const char *fvm = block_domain_vm(gc, frontend_id);
+    const char *ovm = block_domain_vm(gc, otherdom) ?: fvm;
+    const char *ftvm = block_target_vm(gc, frontend_id);
+    const char *otvm = block_target_vm(gc, otherdom);
+
+    return block_vm_eq(fvm, ovm) || block_vm_eq(ftvm, ovm) ||
+           block_vm_eq(fvm, otvm) || block_vm_eq(ftvm, otvm);
+}
+
+/*
+ * check_device_sharing: refuse to hand out a device which is mounted
+ * (read-write, unless we want it writable ourselves) in dom0, or which
+ * is attached to another guest while either side wants to write.
+ * Returns NULL if sharing is fine, or the message for hotplug-error.
+ */
+static const char *block_check_sharing(libxl__gc *gc, libxl__device *dev,
+                                       const char *devpath, char mode,
+                                       const char *devmm,
+                                       const char *frontend_id)
+{
+    const char *be_path = libxl__device_backend_path(gc, dev);
+    const char *base_path;
+    char **doms, **devs;
+    unsigned int nr_doms, nr_devs, i, j;
+    struct mntent *m;
+    struct stat st;
+    FILE *f;
+    bool busy = false;
+
+    f = setmntent("/proc/mounts", "r");
+    if (f) {
+        while (!busy && (m = getmntent(f))) {
+            if (mode != 'w' && hasmntopt(m, "ro"))
+                continue;
+            if (!stat(m->mnt_fsname, &st) && S_ISBLK(st.st_mode) &&
+                !strcmp(devmm, GCSPRINTF("%x:%x", major(st.st_rdev),
+                                         minor(st.st_rdev))))
+                busy = true;
+        }
+        endmntent(f);
+    }
+    if (busy)
+        return GCSPRINTF("Device %s is mounted %sin the privileged domain,\n"
+                         "and so cannot be mounted %sby a guest.", devpath,
+                         mode == 'w' ? "" : "read-write ",
+                         mode == 'w' ? "" : "read-only ");
+
+    base_path = GCSPRINTF("%s/backend/vbd",
+                          libxl__xs_get_dompath(gc, dev->backend_domid));
+    doms = libxl__xs_directory(gc, XBT_NULL, base_path, &nr_doms);
+    for (i = 0; i < nr_doms; i++) {
+        devs = libxl__xs_directory(gc, XBT_NULL,
+                                   GCSPRINTF("%s/%s", base_path, doms[i]),
+                                   &nr_devs);
+        for (j = 0; j < nr_devs; j++) {
+            const char *p = GCSPRINTF("%s/%s/%s", base_path,
+                                      doms[i], devs[j]);
+            const char *d, *m2;
+
+            if (!strcmp(p, be_path)) continue;
+            d = libxl__xs_read(gc, XBT_NULL, GCSPRINTF("%s/physical-device", p));
+            if (!d || strcmp(d, devmm)) continue;
+
+            if (mode != 'w') {
+                m2 = libxl__xs_read(gc, XBT_NULL, GCSPRINTF("%s/mode", p));
+                if (block_mode(m2) != 'w') continue;
+            }
+            if (!block_same_vm(gc, frontend_id, doms[i]))
+                return GCSPRINTF("Device %s is mounted %sin a guest domain,\n"
+                                 "and so cannot be mounted %snow.", devpath,
+                                 mode == 'w' ? "" : "read-write ",
+                                 mode == 'w' ? "" : "read-only ");
+        }
+    }
+
+    return NULL;
+}
+
+static int hotplug_block(libxl__gc *gc, libxl__device *dev, char **args)
+{
+    const char *be_path = libxl__device_backend_path(gc, dev);
+    const char *command = args[1];
+    const char *params, *phys, *mode, *frontend_id, *busy, *devmm;
+    libxl__carefd *lock = NULL;
+    char *devpath = NULL;
+    struct stat st;
+    int rc;
+
+    rc = libxl__xs_read_checked(gc, XBT_NULL,
+                                GCSPRINTF("%s/params", be_path), &params);
+    if (rc) return rc;
+
+    /* Only phy devices; files need a loop device, leave it to losetup */
+    if (!params || stat(params, &st) || !S_ISBLK(st.st_mode))
+        return 0;
+
+    if (!strcmp(command, "remove"))
+        return 1;
+    if (strcmp(command, "add"))
+        return 0;
+
+    rc = libxl__xs_read_checked(gc, XBT_NULL,
+                                GCSPRINTF("%s/physical-device", be_path),
+                                &phys);
+    if (rc) return rc;
+    if (phys) return 1;
+
+    rc = libxl__xs_read_checked(gc, XBT_NULL,
+                                GCSPRINTF("%s/mode", be_path), &mode);
+    if (rc) return rc;
+    rc = libxl__xs_read_checked(gc, XBT_NULL,
+                                GCSPRINTF("%s/frontend-id", be_path),
+                                &frontend_id);
+    if (rc) return rc;
+
+    devpath = realpath(params, NULL);
+    if (!devpath)
+        return hotplug_fail(gc, be_path, "error",
+                            GCSPRINTF("%s link does not exist.", params));
+    libxl__ptr_add(gc, devpath);
+    if (stat(devpath, &st) || !S_ISBLK(st.st_mode))
+        return hotplug_fail(gc, be_path, "error",
+                            GCSPRINTF("%s is not a block device.", devpath));
+    devmm = GCSPRINTF("%x:%x", major(st.st_rdev), minor(st.st_rdev));
+
+    rc = hotplug_lock(gc, "block", &lock);
+    if (rc) return rc == ERROR_LOCK_FAIL ? 0 : rc;
+
+    if (block_mode(mode) != '!') {
+        busy = block_check_sharing(gc, dev, devpath, block_mode(mode),
+                                   devmm, frontend_id);
+        if (busy) {
+            rc = hotplug_fail(gc, be_path, "busy", busy);
+            goto out;
+        }
+    }
+
+    rc = libxl__xs_write_checked(gc, XBT_NULL,
+                                 GCSPRINTF("%s/physical-device", be_path),
+                                 devmm);
+    if (rc) goto out;
+    rc = libxl__xs_write_checked(gc, XBT_NULL,
+                                 GCSPRINTF("%s/physical-device-path", be_path),
+                                 devpath);
+    if (rc) goto out;
+    rc = hotplug_success(gc, be_path);
+    if (rc) goto out;
+
+    LOG(DEBUG, "builtin block add for %s (%s)", devpath, devmm);
+    rc = 1;
+
+out:
+    hotplug_unlock(gc, "block", lock);
+    return rc;
+}
+
+int libxl__hotplug_builtin(libxl__gc *gc, libxl__ao_device *aodev,
+                           char ***args, char ***env)
+{
+    char **a = *args;
+
+    if (!hotplug_builtin_enabled() || !a[0] || !a[1])
+        return 0;
+
+    switch (aodev->dev->backend_kind) {
+    case LIBXL__DEVICE_KIND_VIF:
+        if (hotplug_is_stock_script(gc, a[0], "vif-bridge"))
+            return hotplug_vif_bridge(gc, aodev, args, env);
+        break;
+    case LIBXL__DEVICE_KIND_VBD:
+        if (hotplug_is_stock_script(gc, a[0], "block"))
+            return hotplug_block(gc, aodev->dev, a);
+        break;
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+void libxl__hotplug_builtin_done(libxl__gc *gc, libxl__ao_device *aodev)
+{
+    libxl__hotplug_builtin_state *hp = &aodev->hotplug;
+
+    if (hp->be_path)
+        hotplug_success(gc, hp->be_path);
+    libxl__carefd_close(hp->input);
+    if (hp->lock)
+        hotplug_unlock(gc, hp->lockname, hp->lock);
+
+    memset(hp, 0, sizeof(*hp));
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
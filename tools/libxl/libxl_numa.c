@@ -104,79 +104,6 @@ static int comb_next(comb_iter_t it, int n, int k)
 
 /* NUMA automatic placement (see libxl_internal.h for details) */
 
-/*
- * This function turns a k-combination iterator into a node map,
- * given another map, telling us which nodes should be considered.
- *
- * This means the bits that are set in suitable_nodemap and that
- * corresponds to the indexes of the given combination are the ones
- * that will be set in nodemap.
- *
- * For example, given a fully set suitable_nodemap, if the iterator
- * represents the combination { 0, 2, 4}, nodmeap will have bits #0,
- * #2 and #4 set.
- * On the other hand, if, say,  suitable_nodemap=01011011, the same
- * iterator will cause bits #1, #4 and #7 of nodemap to be set.
- */
-static void comb_get_nodemap(comb_iter_t it, libxl_bitmap *suitable_nodemap,
-                             libxl_bitmap *nodemap, int k)
-{
-    int i, m = 0, n = 0;
-
-    libxl_bitmap_set_none(nodemap);
-    libxl_for_each_set_bit(i, *suitable_nodemap) {
-        /* Check wether the n-th set bit of suitable_nodemap
-         * matches with the m-th element of the iterator (and,
-         * only if it does, advance to the next one) */
-        if (m < k && n == it[m]) {
-            libxl_bitmap_set(nodemap, i);
-            m++;
-        }
-        n++;
-    }
-}
-
-/* Retrieve the number of cpus that the nodes that are part of the nodemap
- * span and are also set in suitable_cpumap. */
-static int nodemap_to_nr_cpus(libxl_cputopology *tinfo, int nr_cpus,
-                              const libxl_bitmap *suitable_cpumap,
-                              const libxl_bitmap *nodemap)
-{
-    int i, nodes_cpus = 0;
-
-    for (i = 0; i < nr_cpus; i++) {
-        if (libxl_bitmap_test(suitable_cpumap, i) &&
-            libxl_bitmap_test(nodemap, tinfo[i].node))
-            nodes_cpus++;
-    }
-    return nodes_cpus;
-}
-
-/* Retrieve the amount of free memory within the nodemap */
-static uint32_t nodemap_to_free_memkb(libxl_numainfo *ninfo,
-                                      libxl_bitmap *nodemap)
-{
-    uint32_t free_memkb = 0;
-    int i;
-
-    libxl_for_each_set_bit(i, *nodemap)
-        free_memkb += ninfo[i].free / 1024;
-
-    return free_memkb;
-}
-
-/* Retrieve the number of vcpus able to run on the nodes in nodemap */
-static int nodemap_to_nr_vcpus(libxl__gc *gc, int vcpus_on_node[],
-                               const libxl_bitmap *nodemap)
-{
-    int i, nr_vcpus = 0;
-
-    libxl_for_each_set_bit(i, *nodemap)
-        nr_vcpus += vcpus_on_node[i];
-
-    return nr_vcpus;
-}
-
 /* Number of vcpus able to run on the cpus of the various nodes
  * (reported by filling the array vcpus_on_node[]). */
 static int nr_vcpus_on_nodes(libxl__gc *gc, libxl_cputopology *tinfo,
@@ -279,6 +206,331 @@ static int count_cpus_per_node(libxl_cputopology *tinfo, int nr_cpus,
     return cpus_per_node;
 }
 
+/*
+ * State of the search. The suitable nodes are gathered in suit[], and
+ * the candidate being evaluated is made of the nodes whose indexes (in
+ * suit[]) are in set[]. Its totals are accumulated while it is being
+ * built, so that checking it costs nothing more than what it takes to
+ * add up the figures of its nodes.
+ */
+typedef struct {
+    libxl__gc *gc;
+    int nr_nodes;
+    const libxl__numa_node_load *nodes;
+    const uint32_t *dists;
+    uint32_t min_free_memkb;
+    int min_cpus;
+    libxl__numa_candidate_cmpf numa_cmpf;
+    libxl__numa_candidate *cndt_out;
+    libxl__numa_candidate new_cndt;
+    int *cndt_found;
+    int nr_suit;
+    int *suit;
+} numa_search;
+
+/*
+ * Evaluate the candidate made of the nr_set nodes in set[], which
+ * contains indexes in suit[]. Returns 1 if the search for this size
+ * can stop (i.e., there is no comparison function and something has
+ * been found), 0 otherwise.
+ */
+static int numa_search_check(numa_search *ns, const int *set, int nr_set)
+{
+    libxl__gc *gc = ns->gc;
+    libxl__numa_candidate *new_cndt = &ns->new_cndt;
+    uint32_t free_memkb = 0;
+    int i, nr_cpus = 0, nr_vcpus = 0;
+
+    for (i = 0; i < nr_set; i++) {
+        const libxl__numa_node_load *node = &ns->nodes[ns->suit[set[i]]];
+
+        free_memkb += node->free_memkb;
+        nr_cpus += node->nr_cpus;
+        nr_vcpus += node->nr_vcpus;
+    }
+
+    /* Skip the combination if it is short in either memory or cpus */
+    if (ns->min_free_memkb && free_memkb < ns->min_free_memkb)
+        return 0;
+    if (ns->min_cpus && nr_cpus < ns->min_cpus)
+        return 0;
+
+    /*
+     * Conditions are met, we can compare this candidate with the
+     * current best one (if any).
+     */
+    libxl_bitmap_set_none(&new_cndt->nodemap);
+    for (i = 0; i < nr_set; i++)
+        libxl_bitmap_set(&new_cndt->nodemap, ns->suit[set[i]]);
+    new_cndt->nr_vcpus = nr_vcpus;
+    new_cndt->free_memkb = free_memkb;
+    new_cndt->nr_nodes = nr_set;
+    new_cndt->nr_cpus = nr_cpus;
+
+    /*
+     * Check if the new candidate we is better the what we found up
+     * to now by means of the comparison function. If no comparison
+     * function is provided, just return as soon as we find our first
+     * candidate.
+     */
+    if (*ns->cndt_found == 0 || ns->numa_cmpf(new_cndt, ns->cndt_out) < 0) {
+        *ns->cndt_found = 1;
+
+        LOG(DEBUG, "New best NUMA placement candidate found: "
+                   "nr_nodes=%d, nr_cpus=%d, nr_vcpus=%d, "
+                   "free_memkb=%"PRIu32"", new_cndt->nr_nodes,
+                   new_cndt->nr_cpus, new_cndt->nr_vcpus,
+                   new_cndt->free_memkb / 1024);
+
+        libxl__numa_candidate_put_nodemap(gc, ns->cndt_out,
+                                          &new_cndt->nodemap);
+        ns->cndt_out->nr_vcpus = new_cndt->nr_vcpus;
+        ns->cndt_out->free_memkb = new_cndt->free_memkb;
+        ns->cndt_out->nr_nodes = new_cndt->nr_nodes;
+        ns->cndt_out->nr_cpus = new_cndt->nr_cpus;
+
+        if (ns->numa_cmpf == NULL)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Evaluate all the candidates with k nodes (see comb_init()). */
+static void numa_search_exhaustive(numa_search *ns, int k)
+{
+    comb_iter_t comb_iter;
+    int comb_ok;
+
+    for (comb_ok = comb_init(ns->gc, &comb_iter, ns->nr_suit, k);
+         comb_ok;
+         comb_ok = comb_next(comb_iter, ns->nr_suit, k)) {
+        if (numa_search_check(ns, comb_iter, k))
+            break;
+    }
+}
+
+/*
+ * Evaluate nr_suit candidates with k nodes, one grown from each of
+ * the suitable nodes. A candidate grows by adding, one at a time, the
+ * node with the smallest total distance from the nodes already in it
+ * (if there is no distance information, all nodes are equally far).
+ * Ties are broken in favour of the node with fewer vcpus, and then of
+ * the one with more free memory, as that is what numa_place_domain()'s
+ * comparison function prefers.
+ *
+ * The distance of each node from the candidate is updated as nodes are
+ * added, so building a candidate takes O(k * nr_suit) steps.
+ */
+static void numa_search_greedy(numa_search *ns, int k)
+{
+    libxl__gc *gc = ns->gc;
+    const libxl__numa_node_load *nodes = ns->nodes;
+    int nr_suit = ns->nr_suit;
+    uint64_t *dist_to_set;
+    int *set, *in_set;
+    int seed, i;
+
+    GCNEW_ARRAY(set, k);
+    GCNEW_ARRAY(in_set, nr_suit);
+    GCNEW_ARRAY(dist_to_set, nr_suit);
+
+    for (seed = 0; seed < nr_suit; seed++) {
+        int nr_set = 0, next = seed;
+
+        memset(in_set, 0, nr_suit * sizeof(*in_set));
+        memset(dist_to_set, 0, nr_suit * sizeof(*dist_to_set));
+
+        for (;;) {
+            int added = ns->suit[next];
+
+            set[nr_set++] = next;
+            in_set[next] = 1;
+            if (nr_set == k)
+                break;
+
+            next = -1;
+            for (i = 0; i < nr_suit; i++) {
+                const libxl__numa_node_load *c, *b;
+
+                if (in_set[i])
+                    continue;
+                if (ns->dists)
+                    dist_to_set[i] +=
+                        ns->dists[ns->suit[i] * ns->nr_nodes + added];
+                if (next < 0) {
+                    next = i;
+                    continue;
+                }
+
+                c = &nodes[ns->suit[i]];
+                b = &nodes[ns->suit[next]];
+                if (dist_to_set[i] < dist_to_set[next] ||
+                    (dist_to_set[i] == dist_to_set[next] &&
+                     (c->nr_vcpus < b->nr_vcpus ||
+                      (c->nr_vcpus == b->nr_vcpus &&
+                       c->free_memkb > b->free_memkb))))
+                    next = i;
+            }
+        }
+
+        if (numa_search_check(ns, set, nr_set))
+            break;
+    }
+}
+
+/* Number of k-combinations of n elements, or cap + 1 if more than cap */
+static unsigned long nr_combinations(int n, int k, unsigned long cap)
+{
+    unsigned long c = 1;
+    int i;
+
+    if (k > n - k)
+        k = n - k;
+    for (i = 1; i <= k; i++) {
+        /* c * (n - k + i) is always a multiple of i */
+        c = c * (n - k + i) / i;
+        if (c > cap)
+            return cap + 1;
+    }
+    return c;
+}
+
+static int cmp_u64_desc(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/*
+ * Fill most_memkb[k] and most_cpus[k] with the largest amount of free
+ * memory and number of cpus, respectively, that k of the suitable nodes
+ * can provide. No candidate with k nodes can do better than that, so
+ * sizes for which those are short can be skipped altogether.
+ */
+static void numa_search_bounds(numa_search *ns, uint64_t *most_memkb,
+                               uint64_t *most_cpus)
+{
+    libxl__gc *gc = ns->gc;
+    uint64_t *memkb, *cpus;
+    int i;
+
+    GCNEW_ARRAY(memkb, ns->nr_suit);
+    GCNEW_ARRAY(cpus, ns->nr_suit);
+    for (i = 0; i < ns->nr_suit; i++) {
+        memkb[i] = ns->nodes[ns->suit[i]].free_memkb;
+        cpus[i] = ns->nodes[ns->suit[i]].nr_cpus;
+    }
+    qsort(memkb, ns->nr_suit, sizeof(*memkb), cmp_u64_desc);
+    qsort(cpus, ns->nr_suit, sizeof(*cpus), cmp_u64_desc);
+
+    most_memkb[0] = most_cpus[0] = 0;
+    for (i = 0; i < ns->nr_suit; i++) {
+        most_memkb[i + 1] = most_memkb[i] + memkb[i];
+        most_cpus[i + 1] = most_cpus[i] + cpus[i];
+    }
+}
+
+int libxl__numa_candidate_search(libxl__gc *gc, int nr_nodes,
+                                 const libxl__numa_node_load *nodes,
+                                 const uint32_t *dists,
+                                 uint32_t min_free_memkb, int min_cpus,
+                                 int min_nodes, int max_nodes,
+                                 unsigned long max_combinations,
+                                 libxl__numa_candidate_cmpf numa_cmpf,
+                                 libxl__numa_candidate *cndt_out,
+                                 int *cndt_found)
+{
+    numa_search ns;
+    uint64_t *most_memkb, *most_cpus;
+    int i, rc;
+
+    memset(&ns, 0, sizeof(ns));
+    ns.gc = gc;
+    ns.nr_nodes = nr_nodes;
+    ns.nodes = nodes;
+    ns.dists = dists;
+    ns.min_free_memkb = min_free_memkb;
+    ns.min_cpus = min_cpus;
+    ns.numa_cmpf = numa_cmpf;
+    ns.cndt_out = cndt_out;
+    ns.cndt_found = cndt_found;
+    libxl__numa_candidate_init(&ns.new_cndt);
+
+    *cndt_found = 0;
+
+    GCNEW_ARRAY(ns.suit, nr_nodes);
+    for (i = 0; i < nr_nodes; i++) {
+        if (nodes[i].nr_cpus > 0)
+            ns.suit[ns.nr_suit++] = i;
+    }
+    if (ns.nr_suit == 0) {
+        rc = 0;
+        goto out;
+    }
+
+    /* We need to be sure we do not exceed the number of nodes we are
+     * allowed to use. */
+    if (!min_nodes)
+        min_nodes = 1;
+    if (min_nodes > ns.nr_suit)
+        min_nodes = ns.nr_suit;
+    if (!max_nodes || max_nodes > ns.nr_suit)
+        max_nodes = ns.nr_suit;
+    if (min_nodes > max_nodes) {
+        LOG(ERROR, "Inconsistent minimum or maximum number of guest nodes");
+        rc = ERROR_INVAL;
+        goto out;
+    }
+
+    rc = libxl__numa_candidate_alloc(gc, &ns.new_cndt);
+    if (rc)
+        goto out;
+    /* This is up to the caller to be disposed */
+    rc = libxl__numa_candidate_alloc(gc, cndt_out);
+    if (rc)
+        goto out;
+
+    /*
+     * Consider the candidates with sizes in [min_nodes, max_nodes]. Note
+     * that, since the fewer the number of nodes the better, it is
+     * guaranteed that any candidate found during the i-eth step will be
+     * better than any other one we could find during the (i+1)-eth and
+     * all the subsequent steps (they all will have more nodes). It's thus
+     * pointless to keep going if we already found something. Sizes for
+     * which even the biggest nodes are short in memory or cpus are not
+     * searched at all (see numa_search_bounds()).
+     *
+     * On hosts with a handful of nodes, all the combinations of each size
+     * are checked. Their number however explodes with the number of
+     * nodes, e.g., there are 12870 ways of picking 8 nodes out of 16, and
+     * more than 10^18 ways of picking 32 out of 64. Sizes with more than
+     * max_combinations candidates are therefore only searched greedily
+     * (see numa_search_greedy()), which takes O(nr_nodes^2 * size) steps
+     * at most.
+     */
+    GCNEW_ARRAY(most_memkb, ns.nr_suit + 1);
+    GCNEW_ARRAY(most_cpus, ns.nr_suit + 1);
+    numa_search_bounds(&ns, most_memkb, most_cpus);
+
+    for (; min_nodes <= max_nodes && *cndt_found == 0; min_nodes++) {
+        if (most_memkb[min_nodes] < min_free_memkb ||
+            most_cpus[min_nodes] < min_cpus)
+            continue;
+
+        if (nr_combinations(ns.nr_suit, min_nodes, max_combinations) <=
+            max_combinations)
+            numa_search_exhaustive(&ns, min_nodes);
+        else
+            numa_search_greedy(&ns, min_nodes);
+    }
+
+ out:
+    libxl__numa_candidate_dispose(&ns.new_cndt);
+    return rc;
+}
+
 /*
  * Looks for the placement candidates that satisfyies some specific
  * conditions and return the best one according to the provided
@@ -292,54 +544,22 @@ int libxl__get_numa_candidate(libxl__gc *gc,
                               libxl__numa_candidate *cndt_out,
                               int *cndt_found)
 {
-    libxl__numa_candidate new_cndt;
     libxl_cputopology *tinfo = NULL;
     libxl_numainfo *ninfo = NULL;
-    int nr_nodes = 0, nr_suit_nodes, nr_cpus = 0;
-    libxl_bitmap suitable_nodemap, nodemap;
-    int *vcpus_on_node, rc = 0;
+    libxl__numa_node_load *nodes;
+    uint32_t *dists = NULL;
+    int nr_nodes = 0, nr_cpus = 0;
+    int *vcpus_on_node, i, j, rc = 0;
 
-    libxl_bitmap_init(&nodemap);
-    libxl_bitmap_init(&suitable_nodemap);
-    libxl__numa_candidate_init(&new_cndt);
+    *cndt_found = 0;
 
     /* Get platform info and prepare the map for testing the combinations */
     ninfo = libxl_get_numainfo(CTX, &nr_nodes);
     if (ninfo == NULL)
         return ERROR_FAIL;
 
-    if (nr_nodes <= 1) {
-        *cndt_found = 0;
+    if (nr_nodes <= 1)
         goto out;
-    }
-
-    GCNEW_ARRAY(vcpus_on_node, nr_nodes);
-
-    /*
-     * The good thing about this solution is that it is based on heuristics
-     * (implemented in numa_cmpf() ), but we at least can evaluate it on
-     * all the possible placement candidates. That can happen because the
-     * number of nodes present in current NUMA systems is quite small.
-     * In fact, even if a sum of binomials is involved, if the system has
-     * up to 16 nodes it "only" takes 65535 steps. This is fine, as the
-     * number of nodes the biggest NUMA systems provide at the time of this
-     * writing is 8 (and it will probably continue to be so for a while).
-     * However, computanional complexity would explode on systems bigger
-     * than that, and it's really important we avoid trying to run this
-     * on monsters with 32, 64 or more nodes (if they ever pop into being).
-     * Therefore, here it comes a safety catch that disables the algorithm
-     * for the cases when it wouldn't work well.
-     */
-    if (nr_nodes > 16) {
-        /* Log we did nothing and return 0, as no real error occurred */
-        LOG(WARN, "System has %d NUMA nodes, which is too big for the "
-                  "placement algorithm to work effectively: skipping it. "
-                  "Consider manually pinning the vCPUs and/or looking at "
-                  "cpupools for manually partitioning the system.",
-                  nr_nodes);
-        *cndt_found = 0;
-        goto out;
-    }
 
     tinfo = libxl_get_cpu_topology(CTX, &nr_cpus);
     if (tinfo == NULL) {
@@ -347,21 +567,8 @@ int libxl__get_numa_candidate(libxl__gc *gc,
         goto out;
     }
 
-    rc = libxl_node_bitmap_alloc(CTX, &nodemap, 0);
-    if (rc)
-        goto out;
-    rc = libxl__numa_candidate_alloc(gc, &new_cndt);
-    if (rc)
-        goto out;
-
-    /* Allocate and prepare the map of the node that can be utilized for
-     * placement, basing on the map of suitable cpus. */
-    rc = libxl_node_bitmap_alloc(CTX, &suitable_nodemap, 0);
-    if (rc)
-        goto out;
-    rc = libxl_cpumap_to_nodemap(CTX, suitable_cpumap, &suitable_nodemap);
-    if (rc)
-        goto out;
+    GCNEW_ARRAY(vcpus_on_node, nr_nodes);
+    GCNEW_ARRAY(nodes, nr_nodes);
 
     /*
      * Later on, we will try to figure out how many vcpus are runnable on
@@ -370,19 +577,39 @@ int libxl__get_numa_candidate(libxl__gc *gc,
      * their affinities. So, instead of doing that for each candidate,
      * let's count here the number of vcpus runnable on each node, so that
      * all we have to do later is summing up the right elements of the
-     * vcpus_on_node array.
+     * vcpus_on_node array. The same goes for the suitable cpus and the
+     * free memory of each node.
      */
     rc = nr_vcpus_on_nodes(gc, tinfo, nr_cpus, suitable_cpumap, vcpus_on_node);
     if (rc)
         goto out;
 
+    for (i = 0; i < nr_cpus; i++) {
+        if (tinfo[i].node < nr_nodes &&
+            libxl_bitmap_test(suitable_cpumap, i))
+            nodes[tinfo[i].node].nr_cpus++;
+    }
+    for (i = 0; i < nr_nodes; i++) {
+        nodes[i].nr_vcpus = vcpus_on_node[i];
+        nodes[i].free_memkb = ninfo[i].free / 1024;
+    }
+
+    /* Only use the distances if Xen provided all of them */
+    GCNEW_ARRAY(dists, nr_nodes * nr_nodes);
+    for (i = 0; i < nr_nodes && dists; i++) {
+        if (ninfo[i].num_dists != nr_nodes) {
+            dists = NULL;
+            break;
+        }
+        for (j = 0; j < nr_nodes; j++)
+            dists[i * nr_nodes + j] = ninfo[i].dists[j];
+    }
+
     /*
      * If the minimum number of NUMA nodes is not explicitly specified
      * (i.e., min_nodes == 0), we try to figure out a sensible number of nodes
      * from where to start generating candidates, if possible (or just start
-     * from 1 otherwise). The maximum number of nodes should not exceed the
-     * number of existent NUMA nodes on the host, or the candidate generation
-     * won't work properly.
+     * from 1 otherwise).
      */
     if (!min_nodes) {
         int cpus_per_node;
@@ -393,115 +620,19 @@ int libxl__get_numa_candidate(libxl__gc *gc,
         else
             min_nodes = (min_cpus + cpus_per_node - 1) / cpus_per_node;
     }
-    /* We also need to be sure we do not exceed the number of
-     * nodes we are allowed to use. */
-    nr_suit_nodes = libxl_bitmap_count_set(&suitable_nodemap);
-
-    if (min_nodes > nr_suit_nodes)
-        min_nodes = nr_suit_nodes;
-    if (!max_nodes || max_nodes > nr_suit_nodes)
-        max_nodes = nr_suit_nodes;
-    if (min_nodes > max_nodes) {
-        LOG(ERROR, "Inconsistent minimum or maximum number of guest nodes");
-        rc = ERROR_INVAL;
-        goto out;
-    }
 
-    /* This is up to the caller to be disposed */
-    rc = libxl__numa_candidate_alloc(gc, cndt_out);
+    rc = libxl__numa_candidate_search(gc, nr_nodes, nodes, dists,
+                                      min_free_memkb, min_cpus,
+                                      min_nodes, max_nodes,
+                                      LIBXL__NUMA_MAX_COMBINATIONS,
+                                      numa_cmpf, cndt_out, cndt_found);
     if (rc)
         goto out;
 
-    /*
-     * Consider all the combinations with sizes in [min_nodes, max_nodes]
-     * (see comb_init() and comb_next()). Note that, since the fewer the
-     * number of nodes the better, it is guaranteed that any candidate
-     * found during the i-eth step will be better than any other one we
-     * could find during the (i+1)-eth and all the subsequent steps (they
-     * all will have more nodes). It's thus pointless to keep going if
-     * we already found something.
-     */
-    *cndt_found = 0;
-    while (min_nodes <= max_nodes && *cndt_found == 0) {
-        comb_iter_t comb_iter;
-        int comb_ok;
-
-        /*
-         * And here it is. Each step of this cycle generates a combination of
-         * nodes as big as min_nodes mandates.  Each of these combinations is
-         * checked against the constraints provided by the caller (namely,
-         * amount of free memory and number of cpus) and it can concur to
-         * become our best placement iff it passes the check.
-         */
-        for (comb_ok = comb_init(gc, &comb_iter, nr_suit_nodes, min_nodes);
-             comb_ok;
-             comb_ok = comb_next(comb_iter, nr_suit_nodes, min_nodes)) {
-            uint32_t nodes_free_memkb;
-            int nodes_cpus;
-
-            /* Get the nodemap for the combination, only considering
-             * suitable nodes. */
-            comb_get_nodemap(comb_iter, &suitable_nodemap,
-                             &nodemap, min_nodes);
-
-            /* If there is not enough memory in this combination, skip it
-             * and go generating the next one... */
-            nodes_free_memkb = nodemap_to_free_memkb(ninfo, &nodemap);
-            if (min_free_memkb && nodes_free_memkb < min_free_memkb)
-                continue;
-
-            /* And the same applies if this combination is short in cpus */
-            nodes_cpus = nodemap_to_nr_cpus(tinfo, nr_cpus, suitable_cpumap,
-                                            &nodemap);
-            if (min_cpus && nodes_cpus < min_cpus)
-                continue;
-
-            /*
-             * Conditions are met, we can compare this candidate with the
-             * current best one (if any).
-             */
-            libxl__numa_candidate_put_nodemap(gc, &new_cndt, &nodemap);
-            new_cndt.nr_vcpus = nodemap_to_nr_vcpus(gc, vcpus_on_node,
-                                                    &nodemap);
-            new_cndt.free_memkb = nodes_free_memkb;
-            new_cndt.nr_nodes = libxl_bitmap_count_set(&nodemap);
-            new_cndt.nr_cpus = nodes_cpus;
-
-            /*
-             * Check if the new candidate we is better the what we found up
-             * to now by means of the comparison function. If no comparison
-             * function is provided, just return as soon as we find our first
-             * candidate.
-             */
-            if (*cndt_found == 0 || numa_cmpf(&new_cndt, cndt_out) < 0) {
-                *cndt_found = 1;
-
-                LOG(DEBUG, "New best NUMA placement candidate found: "
-                           "nr_nodes=%d, nr_cpus=%d, nr_vcpus=%d, "
-                           "free_memkb=%"PRIu32"", new_cndt.nr_nodes,
-                           new_cndt.nr_cpus, new_cndt.nr_vcpus,
-                           new_cndt.free_memkb / 1024);
-
-                libxl__numa_candidate_put_nodemap(gc, cndt_out, &nodemap);
-                cndt_out->nr_vcpus = new_cndt.nr_vcpus;
-                cndt_out->free_memkb = new_cndt.free_memkb;
-                cndt_out->nr_nodes = new_cndt.nr_nodes;
-                cndt_out->nr_cpus = new_cndt.nr_cpus;
-
-                if (numa_cmpf == NULL)
-                    break;
-            }
-        }
-        min_nodes++;
-    }
-
     if (*cndt_found == 0)
         LOG(NOTICE, "NUMA placement failed, performance might be affected");
 
  out:
-    libxl_bitmap_dispose(&nodemap);
-    libxl_bitmap_dispose(&suitable_nodemap);
-    libxl__numa_candidate_dispose(&new_cndt);
     libxl_numainfo_list_free(ninfo, nr_nodes);
     libxl_cputopology_list_free(tinfo, nr_cpus);
     return rc;
@@ -62,12 +62,17 @@ typedef struct callback_id_pair {
 struct libxl__qmp_handler {
     struct sockaddr_un addr;
     int qmp_fd;
+    /* So that children do not keep QEMU's only QMP client slot busy */
+    libxl__carefd *qmp_cfd;
     bool connected;
     time_t timeout;
     /* wait_for_id will be used by the synchronous send function */
     int wait_for_id;
 
     char buffer[QMP_RECEIVE_BUFFER_SIZE + 1];
+    /* Data received but not handled yet, up to an incomplete message */
+    char *rx;
+    size_t rx_len;
     libxl__yajl_ctx *yajl_ctx;
 
     libxl_ctx *ctx;
@@ -75,6 +80,14 @@ struct libxl__qmp_handler {
 
     int last_id_used;
     LIBXL_STAILQ_HEAD(callback_list, callback_id_pair) callback_list;
+
+    /* Set once the connection can no longer be used */
+    bool failed;
+
+    /* Only for the handlers in CTX->qmp_handlers, see qmp_get_handler */
+    libxl__ev_fd efd;
+    libxl__ev_time idle;
+    LIBXL_LIST_ENTRY(struct libxl__qmp_handler) entry;
 };
 
 static int qmp_send(libxl__qmp_handler *qmp,
@@ -83,6 +96,7 @@ static int qmp_send(libxl__qmp_handler *qmp,
                     qmp_request_context *context);
 
 static const int QMP_SOCKET_CONNECT_TIMEOUT = 5;
+static const int QMP_IDLE_TIMEOUT_MS = 1000;
 
 /*
  * QMP callbacks functions
@@ -350,6 +364,8 @@ static libxl__qmp_handler *qmp_init_handler(libxl__gc *gc, uint32_t domid)
     qmp->timeout = 5;
 
     LIBXL_STAILQ_INIT(&qmp->callback_list);
+    libxl__ev_fd_init(&qmp->efd);
+    libxl__ev_time_init(&qmp->idle);
 
     return qmp;
 }
@@ -360,7 +376,9 @@ static int qmp_open(libxl__qmp_handler *qmp, const char *qmp_socket_path,
     int ret = -1;
     int i = 0;
 
+    libxl__carefd_begin();
     qmp->qmp_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    qmp->qmp_cfd = libxl__carefd_opened(qmp->ctx, qmp->qmp_fd);
     if (qmp->qmp_fd < 0) {
         goto out;
     }
@@ -369,11 +387,6 @@ static int qmp_open(libxl__qmp_handler *qmp, const char *qmp_socket_path,
         ret = -1;
         goto out;
     }
-    ret = libxl_fd_set_cloexec(qmp->ctx, qmp->qmp_fd, 1);
-    if (ret) {
-        ret = -1;
-        goto out;
-    }
 
     if (sizeof (qmp->addr.sun_path) <= strlen(qmp_socket_path)) {
         ret = -1;
@@ -399,7 +412,7 @@ static int qmp_open(libxl__qmp_handler *qmp, const char *qmp_socket_path,
     } while ((++i / 5 <= timeout) && (usleep(200 * 1000) <= 0));
 
 out:
-    if (ret == -1 && qmp->qmp_fd > -1) close(qmp->qmp_fd);
+    if (ret == -1 && qmp->qmp_fd > -1) libxl__carefd_close(qmp->qmp_cfd);
 
     return ret;
 }
@@ -409,7 +422,7 @@ static void qmp_close(libxl__qmp_handler *qmp)
     callback_id_pair *pp = NULL;
     callback_id_pair *tmp = NULL;
 
-    close(qmp->qmp_fd);
+    libxl__carefd_close(qmp->qmp_cfd);
     LIBXL_STAILQ_FOREACH(pp, &qmp->callback_list, next) {
         free(tmp);
         tmp = pp;
@@ -417,14 +430,86 @@ static void qmp_close(libxl__qmp_handler *qmp)
     free(tmp);
 }
 
-static int qmp_next(libxl__gc *gc, libxl__qmp_handler *qmp)
+/*
+ * Read what is available on the socket, without blocking. Returns the
+ * number of bytes read, 0 if there was nothing to read, and -1 if the
+ * connection is gone.
+ */
+static ssize_t qmp_read(libxl__gc *gc, libxl__qmp_handler *qmp)
 {
     ssize_t rd;
-    char *s = NULL;
-    char *s_end = NULL;
 
-    char *incomplete = NULL;
-    size_t incomplete_size = 0;
+    do {
+        rd = read(qmp->qmp_fd, qmp->buffer, QMP_RECEIVE_BUFFER_SIZE);
+    } while (rd < 0 && errno == EINTR);
+
+    if (rd == 0) {
+        LOG(ERROR, "Unexpected end of socket");
+        qmp->failed = true;
+        return -1;
+    } else if (rd < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        LOGE(ERROR, "Socket read error");
+        qmp->failed = true;
+        return -1;
+    }
+
+    DEBUG_REPORT_RECEIVED(qmp->buffer, rd);
+
+    qmp->rx = libxl__realloc(NOGC, qmp->rx, qmp->rx_len + rd + 1);
+    memcpy(qmp->rx + qmp->rx_len, qmp->buffer, rd);
+    qmp->rx_len += rd;
+    qmp->rx[qmp->rx_len] = '\0';
+
+    return rd;
+}
+
+/*
+ * Handle the complete messages received so far, and keep the rest for
+ * later. Returns -1 if one of them was an error or could not be parsed,
+ * 0 otherwise. *handled is set to the number of messages handled.
+ */
+static int qmp_handle_received(libxl__gc *gc, libxl__qmp_handler *qmp,
+                               int *handled)
+{
+    char *s = qmp->rx, *end;
+    int rc = 0;
+
+    *handled = 0;
+    if (!s)
+        return 0;
+
+    while ((end = strstr(s, "\r\n"))) {
+        libxl__json_object *o = NULL;
+
+        *end = '\0';
+
+        o = libxl__json_parse(gc, s);
+
+        if (o) {
+            if (qmp_handle_response(gc, qmp, o) < 0)
+                rc = -1;
+        } else {
+            LOG(ERROR, "Parse error of : %s", s);
+            qmp->failed = true;
+            return -1;
+        }
+
+        (*handled)++;
+        s = end + 2;
+    }
+
+    qmp->rx_len -= s - qmp->rx;
+    memmove(qmp->rx, s, qmp->rx_len + 1);
+
+    return rc;
+}
+
+/* Wait for at least one message and handle it */
+static int qmp_next(libxl__gc *gc, libxl__qmp_handler *qmp)
+{
+    int handled = 0;
     int rc = 0;
 
     do {
@@ -441,65 +526,23 @@ static int qmp_next(libxl__gc *gc, libxl__qmp_handler *qmp)
         ret = select(qmp->qmp_fd + 1, &rfds, NULL, NULL, &timeout);
         if (ret == 0) {
             LOG(ERROR, "timeout");
+            qmp->failed = true;
             return -1;
         } else if (ret < 0) {
             if (errno == EINTR)
                 continue;
             LOGE(ERROR, "Select error");
+            qmp->failed = true;
             return -1;
         }
 
-        rd = read(qmp->qmp_fd, qmp->buffer, QMP_RECEIVE_BUFFER_SIZE);
-        if (rd == 0) {
-            LOG(ERROR, "Unexpected end of socket");
+        if (qmp_read(gc, qmp) < 0)
             return -1;
-        } else if (rd < 0) {
-            LOGE(ERROR, "Socket read error");
-            return rd;
-        }
-        qmp->buffer[rd] = '\0';
-
-        DEBUG_REPORT_RECEIVED(qmp->buffer, rd);
-
-        do {
-            char *end = NULL;
-            if (incomplete) {
-                size_t current_pos = s - incomplete;
-                incomplete = libxl__realloc(gc, incomplete,
-                                            incomplete_size + rd + 1);
-                strncat(incomplete + incomplete_size, qmp->buffer, rd);
-                s = incomplete + current_pos;
-                incomplete_size += rd;
-                s_end = incomplete + incomplete_size;
-            } else {
-                incomplete = libxl__strndup(gc, qmp->buffer, rd);
-                incomplete_size = rd;
-                s = incomplete;
-                s_end = s + rd;
-                rd = 0;
-            }
-
-            end = strstr(s, "\r\n");
-            if (end) {
-                libxl__json_object *o = NULL;
-
-                *end = '\0';
 
-                o = libxl__json_parse(gc, s);
-
-                if (o) {
-                    rc = qmp_handle_response(gc, qmp, o);
-                } else {
-                    LOG(ERROR, "Parse error of : %s", s);
-                    return -1;
-                }
-
-                s = end + 2;
-            } else {
-                break;
-            }
-        } while (s < s_end);
-   } while (s < s_end);
+        rc = qmp_handle_received(gc, qmp, &handled);
+        if (qmp->failed)
+            return -1;
+    } while (!handled);
 
     return rc;
 }
@@ -569,6 +612,9 @@ static int qmp_send(libxl__qmp_handler *qmp,
     int rc = -1;
     GC_INIT(qmp->ctx);
 
+    if (qmp->failed)
+        goto out;
+
     buf = qmp_send_prepare(gc, qmp, cmd, args, callback, opaque, context);
 
     if (buf == NULL) {
@@ -584,35 +630,57 @@ static int qmp_send(libxl__qmp_handler *qmp,
 
     rc = qmp->last_id_used;
 out:
+    /*
+     * Commands sent earlier may still be waiting for their response, and
+     * this one may have been half written, so the connection cannot be
+     * trusted anymore.
+     */
+    if (rc < 0)
+        qmp->failed = true;
     GC_FREE;
     return rc;
 }
 
+/*
+ * Wait for the response to the command with the given id. QEMU answers
+ * commands in the order they were sent, so by the time this returns,
+ * all the commands sent before are done too. Returns -1 if any of them
+ * got an error response, but only gives up early if the connection
+ * fails, so that it stays in step for the next command.
+ */
+static int qmp_wait_for_id(libxl__gc *gc, libxl__qmp_handler *qmp, int id)
+{
+    int rc = 0;
+
+    if (qmp->failed)
+        return -1;
+
+    qmp->wait_for_id = id;
+
+    while (qmp->wait_for_id == id) {
+        if (qmp_next(gc, qmp) < 0) {
+            if (qmp->failed)
+                return -1;
+            rc = -1;
+        }
+    }
+
+    return rc;
+}
+
 static int qmp_synchronous_send(libxl__qmp_handler *qmp, const char *cmd,
                                 libxl__json_object *args,
                                 qmp_callback_t callback, void *opaque,
                                 int ask_timeout)
 {
     int id = 0;
-    int ret = 0;
+    int ret = -1;
     GC_INIT(qmp->ctx);
     qmp_request_context context = { .rc = 0 };
 
     id = qmp_send(qmp, cmd, args, callback, opaque, &context);
-    if (id <= 0) {
-        return -1;
-    }
-    qmp->wait_for_id = id;
-
-    while (qmp->wait_for_id == id) {
-        if ((ret = qmp_next(gc, qmp)) < 0) {
-            break;
-        }
-    }
-
-    if (qmp->wait_for_id != id && ret == 0) {
+    if (id > 0 && !qmp_wait_for_id(gc, qmp, id))
         ret = context.rc;
-    }
 
     GC_FREE;
 
@@ -621,6 +689,7 @@ static int qmp_synchronous_send(libxl__qmp_handler *qmp, const char *cmd,
 
 static void qmp_free_handler(libxl__qmp_handler *qmp)
 {
+    free(qmp->rx);
     free(qmp);
 }
 
@@ -684,6 +753,157 @@ static void qmp_parameters_add_integer(libxl__gc *gc,
 #define QMP_PARAMETERS_SPRINTF(args, name, format, ...) \
     qmp_parameters_add_string(gc, args, name, GCSPRINTF(format, __VA_ARGS__))
 
+/*
+ * Connections kept open for reuse
+ *
+ * Connecting to QEMU and negotiating the QMP capabilities takes longer
+ * than most commands, so instead of closing the connection to a domain's
+ * device model after use, it is kept in the ctx for the next command.
+ * QEMU only serves one client at a time on that socket though, so such
+ * a connection is only kept if the application runs libxl's event loop
+ * (with the osevent hooks or libxl_osevent_beforepoll), since nothing
+ * would close it otherwise. It is then closed once it has been idle
+ * for QMP_IDLE_TIMEOUT_MS, and straight away if someone else in this ctx
+ * is connecting to QMP. Otherwise it is closed after use, as before. It
+ * is also closed when the domain is destroyed and when the ctx is freed.
+ * While cached, it is watched for hangups, and for the events QEMU sends
+ * (which are discarded).
+ *
+ * qmp_get_handler takes a connection out of the cache, so that commands
+ * can be run on it without holding the ctx lock, and qmp_put_handler
+ * gives it back.
+ */
+
+static void qmp_handler_drop(libxl__gc *gc, libxl__qmp_handler *qmp)
+{
+    LIBXL_LIST_REMOVE(qmp, entry);
+    libxl__ev_fd_deregister(gc, &qmp->efd);
+    libxl__ev_time_deregister(gc, &qmp->idle);
+    libxl__qmp_close(qmp);
+}
+
+static void qmp_handler_idle_timeout(libxl__egc *egc, libxl__ev_time *ev,
+                                     const struct timeval *requested_abs,
+                                     int rc)
+{
+    EGC_GC;
+    libxl__qmp_handler *qmp = CONTAINER_OF(ev, *qmp, idle);
+
+    LOG(DEBUG, "closing idle QMP connection to domain %"PRIu32, qmp->domid);
+    qmp_handler_drop(gc, qmp);
+}
+
+/* Returns 0 if the connection is still up, as far as we can tell */
+static int qmp_handler_check(libxl__gc *gc, libxl__qmp_handler *qmp)
+{
+    ssize_t r;
+    char c;
+
+    if (qmp->failed)
+        return -1;
+
+    r = recv(qmp->qmp_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (r > 0)
+        return 0;
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
+
+    return -1;
+}
+
+static void qmp_handler_fd_readable(libxl__egc *egc, libxl__ev_fd *ev,
+                                    int fd, short events, short revents)
+{
+    EGC_GC;
+    libxl__qmp_handler *qmp = CONTAINER_OF(ev, *qmp, efd);
+    int handled;
+
+    if (revents & (POLLERR|POLLHUP))
+        goto lost;
+
+    /* Only read what is there, a partial message is kept for later */
+    if (qmp_read(gc, qmp) < 0)
+        goto lost;
+    qmp_handle_received(gc, qmp, &handled);
+    if (qmp->failed)
+        goto lost;
+    return;
+
+ lost:
+    LOG(DEBUG, "lost QMP connection to domain %"PRIu32, qmp->domid);
+    qmp_handler_drop(gc, qmp);
+}
+
+static libxl__qmp_handler *qmp_get_handler(libxl__gc *gc, uint32_t domid)
+{
+    libxl__qmp_handler *qmp;
+
+    CTX_LOCK;
+    LIBXL_LIST_FOREACH(qmp, &CTX->qmp_handlers, entry) {
+        if (qmp->domid == domid)
+            break;
+    }
+    if (qmp) {
+        LIBXL_LIST_REMOVE(qmp, entry);
+        libxl__ev_fd_deregister(gc, &qmp->efd);
+        libxl__ev_time_deregister(gc, &qmp->idle);
+    }
+    CTX_UNLOCK;
+
+    if (qmp) {
+        if (!qmp_handler_check(gc, qmp))
+            return qmp;
+        libxl__qmp_close(qmp);
+    }
+
+    CTX_LOCK;
+    CTX->qmp_connecting++;
+    CTX_UNLOCK;
+
+    qmp = libxl__qmp_initialize(gc, domid);
+
+    CTX_LOCK;
+    CTX->qmp_connecting--;
+    CTX_UNLOCK;
+
+    return qmp;
+}
+
+static void qmp_put_handler(libxl__gc *gc, libxl__qmp_handler *qmp)
+{
+    libxl__qmp_handler *other;
+    int rc;
+
+    if (qmp->failed || !(CTX->osevent_hooks || CTX->poller_app_used)) {
+        libxl__qmp_close(qmp);
+        return;
+    }
+
+    CTX_LOCK;
+
+    LIBXL_LIST_FOREACH(other, &CTX->qmp_handlers, entry) {
+        if (other->domid == qmp->domid)
+            break;
+    }
+    if (other || CTX->qmp_connecting) {
+        libxl__qmp_close(qmp);
+        goto out;
+    }
+
+    LIBXL_LIST_INSERT_HEAD(&CTX->qmp_handlers, qmp, entry);
+    rc = libxl__ev_fd_register(gc, &qmp->efd, qmp_handler_fd_readable,
+                               qmp->qmp_fd, POLLIN);
+    if (!rc)
+        rc = libxl__ev_time_register_rel_noao(gc, &qmp->idle,
+                                              qmp_handler_idle_timeout,
+                                              QMP_IDLE_TIMEOUT_MS);
+    if (rc)
+        qmp_handler_drop(gc, qmp);
+
+ out:
+    CTX_UNLOCK;
+}
+
 /*
  * API
  */
@@ -729,10 +949,30 @@ void libxl__qmp_close(libxl__qmp_handler *qmp)
     qmp_free_handler(qmp);
 }
 
+void libxl__qmp_close_all(libxl__gc *gc)
+{
+    libxl__qmp_handler *qmp;
+
+    CTX_LOCK;
+    while ((qmp = LIBXL_LIST_FIRST(&CTX->qmp_handlers)))
+        qmp_handler_drop(gc, qmp);
+    CTX_UNLOCK;
+}
+
 void libxl__qmp_cleanup(libxl__gc *gc, uint32_t domid)
 {
+    libxl__qmp_handler *qmp;
     char *qmp_socket;
 
+    CTX_LOCK;
+    LIBXL_LIST_FOREACH(qmp, &CTX->qmp_handlers, entry) {
+        if (qmp->domid == domid) {
+            qmp_handler_drop(gc, qmp);
+            break;
+        }
+    }
+    CTX_UNLOCK;
+
     qmp_socket = GCSPRINTF("%s/qmp-libxl-%d", libxl__run_dir_path(), domid);
     if (unlink(qmp_socket) == -1) {
         if (errno != ENOENT) {
@@ -755,13 +995,6 @@ int libxl__qmp_query_serial(libxl__qmp_handler *qmp)
                                 NULL, qmp->timeout);
 }
 
-static int qmp_query_vnc(libxl__qmp_handler *qmp)
-{
-    return qmp_synchronous_send(qmp, "query-vnc", NULL,
-                                qmp_register_vnc_callback,
-                                NULL, qmp->timeout);
-}
-
 static int pci_add_callback(libxl__qmp_handler *qmp,
                             const libxl__json_object *response, void *opaque)
 {
@@ -817,13 +1050,13 @@ static int qmp_run_command(libxl__gc *gc, int domid,
     libxl__qmp_handler *qmp = NULL;
     int rc = 0;
 
-    qmp = libxl__qmp_initialize(gc, domid);
+    qmp = qmp_get_handler(gc, domid);
     if (!qmp)
         return ERROR_FAIL;
 
     rc = qmp_synchronous_send(qmp, cmd, args, callback, opaque, qmp->timeout);
 
-    libxl__qmp_close(qmp);
+    qmp_put_handler(gc, qmp);
     return rc;
 }
 
@@ -834,14 +1067,8 @@ int libxl__qmp_pci_add(libxl__gc *gc, int domid, libxl_device_pci *pcidev)
     char *hostaddr = NULL;
     int rc = 0;
 
-    qmp = libxl__qmp_initialize(gc, domid);
-    if (!qmp)
-        return -1;
-
     hostaddr = GCSPRINTF("%04x:%02x:%02x.%01x", pcidev->domain,
                          pcidev->bus, pcidev->dev, pcidev->func);
-    if (!hostaddr)
-        return -1;
 
     qmp_parameters_add_string(gc, &args, "driver", "xen-pci-passthrough");
     QMP_PARAMETERS_SPRINTF(&args, "id", PCI_PT_QDEV_ID,
@@ -864,6 +1091,10 @@ int libxl__qmp_pci_add(libxl__gc *gc, int domid, libxl_device_pci *pcidev)
     if (pcidev->permissive)
         qmp_parameters_add_bool(gc, &args, "permissive", true);
 
+    qmp = qmp_get_handler(gc, domid);
+    if (!qmp)
+        return -1;
+
     rc = qmp_synchronous_send(qmp, "device_add", args,
                               NULL, NULL, qmp->timeout);
     if (rc == 0) {
@@ -871,7 +1102,7 @@ int libxl__qmp_pci_add(libxl__gc *gc, int domid, libxl_device_pci *pcidev)
                                   pci_add_callback, pcidev, qmp->timeout);
     }
 
-    libxl__qmp_close(qmp);
+    qmp_put_handler(gc, qmp);
     return rc;
 }
 
@@ -916,24 +1147,6 @@ int libxl__qmp_restore(libxl__gc *gc, int domid, const char *state_file)
                            NULL, NULL);
 }
 
-static int qmp_change(libxl__gc *gc, libxl__qmp_handler *qmp,
-                      char *device, char *target, char *arg)
-{
-    libxl__json_object *args = NULL;
-    int rc = 0;
-
-    qmp_parameters_add_string(gc, &args, "device", device);
-    qmp_parameters_add_string(gc, &args, "target", target);
-    if (arg) {
-        qmp_parameters_add_string(gc, &args, "arg", arg);
-    }
-
-    rc = qmp_synchronous_send(qmp, "change", args,
-                              NULL, NULL, qmp->timeout);
-
-    return rc;
-}
-
 int libxl__qmp_stop(libxl__gc *gc, int domid)
 {
     return qmp_run_command(gc, domid, "stop", NULL, NULL, NULL);
@@ -1080,20 +1293,40 @@ int libxl__qmp_initializations(libxl__gc *gc, uint32_t domid,
 {
     const libxl_vnc_info *vnc = libxl__dm_vnc(guest_config);
     libxl__qmp_handler *qmp = NULL;
-    int ret = 0;
+    qmp_request_context serial = { .rc = 0 }, vnc_info = { .rc = 0 };
+    int id, ret = -1;
 
-    qmp = libxl__qmp_initialize(gc, domid);
+    qmp = qmp_get_handler(gc, domid);
     if (!qmp)
         return -1;
-    ret = libxl__qmp_query_serial(qmp);
-    if (!ret && vnc && vnc->passwd) {
-        ret = qmp_change(gc, qmp, "vnc", "password", vnc->passwd);
-        qmp_write_domain_console_item(gc, domid, "vnc-pass", vnc->passwd);
+
+    /*
+     * None of these commands depends on the outcome of the others, so
+     * send them all before waiting for the responses.
+     */
+    qmp_send(qmp, "query-chardev", NULL,
+             register_serials_chardev_callback, NULL, &serial);
+    if (vnc && vnc->passwd) {
+        libxl__json_object *args = NULL;
+
+        qmp_parameters_add_string(gc, &args, "device", "vnc");
+        qmp_parameters_add_string(gc, &args, "target", "password");
+        qmp_parameters_add_string(gc, &args, "arg", vnc->passwd);
+        qmp_send(qmp, "change", args, NULL, NULL, NULL);
     }
-    if (!ret) {
-        ret = qmp_query_vnc(qmp);
+    id = qmp_send(qmp, "query-vnc", NULL,
+                  qmp_register_vnc_callback, NULL, &vnc_info);
+
+    /* Fails if any of them got an error response */
+    if (!qmp_wait_for_id(gc, qmp, id)) {
+        ret = serial.rc;
+        if (!ret && vnc && vnc->passwd)
+            qmp_write_domain_console_item(gc, domid, "vnc-pass", vnc->passwd);
+        if (!ret)
+            ret = vnc_info.rc;
     }
-    libxl__qmp_close(qmp);
+
+    qmp_put_handler(gc, qmp);
     return ret;
 }
 
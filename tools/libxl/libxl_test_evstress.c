@@ -0,0 +1,138 @@
+/*
+ * evstress test case for the libxl event system
+ *
+ * To run this test:
+ *    ./test_evstress [NFDS [NTIMEOUTS]]
+ * Success:
+ *    program prints how long the operation took and exits 0
+ * Failure:
+ *    crash
+ *
+ * make NFDS pipes and register an ev_fd on the reading end of each
+ * register NTIMEOUTS timeouts at various times up to 1s from now
+ * each timeout writes one byte to each of its share of the pipes
+ * each ev_fd reads its byte and deregisters itself
+ * when every ev_fd and timeout has occurred exactly once, complete
+ *
+ * With thousands of fds registered but only a few ready at a time,
+ * the run time shows the per-iteration cost of the event loop.
+ */
+
+#include "libxl_internal.h"
+
+#include "libxl_test_evstress.h"
+
+typedef struct {
+    libxl__ev_fd efd;
+    int pipe[2];
+    bool occurred;
+} evstress_fd;
+
+typedef struct {
+    libxl__ev_time etime;
+    int first, nfds; /* the pipes this timeout writes to */
+} evstress_timeout;
+
+static libxl__ao *sao;
+static evstress_fd *sfds;
+static evstress_timeout *stimes;
+static int snfds, sntimes, outstanding;
+
+static void evstress_occurred(libxl__egc *egc)
+{
+    int i;
+
+    assert(outstanding > 0);
+    if (--outstanding)
+        return;
+
+    for (i = 0; i < snfds; i++) {
+        assert(sfds[i].occurred);
+        assert(!libxl__ev_fd_isregistered(&sfds[i].efd));
+        libxl__pipe_close(sfds[i].pipe);
+    }
+    for (i = 0; i < sntimes; i++)
+        assert(!libxl__ev_time_isregistered(&stimes[i].etime));
+
+    free(sfds);
+    free(stimes);
+    libxl__ao_complete(egc, sao, 0);
+}
+
+static void fd_occurs(libxl__egc *egc, libxl__ev_fd *ev,
+                      int fd, short events, short revents)
+{
+    EGC_GC;
+    evstress_fd *sfd = CONTAINER_OF(ev, *sfd, efd);
+    char c;
+    ssize_t r;
+
+    assert(revents & POLLIN);
+    assert(!sfd->occurred);
+
+    r = read(fd, &c, 1);
+    assert(r == 1);
+
+    sfd->occurred = 1;
+    libxl__ev_fd_deregister(gc, ev);
+    evstress_occurred(egc);
+}
+
+static void timeout_occurs(libxl__egc *egc, libxl__ev_time *ev,
+                           const struct timeval *requested_abs, int rc)
+{
+    evstress_timeout *st = CONTAINER_OF(ev, *st, etime);
+    ssize_t r;
+    int i;
+
+    assert(rc == ERROR_TIMEDOUT);
+
+    for (i = st->first; i < st->first + st->nfds; i++) {
+        r = write(sfds[i].pipe[1], "x", 1);
+        assert(r == 1);
+    }
+    evstress_occurred(egc);
+}
+
+int libxl_test_evstress(libxl_ctx *ctx, int nfds, int ntimeouts,
+                        libxl_asyncop_how *ao_how)
+{
+    int i, rc;
+    AO_CREATE(ctx, 0, ao_how);
+
+    assert(nfds >= 0);
+    assert(ntimeouts > 0);
+
+    sao = ao;
+    snfds = nfds;
+    sntimes = ntimeouts;
+    outstanding = nfds + ntimeouts;
+    sfds = libxl__calloc(NOGC, nfds ? nfds : 1, sizeof(*sfds));
+    stimes = libxl__calloc(NOGC, ntimeouts, sizeof(*stimes));
+
+    for (i = 0; i < nfds; i++) {
+        libxl__ev_fd_init(&sfds[i].efd);
+        rc = libxl__pipe_nonblock(CTX, sfds[i].pipe);
+        assert(!rc);
+        rc = libxl__ev_fd_register(gc, &sfds[i].efd, fd_occurs,
+                                   sfds[i].pipe[0], POLLIN);
+        assert(!rc);
+    }
+
+    for (i = 0; i < ntimeouts; i++) {
+        evstress_timeout *st = &stimes[i];
+
+        libxl__ev_time_init(&st->etime);
+        st->first = (long long)i * nfds / ntimeouts;
+        st->nfds = (long long)(i + 1) * nfds / ntimeouts - st->first;
+        /* not registered in deadline order */
+        rc = libxl__ev_time_register_rel(ao, &st->etime, timeout_occurs,
+                                         1 + (i * 997) % 1000);
+        assert(!rc);
+    }
+
+    LOG(DEBUG, "evstress: %d fds and %d timeouts registered",
+        nfds, ntimeouts);
+
+    return AO_INPROGRESS;
+}
@@ -0,0 +1,15 @@
+#ifndef TEST_EVSTRESS_H
+#define TEST_EVSTRESS_H
+
+#include <pthread.h>
+
+int libxl_test_evstress(libxl_ctx *ctx, int nfds, int ntimeouts,
+                        libxl_asyncop_how *ao_how)
+                        LIBXL_EXTERNAL_CALLERS_ONLY;
+/* This operation makes nfds pipes, watches the reading end of each,
+ * and sets up ntimeouts (at least 1) timeouts spread over about a
+ * second.  Each timeout writes to its share of the pipes.  It
+ * completes successfully once every fd and timeout has occurred
+ * exactly once. */
+
+#endif /*TEST_EVSTRESS_H*/
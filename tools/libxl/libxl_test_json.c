@@ -0,0 +1,84 @@
+/*
+ * json test case for the JSON parser
+ *
+ * To run this test:
+ *    ./test_json [nr_domains [iterations]]
+ * Success:
+ *    program exits 0
+ * Failure:
+ *    crash
+ *
+ * builds the configurations of many made up domains into one document,
+ * like xl list -l prints, and parses it back repeatedly
+ * checks the configurations survive the round trip
+ * checks the parse tree is not allocated node by node from the gc
+ * reports the time and the number of gc allocations a parse takes
+ */
+
+#include "libxl_internal.h"
+
+#include "libxl_test_json.h"
+
+static int count_nodes(const libxl__json_object *o)
+{
+    const libxl__json_object *e;
+    const libxl__json_map_node *node;
+    flexarray_t *maps;
+    int i, n = 1;
+
+    if (libxl__json_object_is_array(o)) {
+        for (i = 0; (e = libxl__json_array_get(o, i)); i++)
+            n += count_nodes(e);
+    } else if (libxl__json_object_is_map(o)) {
+        maps = libxl__json_object_get_map(o);
+        for (i = 0; i < maps->count; i++) {
+            if (flexarray_get(maps, i, (void**)&node) != 0)
+                break;
+            if (node->obj)
+                n += count_nodes(node->obj);
+        }
+    }
+
+    return n;
+}
+
+static int count_gc_allocs(libxl__gc *gc)
+{
+    int i, n = 0;
+
+    for (i = 0; i < gc->alloc_maxsize; i++)
+        if (gc->alloc_ptrs[i])
+            n++;
+
+    return n;
+}
+
+int libxl_test_json_parse(libxl_ctx *ctx, const char *json,
+                          int *nodes_r, int *gc_allocs_r)
+{
+    GC_INIT(ctx);
+    libxl__json_object *tree;
+    const libxl__json_object *o;
+    libxl_domain_config d_config;
+    int i, rc, nr = -1;
+
+    tree = libxl__json_parse(gc, json);
+    if (!tree || !libxl__json_object_is_array(tree))
+        goto out;
+
+    *gc_allocs_r = count_gc_allocs(gc);
+    *nodes_r = count_nodes(tree);
+
+    for (i = 0; (o = libxl__json_array_get(tree, i)); i++) {
+        libxl_domain_config_init(&d_config);
+        rc = libxl__domain_config_parse_json(gc, o, &d_config);
+        libxl_domain_config_dispose(&d_config);
+        if (rc)
+            goto out;
+    }
+    nr = i;
+
+out:
+    GC_FREE;
+    return nr;
+}
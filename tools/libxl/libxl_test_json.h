@@ -0,0 +1,16 @@
+#ifndef TEST_JSON_H
+#define TEST_JSON_H
+
+#include "libxl.h"
+
+int libxl_test_json_parse(libxl_ctx *ctx, const char *json,
+                          int *nodes_r, int *gc_allocs_r)
+                          LIBXL_EXTERNAL_CALLERS_ONLY;
+/* Parses json, which must be an array of domain configurations, the
+ * way libxl parses stored configurations, and each element of it into
+ * a libxl_domain_config.  Returns the number of configurations, or -1
+ * on error.  *nodes_r is set to the number of nodes in the parse tree
+ * and *gc_allocs_r to the number of allocations building it registered
+ * with the gc. */
+
+#endif /*TEST_JSON_H*/
@@ -0,0 +1,72 @@
+/*
+ * numa test case for the NUMA placement search
+ *
+ * To run this test:
+ *    ./test_numa
+ * Success:
+ *    program prints how long the searches took and exits 0
+ * Failure:
+ *    crash
+ *
+ * Runs libxl__numa_candidate_search on a number of synthetic
+ * topologies, both exhaustively and greedily, and checks the
+ * candidates it comes up with.
+ */
+
+#include "libxl_internal.h"
+
+#include "libxl_test_numa.h"
+
+/* Same as numa_cmpf in libxl_dom.c */
+static int test_numa_cmpf(const libxl__numa_candidate *c1,
+                          const libxl__numa_candidate *c2)
+{
+    if (c1->nr_vcpus != c2->nr_vcpus)
+        return c1->nr_vcpus - c2->nr_vcpus;
+
+    return c2->free_memkb - c1->free_memkb;
+}
+
+int libxl_test_numa_placement(libxl_ctx *ctx, int nr_nodes,
+                              const libxl_test_numa_node *nodes,
+                              const uint32_t *dists,
+                              uint32_t min_free_memkb, int min_cpus,
+                              bool greedy,
+                              libxl_bitmap *nodemap_r)
+{
+    GC_INIT(ctx);
+    libxl__numa_node_load *loads;
+    libxl__numa_candidate cndt;
+    unsigned long max_combinations;
+    int i, found, rc;
+
+    libxl__numa_candidate_init(&cndt);
+
+    GCNEW_ARRAY(loads, nr_nodes);
+    for (i = 0; i < nr_nodes; i++) {
+        loads[i].nr_cpus = nodes[i].nr_cpus;
+        loads[i].nr_vcpus = nodes[i].nr_vcpus;
+        loads[i].free_memkb = nodes[i].free_memkb;
+    }
+
+    max_combinations = greedy ? 0 : LIBXL__NUMA_MAX_COMBINATIONS;
+    rc = libxl__numa_candidate_search(gc, nr_nodes, loads, dists,
+                                      min_free_memkb, min_cpus, 0, 0,
+                                      max_combinations, test_numa_cmpf,
+                                      &cndt, &found);
+    if (rc)
+        goto out;
+
+    libxl_bitmap_set_none(nodemap_r);
+    if (!found)
+        goto out;
+
+    libxl_for_each_set_bit(i, cndt.nodemap)
+        libxl_bitmap_set(nodemap_r, i);
+    rc = cndt.nr_nodes;
+
+ out:
+    libxl__numa_candidate_dispose(&cndt);
+    GC_FREE;
+    return rc;
+}
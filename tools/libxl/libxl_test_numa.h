@@ -0,0 +1,29 @@
+#ifndef TEST_NUMA_H
+#define TEST_NUMA_H
+
+#include <stdbool.h>
+
+#include "libxl.h"
+
+typedef struct {
+    int nr_cpus;
+    int nr_vcpus;
+    uint32_t free_memkb;
+} libxl_test_numa_node;
+
+int libxl_test_numa_placement(libxl_ctx *ctx, int nr_nodes,
+                              const libxl_test_numa_node *nodes,
+                              const uint32_t *dists,
+                              uint32_t min_free_memkb, int min_cpus,
+                              bool greedy,
+                              libxl_bitmap *nodemap_r)
+                              LIBXL_EXTERNAL_CALLERS_ONLY;
+/* This runs the NUMA placement search on the synthetic topology
+ * described by nodes[] and (if not NULL) the nr_nodes x nr_nodes
+ * distance matrix dists, ranking candidates the same way domain
+ * creation does.  If greedy is set, the greedy search is used even
+ * where the exhaustive one would be.  Returns the number of nodes of the chosen
+ * candidate, whose nodes are set in nodemap_r (which the caller must
+ * have allocated), 0 if there is none, or a libxl error code. */
+
+#endif /*TEST_NUMA_H*/
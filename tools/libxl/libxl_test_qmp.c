@@ -0,0 +1,43 @@
+/*
+ * qmp test case for the QMP client
+ *
+ * To run this test:
+ *    ./test_qmp
+ * Success:
+ *    program exits 0
+ * Failure:
+ *    crash
+ *
+ * starts a fake QEMU listening on the QMP socket of a made up domain
+ * checks connections are not kept while the event loop is not used
+ * runs many commands and checks they all went over a single connection
+ * runs the event loop until that connection is closed for being idle
+ * runs another command and checks it made a new connection
+ */
+
+#include "libxl_internal.h"
+
+#include "libxl_test_qmp.h"
+
+char *libxl_test_qmp_socket_path(libxl_ctx *ctx, uint32_t domid)
+{
+    GC_INIT(ctx);
+    char *path;
+
+    path = libxl__strdup(NOGC, GCSPRINTF("%s/qmp-libxl-%"PRIu32,
+                                         libxl__run_dir_path(), domid));
+    GC_FREE;
+    return path;
+}
+
+int libxl_test_qmp_commands(libxl_ctx *ctx, uint32_t domid, int nr_cmds)
+{
+    GC_INIT(ctx);
+    int i, rc = 0;
+
+    for (i = 0; i < nr_cmds && !rc; i++)
+        rc = libxl__qmp_resume(gc, domid);
+
+    GC_FREE;
+    return rc;
+}
@@ -0,0 +1,17 @@
+#ifndef TEST_QMP_H
+#define TEST_QMP_H
+
+#include "libxl.h"
+
+char *libxl_test_qmp_socket_path(libxl_ctx *ctx, uint32_t domid)
+                                 LIBXL_EXTERNAL_CALLERS_ONLY;
+/* Returns (in malloc'd memory) the path of the QMP socket libxl
+ * connects to for domid's device model. */
+
+int libxl_test_qmp_commands(libxl_ctx *ctx, uint32_t domid, int nr_cmds)
+                            LIBXL_EXTERNAL_CALLERS_ONLY;
+/* Sends nr_cmds "cont" commands to domid's device model, one after
+ * the other, the way libxl's internal callers do.  Returns 0 if they
+ * all succeeded. */
+
+#endif /*TEST_QMP_H*/
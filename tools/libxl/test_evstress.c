@@ -0,0 +1,39 @@
+#include <sys/resource.h>
+
+#include "test_common.h"
+#include "libxl_test_evstress.h"
+
+int main(int argc, char **argv) {
+    int rc, r, nfds = 4000, ntimeouts = 1000;
+    struct rlimit rl;
+    struct timeval start, end, elapsed;
+
+    if (argc > 1) nfds = atoi(argv[1]);
+    if (argc > 2) ntimeouts = atoi(argv[2]);
+    assert(nfds >= 0 && ntimeouts > 0);
+
+    /* two fds per pipe, plus some for libxl itself */
+    r = getrlimit(RLIMIT_NOFILE, &rl);  assert(!r);
+    if (rl.rlim_cur < nfds * 2 + 100) {
+        rl.rlim_cur = nfds * 2 + 100;
+        if (rl.rlim_max < rl.rlim_cur)
+            rl.rlim_max = rl.rlim_cur;
+        r = setrlimit(RLIMIT_NOFILE, &rl);
+        if (r) {
+            perror("setrlimit RLIMIT_NOFILE");
+            exit(1);
+        }
+    }
+
+    test_common_setup(XTL_DEBUG);
+
+    r = gettimeofday(&start, 0);  assert(!r);
+    rc = libxl_test_evstress(ctx, nfds, ntimeouts, 0);
+    assert(!rc);
+    r = gettimeofday(&end, 0);  assert(!r);
+
+    timersub(&end, &start, &elapsed);
+    fprintf(stderr, "%d fds, %d timeouts: %ld.%06lds\n", nfds, ntimeouts,
+            (long)elapsed.tv_sec, (long)elapsed.tv_usec);
+    return 0;
+}
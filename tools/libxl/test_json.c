@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "test_common.h"
+#include "libxl_test_json.h"
+
+#define NR_DISKS 4
+#define NR_NICS  2
+
+static char *domain_json(int n)
+{
+    libxl_domain_config d_config, back;
+    libxl_device_disk *disk;
+    libxl_device_nic *nic;
+    char *json, *json_back, buf[64];
+    int i;
+
+    libxl_domain_config_init(&d_config);
+    d_config.c_info.type = LIBXL_DOMAIN_TYPE_PV;
+    snprintf(buf, sizeof(buf), "guest%d", n);
+    d_config.c_info.name = strdup(buf);
+    libxl_uuid_generate(&d_config.c_info.uuid);
+
+    libxl_domain_build_info_init_type(&d_config.b_info,
+                                      LIBXL_DOMAIN_TYPE_PV);
+    d_config.b_info.max_vcpus = 4;
+    d_config.b_info.max_memkb = d_config.b_info.target_memkb = 1 << 20;
+    d_config.b_info.cmdline = strdup("root=/dev/xvda1 ro console=hvc0");
+
+    d_config.disks = calloc(NR_DISKS, sizeof(*d_config.disks));
+    assert(d_config.disks);
+    for (i = 0; i < NR_DISKS; i++) {
+        disk = &d_config.disks[d_config.num_disks++];
+        libxl_device_disk_init(disk);
+        snprintf(buf, sizeof(buf), "/var/lib/xen/images/guest%d-%d.img",
+                 n, i);
+        disk->pdev_path = strdup(buf);
+        snprintf(buf, sizeof(buf), "xvd%c", 'a' + i);
+        disk->vdev = strdup(buf);
+        disk->format = LIBXL_DISK_FORMAT_RAW;
+        disk->readwrite = 1;
+    }
+
+    d_config.nics = calloc(NR_NICS, sizeof(*d_config.nics));
+    assert(d_config.nics);
+    for (i = 0; i < NR_NICS; i++) {
+        nic = &d_config.nics[d_config.num_nics++];
+        libxl_device_nic_init(nic);
+        nic->devid = i;
+        nic->bridge = strdup("xenbr0");
+        nic->mac[0] = 0x00; nic->mac[1] = 0x16; nic->mac[2] = 0x3e;
+        nic->mac[3] = n >> 8; nic->mac[4] = n; nic->mac[5] = i;
+    }
+
+    json = libxl_domain_config_to_json(ctx, &d_config);
+    assert(json);
+
+    /* The configuration must survive the round trip */
+    libxl_domain_config_init(&back);
+    assert(!libxl_domain_config_from_json(ctx, &back, json));
+    json_back = libxl_domain_config_to_json(ctx, &back);
+    assert(json_back && !strcmp(json, json_back));
+
+    free(json_back);
+    libxl_domain_config_dispose(&back);
+    libxl_domain_config_dispose(&d_config);
+
+    return json;
+}
+
+static double now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int main(int argc, char **argv)
+{
+    int nr_domains = argc > 1 ? atoi(argv[1]) : 500;
+    int iterations = argc > 2 ? atoi(argv[2]) : 20;
+    int i, nodes = 0, gc_allocs = 0;
+    size_t len = 0, used = 0;
+    char *doc = NULL, *json;
+    double start, us;
+
+    test_common_setup(XTL_DEBUG);
+
+    assert(nr_domains > 0 && iterations > 0);
+
+    for (i = 0; i < nr_domains; i++) {
+        json = domain_json(i);
+        len += strlen(json) + 2;
+        doc = realloc(doc, len + 2);
+        assert(doc);
+        used += sprintf(doc + used, "%c%s", i ? ',' : '[', json);
+        free(json);
+    }
+    strcpy(doc + used, "]");
+
+    start = now_us();
+    for (i = 0; i < iterations; i++)
+        assert(libxl_test_json_parse(ctx, doc, &nodes, &gc_allocs)
+               == nr_domains);
+    us = (now_us() - start) / iterations;
+
+    printf("%d domains, %zu bytes, %d nodes: %.0f us per parse,"
+           " %d gc allocations\n",
+           nr_domains, strlen(doc), nodes, us, gc_allocs);
+
+    /* The tree must come out of a handful of chunks, not one per node */
+    assert(gc_allocs * 100 < nodes);
+
+    free(doc);
+    return 0;
+}
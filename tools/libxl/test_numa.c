@@ -0,0 +1,114 @@
+#include "test_common.h"
+#include "libxl_utils.h"
+#include "libxl_test_numa.h"
+
+#define GB (1024 * 1024)
+
+static libxl_bitmap nodemap;
+
+static int place(int nr_nodes, const libxl_test_numa_node *nodes,
+                 const uint32_t *dists, uint32_t memkb, int cpus,
+                 bool greedy)
+{
+    int rc = libxl_test_numa_placement(ctx, nr_nodes, nodes, dists,
+                                       memkb, cpus, greedy,
+                                       &nodemap);
+    assert(rc >= 0);
+    return rc;
+}
+
+/* Two sockets of four nodes each */
+static void test_sockets(void)
+{
+    libxl_test_numa_node nodes[8];
+    uint32_t dists[8 * 8];
+    int i, j, n;
+
+    for (i = 0; i < 8; i++) {
+        nodes[i].nr_cpus = 4;
+        nodes[i].nr_vcpus = 4;
+        nodes[i].free_memkb = 1 * GB;
+        for (j = 0; j < 8; j++)
+            dists[i * 8 + j] = i == j ? 10 : i / 4 == j / 4 ? 16 : 32;
+    }
+    nodes[0].nr_vcpus = 2;
+    nodes[4].nr_vcpus = 0;
+
+    /* The exhaustive search only looks at the load... */
+    n = place(8, nodes, dists, 5 * GB / 2, 1, false);
+    assert(n == 3);
+    assert(libxl_bitmap_test(&nodemap, 0) && libxl_bitmap_test(&nodemap, 4));
+
+    /* ... while the greedy one keeps the domain within a socket. */
+    n = place(8, nodes, dists, 5 * GB / 2, 1, true);
+    assert(n == 3);
+    for (i = 4; i < 7; i++)
+        assert(libxl_bitmap_test(&nodemap, i));
+}
+
+int main(int argc, char **argv) {
+    libxl_test_numa_node nodes[64];
+    uint32_t dists[64 * 64];
+    struct timeval start, end, elapsed;
+    int i, j, n, r, rc;
+
+    test_common_setup(XTL_DEBUG);
+
+    rc = libxl_node_bitmap_alloc(ctx, &nodemap, 64);
+    assert(!rc);
+
+    /* The least loaded node which is big enough wins */
+    for (i = 0; i < 4; i++) {
+        nodes[i].nr_cpus = 4;
+        nodes[i].free_memkb = 2 * GB;
+    }
+    nodes[0].nr_vcpus = 5;
+    nodes[1].nr_vcpus = 1;
+    nodes[2].nr_vcpus = 3;
+    nodes[3].nr_vcpus = 2;
+    nodes[3].free_memkb = 1 * GB;
+
+    n = place(4, nodes, NULL, 3 * GB / 2, 4, false);
+    assert(n == 1 && libxl_bitmap_test(&nodemap, 1));
+
+    /* Spanning nodes, both searches agree when all nodes are equidistant */
+    nodes[3].free_memkb = 2 * GB;
+    n = place(4, nodes, NULL, 3 * GB, 4, false);
+    assert(n == 2);
+    assert(libxl_bitmap_test(&nodemap, 1) && libxl_bitmap_test(&nodemap, 3));
+    n = place(4, nodes, NULL, 3 * GB, 4, true);
+    assert(n == 2);
+    assert(libxl_bitmap_test(&nodemap, 1) && libxl_bitmap_test(&nodemap, 3));
+
+    /* Nodes with no suitable cpus are never picked */
+    nodes[1].nr_cpus = 0;
+    n = place(4, nodes, NULL, 1 * GB, 1, false);
+    assert(n == 1 && libxl_bitmap_test(&nodemap, 3));
+
+    /* Not enough memory anywhere */
+    n = place(4, nodes, NULL, 16 * GB, 1, false);
+    assert(n == 0);
+
+    test_sockets();
+
+    /* A big host: 16 sockets of 4 nodes each, unevenly loaded */
+    for (i = 0; i < 64; i++) {
+        nodes[i].nr_cpus = 8;
+        nodes[i].nr_vcpus = (i * 7) % 13;
+        nodes[i].free_memkb = (1 + i % 3) * GB;
+        for (j = 0; j < 64; j++)
+            dists[i * 64 + j] = i == j ? 10 : i / 4 == j / 4 ? 16 : 32;
+    }
+
+    r = gettimeofday(&start, 0);  assert(!r);
+    n = place(64, nodes, dists, 40 * GB, 128, false);
+    r = gettimeofday(&end, 0);  assert(!r);
+    assert(n >= 16 && n < 64);
+
+    timersub(&end, &start, &elapsed);
+    fprintf(stderr, "64 nodes, %d picked: %ld.%06lds\n", n,
+            (long)elapsed.tv_sec, (long)elapsed.tv_usec);
+
+    libxl_bitmap_dispose(&nodemap);
+    return 0;
+}
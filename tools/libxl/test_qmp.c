@@ -0,0 +1,118 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "test_common.h"
+#include "libxl_test_qmp.h"
+
+#define DOMID 32000
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int nr_connections, nr_disconnections, nr_commands;
+static int listen_fd;
+
+static int counter(int *c)
+{
+    int r;
+
+    pthread_mutex_lock(&lock);
+    r = *c;
+    pthread_mutex_unlock(&lock);
+    return r;
+}
+
+static void count(int *c)
+{
+    pthread_mutex_lock(&lock);
+    (*c)++;
+    pthread_mutex_unlock(&lock);
+}
+
+/* Answers every command with an empty return, and sends events */
+static void *fake_qemu(void *unused)
+{
+    for (;;) {
+        char *line = NULL, *id;
+        size_t len = 0;
+        FILE *f;
+        int fd;
+
+        fd = accept(listen_fd, NULL, NULL);
+        assert(fd >= 0);
+        count(&nr_connections);
+
+        f = fdopen(fd, "r");
+        assert(f);
+        dprintf(fd, "{\"QMP\": {\"version\": {\"qemu\": {\"micro\": 0,"
+                " \"minor\": 6, \"major\": 2}, \"package\": \"\"},"
+                " \"capabilities\": []}}\r\n");
+
+        while (getline(&line, &len, f) > 0) {
+            count(&nr_commands);
+            id = strstr(line, "\"id\":");
+            assert(id);
+            if (counter(&nr_commands) % 10 == 0)
+                dprintf(fd, "{\"timestamp\": {\"seconds\": 0,"
+                        " \"microseconds\": 0}, \"event\": \"RESUME\"}\r\n");
+            dprintf(fd, "{\"return\": {}, \"id\": %d}\r\n",
+                    atoi(id + strlen("\"id\":")));
+        }
+
+        free(line);
+        fclose(f);
+        count(&nr_disconnections);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    struct sockaddr_un addr;
+    pthread_t thread;
+    char *path;
+    int rc, r;
+
+    test_common_setup(XTL_DEBUG);
+
+    path = libxl_test_qmp_socket_path(ctx, DOMID);
+    assert(path && strlen(path) < sizeof(addr.sun_path));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);  assert(listen_fd >= 0);
+    r = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));  assert(!r);
+    r = listen(listen_fd, 1);  assert(!r);
+    r = pthread_create(&thread, NULL, fake_qemu, NULL);  assert(!r);
+
+    /* Without an event loop, nothing would close it, so none is kept */
+    rc = libxl_test_qmp_commands(ctx, DOMID, 2);
+    assert(!rc);
+    assert(counter(&nr_connections) == 2);
+
+    /* With one, all the commands share one connection */
+    test_common_beforepoll();
+    rc = libxl_test_qmp_commands(ctx, DOMID, 100);
+    assert(!rc);
+    assert(counter(&nr_connections) == 3);
+    assert(counter(&nr_commands) == 2 * 2 + 1 + 100); /* qmp_capabilities */
+
+    /* Which gets closed once it has been idle for a while */
+    while (counter(&nr_disconnections) < 3) {
+        test_common_beforepoll();
+        if (poll_timeout < 0 || poll_timeout > 100)
+            poll_timeout = 100;
+        test_common_dopoll();
+        test_common_afterpoll();
+    }
+
+    rc = libxl_test_qmp_commands(ctx, DOMID, 1);
+    assert(!rc);
+    assert(counter(&nr_connections) == 4);
+
+    unlink(path);
+    return 0;
+}
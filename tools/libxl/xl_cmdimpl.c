@@ -2683,19 +2683,12 @@ static int preserve_domain(uint32_t *r_domid, libxl_event *event,
 /*
  * Returns false if memory can't be freed, but also if we encounter errors.
  * Returns true in case there is already, or we manage to free it, enough
- * memory, but also if autoballoon is false.
+ * memory.  Callers check autoballoon themselves.
  */
-static bool freemem(uint32_t domid, libxl_domain_build_info *b_info)
+static bool freemem_kb(uint32_t need_memkb)
 {
     int rc, retries = 3;
-    uint32_t need_memkb, free_memkb;
-
-    if (!autoballoon)
-        return true;
-
-    rc = libxl_domain_need_memory(ctx, b_info, &need_memkb);
-    if (rc < 0)
-        return false;
+    uint32_t free_memkb;
 
     do {
         rc = libxl_get_free_memory(ctx, &free_memkb);
@@ -2721,6 +2714,21 @@ static bool freemem(uint32_t domid, libxl_domain_build_info *b_info)
     return false;
 }
 
+static bool freemem(uint32_t domid, libxl_domain_build_info *b_info)
+{
+    int rc;
+    uint32_t need_memkb;
+
+    if (!autoballoon)
+        return true;
+
+    rc = libxl_domain_need_memory(ctx, b_info, &need_memkb);
+    if (rc < 0)
+        return false;
+
+    return freemem_kb(need_memkb);
+}
+
 static void autoconnect_console(libxl_ctx *ctx_ignored,
                                 libxl_event *ev, void *priv)
 {
@@ -5485,6 +5493,132 @@ int main_create(int argc, char **argv)
     return 0;
 }
 
+int main_create_many(int argc, char **argv)
+{
+    libxl_domain_config *d_configs;
+    libxl_domain_create_timing *timings;
+    uint32_t *domids;
+    int *rcs;
+    int paused = 0, quiet = 0;
+    int opt, i, nr_doms, rc, ret = EXIT_FAILURE;
+    static struct option opts[] = {
+        {"quiet", 0, 0, 'q'},
+        COMMON_LONG_OPTS
+    };
+
+    SWITCH_FOREACH_OPT(opt, "pq", opts, "create-many", 1) {
+    case 'p':
+        paused = 1;
+        break;
+    case 'q':
+        quiet = 1;
+        break;
+    }
+
+    nr_doms = argc - optind;
+    d_configs = xmalloc(sizeof(*d_configs) * nr_doms);
+    timings = xmalloc(sizeof(*timings) * nr_doms);
+    domids = xmalloc(sizeof(*domids) * nr_doms);
+    rcs = xmalloc(sizeof(*rcs) * nr_doms);
+
+    for (i = 0; i < nr_doms; i++) {
+        libxl_domain_config_init(&d_configs[i]);
+        libxl_domain_create_timing_init(&timings[i]);
+        domids[i] = INVALID_DOMID;
+        rcs[i] = ERROR_FAIL;
+    }
+
+    for (i = 0; i < nr_doms; i++) {
+        const char *config_file = argv[optind + i];
+        void *config_data = 0;
+        int config_len = 0;
+
+        if (libxl_read_file_contents(ctx, config_file,
+                                     &config_data, &config_len)) {
+            fprintf(stderr, "Failed to read config file: %s: %s\n",
+                    config_file, strerror(errno));
+            goto out;
+        }
+        if (!quiet)
+            fprintf(stderr, "Parsing config from %s\n", config_file);
+        parse_config_data(config_file, config_data, config_len,
+                          &d_configs[i]);
+        free(config_data);
+    }
+
+    if (dryrun_only) {
+        ret = EXIT_SUCCESS;
+        goto out;
+    }
+
+    if (acquire_lock() < 0)
+        goto out;
+
+    /* The domains are all built at once: make room for all of them */
+    if (autoballoon) {
+        uint64_t total_memkb = 0;
+        uint32_t need_memkb;
+
+        for (i = 0; i < nr_doms; i++) {
+            if (libxl_domain_need_memory(ctx, &d_configs[i].b_info,
+                                         &need_memkb) < 0) {
+                fprintf(stderr, "failed to compute memory needed by "
+                        "domain %s\n", d_configs[i].c_info.name);
+                release_lock();
+                goto out;
+            }
+            total_memkb += need_memkb;
+        }
+
+        if (total_memkb > UINT32_MAX || !freemem_kb(total_memkb)) {
+            fprintf(stderr, "failed to free memory for %d domains "
+                    "(%"PRIu64" KiB)\n", nr_doms, total_memkb);
+            release_lock();
+            goto out;
+        }
+    }
+
+    rc = libxl_domain_create_new_many(ctx, nr_doms, d_configs, domids,
+                                      rcs, timings, 0);
+    release_lock();
+
+    if (!quiet)
+        printf("%-32s %5s %8s %8s %8s %8s %8s %8s\n", "Name", "ID",
+               "make", "build", "disks", "devmodel", "devices", "total");
+    for (i = 0; i < nr_doms; i++) {
+        const libxl_domain_create_timing *t = &timings[i];
+
+        if (rcs[i]) {
+            fprintf(stderr, "Failed to create domain %s (rc=%d)\n",
+                    d_configs[i].c_info.name, rcs[i]);
+            continue;
+        }
+        if (!paused)
+            libxl_domain_unpause(ctx, domids[i]);
+        if (quiet)
+            continue;
+        /* times are reported in milliseconds */
+        printf("%-32s %5u %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f\n",
+               d_configs[i].c_info.name, domids[i],
+               t->make_us / 1000.0, t->build_us / 1000.0,
+               t->disks_us / 1000.0, t->devmodel_us / 1000.0,
+               t->devices_us / 1000.0, t->total_us / 1000.0);
+    }
+
+    ret = rc ? EXIT_FAILURE : EXIT_SUCCESS;
+
+ out:
+    for (i = 0; i < nr_doms; i++) {
+        libxl_domain_config_dispose(&d_configs[i]);
+        libxl_domain_create_timing_dispose(&timings[i]);
+    }
+    free(d_configs);
+    free(timings);
+    free(domids);
+    free(rcs);
+    return ret;
+}
+
 int main_config_update(int argc, char **argv)
 {
     uint32_t domid;
@@ -36,6 +36,14 @@ struct cmd_spec cmd_table[] = {
       "-A, --vncviewer-autopass\n"
       "                        Pass VNC password to viewer via stdin."
     },
+    { "create-many",
+      &main_create_many, 1, 1,
+      "Create several domains concurrently from config files",
+      "[options] <ConfigFile>...",
+      "-h                      Print this help.\n"
+      "-p                      Leave the domains paused after they are created.\n"
+      "-q, --quiet             Quiet, do not report per-phase timings."
+    },
     { "config-update",
       &main_config_update, 1, 1,
       "Update a running domain's saved configuration, used when rebuilding "
@@ -24,6 +24,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <sys/time.h>
 
 #include "xenstat_priv.h"
 
@@ -61,6 +62,14 @@ static void xenstat_free_vbds(xenstat_node * node);
 static void xenstat_uninit_vcpus(xenstat_handle * handle);
 static void xenstat_uninit_xen_version(xenstat_handle * handle);
 static char *xenstat_get_domain_name(xenstat_handle * handle, unsigned int domain_id);
+static char *xenstat_get_domain_name_cached(xenstat_handle * handle,
+					    xc_domaininfo_t *info,
+					    unsigned int *old,
+					    struct xenstat_name *entry);
+static void xenstat_update_names(xenstat_handle * handle);
+static void xenstat_replace_names(xenstat_handle * handle,
+				  struct xenstat_name *names,
+				  unsigned int num_names);
 static void xenstat_prune_domain(xenstat_node *node, unsigned int entry);
 
 static xenstat_collector collectors[] = {
@@ -76,6 +85,14 @@ static xenstat_collector collectors[] = {
 
 #define NUM_COLLECTORS (sizeof(collectors)/sizeof(xenstat_collector))
 
+/* Cached domain name, see xenstat_get_domain_name_cached() */
+struct xenstat_name {
+	unsigned int id;
+	xen_domain_handle_t uuid;
+	char *name;		/* NULL once invalidated */
+	int watched;		/* name is kept valid by a watch */
+};
+
 /*
  * libxenstat API
  */
@@ -115,6 +132,9 @@ xenstat_handle *xenstat_init(void)
 		return NULL;
 	}
 
+	/* Domain names are watched, and cached, until events get lost */
+	handle->names_watched = 1;
+
 	return handle;
 }
 
@@ -124,6 +144,7 @@ void xenstat_uninit(xenstat_handle * handle)
 	if (handle) {
 		for (i = 0; i < NUM_COLLECTORS; i++)
 			collectors[i].uninit(handle);
+		xenstat_replace_names(handle, NULL, 0);
 		xc_interface_close(handle->xc_handle);
 		xs_daemon_close(handle->xshandle);
 		free(handle->priv);
@@ -164,9 +185,13 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 	xenstat_node *node;
 	xc_physinfo_t physinfo = { 0 };
 	xc_domaininfo_t domaininfo[DOMAIN_CHUNK_SIZE];
+	struct timeval now;
+	struct xenstat_name *names = NULL;
+	unsigned int num_names = 0, old_name = 0;
+	unsigned int next_domid = 0;
 	int new_domains;
 	unsigned int i;
-	int rc;
+	int rc, tmem;
 
 	/* Create the node */
 	node = (xenstat_node *) calloc(1, sizeof(xenstat_node));
@@ -176,6 +201,9 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 	/* Store the handle in the node for later access */
 	node->handle = handle;
 
+	gettimeofday(&now, NULL);
+	node->time_ns = now.tv_sec * 1000000000ULL + now.tv_usec * 1000ULL;
+
 	/* Get information about the physical system */
 	if (xc_physinfo(handle->xc_handle, &physinfo) < 0) {
 		free(node);
@@ -193,6 +221,8 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 	rc = xc_tmem_control(handle->xc_handle, -1,
                          XEN_SYSCTL_TMEM_OP_QUERY_FREEABLE_MB, -1, 0, 0, NULL);
 	node->freeable_mb = (rc < 0) ? 0 : rc;
+	/* Don't ask for per-domain stats if Xen was built without tmem */
+	tmem = !(rc < 0 && errno == ENOSYS);
 	/* malloc(0) is not portable, so allocate a single domain.  This will
 	 * be resized below. */
 	node->domains = malloc(sizeof(xenstat_domain));
@@ -201,16 +231,23 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 		return NULL;
 	}
 
+	xenstat_update_names(handle);
+
 	node->num_domains = 0;
 	do {
 		xenstat_domain *domain, *tmp;
+		struct xenstat_name *tmp_names;
 
+		/* Domain ids need not be contiguous, so carry on after the
+		 * last one we got rather than after num_domains of them */
 		new_domains = xc_domain_getinfolist(handle->xc_handle,
-						    node->num_domains, 
+						    next_domid,
 						    DOMAIN_CHUNK_SIZE, 
 						    domaininfo);
 		if (new_domains < 0)
 			goto err;
+		if (new_domains > 0)
+			next_domid = domaininfo[new_domains - 1].domain + 1;
 
 		tmp = realloc(node->domains,
 			      (node->num_domains + new_domains)
@@ -220,6 +257,13 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 
 		node->domains = tmp;
 
+		tmp_names = realloc(names, (num_names + new_domains)
+					   * sizeof(*names));
+		if (tmp_names == NULL)
+			goto err;
+
+		names = tmp_names;
+
 		domain = node->domains + node->num_domains;
 
 		/* zero out newly allocated memory in case error occurs below */
@@ -228,11 +272,16 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 		for (i = 0; i < new_domains; i++) {
 			/* Fill in domain using domaininfo[i] */
 			domain->id = domaininfo[i].domain;
-			domain->name = xenstat_get_domain_name(handle, 
-							       domain->id);
+			domain->name = xenstat_get_domain_name_cached(handle,
+					&domaininfo[i], &old_name,
+					&names[num_names]);
+			if (names[num_names].name != NULL)
+				num_names++;
 			if (domain->name == NULL) {
 				if (errno == ENOMEM) {
 					/* fatal error */
+					xenstat_replace_names(handle, names,
+							      num_names);
 					xenstat_free_node(node);
 					return NULL;
 				}
@@ -260,13 +309,15 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 			domain->networks = NULL;
 			domain->num_vbds = 0;
 			domain->vbds = NULL;
-			domain_get_tmem_stats(handle,domain);
+			if (tmem)
+				domain_get_tmem_stats(handle,domain);
 
 			domain++;
 			node->num_domains++;
 		}
 	} while (new_domains == DOMAIN_CHUNK_SIZE);
 
+	xenstat_replace_names(handle, names, num_names);
 
 	/* Run all the extra data collectors requested */
 	node->flags = 0;
@@ -282,6 +333,7 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 
 	return node;
 err:
+	xenstat_replace_names(handle, names, num_names);
 	free(node->domains);
 	free(node);
 	return NULL;
@@ -308,13 +360,18 @@ void xenstat_free_node(xenstat_node * node)
 
 xenstat_domain *xenstat_node_domain(xenstat_node * node, unsigned int domid)
 {
-	unsigned int i;
-
-	/* FIXME: binary search */
-	/* Find the appropriate domain entry in the node struct. */
-	for (i = 0; i < node->num_domains; i++) {
-		if (node->domains[i].id == domid)
-			return &(node->domains[i]);
+	unsigned int lo = 0, hi = node->num_domains, mid;
+
+	/* The hypervisor returns domains in domain id order, and pruning
+	 * entries keeps it. */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (node->domains[mid].id < domid)
+			lo = mid + 1;
+		else if (node->domains[mid].id > domid)
+			hi = mid;
+		else
+			return &(node->domains[mid]);
 	}
 	return NULL;
 }
@@ -363,6 +420,12 @@ unsigned long long xenstat_node_cpu_hz(xenstat_node * node)
 	return node->cpu_hz;
 }
 
+/* Get the time at which the node information was collected */
+unsigned long long xenstat_node_time_ns(xenstat_node * node)
+{
+	return node->time_ns;
+}
+
 /* Get the domain ID for this domain */
 unsigned xenstat_domain_id(xenstat_domain * domain)
 {
@@ -477,6 +540,31 @@ xenstat_vbd *xenstat_domain_vbd(xenstat_domain * domain,
 	return NULL;
 }
 
+/* Find the network with the given ID */
+xenstat_network *xenstat_domain_network_by_id(xenstat_domain * domain,
+					      unsigned int id)
+{
+	unsigned int i;
+
+	for (i = 0; domain->networks && i < domain->num_networks; i++)
+		if (domain->networks[i].id == id)
+			return &(domain->networks[i]);
+	return NULL;
+}
+
+/* Find the VBD with the given back driver type and device number */
+xenstat_vbd *xenstat_domain_vbd_by_dev(xenstat_domain * domain,
+				       unsigned int type, unsigned int dev)
+{
+	unsigned int i;
+
+	for (i = 0; domain->vbds && i < domain->num_vbds; i++)
+		if (domain->vbds[i].back_type == type &&
+		    domain->vbds[i].dev == dev)
+			return &(domain->vbds[i]);
+	return NULL;
+}
+
 /*
  * VCPU functions
  */
@@ -763,6 +851,29 @@ unsigned long long xenstat_tmem_succ_pers_gets(xenstat_tmem *tmem)
 }
 
 
+/*
+ * Rate functions
+ */
+
+/* Get how much a counter increased between two samples */
+unsigned long long xenstat_counter_delta(unsigned long long prev_val,
+					 unsigned long long cur_val)
+{
+	return cur_val >= prev_val ? cur_val - prev_val : 0;
+}
+
+/* Get the increase per second of a counter between two samples */
+double xenstat_counter_rate(xenstat_node * prev, xenstat_node * cur,
+			    unsigned long long prev_val,
+			    unsigned long long cur_val)
+{
+	if (prev == NULL || cur == NULL || cur->time_ns <= prev->time_ns)
+		return -1.0;
+
+	return xenstat_counter_delta(prev_val, cur_val) * 1000000000.0
+	       / (cur->time_ns - prev->time_ns);
+}
+
 static char *xenstat_get_domain_name(xenstat_handle *handle, unsigned int domain_id)
 {
 	char path[80];
@@ -772,6 +883,145 @@ static char *xenstat_get_domain_name(xenstat_handle *handle, unsigned int domain
 	return xs_read(handle->xshandle, XBT_NULL, path, NULL);
 }
 
+/*
+ * Domain name cache
+ *
+ * Reading every domain's name from xenstore on every refresh is most of
+ * the cost of xenstat_get_node() on a host with many domains, so names
+ * are kept in the handle.  The cache is in domain id order and records
+ * the domain handle too, so that a reused domain id is noticed.  Each
+ * cached name has a watch on its own node, which tells us when it is
+ * changed or the domain's directory is removed.  Watches are recursive,
+ * so a watch on /local/domain itself would fire for every write by
+ * every guest.  Appearing and disappearing domains are found by the
+ * hypercall sweep anyway.
+ */
+static struct xenstat_name *xenstat_find_name(xenstat_handle *handle,
+					      unsigned int domid)
+{
+	unsigned int lo = 0, hi = handle->num_names, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (handle->names[mid].id < domid)
+			lo = mid + 1;
+		else if (handle->names[mid].id > domid)
+			hi = mid;
+		else
+			return &handle->names[mid];
+	}
+	return NULL;
+}
+
+static void xenstat_watch_name(xenstat_handle *handle,
+			       struct xenstat_name *entry, int watch)
+{
+	char path[80];
+
+	if (entry->watched == watch)
+		return;
+
+	snprintf(path, sizeof(path), "/local/domain/%u/name", entry->id);
+	if (watch)
+		entry->watched = xs_watch(handle->xshandle, path, "xenstat");
+	else {
+		xs_unwatch(handle->xshandle, path, "xenstat");
+		entry->watched = 0;
+	}
+}
+
+/* Process pending watch events, dropping the names they affect.  Each
+ * watch fires once when it is set up too, so a new name is read twice. */
+static void xenstat_update_names(xenstat_handle *handle)
+{
+	struct xenstat_name *entry;
+	unsigned int domid;
+	char **event;
+	int n;
+
+	if (!handle->names_watched)
+		return;
+
+	while ((event = xs_check_watch(handle->xshandle)) != NULL) {
+		n = 0;
+		if (sscanf(event[XS_WATCH_PATH], "/local/domain/%u%n",
+			   &domid, &n) == 1 &&
+		    !strcmp(event[XS_WATCH_PATH] + n, "/name") &&
+		    (entry = xenstat_find_name(handle, domid)) != NULL) {
+			free(entry->name);
+			entry->name = NULL;
+		}
+		free(event);
+	}
+
+	if (errno != EAGAIN && errno != EINVAL) {
+		/* We may have lost events; stop trusting the cache */
+		handle->names_watched = 0;
+		xenstat_replace_names(handle, NULL, 0);
+	}
+}
+
+/* Get the name of the domain described by info, from the cache if
+ * possible, and record it in entry for the next refresh.  The returned
+ * copy belongs to the caller.  Since domains are visited in domain id
+ * order, *old is where the search for the next one starts. */
+static char *xenstat_get_domain_name_cached(xenstat_handle *handle,
+					    xc_domaininfo_t *info,
+					    unsigned int *old,
+					    struct xenstat_name *entry)
+{
+	struct xenstat_name *cached = NULL;
+
+	while (*old < handle->num_names &&
+	       handle->names[*old].id < info->domain)
+		(*old)++;
+	if (*old < handle->num_names && handle->names[*old].id == info->domain)
+		cached = &handle->names[*old];
+
+	entry->id = info->domain;
+	memcpy(entry->uuid, info->handle, sizeof(entry->uuid));
+	entry->watched = 0;
+
+	/* The watch is on the domain id, so it carries over either way */
+	if (cached) {
+		entry->watched = cached->watched;
+		cached->watched = 0;
+	}
+
+	if (entry->watched && cached->name &&
+	    !memcmp(cached->uuid, info->handle, sizeof(cached->uuid))) {
+		entry->name = cached->name;
+		cached->name = NULL;
+	} else {
+		entry->name = xenstat_get_domain_name(handle, info->domain);
+		if (entry->name == NULL) {
+			xenstat_watch_name(handle, entry, 0);
+			return NULL;
+		}
+		if (handle->names_watched)
+			xenstat_watch_name(handle, entry, 1);
+	}
+
+	return strdup(entry->name);
+}
+
+/* Replace the name cache with names, freeing whatever is left of it */
+static void xenstat_replace_names(xenstat_handle *handle,
+				  struct xenstat_name *names,
+				  unsigned int num_names)
+{
+	unsigned int i;
+
+	for (i = 0; i < handle->num_names; i++) {
+		xenstat_watch_name(handle, &handle->names[i], 0);
+		free(handle->names[i].name);
+	}
+	free(handle->names);
+
+	handle->names = names;
+	handle->num_names = num_names;
+}
+
 /* Remove specified entry from list of domains */
 static void xenstat_prune_domain(xenstat_node *node, unsigned int entry)
 {
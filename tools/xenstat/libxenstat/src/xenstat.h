@@ -82,6 +82,10 @@ unsigned int xenstat_node_num_cpus(xenstat_node * node);
 /* Get information about the CPU speed */
 unsigned long long xenstat_node_cpu_hz(xenstat_node * node);
 
+/* Get the time at which the node information was collected, in
+ * nanoseconds since the Epoch */
+unsigned long long xenstat_node_time_ns(xenstat_node * node);
+
 /*
  * Domain functions - extract information from a xenstat_domain
  */
@@ -133,6 +137,13 @@ unsigned int xenstat_domain_num_vbds(xenstat_domain *);
 xenstat_vbd *xenstat_domain_vbd(xenstat_domain * domain,
 				    unsigned int vbd);
 
+/* Find the network or VBD of a domain which matches one seen in another
+ * sample of the node */
+xenstat_network *xenstat_domain_network_by_id(xenstat_domain * domain,
+					      unsigned int id);
+xenstat_vbd *xenstat_domain_vbd_by_dev(xenstat_domain * domain,
+				       unsigned int type, unsigned int dev);
+
 /* Get the tmem information for a given domain */
 xenstat_tmem *xenstat_domain_tmem(xenstat_domain * domain);
 
@@ -201,4 +212,19 @@ unsigned long long xenstat_tmem_succ_eph_gets(xenstat_tmem *tmem);
 unsigned long long xenstat_tmem_succ_pers_puts(xenstat_tmem *tmem);
 unsigned long long xenstat_tmem_succ_pers_gets(xenstat_tmem *tmem);
 
+/*
+ * Rate functions - compare a counter in two samples of the same node
+ */
+
+/* Get how much a counter increased between two samples; 0 if it went
+ * backwards, e.g. because the device was replaced in between */
+unsigned long long xenstat_counter_delta(unsigned long long prev_val,
+					 unsigned long long cur_val);
+
+/* Get the increase per second of a counter between the samples prev and
+ * cur, or a negative value if they were not taken in that order */
+double xenstat_counter_rate(xenstat_node * prev, xenstat_node * cur,
+			    unsigned long long prev_val,
+			    unsigned long long cur_val);
+
 #endif /* XENSTAT_H */
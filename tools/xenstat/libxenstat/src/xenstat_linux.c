@@ -20,37 +20,95 @@
  * Use is subject to license terms.
  */
 
+#include <errno.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <regex.h>
 
 #include "xenstat_priv.h"
 
 #define SYSFS_VBD_PATH "/sys/bus/xen-backend/devices"
 
+/*
+ * Interfaces and VBDs are remembered from one refresh to the next, in
+ * the order /proc/net/dev and SYSFS_VBD_PATH list them, which does not
+ * change much between refreshes.  This avoids classifying every
+ * interface again and reopening every statistics file each time; the
+ * files are kept open and read with pread.  At most half of
+ * RLIMIT_NOFILE is kept open that way, leaving the rest to the client;
+ * beyond that, files are opened and closed on each read.
+ */
+struct iface_info {
+	char name[16];
+	int fd;			/* device/nodename, or -1 */
+	int known;		/* Classified without fd, for good */
+	int vif;
+	unsigned int domid;
+	unsigned int netid;
+};
+
+#define VBD_NUM_STATS 5
+
+struct vbd_info {
+	char name[32];
+	int fd[VBD_NUM_STATS];
+};
+
 struct priv_data {
 	FILE *procnetdev;
 	DIR *sysfsvbd;
+	struct iface_info *ifaces;
+	unsigned int num_ifaces;
+	int ifaces_changed;	/* Bridge needs looking up again */
+	char bridge[16];
+	struct vbd_info *vbds;
+	unsigned int num_vbds;
+	unsigned int open_fds;	/* Kept open in ifaces and vbds */
+	unsigned int max_fds;	/* Limit for open_fds, 0 until known */
 };
 
+/* Whether n more files may be kept open */
+static int may_keep_open(struct priv_data *priv, unsigned int n)
+{
+	struct rlimit rl;
+
+	if (priv->max_fds == 0) {
+		if (getrlimit(RLIMIT_NOFILE, &rl) || rl.rlim_cur == RLIM_INFINITY
+		    || rl.rlim_cur > 2 * 65536)
+			priv->max_fds = 65536;
+		else
+			priv->max_fds = rl.rlim_cur / 2;
+	}
+
+	return priv->open_fds + n <= priv->max_fds;
+}
+
+static void close_kept(struct priv_data *priv, int *fd)
+{
+	if (*fd < 0)
+		return;
+	close(*fd);
+	*fd = -1;
+	priv->open_fds--;
+}
+
 static struct priv_data *
 get_priv_data(xenstat_handle *handle)
 {
 	if (handle->priv != NULL)
 		return handle->priv;
 
-	handle->priv = malloc(sizeof(struct priv_data));
+	handle->priv = calloc(1, sizeof(struct priv_data));
 	if (handle->priv == NULL)
 		return (NULL);
 
-	((struct priv_data *)handle->priv)->procnetdev = NULL;
-	((struct priv_data *)handle->priv)->sysfsvbd = NULL;
+	((struct priv_data *)handle->priv)->ifaces_changed = 1;
 
 	return handle->priv;
 }
@@ -87,8 +145,8 @@ void getBridge(char *excludeName, char *result, size_t resultLen)
 	closedir(d);
 }
 
-/* parseNetLine provides regular expression based parsing for lines from /proc/net/dev, all the */
-/* information are parsed but not all are used in our case, ie. for xenstat */
+/* parseNetLine parses a line from /proc/net/dev, all the information is */
+/* parsed but not all are used in our case, ie. for xenstat */
 int parseNetDevLine(char *line, char *iface, unsigned long long *rxBytes, unsigned long long *rxPackets,
 		unsigned long long *rxErrs, unsigned long long *rxDrops, unsigned long long *rxFifo,
 		unsigned long long *rxFrames, unsigned long long *rxComp, unsigned long long *rxMcast,
@@ -96,167 +154,145 @@ int parseNetDevLine(char *line, char *iface, unsigned long long *rxBytes, unsign
 		unsigned long long *txDrops, unsigned long long *txFifo, unsigned long long *txColls,
 		unsigned long long *txCarrier, unsigned long long *txComp)
 {
-	/* Temporary/helper variables */
-	int ret;
-	char *tmp;
-	int i = 0, x = 0, col = 0;
-	regex_t r;
-	regmatch_t matches[19];
-	int num = 19;
-
-	/* Regular exception to parse all the information from /proc/net/dev line */
-	char *regex = "([^:]*):([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)"
-			"[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*"
-			"([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)[ ]*([^ ]*)";
+	unsigned long long *fields[] = {
+		rxBytes, rxPackets, rxErrs, rxDrops, rxFifo, rxFrames, rxComp, rxMcast,
+		txBytes, txPackets, txErrs, txDrops, txFifo, txColls, txCarrier, txComp
+	};
+	const int num = sizeof(fields) / sizeof(fields[0]);
+	char *p, *end, *colon;
+	size_t len;
+	int i;
 
 	/* Initialize all variables called has passed as non-NULL to zeros */
 	if (iface != NULL)
-		memset(iface, 0, sizeof(*iface));
-	if (rxBytes != NULL)
-		*rxBytes = 0;
-	if (rxPackets != NULL)
-		*rxPackets = 0;
-	if (rxErrs != NULL)
-		*rxErrs = 0;
-	if (rxDrops != NULL)
-		*rxDrops = 0;
-	if (rxFifo != NULL)
-		*rxFifo = 0;
-	if (rxFrames != NULL)
-		*rxFrames = 0;
-	if (rxPackets != NULL)
-		*rxPackets = 0;
-	if (rxComp != NULL)
-		*rxComp = 0;
-	if (txBytes != NULL)
-		*txBytes = 0;
-	if (txPackets != NULL)
-		*txPackets = 0;
-	if (txErrs != NULL)
-		*txErrs = 0;
-	if (txDrops != NULL)
-		*txDrops = 0;
-	if (txFifo != NULL)
-		*txFifo = 0;
-	if (txColls != NULL)
-		*txColls = 0;
-	if (txCarrier != NULL)
-		*txCarrier = 0;
-	if (txComp != NULL)
-		*txComp = 0;
-
-	if ((ret = regcomp(&r, regex, REG_EXTENDED))) {
-		regfree(&r);
-		return ret;
-	}
+		iface[0] = '\0';
+	for (i = 0; i < num; i++)
+		if (fields[i] != NULL)
+			*fields[i] = 0;
 
-	tmp = (char *)malloc( sizeof(char) );
-	if (regexec (&r, line, num, matches, REG_EXTENDED) == 0){
-		for (i = 1; i < num; i++) {
-			/* The expression matches are empty sometimes so we need to check it first */
-			if (matches[i].rm_eo - matches[i].rm_so > 0) {
-				/* Col variable contains current id of non-empty match */
-				col++;
-				tmp = (char *)realloc(tmp, (matches[i].rm_eo - 
-							matches[i].rm_so + 1) * sizeof(char));
-				for (x = matches[i].rm_so; x < matches[i].rm_eo; x++)
-					tmp[x - matches[i].rm_so] = line[x];
-
-				/* We populate all the fields from /proc/net/dev line */
-				if (i > 1) {
-					unsigned long long ullTmp = strtoull(tmp, NULL, 10);
-
-					switch (col) {
-						case 2: if (rxBytes != NULL)
-								*rxBytes = ullTmp;
-							break;
-						case 3: if (rxPackets != NULL)
-								*rxPackets = ullTmp;
-							break;
-						case 4: if (rxErrs != NULL)
-								*rxErrs = ullTmp;
-							break;
-						case 5: if (rxDrops != NULL)
-								*rxDrops = ullTmp;
-							break;
-						case 6: if (rxFifo != NULL)
-								*rxFifo = ullTmp;
-							break;
-						case 7: if (rxFrames != NULL)
-								*rxFrames = ullTmp;
-							break;
-						case 8: if (rxComp != NULL)
-								*rxComp = ullTmp;
-							break;
-						case 9: if (rxMcast != NULL)
-								*rxMcast = ullTmp;
-							break;
-						case 10: if (txBytes != NULL)
-								*txBytes = ullTmp;
-							break;
-						case 11: if (txPackets != NULL)
-								*txPackets = ullTmp;
-							break;
-						case 12: if (txErrs != NULL)
-								*txErrs = ullTmp;
-							break;
-						case 13: if (txDrops != NULL)
-								*txDrops = ullTmp;
-							break;
-						case 14: if (txFifo != NULL)
-								*txFifo = ullTmp;
-							break;
-						case 15: if (txColls != NULL)
-								*txColls = ullTmp;
-							break;
-						case 16: if (txCarrier != NULL)
-								*txCarrier = ullTmp;
-							break;
-						case 17: if (txComp != NULL)
-								*txComp = ullTmp;
-							break;
-					}
-				}
-				else
-				/* There were errors when parsing this directly in RE. strpbrk() helps */
-				if (iface != NULL) {
-					char *tmp2 = strpbrk(tmp, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789");
-					if (tmp2 != NULL)
-						strcpy(iface, tmp2);
-				}
+	colon = strchr(line, ':');
+	if (colon == NULL)
+		return 0;
 
-				memset(tmp, 0, matches[i].rm_eo - matches[i].rm_so);
-			}
-		}
+	if (iface != NULL) {
+		p = line + strspn(line, " ");
+		len = colon > p ? colon - p : 0;
+		if (len > 15)
+			len = 15;
+		memcpy(iface, p, len);
+		iface[len] = '\0';
 	}
 
-	free(tmp);
-	regfree(&r);
+	p = colon + 1;
+	for (i = 0; i < num; i++) {
+		unsigned long long val = strtoull(p, &end, 10);
+
+		if (end == p)
+			break;
+		if (fields[i] != NULL)
+			*fields[i] = val;
+		p = end;
+	}
 
 	return 0;
 }
 
-/* Find out the domid and network number given an interface name.
+/* Read the xenstore backend path of a VIF through its open nodename */
+static int read_iface_nodename(struct iface_info *info)
+{
+	char buf[64];
+	ssize_t n;
+
+	n = pread(info->fd, buf, sizeof(buf) - 1, 0);
+	if (n <= 0)
+		return 0;
+	buf[n] = '\0';
+
+	return sscanf(buf, "backend/vif/%u/%u", &info->domid,
+		      &info->netid) == 2;
+}
+
+/* Find out the domid and network number of an interface.
  * Return 0 if the iface cannot be recognized as a Xen VIF. */
-static int get_iface_domid_network(const char *iface, unsigned int *domid_p, unsigned int *netid_p)
+static int get_iface_domid_network(struct priv_data *priv,
+				   struct iface_info *info)
 {
 	char nodename_path[48];
-	FILE * nodename_file;
-	int ret;
-
-	snprintf(nodename_path, 48, "/sys/class/net/%s/device/nodename", iface);
-	nodename_file = fopen(nodename_path, "r");
-	if (nodename_file != NULL) {
-		ret = fscanf(nodename_file, "backend/vif/%u/%u", domid_p, netid_p);
-		fclose(nodename_file);
-		if (ret == 2)
+	int ok;
+
+	if (info->known)
+		return info->vif;
+
+	if (info->fd >= 0) {
+		if (read_iface_nodename(info))
+			return 1;
+		/* The interface went away and a new one took its name */
+		close_kept(priv, &info->fd);
+	}
+
+	snprintf(nodename_path, 48, "/sys/class/net/%s/device/nodename",
+		 info->name);
+	info->fd = open(nodename_path, O_RDONLY);
+	if (info->fd >= 0) {
+		ok = read_iface_nodename(info);
+		if (ok && may_keep_open(priv, 1)) {
+			priv->open_fds++;
+			return info->vif = 1;
+		}
+		close(info->fd);
+		info->fd = -1;
+		/* Read through a new fd on each refresh */
+		if (ok)
 			return 1;
 	}
 
-	if (sscanf(iface, "vif%u.%u", domid_p, netid_p) == 2)
-		return 1;
+	info->known = 1;
+	info->vif = sscanf(info->name, "vif%u.%u", &info->domid,
+			   &info->netid) == 2;
 
-	return 0;
+	return info->vif;
+}
+
+/* Take the entry for iface out of the previous refresh's list, or make
+ * a new one.  *cursor is where we expect to find it. */
+static void take_iface(struct priv_data *priv, const char *iface,
+		       unsigned int *cursor, struct iface_info *info)
+{
+	unsigned int i, n = priv->num_ifaces;
+
+	for (i = 0; i < n; i++) {
+		struct iface_info *old = &priv->ifaces[(*cursor + i) % n];
+
+		if (old->name[0] != '\0' && !strcmp(old->name, iface)) {
+			*info = *old;
+			old->name[0] = '\0';
+			old->fd = -1;
+			*cursor = (*cursor + i + 1) % n;
+			return;
+		}
+	}
+
+	memset(info, 0, sizeof(*info));
+	strncpy(info->name, iface, sizeof(info->name) - 1);
+	info->fd = -1;
+	priv->ifaces_changed = 1;
+}
+
+/* Replace the remembered interfaces by the ones seen in this refresh */
+static void replace_ifaces(struct priv_data *priv, struct iface_info *ifaces,
+			   unsigned int num_ifaces)
+{
+	unsigned int i;
+
+	for (i = 0; i < priv->num_ifaces; i++) {
+		if (priv->ifaces[i].name[0] != '\0')
+			priv->ifaces_changed = 1;
+		close_kept(priv, &priv->ifaces[i].fd);
+	}
+	free(priv->ifaces);
+
+	priv->ifaces = ifaces;
+	priv->num_ifaces = num_ifaces;
 }
 
 /* Collect information about networks */
@@ -264,8 +300,11 @@ int xenstat_collect_networks(xenstat_node * node)
 {
 	/* Helper variables for parseNetDevLine() function defined above */
 	int i;
-	char line[512] = { 0 }, iface[16] = { 0 }, devBridge[16] = { 0 }, devNoBridge[16] = { 0 };
+	char line[512] = { 0 }, iface[16] = { 0 }, devNoBridge[16] = { 0 };
+	char *devBridge;
 	unsigned long long rxBytes, rxPackets, rxErrs, rxDrops, txBytes, txPackets, txErrs, txDrops;
+	struct iface_info *ifaces = NULL, *info;
+	unsigned int num_ifaces = 0, max_ifaces = 0, cursor = 0;
 
 	struct priv_data *priv = get_priv_data(node->handle);
 
@@ -298,21 +337,43 @@ int xenstat_collect_networks(xenstat_node * node)
 	}
 
 	/* Fill in networks */
-	/* FIXME: optimize this */
 	fseek(priv->procnetdev, sizeof(PROCNETDEV_HEADER) - 1,
 	      SEEK_SET);
 
 	/* We get the bridge devices for use with bonding interface to get bonding interface stats */
-	getBridge("vir", devBridge, sizeof(devBridge));
+	/* Looking through every interface is costly with many VIFs, so */
+	/* only do it again when the set of interfaces changed */
+	if (priv->ifaces_changed) {
+		priv->bridge[0] = '\0';
+		getBridge("vir", priv->bridge, sizeof(priv->bridge));
+		priv->ifaces_changed = 0;
+	}
+	devBridge = priv->bridge;
 	snprintf(devNoBridge, 16, "p%s", devBridge);
 
 	while (fgets(line, 512, priv->procnetdev)) {
 		xenstat_domain *domain;
 		xenstat_network net;
-		unsigned int domid;
 
 		parseNetDevLine(line, iface, &rxBytes, &rxPackets, &rxErrs, &rxDrops, NULL, NULL, NULL,
 				NULL, &txBytes, &txPackets, &txErrs, &txDrops, NULL, NULL, NULL, NULL);
+		if (iface[0] == '\0')
+			continue;
+
+		if (num_ifaces == max_ifaces) {
+			struct iface_info *tmp;
+
+			max_ifaces = max_ifaces ? max_ifaces * 2 : 64;
+			tmp = realloc(ifaces, max_ifaces * sizeof(*ifaces));
+			if (tmp == NULL) {
+				replace_ifaces(priv, ifaces, num_ifaces);
+				perror("Allocation error");
+				return 0;
+			}
+			ifaces = tmp;
+		}
+		info = &ifaces[num_ifaces++];
+		take_iface(priv, iface, &cursor, info);
 
 		/* If the device parsed is network bridge and both tx & rx packets are zero, we are most */
 		/* likely using bonding so we alter the configuration for dom0 to have bridge stats */
@@ -335,7 +396,9 @@ int xenstat_collect_networks(xenstat_node * node)
 			}
 		}
 		else /* Otherwise we need to preserve old behaviour */
-		if (get_iface_domid_network(iface, &domid, &net.id)) {
+		if (get_iface_domid_network(priv, info)) {
+
+			net.id = info->netid;
 
 			net.tbytes = txBytes;
 			net.tpackets = txPackets;
@@ -346,13 +409,12 @@ int xenstat_collect_networks(xenstat_node * node)
 			net.rerrs = rxErrs;
 			net.rdrop = rxDrops;
 
-		/* FIXME: this does a search for the domid */
-		  domain = xenstat_node_domain(node, domid);
+		  domain = xenstat_node_domain(node, info->domid);
 		  if (domain == NULL) {
 			fprintf(stderr,
 				"Found interface vif%u.%u but domain %u"
-				" does not exist.\n", domid, net.id,
-				domid);
+				" does not exist.\n", info->domid, net.id,
+				info->domid);
 			continue;
 		  }
 		  if (domain->networks == NULL) {
@@ -368,12 +430,16 @@ int xenstat_collect_networks(xenstat_node * node)
 				free(domain->networks);
 			domain->networks = tmp;
 		  }
-		  if (domain->networks == NULL)
+		  if (domain->networks == NULL) {
+			replace_ifaces(priv, ifaces, num_ifaces);
 			return 0;
+		  }
 		  domain->networks[domain->num_networks - 1] = net;
           }
         }
 
+	replace_ifaces(priv, ifaces, num_ifaces);
+
 	return 1;
 }
 
@@ -383,22 +449,134 @@ void xenstat_uninit_networks(xenstat_handle * handle)
 	struct priv_data *priv = get_priv_data(handle);
 	if (priv != NULL && priv->procnetdev != NULL)
 		fclose(priv->procnetdev);
+	if (priv != NULL)
+		replace_ifaces(priv, NULL, 0);
 }
 
-static int read_attributes_vbd(const char *vbd_directory, const char *what, char *ret, int cap)
+static const char *const vbd_stats[VBD_NUM_STATS] = {
+	"statistics/oo_req",
+	"statistics/rd_req",
+	"statistics/wr_req",
+	"statistics/rd_sect",
+	"statistics/wr_sect",
+};
+
+static void close_vbd_stats(struct priv_data *priv, struct vbd_info *info)
 {
-	static char file_name[80];
-	int fd, num_read;
-
-	snprintf(file_name, sizeof(file_name), "%s/%s/%s",
-		SYSFS_VBD_PATH, vbd_directory, what);
-	fd = open(file_name, O_RDONLY, 0);
-	if (fd==-1) return -1;
-	num_read = read(fd, ret, cap - 1);
-	close(fd);
-	if (num_read<=0) return -1;
-	ret[num_read] = '\0';
-	return num_read;
+	int i;
+
+	for (i = 0; i < VBD_NUM_STATS; i++)
+		close_kept(priv, &info->fd[i]);
+}
+
+static int open_vbd_stats(struct priv_data *priv, struct vbd_info *info)
+{
+	char file_name[80];
+	int i;
+
+	if (!may_keep_open(priv, VBD_NUM_STATS))
+		return 0;
+
+	for (i = 0; i < VBD_NUM_STATS; i++) {
+		snprintf(file_name, sizeof(file_name), "%s/%s/%s",
+			 SYSFS_VBD_PATH, info->name, vbd_stats[i]);
+		info->fd[i] = open(file_name, O_RDONLY, 0);
+		if (info->fd[i] == -1) {
+			close_vbd_stats(priv, info);
+			return 0;
+		}
+		priv->open_fds++;
+	}
+	return 1;
+}
+
+static int read_vbd_stat(int fd, unsigned long long *val)
+{
+	char buf[64];
+	ssize_t num_read;
+
+	num_read = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (num_read <= 0)
+		return 0;
+	buf[num_read] = '\0';
+	return sscanf(buf, "%llu", val) == 1;
+}
+
+static int read_vbd_stats(struct vbd_info *info, xenstat_vbd *vbd)
+{
+	return read_vbd_stat(info->fd[0], &vbd->oo_reqs) &&
+	       read_vbd_stat(info->fd[1], &vbd->rd_reqs) &&
+	       read_vbd_stat(info->fd[2], &vbd->wr_reqs) &&
+	       read_vbd_stat(info->fd[3], &vbd->rd_sects) &&
+	       read_vbd_stat(info->fd[4], &vbd->wr_sects);
+}
+
+/* Read the statistics of a VBD whose files could not be kept open (we
+ * may be out of file descriptors, or over our share of them), one file
+ * at a time.  Returns 0 and
+ * sets errno to ENOENT if the device has gone away. */
+static int read_vbd_stats_uncached(struct vbd_info *info, xenstat_vbd *vbd)
+{
+	unsigned long long *vals[VBD_NUM_STATS] = {
+		&vbd->oo_reqs, &vbd->rd_reqs, &vbd->wr_reqs,
+		&vbd->rd_sects, &vbd->wr_sects,
+	};
+	char file_name[80];
+	int i, fd, ok;
+
+	for (i = 0; i < VBD_NUM_STATS; i++) {
+		snprintf(file_name, sizeof(file_name), "%s/%s/%s",
+			 SYSFS_VBD_PATH, info->name, vbd_stats[i]);
+		fd = open(file_name, O_RDONLY, 0);
+		if (fd == -1)
+			return 0;
+		ok = read_vbd_stat(fd, vals[i]);
+		close(fd);
+		if (!ok) {
+			errno = EIO;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Take the entry for a VBD out of the previous refresh's list, or make
+ * a new one.  *cursor is where we expect to find it. */
+static void take_vbd(struct priv_data *priv, const char *name,
+		     unsigned int *cursor, struct vbd_info *info)
+{
+	unsigned int i, n = priv->num_vbds;
+
+	for (i = 0; i < n; i++) {
+		struct vbd_info *old = &priv->vbds[(*cursor + i) % n];
+
+		if (old->name[0] != '\0' && !strcmp(old->name, name)) {
+			*info = *old;
+			old->name[0] = '\0';
+			*cursor = (*cursor + i + 1) % n;
+			return;
+		}
+	}
+
+	strncpy(info->name, name, sizeof(info->name) - 1);
+	info->name[sizeof(info->name) - 1] = '\0';
+	for (i = 0; i < VBD_NUM_STATS; i++)
+		info->fd[i] = -1;
+}
+
+/* Replace the remembered VBDs by the ones seen in this refresh */
+static void replace_vbds(struct priv_data *priv, struct vbd_info *vbds,
+			 unsigned int num_vbds)
+{
+	unsigned int i;
+
+	for (i = 0; i < priv->num_vbds; i++)
+		if (priv->vbds[i].name[0] != '\0')
+			close_vbd_stats(priv, &priv->vbds[i]);
+	free(priv->vbds);
+
+	priv->vbds = vbds;
+	priv->num_vbds = num_vbds;
 }
 
 /* Collect information about VBDs */
@@ -406,6 +584,8 @@ int xenstat_collect_vbds(xenstat_node * node)
 {
 	struct dirent *dp;
 	struct priv_data *priv = get_priv_data(node->handle);
+	struct vbd_info *vbds = NULL, *info;
+	unsigned int num_vbds = 0, max_vbds = 0, cursor = 0;
 
 	if (priv == NULL) {
 		perror("Allocation error");
@@ -453,42 +633,51 @@ int xenstat_collect_vbds(xenstat_node * node)
 			continue;
 		}
 
-		if((read_attributes_vbd(dp->d_name, "statistics/oo_req", buf, 256)<=0)
-		   || ((ret = sscanf(buf, "%llu", &vbd.oo_reqs)) != 1))
-		{
-			continue;
-		}
-
-		if((read_attributes_vbd(dp->d_name, "statistics/rd_req", buf, 256)<=0)
-		   || ((ret = sscanf(buf, "%llu", &vbd.rd_reqs)) != 1))
-		{
-			continue;
-		}
-
-		if((read_attributes_vbd(dp->d_name, "statistics/wr_req", buf, 256)<=0)
-		   || ((ret = sscanf(buf, "%llu", &vbd.wr_reqs)) != 1))
-		{
-			continue;
-		}
+		if (num_vbds == max_vbds) {
+			struct vbd_info *tmp;
 
-		if((read_attributes_vbd(dp->d_name, "statistics/rd_sect", buf, 256)<=0)
-		   || ((ret = sscanf(buf, "%llu", &vbd.rd_sects)) != 1))
-		{
-			continue;
+			max_vbds = max_vbds ? max_vbds * 2 : 64;
+			tmp = realloc(vbds, max_vbds * sizeof(*vbds));
+			if (tmp == NULL) {
+				replace_vbds(priv, vbds, num_vbds);
+				perror("Allocation error");
+				return 0;
+			}
+			vbds = tmp;
 		}
-
-		if((read_attributes_vbd(dp->d_name, "statistics/wr_sect", buf, 256)<=0)
-		   || ((ret = sscanf(buf, "%llu", &vbd.wr_sects)) != 1))
-		{
-			continue;
+		info = &vbds[num_vbds];
+		take_vbd(priv, dp->d_name, &cursor, info);
+
+		/* The files of a VBD which was replaced by another one of the
+		 * same name can't be read any more; open them again.  If that
+		 * fails, read them the slow way, and try to cache them again
+		 * on the next refresh.  Only a VBD which is gone is skipped,
+		 * any other failure leaves its statistics at zero. */
+		if (info->fd[0] < 0 || !read_vbd_stats(info, &vbd)) {
+			close_vbd_stats(priv, info);
+			if (!open_vbd_stats(priv, info) ||
+			    !read_vbd_stats(info, &vbd)) {
+				close_vbd_stats(priv, info);
+				if (!read_vbd_stats_uncached(info, &vbd)) {
+					if (errno == ENOENT)
+						continue;
+					vbd.oo_reqs = vbd.rd_reqs = 0;
+					vbd.wr_reqs = vbd.rd_sects = 0;
+					vbd.wr_sects = 0;
+				}
+			}
 		}
+		num_vbds++;
 
 		if ((xenstat_save_vbd(domain, &vbd)) == NULL) {
+			replace_vbds(priv, vbds, num_vbds);
 			perror("Allocation error");
 			return 0;
 		}
 	}
 
+	replace_vbds(priv, vbds, num_vbds);
+
 	return 1;	
 }
 
@@ -498,4 +687,6 @@ void xenstat_uninit_vbds(xenstat_handle * handle)
 	struct priv_data *priv = get_priv_data(handle);
 	if (priv != NULL && priv->sysfsvbd != NULL)
 		closedir(priv->sysfsvbd);
+	if (priv != NULL)
+		replace_vbds(priv, NULL, 0);
 }
@@ -38,11 +38,15 @@ struct xenstat_handle {
 	int page_size;
 	void *priv;
 	char xen_version[VERSION_SIZE]; /* xen version running on this node */
+	struct xenstat_name *names;	/* Domain names, sorted by domain id */
+	unsigned int num_names;
+	int names_watched;		/* names are kept valid by watches */
 };
 
 struct xenstat_node {
 	xenstat_handle *handle;
 	unsigned int flags;
+	unsigned long long time_ns;	/* When the node was sampled */
 	unsigned long long cpu_hz;
 	unsigned int num_cpus;
 	unsigned long long tot_mem;
@@ -32,6 +32,10 @@
 #include <time.h>
 #include <unistd.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #if defined(__linux__)
 #include <linux/kdev_t.h>
 #endif
@@ -138,6 +142,9 @@ static void do_vcpu(xenstat_domain *);
 static void do_network(xenstat_domain *);
 static void do_vbd(xenstat_domain *);
 static void top(void);
+static void do_json(void);
+static void json_listen(const char *path);
+static void json_wait(unsigned int seconds);
 
 /* Field types */
 typedef enum field_id {
@@ -212,6 +219,8 @@ int show_vbds = 0;
 int show_tmem = 0;
 int repeat_header = 0;
 int show_full_name = 0;
+int json = 0;
+const char *json_socket = NULL;
 #define PROMPT_VAL_LEN 80
 char *prompt = NULL;
 char prompt_val[PROMPT_VAL_LEN];
@@ -241,6 +250,8 @@ static void usage(const char *program)
 	       "-b, --batch	     output in batch mode, no user input accepted\n"
 	       "-i, --iterations     number of iterations before exiting\n"
 	       "-f, --full-name      output the full domain name (not truncated)\n"
+	       "-j, --json           output a JSON object per update, one per line\n"
+	       "-S, --socket=PATH    send the -j output to clients of a Unix socket\n"
 	       "\n" XENTOP_BUGSTO,
 	       program);
 	return;
@@ -504,7 +515,7 @@ static void print_cpu(xenstat_domain *domain)
 static double get_cpu_pct(xenstat_domain *domain)
 {
 	xenstat_domain *old_domain;
-	double us_elapsed;
+	double ns_per_sec;
 
 	/* Can't calculate CPU percentage without a previous sample. */
 	if(prev_node == NULL)
@@ -514,15 +525,15 @@ static double get_cpu_pct(xenstat_domain *domain)
 	if(old_domain == NULL)
 		return 0.0;
 
-	/* Calculate the time elapsed in microseconds */
-	us_elapsed = ((curtime.tv_sec-oldtime.tv_sec)*1000000.0
-		      +(curtime.tv_usec - oldtime.tv_usec));
+	ns_per_sec = xenstat_counter_rate(prev_node, cur_node,
+					  xenstat_domain_cpu_ns(old_domain),
+					  xenstat_domain_cpu_ns(domain));
+	if (ns_per_sec < 0)
+		return 0.0;
 
-	/* In the following, nanoseconds must be multiplied by 1000.0 to
-	 * convert to microseconds, then divided by 100.0 to get a percentage,
-	 * resulting in a multiplication by 10.0 */
-	return ((xenstat_domain_cpu_ns(domain)
-		 -xenstat_domain_cpu_ns(old_domain))/10.0)/us_elapsed;
+	/* Nanoseconds per second, divided by 10^9 and multiplied by 100.0
+	 * to get a percentage */
+	return ns_per_sec / 10000000.0;
 }
 
 static int compare_cpu_pct(xenstat_domain *domain1, xenstat_domain *domain2)
@@ -1165,6 +1176,402 @@ static void top(void)
 	free(domains);
 }
 
+/*
+ * Machine-readable output
+ *
+ * With -j, each update is written as a single line holding a JSON
+ * object: the node, and every domain with all its counters.  Counters
+ * which only ever increase come with their rate per second since the
+ * previous update (null on the first one), computed by libxenstat.
+ * With -S the lines go to every client connected to a Unix socket
+ * instead of stdout, so that any number of monitoring agents can share
+ * one sampling loop.
+ */
+
+static struct {
+	char *buf;
+	size_t len;
+	size_t size;
+} json_out;
+
+static void json_printf(const char *fmt, ...) __attribute__((format(printf,1,2)));
+
+static void json_printf(const char *fmt, ...)
+{
+	va_list args;
+	int n;
+
+	for (;;) {
+		va_start(args, fmt);
+		n = vsnprintf(json_out.buf + json_out.len,
+			      json_out.size - json_out.len, fmt, args);
+		va_end(args);
+		if (n < 0)
+			fail("Failed to format output\n");
+		if (json_out.len + n < json_out.size)
+			break;
+		json_out.size = (json_out.len + n + 1) * 2;
+		json_out.buf = realloc(json_out.buf, json_out.size);
+		if (json_out.buf == NULL)
+			fail("Failed to allocate memory\n");
+	}
+	json_out.len += n;
+}
+
+static void json_string(const char *str)
+{
+	const unsigned char *p;
+
+	json_printf("\"");
+	for (p = (const unsigned char *)str; p && *p; p++) {
+		if (*p == '"' || *p == '\\')
+			json_printf("\\%c", *p);
+		else if (*p < 0x20)
+			json_printf("\\u%04x", *p);
+		else
+			json_printf("%c", *p);
+	}
+	json_printf("\"");
+}
+
+/* Print a counter, and its rate if it was present in the previous sample */
+static void json_counter(const char *name, int have_prev,
+			 unsigned long long prev_val,
+			 unsigned long long cur_val)
+{
+	double rate = -1.0;
+
+	if (have_prev)
+		rate = xenstat_counter_rate(prev_node, cur_node,
+					    prev_val, cur_val);
+	json_printf(",\"%s\":%llu", name, cur_val);
+	if (rate < 0)
+		json_printf(",\"%s_rate\":null", name);
+	else
+		json_printf(",\"%s_rate\":%.3f", name, rate);
+}
+
+static void json_domain(xenstat_domain *domain)
+{
+	xenstat_domain *old = NULL;
+	unsigned int i;
+	char state[8];
+
+	if (prev_node != NULL)
+		old = xenstat_node_domain(prev_node, xenstat_domain_id(domain));
+
+	for (i = 0; i < NUM_STATES && i < sizeof(state) - 1; i++)
+		state[i] = state_funcs[i].get(domain) ? state_funcs[i].ch : '-';
+	state[i] = '\0';
+
+	json_printf("{\"id\":%u,\"name\":", xenstat_domain_id(domain));
+	json_string(xenstat_domain_name(domain));
+	json_printf(",\"state\":\"%s\"", state);
+	json_counter("cpu_ns", old != NULL,
+		     old ? xenstat_domain_cpu_ns(old) : 0,
+		     xenstat_domain_cpu_ns(domain));
+	json_printf(",\"mem_kb\":%llu", xenstat_domain_cur_mem(domain) / 1024);
+	if (xenstat_domain_max_mem(domain) == (unsigned long long)-1)
+		json_printf(",\"maxmem_kb\":null");
+	else
+		json_printf(",\"maxmem_kb\":%llu",
+			    xenstat_domain_max_mem(domain) / 1024);
+	json_printf(",\"ssid\":%u", xenstat_domain_ssid(domain));
+
+	json_printf(",\"vcpus\":[");
+	for (i = 0; i < xenstat_domain_num_vcpus(domain); i++) {
+		xenstat_vcpu *vcpu = xenstat_domain_vcpu(domain, i);
+		xenstat_vcpu *old_vcpu = old ? xenstat_domain_vcpu(old, i) : NULL;
+
+		json_printf("%s{\"id\":%u,\"online\":%s", i ? "," : "", i,
+			    xenstat_vcpu_online(vcpu) ? "true" : "false");
+		json_counter("ns", old_vcpu != NULL,
+			     old_vcpu ? xenstat_vcpu_ns(old_vcpu) : 0,
+			     xenstat_vcpu_ns(vcpu));
+		json_printf("}");
+	}
+
+	json_printf("],\"nets\":[");
+	for (i = 0; i < xenstat_domain_num_networks(domain); i++) {
+		xenstat_network *net = xenstat_domain_network(domain, i);
+		xenstat_network *o = old ?
+			xenstat_domain_network_by_id(old,
+						xenstat_network_id(net)) : NULL;
+
+		json_printf("%s{\"id\":%u", i ? "," : "",
+			    xenstat_network_id(net));
+#define NET_COUNTER(c) \
+		json_counter(#c, o != NULL, o ? xenstat_network_##c(o) : 0, \
+			     xenstat_network_##c(net))
+		NET_COUNTER(rbytes);
+		NET_COUNTER(rpackets);
+		NET_COUNTER(rerrs);
+		NET_COUNTER(rdrop);
+		NET_COUNTER(tbytes);
+		NET_COUNTER(tpackets);
+		NET_COUNTER(terrs);
+		NET_COUNTER(tdrop);
+#undef NET_COUNTER
+		json_printf("}");
+	}
+
+	json_printf("],\"vbds\":[");
+	for (i = 0; i < xenstat_domain_num_vbds(domain); i++) {
+		xenstat_vbd *vbd = xenstat_domain_vbd(domain, i);
+		xenstat_vbd *o = old ?
+			xenstat_domain_vbd_by_dev(old, xenstat_vbd_type(vbd),
+						  xenstat_vbd_dev(vbd)) : NULL;
+
+		json_printf("%s{\"type\":%u,\"dev\":%u", i ? "," : "",
+			    xenstat_vbd_type(vbd), xenstat_vbd_dev(vbd));
+#define VBD_COUNTER(c) \
+		json_counter(#c, o != NULL, o ? xenstat_vbd_##c(o) : 0, \
+			     xenstat_vbd_##c(vbd))
+		VBD_COUNTER(oo_reqs);
+		VBD_COUNTER(rd_reqs);
+		VBD_COUNTER(wr_reqs);
+		VBD_COUNTER(rd_sects);
+		VBD_COUNTER(wr_sects);
+#undef VBD_COUNTER
+		json_printf("}");
+	}
+	json_printf("]}");
+}
+
+/* Client connections of the -S socket, with the output they have yet
+ * to take.  A client with more than this much pending is dropped. */
+#define JSON_CLIENT_MAX_PENDING (4 << 20)
+
+struct json_client {
+	int fd;
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+static int json_listen_fd = -1;
+static struct json_client *json_clients;
+static unsigned int json_num_clients;
+
+static void json_listen(const char *path)
+{
+	struct sockaddr_un addr;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		fail("Socket path too long\n");
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	json_listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (json_listen_fd < 0)
+		fail("Failed to create socket\n");
+	fcntl(json_listen_fd, F_SETFL,
+	      fcntl(json_listen_fd, F_GETFL) | O_NONBLOCK);
+
+	unlink(path);
+	if (bind(json_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(json_listen_fd, 16) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		fail("Failed to listen on socket\n");
+	}
+
+	/* A client going away must not kill us */
+	signal(SIGPIPE, SIG_IGN);
+}
+
+static void json_drop_client(unsigned int i)
+{
+	close(json_clients[i].fd);
+	free(json_clients[i].buf);
+	json_clients[i] = json_clients[--json_num_clients];
+}
+
+/* Send as much of a client's pending output as it takes without
+ * blocking.  Returns 0 if the client has to be dropped. */
+static int json_flush_client(struct json_client *client)
+{
+	ssize_t n;
+
+	while (client->len) {
+		n = send(client->fd, client->buf, client->len, MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+		memmove(client->buf, client->buf + n, client->len - n);
+		client->len -= n;
+	}
+	return 1;
+}
+
+static void json_accept(void)
+{
+	struct json_client *tmp;
+	int fd;
+
+	fd = accept(json_listen_fd, NULL, NULL);
+	if (fd < 0)
+		return;
+
+	tmp = realloc(json_clients,
+		      (json_num_clients + 1) * sizeof(*json_clients));
+	if (tmp == NULL) {
+		close(fd);
+		return;
+	}
+	json_clients = tmp;
+	memset(&json_clients[json_num_clients], 0, sizeof(*json_clients));
+	json_clients[json_num_clients++].fd = fd;
+}
+
+/* Wait until the next update is due, taking new clients and sending
+ * pending output meanwhile */
+static void json_wait(unsigned int seconds)
+{
+	struct timeval start, now;
+	struct pollfd *pfds = NULL, *tmp;
+	unsigned int i, j, nfds;
+	int timeout;
+
+	if (json_listen_fd < 0) {
+		sleep(seconds);
+		return;
+	}
+
+	gettimeofday(&start, NULL);
+	for (;;) {
+		gettimeofday(&now, NULL);
+		timeout = seconds * 1000
+			  - ((now.tv_sec - start.tv_sec) * 1000
+			     + (now.tv_usec - start.tv_usec) / 1000);
+		if (timeout <= 0)
+			break;
+
+		tmp = realloc(pfds, (json_num_clients + 1) * sizeof(*pfds));
+		if (tmp == NULL) {
+			/* Try again on the next update */
+			poll(NULL, 0, timeout);
+			break;
+		}
+		pfds = tmp;
+
+		pfds[0].fd = json_listen_fd;
+		pfds[0].events = POLLIN;
+		for (i = 0, nfds = 1; i < json_num_clients; i++) {
+			if (json_clients[i].len == 0)
+				continue;
+			pfds[nfds].fd = json_clients[i].fd;
+			pfds[nfds].events = POLLOUT;
+			nfds++;
+		}
+
+		if (poll(pfds, nfds, timeout) <= 0)
+			break;
+
+		/* Clients only move around when one is dropped, so match
+		 * them up by fd */
+		for (j = 1; j < nfds; j++) {
+			if (!pfds[j].revents)
+				continue;
+			for (i = 0; i < json_num_clients; i++)
+				if (json_clients[i].fd == pfds[j].fd)
+					break;
+			if (i < json_num_clients &&
+			    !json_flush_client(&json_clients[i]))
+				json_drop_client(i);
+		}
+
+		if (pfds[0].revents & POLLIN)
+			json_accept();
+	}
+
+	free(pfds);
+}
+
+/* Queue the line for every client, and send what each of them takes.
+ * A client which does not keep up is disconnected once too much is
+ * pending for it, rather than slowing everyone down. */
+static void json_send(void)
+{
+	struct json_client *client;
+	unsigned int i = 0;
+	size_t size;
+	char *buf;
+
+	if (json_listen_fd < 0) {
+		fwrite(json_out.buf, 1, json_out.len, stdout);
+		return;
+	}
+
+	while (i < json_num_clients) {
+		client = &json_clients[i];
+
+		if (client->len + json_out.len > JSON_CLIENT_MAX_PENDING &&
+		    client->len) {
+			json_drop_client(i);
+			continue;
+		}
+
+		if (client->len + json_out.len > client->size) {
+			size = (client->len + json_out.len) * 2;
+			buf = realloc(client->buf, size);
+			if (buf == NULL) {
+				json_drop_client(i);
+				continue;
+			}
+			client->buf = buf;
+			client->size = size;
+		}
+		memcpy(client->buf + client->len, json_out.buf, json_out.len);
+		client->len += json_out.len;
+
+		if (!json_flush_client(client)) {
+			json_drop_client(i);
+			continue;
+		}
+		i++;
+	}
+}
+
+static void do_json(void)
+{
+	unsigned int i, num_domains;
+
+	if (prev_node != NULL)
+		xenstat_free_node(prev_node);
+	prev_node = cur_node;
+	cur_node = xenstat_get_node(xhandle, XENSTAT_ALL);
+	if (cur_node == NULL)
+		fail("Failed to retrieve statistics from libxenstat\n");
+
+	json_out.len = 0;
+	json_printf("{\"time_ns\":%llu", xenstat_node_time_ns(cur_node));
+	json_printf(",\"node\":{\"xen_version\":");
+	json_string(xenstat_node_xen_version(cur_node));
+	json_printf(",\"cpus\":%u,\"cpu_hz\":%llu",
+		    xenstat_node_num_cpus(cur_node),
+		    xenstat_node_cpu_hz(cur_node));
+	json_printf(",\"mem_kb\":%llu,\"free_mem_kb\":%llu"
+		    ",\"freeable_mb\":%ld}",
+		    xenstat_node_tot_mem(cur_node) / 1024,
+		    xenstat_node_free_mem(cur_node) / 1024,
+		    xenstat_node_freeable_mb(cur_node));
+
+	json_printf(",\"domains\":[");
+	num_domains = xenstat_node_num_domains(cur_node);
+	for (i = 0; i < num_domains; i++) {
+		if (i)
+			json_printf(",");
+		json_domain(xenstat_node_domain_by_index(cur_node, i));
+	}
+	json_printf("]}\n");
+
+	json_send();
+}
+
 static int signal_exit;
 
 static void signal_exit_handler(int sig)
@@ -1188,9 +1595,11 @@ int main(int argc, char **argv)
 		{ "batch",	   no_argument,	      NULL, 'b' },
 		{ "iterations",	   required_argument, NULL, 'i' },
 		{ "full-name",     no_argument,       NULL, 'f' },
+		{ "json",          no_argument,       NULL, 'j' },
+		{ "socket",        required_argument, NULL, 'S' },
 		{ 0, 0, 0, 0 },
 	};
-	const char *sopts = "hVnxrvd:bi:f";
+	const char *sopts = "hVnxrvd:bi:fjS:";
 
 	if (atexit(cleanup) != 0)
 		fail("Failed to install cleanup handler.\n");
@@ -1235,9 +1644,19 @@ int main(int argc, char **argv)
 		case 't':
 			show_tmem = 1;
 			break;
+		case 'S':
+			json_socket = optarg;
+			/* fall through */
+		case 'j':
+			json = 1;
+			batch = 1;
+			break;
 		}
 	}
 
+	if (json_socket != NULL)
+		json_listen(json_socket);
+
 	/* Get xenstat handle */
 	xhandle = xenstat_init();
 	if (xhandle == NULL)
@@ -1280,13 +1699,19 @@ int main(int argc, char **argv)
 
 		do {
 			gettimeofday(&curtime, NULL);
-			top();
+			if (json)
+				do_json();
+			else
+				top();
 			fflush(stdout);
 			oldtime = curtime;
 			if ((!loop) && !(--iterations))
 				break;
-			sleep(delay);
+			json_wait(delay);
 		} while (!signal_exit);
+
+		if (json_socket != NULL)
+			unlink(json_socket);
 	}
 
 	/* Cleanup occurs in cleanup(), so no work to do here. */
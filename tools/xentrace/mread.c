@@ -5,6 +5,8 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <errno.h>
+#include <string.h>
+#include <unistd.h>
 #include "mread.h"
 
 mread_handle_t mread_init(int fd)
@@ -27,9 +29,117 @@ mread_handle_t mread_init(int fd)
     fstat(fd, &s);
     h->file_size = s.st_size;
 
+    /* Can't mmap a pipe; read it as it comes */
+    if ( !S_ISREG(s.st_mode) )
+    {
+        h->stream.active = 1;
+        h->stream.limit = MREAD_STREAM_LIMIT_DEFAULT;
+        h->file_size = (off_t)(~0ULL >> 1);
+    }
+
     return h;
 }
 
+static void mread_stream_compact(struct mread_stream *s)
+{
+    size_t drop = s->released - s->start;
+
+    if ( s->released <= s->start )
+        return;
+    if ( drop > s->len )
+        drop = s->len;
+
+    memmove(s->buffer, s->buffer + drop, s->len - drop);
+    s->len -= drop;
+    s->start += drop;
+}
+
+/*
+ * Streams are read sequentially into a buffer, which is extended as
+ * far as the reader asks.  The caller tells with mread_release() which
+ * part it won't look at any more; the buffer never holds more than
+ * stream.limit bytes, and reading beyond that fails as if at EOF.
+ */
+static ssize_t mread_stream(mread_handle_t h, void *dst, ssize_t len,
+                            off_t offset)
+{
+    struct mread_stream *s = &h->stream;
+    ssize_t r;
+
+    if ( offset < s->start )
+    {
+        fprintf(stderr, "mread: offset %llx already released (start %llx)\n",
+                (unsigned long long)offset, (unsigned long long)s->start);
+        exit(1);
+    }
+
+    while ( !s->eof && offset + len > s->start + (off_t)s->len )
+    {
+        size_t need;
+
+        if ( s->len == s->size )
+            mread_stream_compact(s);
+
+        need = offset + len - s->start;
+        if ( need > s->limit )
+            return 0;
+
+        if ( s->len == s->size )
+        {
+            size_t size = s->size ? s->size * 2 : (1UL << 20);
+            char *b;
+
+            if ( size > s->limit )
+                size = s->limit;
+            if ( size < need )
+                size = need;
+            if ( (b = realloc(s->buffer, size)) == NULL )
+            {
+                perror("realloc");
+                exit(1);
+            }
+            s->buffer = b;
+            s->size = size;
+        }
+
+        r = read(h->fd, s->buffer + s->len, s->size - s->len);
+        if ( r < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+            perror("read");
+            exit(1);
+        }
+        if ( r == 0 )
+            s->eof = 1;
+        s->len += r;
+    }
+
+    if ( offset >= s->start + (off_t)s->len )
+        return 0;
+    if ( offset + len > s->start + (off_t)s->len )
+        len = s->start + s->len - offset;
+
+    memcpy(dst, s->buffer + (offset - s->start), len);
+
+    return len;
+}
+
+void mread_release(mread_handle_t h, off_t offset)
+{
+    struct mread_stream *s = &h->stream;
+
+    if ( !s->active || offset <= s->released )
+        return;
+
+    s->released = offset;
+
+    /* Only move what's left now if that's cheaper than what's dropped;
+     * otherwise wait until the space is needed. */
+    if ( (size_t)(s->released - s->start) * 2 >= s->len )
+        mread_stream_compact(s);
+}
+
 ssize_t mread64(mread_handle_t h, void *rec, ssize_t len, off_t offset)
 {
     /* Idea: have a "cache" of N mmaped regions.  If the offset is
@@ -51,6 +161,9 @@ ssize_t mread64(mread_handle_t h, void *rec, ssize_t len, off_t offset)
 #define dprintf(x...)
 //#define dprintf fprintf
 
+    if ( h->stream.active )
+        return mread_stream(h, rec, len, offset);
+
     dprintf(warn, "%s: offset %llx len %d\n", __func__,
             offset, len);
     if ( offset > h->file_size )
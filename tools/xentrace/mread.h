@@ -12,7 +12,17 @@ typedef struct mread_ctrl {
         int accessed;
     } map[MREAD_MAPS];
     int clock, last;
+    /* Pipes and sockets are read into a buffer holding [start, start+len) */
+    struct mread_stream {
+        int active, eof;
+        char *buffer;
+        off_t start, released;
+        size_t len, size, limit;
+    } stream;
 } *mread_handle_t;
 
+#define MREAD_STREAM_LIMIT_DEFAULT (256ULL<<20)
+
 mread_handle_t mread_init(int fd);
 ssize_t mread64(mread_handle_t h, void *dst, ssize_t len, off_t offset);
+void mread_release(mread_handle_t h, off_t offset);
@@ -36,6 +36,7 @@
 #include <strings.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 
 struct mread_ctrl;
 
@@ -70,12 +71,19 @@ struct {
     char * trace_file;
     int output_defined;
     off_t file_size;
+    int stream;                       /* Reading from a pipe or socket */
+    unsigned long stream_limit;
     struct {
         off_t update_offset;
         int pipe[2];
         FILE* out;
         int pid;
     } progress;
+    struct {
+        int active;
+        double start, end;            /* Seconds, end == 0 for no end */
+        tsc_t start_tsc, end_tsc;
+    } window;
 } G = {
     .fd=-1,
     .symbols = NULL,
@@ -179,6 +187,7 @@ struct {
         summary:1,
         report_pcpu:1,
         tsc_loop_fatal:1,
+        sample_size_set:1,
         summary_info;
     long long cpu_qhz, cpu_hz;
     int scatterplot_interrupt_vector;
@@ -189,6 +198,7 @@ struct {
     int interrupt_eip_enumeration_vector;
     int default_guest_paging_levels;
     int sample_size;
+    int readahead_threads;
     enum error_level tolerance; /* Tolerate up to this level of error */
     struct {
         tsc_t cycles;
@@ -203,7 +213,8 @@ struct {
             INTERVAL_DOMAIN_TOTAL_TIME,
             INTERVAL_DOMAIN_SHORT_SUMMARY,
             INTERVAL_DOMAIN_GUEST_INTERRUPT,
-            INTERVAL_DOMAIN_GRANT_MAPS
+            INTERVAL_DOMAIN_GRANT_MAPS,
+            INTERVAL_JSON_SUMMARY
         } output;
         enum {
             INTERVAL_MODE_CUSTOM,
@@ -1828,6 +1839,7 @@ void volume_summary(struct trace_volume *vol)
 struct pcpu_info {
     /* Information about this pcpu */
     unsigned active:1, summary:1;
+    unsigned compact:1; /* Current window in the compact format */
     int pid;
 
     /* Information related to scanning thru the file */
@@ -1869,6 +1881,9 @@ struct pcpu_info {
         tsc_t tsc;
         struct cycle_summary idle, running, lost;
     } time;
+
+    /* Records decoded ahead by a prefetch thread, if any */
+    struct pcpu_prefetch *prefetch;
 };
 
 void __fill_in_record_info(struct pcpu_info *p);
@@ -2847,6 +2862,96 @@ void interval_domain_grant_maps_output(void) {
 
 /* General interval gateways */
 
+/*
+ * One line of JSON per interval, for every vcpu seen: the share of the
+ * interval spent in each runstate, how long it waited for a pcpu after
+ * waking or being preempted, and the HVM exits by reason.  Meant to be
+ * consumed by monitoring, typically reading a live trace from a pipe.
+ */
+static double interval_cycles_to_us(long long cycles)
+{
+    return cycles * 1000000.0 / opt.cpu_hz;
+}
+
+void interval_json_summary_output(void) {
+    struct domain_data *d;
+    struct time_struct t;
+    int i, vid, first_d = 1;
+
+    abs_cycles_to_time(P.interval.start_tsc, &t);
+    printf("{\"time\":%u.%09u,\"interval_ms\":%u,\"domains\":[",
+           t.s, t.ns, opt.interval.msec);
+
+    for ( d = domain_list; d; d = d->next ) {
+        int first_v = 1;
+
+        printf("%s{\"id\":%d,\"vcpus\":[", first_d ? "" : ",", d->did);
+        first_d = 0;
+
+        for ( vid = 0; vid <= d->max_vid; vid++ ) {
+            struct vcpu_data *v = d->vcpu[vid];
+            int first;
+
+            if ( !v )
+                continue;
+
+            printf("%s{\"id\":%d,\"runstates\":{", first_v ? "" : ",", vid);
+            first_v = 0;
+
+            for ( i = 0, first = 1; i < RUNSTATE_MAX; i++ ) {
+                struct interval_element *e = &v->runstates[i].interval;
+
+                if ( !e->cycles )
+                    continue;
+                printf("%s\"%s\":%.2lf", first ? "" : ",", runstate_name[i],
+                       __cycles_percent(e->cycles, opt.interval.cycles));
+                first = 0;
+                clear_interval_cycles(e);
+            }
+
+            printf("},\"runnable\":{");
+            for ( i = 0, first = 1; i < RUNNABLE_STATE_MAX; i++ ) {
+                struct interval_element *e = &v->runnable_states[i].interval;
+
+                if ( !e->count )
+                    continue;
+                printf("%s\"%s\":{\"count\":%d,\"avg_us\":%.1lf}",
+                       first ? "" : ",", runnable_state_name[i], e->count,
+                       interval_cycles_to_us(e->cycles / e->count));
+                first = 0;
+                clear_interval_cycles(e);
+            }
+            printf("}");
+
+            if ( v->data_type == VCPU_DATA_HVM ) {
+                struct hvm_data *h = &v->hvm;
+
+                printf(",\"vmexits\":{");
+                for ( i = 0, first = 1; i < h->exit_reason_max; i++ ) {
+                    struct interval_element *e = &h->summary.exit_reason[i].interval;
+
+                    if ( !e->count )
+                        continue;
+                    if ( h->exit_reason_name[i] )
+                        printf("%s\"%s\"", first ? "" : ",",
+                               h->exit_reason_name[i]);
+                    else
+                        printf("%s\"%d\"", first ? "" : ",", i);
+                    printf(":{\"count\":%d,\"avg_us\":%.2lf}", e->count,
+                           interval_cycles_to_us(e->cycles / e->count));
+                    first = 0;
+                    clear_interval_cycles(e);
+                }
+                printf("}");
+            }
+            printf("}");
+        }
+        printf("]}");
+    }
+    printf("]}\n");
+    fflush(stdout);
+}
+
 void interval_callback(void) {
     /* First, see if we're in generic mode. */
     switch(opt.interval.mode) {
@@ -2874,6 +2979,9 @@ void interval_callback(void) {
     case INTERVAL_DOMAIN_GRANT_MAPS:
         interval_domain_grant_maps_output();
         break;
+    case INTERVAL_JSON_SUMMARY:
+        interval_json_summary_output();
+        break;
     default:
         break;
     }
@@ -8803,6 +8911,7 @@ void base_process(struct pcpu_info *p) {
 void record_order_insert(struct pcpu_info *new);
 void record_order_remove(struct pcpu_info *rem);
 void record_order_bubble(struct pcpu_info *last);
+void prefetch_stop(struct pcpu_info *p);
 
 struct cpu_change_data {
     int cpu;
@@ -8855,6 +8964,12 @@ off_t scan_for_new_pcpu(off_t offset) {
         error(ERR_ASSERT, NULL);
     }
 
+    /* A pcpu given up on while streaming must not go back over windows
+     * it had already processed */
+    if(G.stream && !P.pcpu[cd->cpu].active && P.pcpu[cd->cpu].file_offset
+       && offset <= P.pcpu[cd->cpu].file_offset)
+        return 0;
+
     if(cd->cpu > P.max_active_pcpu || !P.pcpu[cd->cpu].active) {
         struct pcpu_info *p = P.pcpu + cd->cpu;
 
@@ -8862,6 +8977,9 @@ off_t scan_for_new_pcpu(off_t offset) {
                 __func__, cd->cpu, (unsigned long long)offset);
 
         p->active = 1;
+        /* Compact deltas are relative to records we didn't read */
+        if ( G.stream && p->file_offset )
+            p->last_tsc = 0;
         /* Process this cpu_change record first */
         p->ri.rec = rec;
         p->ri.size = r;
@@ -8925,6 +9043,7 @@ void deactivate_pcpu(struct pcpu_info *p)
     p->active = 0;
 
     record_order_remove(p);
+    prefetch_stop(p);
 
     if ( p->pid == P.max_active_pcpu )
     {
@@ -9081,12 +9200,19 @@ void process_cpu_change(struct pcpu_info *p) {
         P.last_epoch_offset = p->file_offset;
     }
 
-    /* If that pcpu has never been activated, activate it. */
-    if(!P.pcpu[r->cpu].active && P.pcpu[r->cpu].file_offset == 0)
+    /* If that pcpu has never been activated, activate it.  When
+     * streaming, a pcpu may also have been given up on (see
+     * mread_stream()) and is brought back by its next window. */
+    if(!P.pcpu[r->cpu].active
+       && (P.pcpu[r->cpu].file_offset == 0
+           || (G.stream && p->file_offset > P.pcpu[r->cpu].file_offset)))
     {
         struct pcpu_info * p2 = P.pcpu + r->cpu;
 
         p2->active = 1;
+        /* Compact deltas are relative to records we didn't read */
+        if(p2->file_offset)
+            p2->last_tsc = 0;
         if(r->cpu > P.max_active_pcpu)
             P.max_active_pcpu = r->cpu;
 
@@ -9124,6 +9250,10 @@ void process_cpu_change(struct pcpu_info *p) {
     }
     else
     {
+        /* xentrace adds flags to the record if there are any */
+        p->compact = ri->extra_words > 2
+            && (ri->d[2] & TRC_TRACE_CPU_CHANGE_COMPACT);
+
         /* Track information about dom0 scheduling and records */
         if(opt.dump_trace_volume_on_lost_record) {
             tsc_t cycles;
@@ -9259,6 +9389,10 @@ void process_record(struct pcpu_info *p) {
     if ( opt.dump_no_processing )
         goto out;
 
+    /* Records read to reach the start of --time-window */
+    if ( p->order_tsc < G.window.start_tsc )
+        goto out;
+
     p->summary = 1;
 
     if( opt.dump_raw_process )
@@ -9470,6 +9604,21 @@ void __fill_in_record_info(struct pcpu_info *p)
             p->order_tsc = tsc;
 
         p->last_tsc = tsc;
+    } else if(p->compact && ri->evt.main != (TRC_GEN >> TRC_CLS_SHIFT)
+              && ri->extra_words > 0) {
+        /* Compact format: the first word is the delta from the last tsc.
+         * Without a full tsc to start from, the record has no timestamp. */
+        ri->d = ri->rec.u.notsc.data + 1;
+        ri->extra_words--;
+
+        if(p->last_tsc) {
+            tsc = p->last_tsc + ri->rec.u.notsc.data[0];
+
+            ri->tsc = tsc;
+            p->order_tsc = tsc;
+            p->last_tsc = tsc;
+        } else
+            ri->tsc = 0;
     } else {
         ri->tsc = p->last_tsc;
         ri->d = ri->rec.u.notsc.data;
@@ -9488,6 +9637,340 @@ void __fill_in_record_info(struct pcpu_info *p)
     ri->cpu = p->pid;
 }
 
+/*
+ * Record prefetching
+ *
+ * The records of a pcpu are spread over the file in windows, each
+ * preceded by a cpu_change record, and every pcpu walks the cpu_change
+ * records of all the others to find its own windows.  Which records a
+ * pcpu reads only depends on the file, so with --readahead-threads the
+ * reading is done ahead by a pool of threads, each walking
+ * the windows of the pcpus assigned to it (pid modulo the number of
+ * threads) with its own mread handle, and queueing batches of records.
+ *
+ * The main thread still merges the pcpus in tsc order and runs all the
+ * handlers, so the analysis is unchanged; it checks the offset of every
+ * prefetched record, restarts the prefetching if it went elsewhere, and
+ * reads synchronously whatever the thread could not (EOF, short reads),
+ * so that errors are reported as before.  The records are only read
+ * ahead, all the decoding and accounting is still done by the main
+ * thread, so this helps with slow storage, not with the analysis.
+ */
+#define PREFETCH_BATCH 512
+#define PREFETCH_DEPTH 4
+
+struct prefetch_thread {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work, ready;
+    struct pcpu_prefetch *pcpus[MAX_CPUS];
+    int nr_pcpus;
+    int exit;
+};
+
+struct pcpu_prefetch {
+    struct prefetch_thread *t;
+    int pid;
+    struct mread_ctrl *mh;
+
+    /* Protected by t->lock */
+    int running, eof;
+    unsigned seq;              /* Bumped when restarted or stopped */
+    unsigned prod, cons;       /* Batches filled / released */
+    off_t next_offset;         /* Offset of the next record to queue */
+    struct prefetch_batch {
+        int count;
+        struct {
+            off_t offset;
+            ssize_t size;      /* 0 if the thread couldn't read it */
+            struct trace_record rec;
+        } r[PREFETCH_BATCH];
+    } ring[PREFETCH_DEPTH];
+
+    /* Main thread only: the batch being consumed */
+    struct prefetch_batch *cur;
+    int pos;
+};
+
+static struct prefetch_thread *prefetch_threads;
+
+/* Like __read_record(), but silent, for use from the prefetch threads */
+static ssize_t prefetch_read_at(struct mread_ctrl *mh,
+                                struct trace_record *rec, off_t offset)
+{
+    ssize_t r, rsize;
+
+    r = mread64(mh, rec, sizeof(*rec), offset);
+    if ( r < (ssize_t)sizeof(uint32_t) )
+        return 0;
+
+    rsize = get_rec_size(rec);
+    if ( r < rsize )
+        return 0;
+
+    return rsize;
+}
+
+/* Fill a batch with the records the pcpu will read from offset onwards;
+ * this follows process_cpu_change() skipping the windows of other pcpus */
+static off_t prefetch_fill(struct pcpu_prefetch *pf, struct prefetch_batch *b,
+                           off_t offset, int *eof)
+{
+    struct trace_record *rec;
+    ssize_t size;
+
+    for ( b->count = 0; b->count < PREFETCH_BATCH; b->count++ )
+    {
+        rec = &b->r[b->count].rec;
+        size = prefetch_read_at(pf->mh, rec, offset);
+
+        b->r[b->count].offset = offset;
+        b->r[b->count].size = size;
+
+        if ( size == 0 )
+        {
+            b->count++;
+            *eof = 1;
+            break;
+        }
+
+        offset += size;
+
+        if ( rec->event == TRC_TRACE_CPU_CHANGE && !rec->cycle_flag )
+        {
+            struct cpu_change_data *cd = (typeof(cd))rec->u.notsc.data;
+
+            if ( cd->cpu != pf->pid )
+                offset += cd->window_size;
+        }
+    }
+
+    return offset;
+}
+
+static void *prefetch_thread_main(void *arg)
+{
+    struct prefetch_thread *t = arg;
+    struct pcpu_prefetch *pf;
+    struct prefetch_batch *b;
+    unsigned seq;
+    off_t offset;
+    int i, eof, progress;
+
+    pthread_mutex_lock(&t->lock);
+    for ( ;; )
+    {
+        progress = 0;
+
+        for ( i = 0; i < t->nr_pcpus; i++ )
+        {
+            pf = t->pcpus[i];
+            if ( !pf->running || pf->eof
+                 || pf->prod - pf->cons >= PREFETCH_DEPTH )
+                continue;
+
+            seq = pf->seq;
+            offset = pf->next_offset;
+            b = &pf->ring[pf->prod % PREFETCH_DEPTH];
+            eof = 0;
+
+            pthread_mutex_unlock(&t->lock);
+            offset = prefetch_fill(pf, b, offset, &eof);
+            pthread_mutex_lock(&t->lock);
+
+            /* Throw the batch away if we were restarted meanwhile */
+            if ( seq == pf->seq )
+            {
+                pf->prod++;
+                pf->next_offset = offset;
+                pf->eof = eof;
+                pthread_cond_broadcast(&t->ready);
+            }
+            progress = 1;
+        }
+
+        if ( t->exit )
+            break;
+
+        if ( !progress )
+            pthread_cond_wait(&t->work, &t->lock);
+    }
+    pthread_mutex_unlock(&t->lock);
+
+    return NULL;
+}
+
+void prefetch_init(void)
+{
+    int i;
+
+    prefetch_threads = calloc(opt.readahead_threads, sizeof(*prefetch_threads));
+    if ( !prefetch_threads )
+    {
+        fprintf(stderr, "%s: malloc failed!\n", __func__);
+        error(ERR_SYSTEM, NULL);
+    }
+
+    for ( i = 0; i < opt.readahead_threads; i++ )
+    {
+        struct prefetch_thread *t = prefetch_threads + i;
+
+        pthread_mutex_init(&t->lock, NULL);
+        pthread_cond_init(&t->work, NULL);
+        pthread_cond_init(&t->ready, NULL);
+
+        if ( pthread_create(&t->thread, NULL, prefetch_thread_main, t) )
+        {
+            fprintf(stderr, "%s: pthread_create failed!\n", __func__);
+            error(ERR_SYSTEM, NULL);
+        }
+    }
+}
+
+/* Stop and join the threads once all the records have been read */
+void prefetch_finish(void)
+{
+    int i;
+
+    if ( !prefetch_threads )
+        return;
+
+    for ( i = 0; i < opt.readahead_threads; i++ )
+    {
+        struct prefetch_thread *t = prefetch_threads + i;
+
+        pthread_mutex_lock(&t->lock);
+        t->exit = 1;
+        pthread_cond_signal(&t->work);
+        pthread_mutex_unlock(&t->lock);
+
+        pthread_join(t->thread, NULL);
+
+        pthread_mutex_destroy(&t->lock);
+        pthread_cond_destroy(&t->work);
+        pthread_cond_destroy(&t->ready);
+    }
+
+    for ( i = 0; i < MAX_CPUS; i++ )
+    {
+        free(P.pcpu[i].prefetch);
+        P.pcpu[i].prefetch = NULL;
+    }
+
+    free(prefetch_threads);
+    prefetch_threads = NULL;
+}
+
+static struct pcpu_prefetch *prefetch_get(struct pcpu_info *p)
+{
+    struct prefetch_thread *t;
+    struct pcpu_prefetch *pf;
+
+    if ( p->prefetch || !prefetch_threads )
+        return p->prefetch;
+
+    pf = calloc(1, sizeof(*pf));
+    if ( !pf )
+    {
+        fprintf(stderr, "%s: malloc failed!\n", __func__);
+        error(ERR_SYSTEM, NULL);
+    }
+
+    t = prefetch_threads + (p->pid % opt.readahead_threads);
+    pf->t = t;
+    pf->pid = p->pid;
+    if ( (pf->mh = mread_init(G.fd)) == NULL )
+        error(ERR_SYSTEM, NULL);
+
+    pthread_mutex_lock(&t->lock);
+    t->pcpus[t->nr_pcpus++] = pf;
+    pthread_mutex_unlock(&t->lock);
+
+    p->prefetch = pf;
+
+    return pf;
+}
+
+/* Called with t->lock held */
+static void __prefetch_restart(struct pcpu_prefetch *pf, off_t offset)
+{
+    pf->seq++;
+    pf->prod = pf->cons = 0;
+    pf->cur = NULL;
+    pf->eof = 0;
+    pf->next_offset = offset;
+    pf->running = 1;
+    pthread_cond_signal(&pf->t->work);
+}
+
+void prefetch_stop(struct pcpu_info *p)
+{
+    struct pcpu_prefetch *pf = p->prefetch;
+
+    if ( !pf )
+        return;
+
+    pthread_mutex_lock(&pf->t->lock);
+    pf->seq++;
+    pf->running = 0;
+    pf->cur = NULL;
+    pthread_mutex_unlock(&pf->t->lock);
+}
+
+/* Get the record at offset from the prefetched ones.  Returns its size,
+ * or 0 if it has to be read synchronously. */
+static ssize_t prefetch_read(struct pcpu_info *p, struct trace_record *rec,
+                             off_t offset)
+{
+    struct pcpu_prefetch *pf = prefetch_get(p);
+    struct prefetch_thread *t;
+
+    if ( !pf )
+        return 0;
+    t = pf->t;
+
+    for ( ;; )
+    {
+        if ( pf->cur && pf->pos < pf->cur->count )
+        {
+            if ( pf->cur->r[pf->pos].offset == offset )
+            {
+                ssize_t size = pf->cur->r[pf->pos].size;
+
+                if ( size )
+                    *rec = pf->cur->r[pf->pos].rec;
+                pf->pos++;
+                return size;
+            }
+
+            pthread_mutex_lock(&t->lock);
+            __prefetch_restart(pf, offset);
+            pthread_mutex_unlock(&t->lock);
+        }
+
+        pthread_mutex_lock(&t->lock);
+        if ( pf->cur )
+        {
+            /* Done with this batch; give it back */
+            pf->cur = NULL;
+            pf->cons++;
+            pthread_cond_signal(&t->work);
+        }
+        if ( !pf->running )
+            __prefetch_restart(pf, offset);
+        while ( pf->prod == pf->cons && !pf->eof )
+            pthread_cond_wait(&t->ready, &t->lock);
+        if ( pf->prod == pf->cons )
+        {
+            pthread_mutex_unlock(&t->lock);
+            return 0;
+        }
+        pf->cur = &pf->ring[pf->cons % PREFETCH_DEPTH];
+        pf->pos = 0;
+        pthread_mutex_unlock(&t->lock);
+    }
+}
+
 ssize_t read_record(struct pcpu_info * p) {
     off_t * offset;
     struct record_info *ri;
@@ -9495,7 +9978,9 @@ ssize_t read_record(struct pcpu_info * p) {
     offset = &p->file_offset;
     ri = &p->ri;
 
-    ri->size = __read_record(&ri->rec, *offset);
+    ri->size = prefetch_read(p, &ri->rec, *offset);
+    if(!ri->size)
+        ri->size = __read_record(&ri->rec, *offset);
     if(ri->size)
     {
         __fill_in_record_info(p);
@@ -9674,13 +10159,35 @@ struct pcpu_info * choose_next_record(void)
     return min_p;
 }
 
+/* Let the stream buffer go up to the lowest offset any pcpu will read */
+static void stream_release(void)
+{
+    off_t min = -1;
+    int i;
+
+    for(i=0; record_order[i]; i++)
+        if(min < 0 || record_order[i]->file_offset < min)
+            min = record_order[i]->file_offset;
+
+    if(min >= 0)
+        mread_release(G.mh, min);
+}
+
 void process_records(void) {
+    unsigned long count = 0;
+
     while(1) {
         struct pcpu_info *p = NULL;
 
+        if(G.stream && !(++count & 0xfff))
+            stream_release();
+
         if(!(p=choose_next_record()))
             return;
 
+        if(G.window.end_tsc && p->order_tsc > G.window.end_tsc)
+            return;
+
         process_record(p);
 
         /* Lost records gets processed twice. */
@@ -9804,6 +10311,249 @@ void report_pcpu(void) {
 
 }
 
+/*
+ * Sidecar index
+ *
+ * To analyse a --time-window without reading the whole file, xenalyze
+ * keeps next to the trace ("<trace>.idx") the offset, pcpu and first tsc
+ * of every cpu_change window.  Building it only reads the window
+ * headers; it is rebuilt whenever the size or mtime of the trace
+ * changes.  Each pcpu then starts at its last window beginning before
+ * the start of the time window, and records before it are skipped.
+ */
+#define INDEX_MAGIC "XENAIDX1"
+
+struct index_header {
+    char magic[8];
+    uint64_t file_size;
+    int64_t mtime;
+    uint64_t nr_entries;
+};
+
+struct index_entry {
+    uint64_t offset;
+    uint64_t tsc;
+    uint32_t cpu;
+    uint32_t window_size;
+};
+
+static struct {
+    struct index_entry *entries;
+    uint64_t nr, size;
+} index_data;
+
+static char *index_path(void)
+{
+    char *path = malloc(strlen(G.trace_file) + sizeof(".idx"));
+
+    if ( !path )
+    {
+        fprintf(stderr, "%s: malloc failed!\n", __func__);
+        error(ERR_SYSTEM, NULL);
+    }
+    sprintf(path, "%s.idx", G.trace_file);
+
+    return path;
+}
+
+static int index_load(const char *path, struct stat *st)
+{
+    struct index_header h;
+    FILE *f;
+    int rc = -1;
+
+    if ( (f = fopen(path, "r")) == NULL )
+        return -1;
+
+    if ( fread(&h, sizeof(h), 1, f) != 1
+         || memcmp(h.magic, INDEX_MAGIC, sizeof(h.magic))
+         || h.file_size != st->st_size
+         || h.mtime != st->st_mtime )
+        goto out;
+
+    index_data.entries = malloc(h.nr_entries * sizeof(*index_data.entries));
+    if ( !index_data.entries && h.nr_entries )
+        goto out;
+    if ( fread(index_data.entries, sizeof(*index_data.entries),
+               h.nr_entries, f) != h.nr_entries )
+    {
+        free(index_data.entries);
+        index_data.entries = NULL;
+        goto out;
+    }
+    index_data.nr = index_data.size = h.nr_entries;
+    rc = 0;
+
+ out:
+    fclose(f);
+    return rc;
+}
+
+static void index_save(const char *path, struct stat *st)
+{
+    struct index_header h;
+    FILE *f;
+
+    memcpy(h.magic, INDEX_MAGIC, sizeof(h.magic));
+    h.file_size = st->st_size;
+    h.mtime = st->st_mtime;
+    h.nr_entries = index_data.nr;
+
+    if ( (f = fopen(path, "w")) == NULL
+         || fwrite(&h, sizeof(h), 1, f) != 1
+         || fwrite(index_data.entries, sizeof(*index_data.entries),
+                   index_data.nr, f) != index_data.nr
+         || fclose(f) )
+    {
+        fprintf(warn, "%s: could not write %s: %s\n",
+                __func__, path, strerror(errno));
+        unlink(path);
+    }
+}
+
+static void index_build(void)
+{
+    struct trace_record rec;
+    struct cpu_change_data *cd;
+    struct index_entry *e;
+    off_t offset = 0, o;
+    ssize_t r, rsize;
+    static tsc_t last_tsc[MAX_CPUS];
+    tsc_t tsc;
+    int compact;
+
+    fprintf(warn, "Indexing %s...\n", G.trace_file);
+
+    while ( (r = __read_record(&rec, offset)) != 0 )
+    {
+        if ( rec.event != TRC_TRACE_CPU_CHANGE || rec.cycle_flag )
+        {
+            fprintf(warn, "%s: no cpu_change record at offset %llx, "
+                    "index stops there\n",
+                    __func__, (unsigned long long)offset);
+            break;
+        }
+        cd = (typeof(cd))rec.u.notsc.data;
+
+        if ( index_data.nr == index_data.size )
+        {
+            index_data.size = index_data.size ? index_data.size * 2 : 4096;
+            index_data.entries = realloc(index_data.entries,
+                                         index_data.size * sizeof(*e));
+            if ( !index_data.entries )
+            {
+                fprintf(stderr, "%s: malloc failed!\n", __func__);
+                error(ERR_SYSTEM, NULL);
+            }
+        }
+        e = index_data.entries + index_data.nr++;
+        e->offset = offset;
+        e->cpu = cd->cpu;
+        e->window_size = cd->window_size;
+        e->tsc = 0;
+
+        /*
+         * Timestamp of the window: that of its first record having one.
+         * In the compact format, it is rather the one the first delta is
+         * relative to, which is needed to start there, and all the window
+         * has to be read to follow the deltas.
+         */
+        compact = rec.extra_words > 2
+            && (rec.u.notsc.data[2] & TRC_TRACE_CPU_CHANGE_COMPACT)
+            && cd->cpu < MAX_CPUS;
+        if ( compact )
+            e->tsc = last_tsc[cd->cpu];
+
+        for ( o = offset + r; o < offset + r + cd->window_size; o += rsize )
+        {
+            struct trace_record wrec;
+
+            rsize = __read_record(&wrec, o);
+            if ( rsize == 0 )
+                break;
+            if ( wrec.cycle_flag )
+                tsc = (((tsc_t)wrec.u.tsc.tsc_hi) << 32)
+                    | wrec.u.tsc.tsc_lo;
+            else if ( compact && wrec.extra_words && last_tsc[cd->cpu]
+                      && (wrec.event >> TRC_CLS_SHIFT)
+                         != (TRC_GEN >> TRC_CLS_SHIFT) )
+                tsc = last_tsc[cd->cpu] + wrec.u.notsc.data[0];
+            else
+                continue;
+
+            if ( !e->tsc )
+                e->tsc = tsc;
+            if ( !compact )
+                break;
+            last_tsc[cd->cpu] = tsc;
+        }
+
+        offset += r + cd->window_size;
+    }
+}
+
+/* Start every pcpu at its window covering the start of --time-window */
+static void init_pcpus_window(void)
+{
+    struct stat st;
+    char *path = index_path();
+    off_t start[MAX_CPUS];
+    tsc_t start_tsc[MAX_CPUS];
+    tsc_t first_tsc = 0;
+    uint64_t i;
+    int cpu;
+
+    fstat(G.fd, &st);
+    if ( index_load(path, &st) )
+    {
+        index_build();
+        index_save(path, &st);
+    }
+    free(path);
+
+    for ( i = 0; i < index_data.nr; i++ )
+        if ( index_data.entries[i].tsc
+             && (!first_tsc || index_data.entries[i].tsc < first_tsc) )
+            first_tsc = index_data.entries[i].tsc;
+
+    G.window.start_tsc = first_tsc + G.window.start * opt.cpu_hz;
+    if ( G.window.end )
+        G.window.end_tsc = first_tsc + G.window.end * opt.cpu_hz;
+
+    /* The last window starting before start_tsc, or else the first one */
+    for ( cpu = 0; cpu < MAX_CPUS; cpu++ )
+        start[cpu] = -1;
+    for ( i = 0; i < index_data.nr; i++ )
+    {
+        struct index_entry *e = index_data.entries + i;
+
+        if ( e->cpu >= MAX_CPUS )
+            continue;
+        /*
+         * A window with no timestamp says nothing about where it lies in
+         * time: starting there could skip earlier records of the time
+         * window.  Only use one if the pcpu has nothing better yet.
+         */
+        if ( !e->tsc && start[e->cpu] >= 0 )
+            continue;
+        if ( e->tsc <= G.window.start_tsc || start[e->cpu] < 0 )
+        {
+            start[e->cpu] = e->offset;
+            start_tsc[e->cpu] = e->tsc;
+        }
+    }
+
+    /* In the compact format, the first deltas are relative to e->tsc */
+    for ( cpu = 0; cpu < MAX_CPUS; cpu++ )
+        if ( start[cpu] >= 0 )
+        {
+            scan_for_new_pcpu(start[cpu]);
+            P.pcpu[cpu].last_tsc = start_tsc[cpu];
+        }
+
+    free(index_data.entries);
+}
+
 void init_pcpus(void) {
     int i=0;
     off_t offset = 0;
@@ -9819,6 +10569,12 @@ void init_pcpus(void) {
 
     sched_default_domain_init();
 
+    if ( G.window.active )
+    {
+        init_pcpus_window();
+        return;
+    }
+
     /* Scan through the cpu_change recs until we see a duplicate */
     do {
         offset = scan_for_new_pcpu(offset);
@@ -9884,6 +10640,10 @@ enum {
     OPT_PROGRESS,
     OPT_TOLERANCE,
     OPT_TSC_LOOP_FATAL,
+    OPT_READAHEAD_THREADS,
+    OPT_TIME_WINDOW,
+    OPT_STREAM_BUFFER,
+    OPT_INTERVAL_JSON_SUMMARY,
     /* Specific letters */
     OPT_DUMP_ALL='a',
     OPT_INTERVAL_LENGTH='i',
@@ -10053,6 +10813,7 @@ error_t cmd_parser(int key, char *arg, struct argp_state *state)
         opt.sample_size = (int)strtol(arg, &inval, 0);
         if( inval == arg )
             argp_usage(state);
+        opt.sample_size_set = 1;
         break;
     }
     case OPT_MMIO_ENUMERATION_SKIP_VGA:
@@ -10284,6 +11045,13 @@ error_t cmd_parser(int key, char *arg, struct argp_state *state)
         break;
     }
 
+    case OPT_INTERVAL_JSON_SUMMARY:
+        opt.interval.output = INTERVAL_JSON_SUMMARY;
+        opt.interval_mode = 1;
+        opt.summary_info = 1;
+        G.output_defined = 1;
+        break;
+
     case OPT_INTERVAL_DOMAIN_GRANT_MAPS:
     {
         if((parse_array(arg, &opt.interval.array) < 0)
@@ -10360,6 +11128,49 @@ error_t cmd_parser(int key, char *arg, struct argp_state *state)
         opt.tsc_loop_fatal = 1;
         break;
 
+    case OPT_STREAM_BUFFER:
+    {
+        char * inval;
+
+        G.stream_limit = strtoul(arg, &inval, 0) << 20;
+        if ( inval == arg || !G.stream_limit )
+            argp_usage(state);
+    }
+    break;
+
+    case OPT_TIME_WINDOW:
+    {
+        char * inval;
+
+        G.window.start = strtod(arg, &inval);
+        if ( inval == arg || G.window.start < 0 )
+            argp_usage(state);
+        if ( *inval == ':' )
+        {
+            char *end = inval + 1;
+
+            G.window.end = strtod(end, &inval);
+            if ( inval == end || G.window.end <= G.window.start )
+                argp_usage(state);
+        }
+        if ( *inval )
+            argp_usage(state);
+        G.window.active = 1;
+    }
+    break;
+
+    case OPT_READAHEAD_THREADS:
+    {
+        char * inval;
+
+        opt.readahead_threads = (int)strtol(arg, &inval, 0);
+        if ( inval == arg || opt.readahead_threads < 0 )
+            argp_usage(state);
+        if ( opt.readahead_threads > MAX_CPUS )
+            opt.readahead_threads = MAX_CPUS;
+    }
+    break;
+
     case ARGP_KEY_ARG:
     {
         /* FIXME - strcpy */
@@ -10585,6 +11396,11 @@ const struct argp_option cmd_opts[] =  {
       .group = OPT_GROUP_INTERVAL,
       .doc = "Print a csv with the grant maps done on behalf of a given domain every interval.", },
 
+    { .name = "interval-json-summary",
+      .key = OPT_INTERVAL_JSON_SUMMARY,
+      .group = OPT_GROUP_INTERVAL,
+      .doc = "Print a line of JSON every interval with, for each vcpu, its runstate breakdown, time waiting for a pcpu and HVM exits by reason.", },
+
     /* Summary group */
     { .name = "show-default-domain-summary",
       .key = OPT_SHOW_DEFAULT_DOMAIN_SUMMARY,
@@ -10647,6 +11463,21 @@ const struct argp_option cmd_opts[] =  {
       .key = OPT_TSC_LOOP_FATAL,
       .doc = "Stop processing and exit if tsc skew tracking detects a dependency loop.", },
 
+    { .name = "time-window",
+      .key = OPT_TIME_WINDOW,
+      .arg = "start[:end]",
+      .doc = "Only analyse the records between start and end seconds into the trace.  Uses (and creates if needed) an index file next to the trace to find the start without reading the file.", },
+
+    { .name = "stream-buffer",
+      .key = OPT_STREAM_BUFFER,
+      .arg = "MB",
+      .doc = "When reading the trace from a pipe, how much of it to keep buffered at most.  A pcpu needing more to find its next records is considered lost until they come.  Default: 256.", },
+
+    { .name = "readahead-threads",
+      .key = OPT_READAHEAD_THREADS,
+      .arg = "N",
+      .doc = "Read the trace file ahead in N threads.  Records are still decoded and analysed in a single thread, so this only helps when reading is the bottleneck.  Default: 0 (no readahead).", },
+
     { .name = "tolerance",
       .key = OPT_TOLERANCE,
       .arg = "errlevel",
@@ -10659,7 +11490,7 @@ const struct argp_option cmd_opts[] =  {
 const struct argp parser_def = {
     .options = cmd_opts,
     .parser = cmd_parser,
-    .args_doc = "[trace file]",
+    .args_doc = "[trace file|-]",
     .doc = "",
 };
 
@@ -10675,24 +11506,43 @@ int main(int argc, char *argv[]) {
     if (G.trace_file == NULL)
         exit(1);
 
-    if ( (G.fd = open(G.trace_file, O_RDONLY)) < 0) {
+    if ( !strcmp(G.trace_file, "-") )
+        G.fd = STDIN_FILENO;
+    else if ( (G.fd = open(G.trace_file, O_RDONLY)) < 0) {
         perror("open");
         error(ERR_SYSTEM, NULL);
-    } else {
-        struct stat s;
-        fstat(G.fd, &s);
-        G.file_size = s.st_size;
     }
 
     if ( (G.mh = mread_init(G.fd)) == NULL )
         perror("mread");
 
+    G.file_size = G.mh->file_size;
+    G.stream = G.mh->stream.active;
+
+    if ( G.stream ) {
+        if ( G.window.active || opt.readahead_threads || opt.progress ) {
+            fprintf(stderr, "--time-window, --readahead-threads and --progress "
+                    "need a trace file, not a pipe.\n");
+            exit(1);
+        }
+
+        if ( G.stream_limit )
+            G.mh->stream.limit = G.stream_limit;
+
+        /* Keep the memory used per vcpu bounded, unless told otherwise */
+        if ( !opt.sample_size_set )
+            opt.sample_size = 0;
+    }
+
     if (G.symbol_file != NULL)
         parse_symbol_file(G.symbol_file);
 
     if(opt.dump_all)
         warn = stdout;
 
+    if(opt.readahead_threads)
+        prefetch_init();
+
     init_pcpus();
 
     if(opt.progress)
@@ -10700,6 +11550,9 @@ int main(int argc, char *argv[]) {
 
     process_records();
 
+    if(opt.readahead_threads)
+        prefetch_finish();
+
     if(opt.interval_mode)
         interval_tail();
 
@@ -26,6 +26,8 @@
 #include <ctype.h>
 #include <sys/poll.h>
 #include <sys/statvfs.h>
+#include <sys/time.h>
+#include <pthread.h>
 
 #include <xen/xen.h>
 #include <xen/trace.h>
@@ -49,6 +51,9 @@ do {                                                            \
 #define POLL_SLEEP_MILLIS 100
 
 #define DEFAULT_TBUF_SIZE 32
+
+/* minimum size of the staging buffer of each writer thread */
+#define WRITER_BUF_SIZE (4UL << 20)
 /***** The code **************************************************************/
 
 typedef struct settings_st {
@@ -60,9 +65,12 @@ typedef struct settings_st {
     unsigned long disk_rsvd;
     unsigned long timeout;
     unsigned long memory_buffer;
+    unsigned int writer_threads;
+    struct xen_sysctl_tbuf_filter filter;
     uint8_t discard:1,
         disable_tracing:1,
-        start_disabled:1;
+        start_disabled:1,
+        compact:1;
 } settings_t;
 
 struct t_struct {
@@ -80,6 +88,14 @@ static xenevtchn_handle *xce_handle = NULL;
 static int virq_port = -1;
 static int outfd = 1;
 
+/* Per-cpu record statistics, each only updated by the thread reading
+ * that cpu's buffer. */
+static struct cpu_stats {
+    unsigned long long records;
+    unsigned long long lost;        /* records dropped by Xen */
+    unsigned long lost_events;      /* TRC_LOST_RECORDS seen */
+} *cpu_stats;
+
 static void close_handler(int signal)
 {
     interrupted = 1;
@@ -121,12 +137,19 @@ struct cpu_change_record {
     struct {
         int cpu;
         unsigned window_size;
+        uint32_t flags;     /* TRC_TRACE_CPU_CHANGE_*, only if non-zero */
     } data;
 };
 
+static uint32_t cpu_change_flags;
+
+#define CPU_CHANGE_SIZE                                             \
+    (cpu_change_flags ? sizeof(struct cpu_change_record)            \
+     : offsetof(struct cpu_change_record, data.flags))
+
 #define CPU_CHANGE_HEADER                                           \
     (TRC_TRACE_CPU_CHANGE                                           \
-     | (((sizeof(struct cpu_change_record)/sizeof(uint32_t)) - 1)   \
+     | (((CPU_CHANGE_SIZE/sizeof(uint32_t)) - 1)                    \
         << TRACE_EXTRA_SHIFT) )
 
 void membuf_alloc(unsigned long size)
@@ -162,7 +185,7 @@ void membuf_reserve_window(unsigned cpu, unsigned long window_size)
         exit(1);
     }
 
-    need_to_consume = window_size + sizeof(*rec);
+    need_to_consume = window_size + CPU_CHANGE_SIZE;
 
     if ( window_size > membuf.size )
     {
@@ -194,7 +217,7 @@ void membuf_reserve_window(unsigned cpu, unsigned long window_size)
             exit(EXIT_FAILURE);
         }
 
-        freed = sizeof(*rec) + rec->data.window_size;
+        freed = CPU_CHANGE_SIZE + rec->data.window_size;
 
         if ( need_to_consume > 0 )
         {
@@ -211,7 +234,7 @@ void membuf_reserve_window(unsigned cpu, unsigned long window_size)
     {
         last_cpu = rec->data.cpu; 
 
-        freed = sizeof(*rec) + rec->data.window_size;
+        freed = CPU_CHANGE_SIZE + rec->data.window_size;
         
         MEMBUF_CONS_INCREMENT(freed);
         rec = (struct cpu_change_record *)MEMBUF_POINTER(membuf.cons);
@@ -230,8 +253,10 @@ start_window:
     rec->header = CPU_CHANGE_HEADER;
     rec->data.cpu = cpu;
     rec->data.window_size = window_size;
+    if ( cpu_change_flags )
+        rec->data.flags = cpu_change_flags;
 
-    membuf.pending_prod += sizeof(*rec);
+    membuf.pending_prod += CPU_CHANGE_SIZE;
 }
 
 void membuf_write(void *start, unsigned long size) {
@@ -332,6 +357,36 @@ fail:
     return;
 }
 
+/**
+ * check_disk_space - exit if writing would go over the disk reservation
+ * @size     - size of the upcoming write
+ */
+static void check_disk_space(unsigned long size)
+{
+    struct statvfs stat;
+    unsigned long long freespace;
+
+    if ( opts.disk_rsvd == 0 )
+        return;
+
+    /* Check that filesystem has enough space. */
+    if ( fstatvfs (outfd, &stat) )
+    {
+        PERROR("Statfs failed!");
+        exit(EXIT_FAILURE);
+    }
+
+    freespace = stat.f_frsize * (unsigned long long)stat.f_bfree;
+    freespace -= size;
+    freespace >>= 20; /* Convert to MB */
+
+    if ( freespace <= opts.disk_rsvd )
+    {
+        fprintf(stderr, "Disk space limit reached (free space: %lluMB, limit: %luMB).\n", freespace, opts.disk_rsvd);
+        exit (EXIT_FAILURE);
+    }
+}
+
 /**
  * write_buffer - write a section of the trace buffer
  * @cpu      - source buffer CPU ID
@@ -346,35 +401,10 @@ fail:
 static void write_buffer(unsigned int cpu, unsigned char *start, int size,
                          int total_size)
 {
-    struct statvfs stat;
     size_t written = 0;
     
-    if ( opts.memory_buffer == 0 && opts.disk_rsvd != 0 )
-    {
-        unsigned long long freespace;
-
-        /* Check that filesystem has enough space. */
-        if ( fstatvfs (outfd, &stat) )
-        {
-            fprintf(stderr, "Statfs failed!\n");
-            goto fail;
-        }
-
-        freespace = stat.f_frsize * (unsigned long long)stat.f_bfree;
-
-        if ( total_size )
-            freespace -= total_size;
-        else
-            freespace -= size;
-
-        freespace >>= 20; /* Convert to MB */
-
-        if ( freespace <= opts.disk_rsvd )
-        {
-            fprintf(stderr, "Disk space limit reached (free space: %lluMB, limit: %luMB).\n", freespace, opts.disk_rsvd);
-            exit (EXIT_FAILURE);
-        }
-    }
+    if ( opts.memory_buffer == 0 )
+        check_disk_space(total_size ? total_size : size);
 
     /* Write a CPU_BUF record on each buffer "window" written.  Wrapped
      * windows may involve two writes, so only write the record on the
@@ -392,9 +422,10 @@ static void write_buffer(unsigned int cpu, unsigned char *start, int size,
             rec.header = CPU_CHANGE_HEADER;
             rec.data.cpu = cpu;
             rec.data.window_size = total_size;
+            rec.data.flags = cpu_change_flags;
 
-            written = write(outfd, &rec, sizeof(rec));
-            if ( written != sizeof(rec) )
+            written = write(outfd, &rec, CPU_CHANGE_SIZE);
+            if ( written != CPU_CHANGE_SIZE )
             {
                 fprintf(stderr, "Cannot write cpu change (write returned %zd)\n",
                         written);
@@ -425,6 +456,135 @@ fail:
     exit(EXIT_FAILURE);
 }
 
+/**
+ * account_window - update the record statistics of a cpu
+ * @cpu         - source buffer CPU ID
+ * @data        - trace buffer data area
+ * @data_size   - size of the data area
+ * @start       - offset of the window in the data area
+ * @window_size - size of the window
+ *
+ * Walks the records of a window which has not been released to Xen yet.
+ * Records may be split across the end of the data area, so this can't
+ * be done piece by piece.
+ */
+static void account_window(unsigned int cpu, const unsigned char *data,
+                           unsigned long data_size, unsigned long start,
+                           unsigned long window_size)
+{
+    struct cpu_stats *stats = &cpu_stats[cpu];
+    unsigned long off = 0;
+
+#define WINDOW_U32(_o) (*(const uint32_t *)(data + (start + (_o)) % data_size))
+
+    while ( off + sizeof(uint32_t) <= window_size )
+    {
+        uint32_t header = WINDOW_U32(off);
+        uint32_t event = header & ((1u << TRACE_EXTRA_SHIFT) - 1);
+        unsigned int extra = (header >> TRACE_EXTRA_SHIFT) & 7;
+        unsigned int cycles = header >> 31;
+        unsigned long rec_size = 4 * (1 + extra + (cycles ? 2 : 0));
+
+        if ( off + rec_size > window_size )
+            break;
+
+        if ( event == TRC_LOST_RECORDS && extra > 0 )
+        {
+            stats->lost += WINDOW_U32(off + 4 * (1 + (cycles ? 2 : 0)));
+            stats->lost_events++;
+        }
+        else
+            stats->records++;
+
+        off += rec_size;
+    }
+
+#undef WINDOW_U32
+}
+
+/**
+ * discard_buffer - drop the records currently in a trace buffer
+ *
+ * In the compact format, the records following the last one carrying a
+ * full TSC are only timestamped relative to it, so keep from that one.
+ */
+static void discard_buffer(struct t_buf *meta, const unsigned char *data,
+                           unsigned long data_size)
+{
+    unsigned long cons = meta->cons, prod = meta->prod;
+    unsigned long window_size, off = 0, keep;
+
+    xen_rmb(); /* read prod, then read item. */
+
+    if ( !(cpu_change_flags & TRC_TRACE_CPU_CHANGE_COMPACT) || cons == prod )
+    {
+        meta->cons = prod;
+        return;
+    }
+
+    window_size = prod < cons ? (prod + 2*data_size) - cons : prod - cons;
+    keep = window_size;
+
+#define WINDOW_U32(_o) (*(const uint32_t *)(data + (cons + (_o)) % data_size))
+
+    while ( off + sizeof(uint32_t) <= window_size )
+    {
+        uint32_t header = WINDOW_U32(off);
+        unsigned int extra = (header >> TRACE_EXTRA_SHIFT) & 7;
+        unsigned int cycles = header >> 31;
+
+        if ( cycles )
+            keep = off;
+        off += 4 * (1 + extra + (cycles ? 2 : 0));
+    }
+
+#undef WINDOW_U32
+
+    xen_mb(); /* read buffer, then update cons. */
+    meta->cons = (cons + keep) % (2*data_size);
+}
+
+/**
+ * report_stats - report on stderr how many records Xen had to drop
+ * @num     - number of cpus
+ * @seconds - duration of the trace
+ */
+static void report_stats(unsigned int num, double seconds)
+{
+    unsigned long long records = 0, lost = 0;
+    unsigned int i;
+
+    for ( i = 0; i < num; i++ )
+    {
+        records += cpu_stats[i].records;
+        lost += cpu_stats[i].lost;
+    }
+
+    if ( lost == 0 )
+        return;
+
+    fprintf(stderr, "Xen dropped %llu of %llu records (%.2f%%), "
+            "%.0f records/s over %.1fs:\n", lost, records + lost,
+            100.0 * lost / (records + lost),
+            seconds > 0 ? lost / seconds : 0.0, seconds);
+
+    for ( i = 0; i < num; i++ )
+    {
+        struct cpu_stats *stats = &cpu_stats[i];
+
+        if ( stats->lost == 0 )
+            continue;
+        fprintf(stderr, "  cpu %u: %llu of %llu records (%.2f%%) "
+                "in %lu bursts\n", i, stats->lost,
+                stats->records + stats->lost,
+                100.0 * stats->lost / (stats->records + stats->lost),
+                stats->lost_events);
+    }
+
+    fprintf(stderr, "Consider a larger buffer (-S) or more writer "
+            "threads (-w).\n");
+}
+
 static void disable_tbufs(void)
 {
     xc_interface *xc_handle = xc_interface_open(0,0,0);
@@ -445,6 +605,7 @@ static void disable_tbufs(void)
 
 static void get_tbufs(unsigned long *mfn, unsigned long *size)
 {
+    uint32_t format;
     int ret;
 
     if(!opts.tbuf_size)
@@ -457,6 +618,23 @@ static void get_tbufs(unsigned long *mfn, unsigned long *size)
         perror("Couldn't enable trace buffers");
         exit(1);
     }
+
+    /* Tracing may have been enabled by someone else, in any format. */
+    if ( xc_tbuf_get_format(xc_handle, &format) != 0 )
+    {
+        PERROR("Couldn't get the trace record format");
+        exit(EXIT_FAILURE);
+    }
+    if ( format == XEN_SYSCTL_TBUF_FORMAT_compact )
+    {
+        if ( opts.memory_buffer )
+        {
+            fprintf(stderr, "Tracing is enabled in the compact format, "
+                    "which cannot be used with a memory buffer.\n");
+            exit(EXIT_FAILURE);
+        }
+        cpu_change_flags |= TRC_TRACE_CPU_CHANGE_COMPACT;
+    }
 }
 
 /**
@@ -578,6 +756,36 @@ static void set_evt_mask(uint32_t mask)
     }
 }
 
+/**
+ * set_filter - set the record filters and format in HV
+ *
+ * The filters are always set, so that none is left over from a previous
+ * run.  The format can only be changed while tracing is disabled, which
+ * only matters if the compact one was asked for.
+ */
+static void set_filter(void)
+{
+    uint32_t format = opts.compact ? XEN_SYSCTL_TBUF_FORMAT_compact
+                                   : XEN_SYSCTL_TBUF_FORMAT_full;
+
+    if ( xc_tbuf_set_filter(xc_handle, &opts.filter) != 0 )
+    {
+        PERROR("Failure to set the trace filters");
+        exit(EXIT_FAILURE);
+    }
+
+    if ( xc_tbuf_set_format(xc_handle, format) != 0 &&
+         (opts.compact || errno != EBUSY) )
+    {
+        if ( errno == EBUSY )
+            fprintf(stderr, "Tracing is enabled, cannot switch to the "
+                    "compact format.\n");
+        else
+            PERROR("Failure to set the trace record format");
+        exit(EXIT_FAILURE);
+    }
+}
+
 /**
  * get_num_cpus - get the number of logical CPUs
  */
@@ -658,6 +866,252 @@ static void wait_for_event_or_timeout(unsigned long milliseconds)
 }
 
 
+/*
+ * Writer threads
+ *
+ * With -w, the buffers are read by a pool of threads instead of the main
+ * loop, each thread serving the cpus whose number modulo the number of
+ * threads is its index.  A thread copies the windows of its cpus, each
+ * prefixed with its cpu_change record, into a large page-aligned staging
+ * buffer and hands the buffer back to Xen straight away; the staging
+ * buffer is written out once per pass (or when full), so a single slow
+ * write neither holds up the other cpus nor costs one syscall per window.
+ *
+ * The main thread keeps waiting for VIRQ_TBUF and wakes all the writers
+ * by bumping the generation counter.  Windows stay contiguous in the
+ * output, which is all xenalyze and xentrace_format rely on.
+ */
+
+struct writer {
+    pthread_t thread;
+    unsigned int id;
+    unsigned char *buf;
+    unsigned long len, size;
+};
+
+static struct {
+    struct writer *writers;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned long generation;
+    int stop;
+
+    /* output position, when the output is seekable */
+    pthread_mutex_t out_lock;
+    off_t out_offset;
+    int out_seekable;
+
+    struct t_buf **meta;
+    unsigned char **data;
+    unsigned long data_size;
+    unsigned int num;
+} wr = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .out_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void writer_flush(struct writer *w)
+{
+    unsigned long done = 0;
+    ssize_t rc;
+    off_t offset = 0;
+
+    if ( w->len == 0 )
+        return;
+
+    check_disk_space(w->len);
+
+    /* A seekable output only needs the offset to be reserved, so the
+     * writes themselves can proceed in parallel. */
+    pthread_mutex_lock(&wr.out_lock);
+    if ( wr.out_seekable )
+    {
+        offset = wr.out_offset;
+        wr.out_offset += w->len;
+        pthread_mutex_unlock(&wr.out_lock);
+    }
+
+    while ( done < w->len )
+    {
+        if ( wr.out_seekable )
+            rc = pwrite(outfd, w->buf + done, w->len - done, offset + done);
+        else
+            rc = write(outfd, w->buf + done, w->len - done);
+        if ( rc < 0 && errno == EINTR )
+            continue;
+        if ( rc <= 0 )
+        {
+            PERROR("Failed to write trace data");
+            exit(EXIT_FAILURE);
+        }
+        done += rc;
+    }
+
+    if ( !wr.out_seekable )
+        pthread_mutex_unlock(&wr.out_lock);
+
+    w->len = 0;
+}
+
+static void writer_copy(struct writer *w, const void *src, unsigned long size)
+{
+    memcpy(w->buf + w->len, src, size);
+    w->len += size;
+}
+
+static void writer_drain_cpu(struct writer *w, unsigned int cpu)
+{
+    struct t_buf *meta = wr.meta[cpu];
+    unsigned char *data = wr.data[cpu];
+    unsigned long data_size = wr.data_size;
+    unsigned long start_offset, window_size, cons, prod;
+    struct cpu_change_record rec;
+
+    cons = meta->cons;
+    prod = meta->prod;
+    xen_rmb(); /* read prod, then read item. */
+
+    if ( cons == prod )
+        return;
+
+    assert(cons < 2*data_size);
+    assert(prod < 2*data_size);
+
+    if ( prod < cons )
+        window_size = (prod + 2*data_size) - cons;
+    else
+        window_size = prod - cons;
+    assert(window_size <= data_size);
+
+    start_offset = cons % data_size;
+
+    if ( w->len + CPU_CHANGE_SIZE + window_size > w->size )
+        writer_flush(w);
+
+    account_window(cpu, data, data_size, start_offset, window_size);
+
+    rec.header = CPU_CHANGE_HEADER;
+    rec.data.cpu = cpu;
+    rec.data.window_size = window_size;
+    rec.data.flags = cpu_change_flags;
+    writer_copy(w, &rec, CPU_CHANGE_SIZE);
+
+    if ( start_offset + window_size <= data_size )
+        writer_copy(w, data + start_offset, window_size);
+    else
+    {
+        writer_copy(w, data + start_offset, data_size - start_offset);
+        writer_copy(w, data, window_size - (data_size - start_offset));
+    }
+
+    xen_mb(); /* read buffer, then update cons. */
+    meta->cons = prod;
+}
+
+static void *writer_thread(void *arg)
+{
+    struct writer *w = arg;
+    unsigned long seen = 0;
+    unsigned int cpu;
+    int stop;
+
+    pthread_mutex_lock(&wr.lock);
+    for ( ;; )
+    {
+        while ( wr.generation == seen && !wr.stop )
+            pthread_cond_wait(&wr.cond, &wr.lock);
+        seen = wr.generation;
+        stop = wr.stop;
+        pthread_mutex_unlock(&wr.lock);
+
+        for ( cpu = w->id; cpu < wr.num; cpu += opts.writer_threads )
+            writer_drain_cpu(w, cpu);
+        writer_flush(w);
+
+        if ( stop )
+            break;
+        pthread_mutex_lock(&wr.lock);
+    }
+
+    return NULL;
+}
+
+static void start_writers(struct t_struct *tbufs, unsigned int num,
+                          unsigned long data_size)
+{
+    unsigned int i;
+    int rc;
+
+    if ( opts.writer_threads > num )
+        opts.writer_threads = num;
+
+    wr.meta = tbufs->meta;
+    wr.data = tbufs->data;
+    wr.data_size = data_size;
+    wr.num = num;
+
+    wr.out_offset = lseek(outfd, 0, SEEK_CUR);
+    wr.out_seekable = wr.out_offset != (off_t)-1;
+
+    wr.writers = calloc(opts.writer_threads, sizeof(*wr.writers));
+    if ( wr.writers == NULL )
+    {
+        PERROR("Failed to allocate writer threads");
+        exit(EXIT_FAILURE);
+    }
+
+    for ( i = 0; i < opts.writer_threads; i++ )
+    {
+        struct writer *w = &wr.writers[i];
+
+        w->id = i;
+        w->size = data_size + sizeof(struct cpu_change_record);
+        if ( w->size < WRITER_BUF_SIZE )
+            w->size = WRITER_BUF_SIZE;
+        w->size = (w->size + XC_PAGE_SIZE - 1) & ~(XC_PAGE_SIZE - 1);
+
+        rc = posix_memalign((void **)&w->buf, XC_PAGE_SIZE, w->size);
+        if ( rc )
+        {
+            errno = rc;
+            PERROR("Failed to allocate writer buffer");
+            exit(EXIT_FAILURE);
+        }
+
+        rc = pthread_create(&w->thread, NULL, writer_thread, w);
+        if ( rc )
+        {
+            errno = rc;
+            PERROR("Failed to create writer thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void kick_writers(int stop)
+{
+    pthread_mutex_lock(&wr.lock);
+    wr.generation++;
+    wr.stop = stop;
+    pthread_cond_broadcast(&wr.cond);
+    pthread_mutex_unlock(&wr.lock);
+}
+
+/* Let every writer do a last pass, and wait for them */
+static void stop_writers(void)
+{
+    unsigned int i;
+
+    kick_writers(1);
+    for ( i = 0; i < opts.writer_threads; i++ )
+    {
+        pthread_join(wr.writers[i].thread, NULL);
+        free(wr.writers[i].buf);
+    }
+    free(wr.writers);
+}
+
 /**
  * monitor_tbufs - monitor the contents of tbufs and output to a file
  * @logfile:       the FILE * representing the file to log to
@@ -676,6 +1130,7 @@ static int monitor_tbufs(void)
     unsigned long size;          /* size of a single trace buffer            */
 
     unsigned long data_size;
+    struct timeval start_time, end_time;
 
     int last_read = 1;
 
@@ -702,7 +1157,33 @@ static int monitor_tbufs(void)
 
     if ( opts.discard )
         for ( i = 0; i < num; i++ )
-            meta[i]->cons = meta[i]->prod;
+            discard_buffer(meta[i], data[i], data_size);
+
+    cpu_stats = calloc(num, sizeof(*cpu_stats));
+    if ( cpu_stats == NULL )
+    {
+        PERROR("Failed to allocate memory for statistics");
+        exit(EXIT_FAILURE);
+    }
+
+    gettimeofday(&start_time, NULL);
+
+    if ( opts.writer_threads )
+    {
+        start_writers(tbufs, num, data_size);
+
+        while ( !interrupted )
+        {
+            kick_writers(0);
+            wait_for_event_or_timeout(opts.poll_sleep);
+        }
+
+        /* Disable tracing, then have the buffers read one last time */
+        if ( opts.disable_tracing )
+            disable_tbufs();
+        stop_writers();
+        goto done;
+    }
 
     /* now, scan buffers for events */
     while ( 1 )
@@ -734,6 +1215,8 @@ static int monitor_tbufs(void)
             start_offset = cons % data_size;
             end_offset = prod % data_size;
 
+            account_window(i, data[i], data_size, start_offset, window_size);
+
             if ( end_offset > start_offset )
             {
                 /* If window does not wrap, write in one big chunk */
@@ -780,6 +1263,11 @@ static int monitor_tbufs(void)
     if ( opts.memory_buffer )
         membuf_dump();
 
+ done:
+    gettimeofday(&end_time, NULL);
+    report_stats(num, (end_time.tv_sec - start_time.tv_sec) +
+                 (end_time.tv_usec - start_time.tv_usec) / 1000000.0);
+
     /* cleanup */
     free(meta);
     free(data);
@@ -835,6 +1323,19 @@ static void usage(void)
 "  -r  --reserve-disk-space=n Before writing trace records to disk, check to see\n" \
 "                          that after the write there will be at least n space\n" \
 "                          left on the disk.\n" \
+"  -w  --writer-threads=n  Read the trace buffers from n threads rather than\n" \
+"                          from the main loop, staging the data of several\n" \
+"                          buffers per write.  Cannot be combined with -M.\n" \
+"  -d  --domain=d          Only trace records generated while domain d (or\n" \
+"                          the idle domain) is running.\n" \
+"  -R  --event-range=a-b   Only trace events with ids between a and b.\n" \
+"  -n  --sample=n          Only trace one in every n records passing the\n" \
+"                          other filters, on each cpu.\n" \
+"  -C  --compact           Have Xen write timestamps as deltas from the\n" \
+"                          previous record on the same cpu when it can,\n" \
+"                          which saves 4 bytes per record.  Tracing must be\n" \
+"                          disabled when xentrace starts.  Cannot be\n" \
+"                          combined with -M.\n" \
 "\n" \
 "This tool is used to capture trace buffer data from Xen. The\n" \
 "data is output in a binary format, in the following order:\n" \
@@ -898,6 +1399,30 @@ invalid:
     return 0; /* not actually reached */
 }
 
+/* parse an event id range, "min-max" */
+static void parse_event_range(const char *arg)
+{
+    const char *max;
+    char *endp;
+
+    errno = 0;
+    opts.filter.evt_min = strtoul(arg, &endp, 0);
+    if ( errno != 0 || endp == arg || *endp != '-' )
+        goto invalid;
+    max = endp + 1;
+    opts.filter.evt_max = strtoul(max, &endp, 0);
+    if ( errno != 0 || endp == max || *endp != '\0' ||
+         opts.filter.evt_max < opts.filter.evt_min )
+        goto invalid;
+
+    opts.filter.flags |= XEN_SYSCTL_TBUF_FILTER_range;
+    return;
+
+invalid:
+    fprintf(stderr, "Invalid event range: %s\n\n", arg);
+    usage();
+}
+
 /* convert the argument string pointed to by arg to a long int representation */
 static long argtol(const char *restrict arg, int base)
 {
@@ -1083,12 +1608,17 @@ static void parse_args(int argc, char **argv)
         { "discard-buffers", no_argument,      0, 'D' },
         { "dont-disable-tracing", no_argument, 0, 'x' },
         { "start-disabled", no_argument,       0, 'X' },
+        { "writer-threads", required_argument, 0, 'w' },
+        { "domain",         required_argument, 0, 'd' },
+        { "event-range",    required_argument, 0, 'R' },
+        { "sample",         required_argument, 0, 'n' },
+        { "compact",        no_argument,       0, 'C' },
         { "help",           no_argument,       0, '?' },
         { "version",        no_argument,       0, 'V' },
         { 0, 0, 0, 0 }
     };
 
-    while ( (option = getopt_long(argc, argv, "t:s:c:e:S:r:T:M:DxX?V",
+    while ( (option = getopt_long(argc, argv, "t:s:c:e:S:r:T:M:w:d:R:n:CDxX?V",
                     long_options, NULL)) != -1) 
     {
         switch ( option )
@@ -1137,11 +1667,55 @@ static void parse_args(int argc, char **argv)
             opts.memory_buffer = sargtol(optarg, 0);
             break;
 
+        case 'w':
+            opts.writer_threads = argtol(optarg, 0);
+            break;
+
+        case 'd':
+            opts.filter.domid = argtol(optarg, 0);
+            opts.filter.flags |= XEN_SYSCTL_TBUF_FILTER_domain;
+            break;
+
+        case 'R':
+            parse_event_range(optarg);
+            break;
+
+        case 'n':
+            opts.filter.sample = argtol(optarg, 0);
+            if ( opts.filter.sample == 0 )
+            {
+                fprintf(stderr, "Invalid sample rate: %s\n\n", optarg);
+                usage();
+            }
+            opts.filter.flags |= XEN_SYSCTL_TBUF_FILTER_sample;
+            break;
+
+        case 'C':
+            opts.compact = 1;
+            break;
+
         default:
             usage();
         }
     }
 
+    if ( opts.memory_buffer && opts.writer_threads )
+    {
+        fprintf(stderr, "Writer threads cannot be used with a memory buffer.\n\n");
+        usage();
+    }
+
+    /*
+     * The oldest windows of the memory buffer are thrown away, and with
+     * them the records the timestamp deltas of the next ones are
+     * relative to.
+     */
+    if ( opts.memory_buffer && opts.compact )
+    {
+        fprintf(stderr, "The compact format cannot be used with a memory buffer.\n\n");
+        usage();
+    }
+
     /* get outfile (required last argument) */
     if (optind != (argc-1))
         usage();
@@ -1167,6 +1741,7 @@ int main(int argc, char **argv)
     opts.disable_tracing = 1;
     opts.start_disabled = 0;
     opts.timeout = 0;
+    opts.writer_threads = 0;
 
     parse_args(argc, argv);
 
@@ -1180,6 +1755,8 @@ int main(int argc, char **argv)
     if ( opts.evt_mask != 0 )
         set_evt_mask(opts.evt_mask);
 
+    set_filter();
+
     if ( opts.cpu_mask_str )
     {
         if ( parse_cpu_mask() )
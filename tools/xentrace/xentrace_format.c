@@ -0,0 +1,1455 @@
+/******************************************************************************
+ * tools/xentrace/xentrace_format.c
+ *
+ * Reformat xentrace binary data according to a file of rules.
+ *
+ * This replaces the original Python script by Mark Williamson, (C) 2004
+ * Intel Research Cambridge.  Rule files are read the same way and the
+ * output is the same, including the Python '%' formatting semantics the
+ * rules rely on, but each rule is compiled once into a list of pieces,
+ * rules are found through a hash table, and the text of whole batches
+ * of records can be produced by several threads.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <ctype.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+#define TRC_TRACE_CPU_CHANGE        0x1f003
+#define TRC_TRACE_IRQ               0x1f004
+#define TRC_PV_HYPERCALL_V2         0x20100d
+#define TRC_PV_HYPERCALL_SUBCALL    0x20100e
+
+#define NR_VECTORS                  256
+
+/* records decoded in one go, and handed to one formatting thread */
+#define BATCH_RECORDS               4096
+#define INPUT_BUF_SIZE              (1UL << 20)
+
+/*
+ * The values a rule can refer to.  They are numbered in the order a
+ * Python 2 dict with these keys is printed in, which is what has to be
+ * reproduced when a rule cannot be applied to a record.
+ */
+enum {
+    ARG_2, ARG_EVENT, ARG_TSC, ARG_1, ARG_3, ARG_RELTSC,
+    ARG_5, ARG_4, ARG_7, ARG_6, ARG_CPU,
+    NR_ARGS,
+    ARG_DICT = NR_ARGS,     /* the whole set of values, as "%s" sees it */
+};
+
+static const char *const arg_names[NR_ARGS] = {
+    "2", "event", "tsc", "1", "3", "reltsc", "5", "4", "7", "6", "cpu",
+};
+
+#define F_LJUST     (1 << 0)
+#define F_SIGN      (1 << 1)
+#define F_BLANK     (1 << 2)
+#define F_ALT       (1 << 3)
+#define F_ZERO      (1 << 4)
+
+enum piece_kind {
+    PIECE_TEXT,         /* literal text */
+    PIECE_CONV,         /* a conversion */
+    PIECE_TYPE_ERROR,   /* the rule cannot be applied: print it raw */
+    PIECE_FATAL,        /* the original script died here */
+};
+
+struct piece {
+    enum piece_kind kind;
+    char conv;
+    unsigned char flags;
+    int arg;
+    int width;
+    int prec;           /* -1 if none was given */
+    const char *text;   /* PIECE_TEXT: the text; PIECE_FATAL: the error */
+    size_t len;
+};
+
+struct rule {
+    long long event;
+    char *text;         /* the rule as written, minus the event id */
+    size_t len;
+    struct piece *pieces;
+    unsigned int nr_pieces;
+};
+
+static struct {
+    struct rule **slot;
+    unsigned long mask;
+    struct rule *dflt;  /* the rule for event 0, used for everything else */
+} rules;
+
+struct record {
+    long long d[7];
+    long long cpu;
+    long long tsc;      /* 0 if the record carried none */
+    long long reltsc;
+    long long last_tsc; /* for the "stepped backward" warning */
+    uint32_t event;
+    int tsc_in;
+    int backward;
+};
+
+struct outbuf {
+    char *p;
+    size_t len, size;
+};
+
+enum batch_state { BATCH_FREE, BATCH_DECODED, BATCH_FORMATTED };
+
+struct batch {
+    struct record rec[BATCH_RECORDS];
+    unsigned int nr;
+    enum batch_state state;
+    struct outbuf out;
+    const char *decode_error;   /* the input stopped with this error */
+    const char *error;          /* formatting stopped with this error */
+    char errbuf[160];
+};
+
+static long mhz;
+static int benchmark;
+static volatile sig_atomic_t interrupted;
+
+static void fatal(const char *fmt, ...)
+    __attribute__((format(printf, 1, 2), noreturn));
+
+static void fatal(const char *fmt, ...)
+{
+    va_list ap;
+
+    fflush(stdout);
+    fprintf(stderr, "xentrace_format: ");
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+    exit(EXIT_FAILURE);
+}
+
+static void *xmalloc(size_t size)
+{
+    void *p = malloc(size);
+
+    if ( !p )
+        fatal("out of memory");
+    return p;
+}
+
+static void *xrealloc(void *old, size_t size)
+{
+    void *p = realloc(old, size);
+
+    if ( !p )
+        fatal("out of memory");
+    return p;
+}
+
+/***** Output buffers ********************************************************/
+
+static inline void out_reserve(struct outbuf *o, size_t n)
+{
+    if ( o->len + n <= o->size )
+        return;
+    o->size = o->size ? o->size * 2 : 65536;
+    while ( o->len + n > o->size )
+        o->size *= 2;
+    o->p = xrealloc(o->p, o->size);
+}
+
+static inline void out_put(struct outbuf *o, const char *s, size_t n)
+{
+    out_reserve(o, n);
+    memcpy(o->p + o->len, s, n);
+    o->len += n;
+}
+
+static inline void out_putc(struct outbuf *o, char c)
+{
+    out_reserve(o, 1);
+    o->p[o->len++] = c;
+}
+
+static inline void out_fill(struct outbuf *o, char c, size_t n)
+{
+    out_reserve(o, n);
+    memset(o->p + o->len, c, n);
+    o->len += n;
+}
+
+/***** Rules *****************************************************************/
+
+static void add_piece(struct rule *r, const struct piece *p)
+{
+    if ( (r->nr_pieces & (r->nr_pieces - 1)) == 0 )
+        r->pieces = xrealloc(r->pieces,
+                             (r->nr_pieces ? r->nr_pieces * 2 : 4) *
+                             sizeof(*r->pieces));
+    r->pieces[r->nr_pieces++] = *p;
+}
+
+static void add_text(struct rule *r, const char *s, size_t len)
+{
+    struct piece p = { .kind = PIECE_TEXT, .text = s, .len = len };
+
+    if ( len )
+        add_piece(r, &p);
+}
+
+static void add_error(struct rule *r, enum piece_kind kind,
+                      const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+static void add_error(struct rule *r, enum piece_kind kind,
+                      const char *fmt, ...)
+{
+    struct piece p = { .kind = kind };
+    char msg[128];
+    va_list ap;
+
+    if ( fmt )
+    {
+        va_start(ap, fmt);
+        vsnprintf(msg, sizeof(msg), fmt, ap);
+        va_end(ap);
+        p.text = strdup(msg);
+        if ( !p.text )
+            fatal("out of memory");
+    }
+    add_piece(r, &p);
+}
+
+/*
+ * Turn the text of a rule into pieces, following the parser of Python
+ * 2's string '%' operator with a dict on the right-hand side.  Errors
+ * Python only reports when the rule is used become pieces of their own,
+ * and nothing after them is ever reached.
+ */
+static void compile_rule(struct rule *r)
+{
+    const char *start = r->text, *fmt = start, *lit = start;
+    long fmtcnt = r->len;
+    int cur = ARG_DICT, have_arg = 1;
+
+    while ( --fmtcnt >= 0 )
+    {
+        struct piece p = { .kind = PIECE_CONV, .width = -1, .prec = -1 };
+        int c = '\0';
+
+        if ( *fmt != '%' )
+        {
+            fmt++;
+            continue;
+        }
+        add_text(r, lit, fmt - lit);
+        fmt++;
+
+        if ( *fmt == '(' )
+        {
+            const char *key;
+            int pcount = 1, i;
+            long keylen;
+
+            key = ++fmt;
+            --fmtcnt;
+            while ( pcount > 0 && --fmtcnt >= 0 )
+            {
+                if ( *fmt == ')' )
+                    --pcount;
+                else if ( *fmt == '(' )
+                    ++pcount;
+                fmt++;
+            }
+            keylen = fmt - key - 1;
+            if ( fmtcnt < 0 || pcount > 0 )
+            {
+                add_error(r, PIECE_FATAL, "incomplete field name");
+                return;
+            }
+            for ( i = 0; i < NR_ARGS; i++ )
+                if ( strlen(arg_names[i]) == keylen &&
+                     !memcmp(arg_names[i], key, keylen) )
+                    break;
+            if ( i == NR_ARGS )
+            {
+                add_error(r, PIECE_FATAL, "unknown field '%.*s'",
+                          (int)keylen, key);
+                return;
+            }
+            cur = i;
+            have_arg = 1;
+        }
+
+        while ( --fmtcnt >= 0 )
+        {
+            switch ( c = *fmt++ )
+            {
+            case '-': p.flags |= F_LJUST; continue;
+            case '+': p.flags |= F_SIGN; continue;
+            case ' ': p.flags |= F_BLANK; continue;
+            case '#': p.flags |= F_ALT; continue;
+            case '0': p.flags |= F_ZERO; continue;
+            }
+            break;
+        }
+
+        /* A '*' would take its value from the dict, which is no number. */
+        if ( c == '*' )
+        {
+            add_error(r, PIECE_TYPE_ERROR, NULL);
+            return;
+        }
+        if ( isdigit((unsigned char)c) )
+        {
+            p.width = c - '0';
+            while ( --fmtcnt >= 0 )
+            {
+                c = (unsigned char)*fmt++;
+                if ( !isdigit(c) )
+                    break;
+                if ( p.width > (0x7fffffff - (c - '0')) / 10 )
+                {
+                    add_error(r, PIECE_FATAL, "width too big");
+                    return;
+                }
+                p.width = p.width * 10 + (c - '0');
+            }
+        }
+        if ( c == '.' )
+        {
+            p.prec = 0;
+            if ( --fmtcnt >= 0 )
+                c = *fmt++;
+            if ( c == '*' )
+            {
+                add_error(r, PIECE_TYPE_ERROR, NULL);
+                return;
+            }
+            if ( isdigit((unsigned char)c) )
+            {
+                p.prec = c - '0';
+                while ( --fmtcnt >= 0 )
+                {
+                    c = (unsigned char)*fmt++;
+                    if ( !isdigit(c) )
+                        break;
+                    if ( p.prec > (0x7fffffff - (c - '0')) / 10 )
+                    {
+                        add_error(r, PIECE_FATAL, "precision too big");
+                        return;
+                    }
+                    p.prec = p.prec * 10 + (c - '0');
+                }
+            }
+        }
+        if ( fmtcnt >= 0 && (c == 'h' || c == 'l' || c == 'L') &&
+             --fmtcnt >= 0 )
+            c = *fmt++;
+        if ( fmtcnt < 0 )
+        {
+            add_error(r, PIECE_FATAL, "incomplete conversion");
+            return;
+        }
+
+        if ( c != '%' )
+        {
+            if ( !have_arg )
+            {
+                add_error(r, PIECE_TYPE_ERROR, NULL);
+                return;
+            }
+            have_arg = 0;
+            p.arg = cur;
+        }
+
+        switch ( c )
+        {
+        case 'i':
+            c = 'd';
+            /* fall through */
+        case '%': case 's': case 'r': case 'd': case 'u': case 'o':
+        case 'x': case 'X': case 'e': case 'E': case 'f': case 'F':
+        case 'g': case 'G': case 'c':
+            break;
+        default:
+            add_error(r, PIECE_FATAL,
+                      "unsupported conversion character "
+                      "'%c' (0x%x) at index %ld", c, c,
+                      (long)(fmt - 1 - start));
+            return;
+        }
+        p.conv = c;
+        add_piece(r, &p);
+        lit = fmt;
+    }
+    add_text(r, lit, fmt - lit);
+}
+
+static unsigned long hash_event(long long event)
+{
+    return (unsigned long long)event * 0x9e3779b97f4a7c15ULL >> 20;
+}
+
+static struct rule **rule_slot(long long event)
+{
+    unsigned long i;
+
+    for ( i = hash_event(event) & rules.mask; rules.slot[i];
+          i = (i + 1) & rules.mask )
+        if ( rules.slot[i]->event == event )
+            break;
+    return &rules.slot[i];
+}
+
+static const struct rule *find_rule(uint32_t event)
+{
+    const struct rule *r = *rule_slot(event);
+
+    return r ? r : rules.dflt;
+}
+
+/* Parse an event id the way Python's eval() reads an integer literal. */
+static int parse_event_id(const char *s, size_t len, long long *event)
+{
+    char buf[64], *end;
+    int base = 10;
+    const char *p;
+
+    if ( len >= sizeof(buf) )
+        return -1;
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+    if ( len > 1 && (buf[len - 1] == 'L' || buf[len - 1] == 'l') )
+        buf[--len] = '\0';
+
+    p = buf;
+    if ( *p == '+' || *p == '-' )
+        p++;
+    if ( p[0] == '0' && (p[1] == 'x' || p[1] == 'X') )
+        base = 16;
+    else if ( p[0] == '0' && (p[1] == 'o' || p[1] == 'O') )
+    {
+        base = 8;
+        memmove((char *)p, p + 2, strlen(p + 2) + 1);
+    }
+    else if ( p[0] == '0' && p[1] )
+        base = 8;
+
+    errno = 0;
+    *event = strtoll(buf, &end, base);
+    return (errno || end == buf || *end) ? -1 : 0;
+}
+
+static void read_rules(const char *file)
+{
+    struct rule *list = NULL;
+    unsigned long nr = 0, i, size;
+    char *line = NULL;
+    size_t len = 0;
+    ssize_t n;
+    FILE *f;
+
+    f = fopen(file, "r");
+    if ( !f )
+    {
+        fatal("cannot open %s: %s", file, strerror(errno));
+    }
+
+    while ( (n = getline(&line, &len, f)) > 0 )
+    {
+        const char *key = line, *key_end, *fmt, *end = line + n;
+        struct rule *r;
+
+        if ( line[0] == '#' || line[0] == '\n' )
+            continue;
+
+        /* The rule line has to match '(\S+)\s+(\S.*)'. */
+        for ( key_end = key; key_end < end && !isspace((unsigned char)*key_end);
+              key_end++ )
+            continue;
+        for ( fmt = key_end; fmt < end && isspace((unsigned char)*fmt); fmt++ )
+            continue;
+        if ( key_end == key || fmt == key_end || fmt == end )
+        {
+            fprintf(stderr, "Bad format file\n");
+            exit(EXIT_FAILURE);
+        }
+        if ( end[-1] == '\n' )
+            end--;
+
+        if ( (nr & (nr - 1)) == 0 )
+            list = xrealloc(list, (nr ? nr * 2 : 64) * sizeof(*list));
+        r = &list[nr++];
+        memset(r, 0, sizeof(*r));
+        if ( parse_event_id(key, key_end - key, &r->event) )
+            fatal("bad event id '%.*s' in %s", (int)(key_end - key), key,
+                  file);
+        r->len = end - fmt;
+        r->text = xmalloc(r->len + 1);
+        memcpy(r->text, fmt, r->len);
+        r->text[r->len] = '\0';
+    }
+    free(line);
+    fclose(f);
+
+    for ( size = 16; size < nr * 2; size *= 2 )
+        continue;
+    rules.slot = calloc(size, sizeof(*rules.slot));
+    if ( !rules.slot )
+        fatal("out of memory");
+    rules.mask = size - 1;
+
+    /* A later rule for the same event replaces an earlier one. */
+    for ( i = 0; i < nr; i++ )
+    {
+        struct rule **slot = rule_slot(list[i].event);
+
+        compile_rule(&list[i]);
+        *slot = &list[i];
+    }
+    rules.dflt = *rule_slot(0);
+}
+
+/***** Python 2 '%' conversions **********************************************/
+
+struct value {
+    int is_float;
+    long long i;
+    double f;
+};
+
+static void get_value(const struct record *r, int arg, struct value *v)
+{
+    v->is_float = 0;
+    switch ( arg )
+    {
+    case ARG_CPU:    v->i = r->cpu; break;
+    case ARG_EVENT:  v->i = r->event; break;
+    case ARG_RELTSC: v->i = r->reltsc; break;
+    case ARG_TSC:
+        if ( mhz )
+        {
+            v->is_float = 1;
+            v->f = r->tsc / (mhz * 1000000.0);
+        }
+        else
+            v->i = r->tsc;
+        break;
+    case ARG_1: v->i = r->d[0]; break;
+    case ARG_2: v->i = r->d[1]; break;
+    case ARG_3: v->i = r->d[2]; break;
+    case ARG_4: v->i = r->d[3]; break;
+    case ARG_5: v->i = r->d[4]; break;
+    case ARG_6: v->i = r->d[5]; break;
+    case ARG_7: v->i = r->d[6]; break;
+    }
+}
+
+/* Digits of @x, written backwards from @end; returns the start. */
+static char *utoa(char *end, unsigned long long x, unsigned int base,
+                  const char *digits)
+{
+    do {
+        *--end = digits[x % base];
+        x /= base;
+    } while ( x );
+    return end;
+}
+
+/* Python's float.__repr__(): the shortest string that reads back. */
+static size_t float_repr(char *buf, double x, int prec)
+{
+    char tmp[40], digits[24], *p, *e;
+    int nd = 0, exp, i;
+    size_t len = 0;
+
+    if ( prec == 0 )
+    {
+        for ( prec = 1; prec < 17; prec++ )
+        {
+            snprintf(tmp, sizeof(tmp), "%.*e", prec - 1, x);
+            if ( strtod(tmp, NULL) == x )
+                break;
+        }
+    }
+    snprintf(tmp, sizeof(tmp), "%.*e", prec - 1, x);
+    if ( !isdigit((unsigned char)tmp[tmp[0] == '-']) )
+        return sprintf(buf, "%s", tmp);
+
+    /* Split "-d.ddde+XX" into its digits and the decimal point position. */
+    p = tmp;
+    if ( *p == '-' )
+        buf[len++] = *p++;
+    for ( ; *p != 'e'; p++ )
+        if ( *p != '.' )
+            digits[nd++] = *p;
+    exp = strtol(p + 1, &e, 10) + 1;
+    while ( nd > 1 && digits[nd - 1] == '0' )
+        nd--;
+
+    if ( prec == 12 ? (exp < -3 || exp > 12) : (exp < -3 || exp > 16) )
+    {
+        buf[len++] = digits[0];
+        if ( nd > 1 )
+        {
+            buf[len++] = '.';
+            memcpy(buf + len, digits + 1, nd - 1);
+            len += nd - 1;
+        }
+        return len + sprintf(buf + len, "e%+.02d", exp - 1);
+    }
+    if ( exp <= 0 )
+    {
+        buf[len++] = '0';
+        buf[len++] = '.';
+        for ( i = exp; i < 0; i++ )
+            buf[len++] = '0';
+        memcpy(buf + len, digits, nd);
+        return len + nd;
+    }
+    for ( i = 0; i < exp || i < nd; i++ )
+    {
+        if ( i == exp )
+            buf[len++] = '.';
+        buf[len++] = i < nd ? digits[i] : '0';
+    }
+    if ( nd <= exp )
+    {
+        buf[len++] = '.';
+        buf[len++] = '0';
+    }
+    return len;
+}
+
+static size_t value_repr(char *buf, const struct value *v)
+{
+    char tmp[24], *p;
+    size_t len;
+
+    if ( v->is_float )
+        return float_repr(buf, v->f, 0);
+    p = utoa(tmp + sizeof(tmp), v->i < 0 ? -(unsigned long long)v->i : v->i,
+             10, "0123456789");
+    if ( v->i < 0 )
+        *--p = '-';
+    len = tmp + sizeof(tmp) - p;
+    memcpy(buf, p, len);
+    return len;
+}
+
+static void put_dict(struct outbuf *o, const struct record *r)
+{
+    struct value v;
+    char buf[64];
+    int i;
+
+    out_putc(o, '{');
+    for ( i = 0; i < NR_ARGS; i++ )
+    {
+        if ( i )
+            out_put(o, ", ", 2);
+        out_putc(o, '\'');
+        out_put(o, arg_names[i], strlen(arg_names[i]));
+        out_put(o, "': ", 3);
+        get_value(r, i, &v);
+        out_put(o, buf, value_repr(buf, &v));
+    }
+    out_putc(o, '}');
+}
+
+/*
+ * Integer conversions, as Python's formatint() does them by way of
+ * snprintf(): the precision is a minimum number of digits, the sign and
+ * the '#' prefix come first, and 'u' is 'd' for negative numbers.
+ */
+static size_t format_int(char *buf, char conv, int flags, int prec,
+                         long long x)
+{
+    unsigned long long ux = x < 0 ? -(unsigned long long)x : x;
+    char tmp[24], *p, *q = buf;
+    size_t nd;
+
+    switch ( conv )
+    {
+    case 'o':
+        p = utoa(tmp + sizeof(tmp), ux, 8, "01234567");
+        break;
+    case 'x':
+        p = utoa(tmp + sizeof(tmp), ux, 16, "0123456789abcdef");
+        break;
+    case 'X':
+        p = utoa(tmp + sizeof(tmp), ux, 16, "0123456789ABCDEF");
+        break;
+    default:
+        p = utoa(tmp + sizeof(tmp), ux, 10, "0123456789");
+        break;
+    }
+    nd = tmp + sizeof(tmp) - p;
+    if ( prec < 0 )
+        prec = 1;
+    if ( prec == 0 && ux == 0 )
+        nd = 0;
+
+    if ( x < 0 )
+        *q++ = '-';
+    if ( (flags & F_ALT) && (conv == 'x' || conv == 'X') )
+    {
+        *q++ = '0';
+        *q++ = conv;
+    }
+    if ( (flags & F_ALT) && conv == 'o' && (nd == 0 || *p != '0') &&
+         nd >= (size_t)prec )
+        *q++ = '0';
+    if ( nd < (size_t)prec )
+    {
+        memset(q, '0', prec - nd);
+        q += prec - nd;
+    }
+    memcpy(q, p, nd);
+    return q + nd - buf;
+}
+
+static int format_float(char **bufp, size_t size, char conv, int flags,
+                        int prec, double x)
+{
+    char fmt[8], *f = fmt;
+    int len;
+
+    *f++ = '%';
+    if ( flags & F_ALT )
+        *f++ = '#';
+    *f++ = '.';
+    *f++ = '*';
+    *f++ = conv;
+    *f = '\0';
+    if ( prec < 0 )
+        prec = 6;
+
+    len = snprintf(*bufp, size, fmt, prec, x);
+    if ( len >= (int)size )
+    {
+        *bufp = xmalloc(len + 1);
+        snprintf(*bufp, len + 1, fmt, prec, x);
+    }
+    return len;
+}
+
+enum { CONV_OK, CONV_TYPE_ERROR, CONV_FATAL };
+
+/* Apply one conversion to a record, padding the result like Python. */
+static int put_conv(struct outbuf *o, const struct piece *p,
+                    const struct record *r, struct batch *b)
+{
+    char stack[160], *buf = stack, *pbuf;
+    int sign = 0, width = p->width, len;
+    char fill = ' ';
+    struct value v;
+    char c = p->conv;
+
+    if ( c != '%' && p->arg != ARG_DICT )
+        get_value(r, p->arg, &v);
+
+    switch ( c )
+    {
+    case '%':
+        buf[0] = '%';
+        len = 1;
+        break;
+
+    case 's':
+    case 'r':
+        if ( p->arg == ARG_DICT )
+        {
+            struct outbuf d = { 0 };
+
+            put_dict(&d, r);
+            len = d.len;
+            buf = d.p;
+        }
+        else if ( v.is_float )
+            len = float_repr(buf, v.f, c == 's' ? 12 : 0);
+        else
+            len = value_repr(buf, &v);
+        if ( p->prec >= 0 && len > p->prec )
+            len = p->prec;
+        break;
+
+    case 'd': case 'u': case 'o': case 'x': case 'X':
+        if ( p->arg == ARG_DICT )
+            return CONV_TYPE_ERROR;
+        if ( p->prec >= 117 )
+        {
+            snprintf(b->errbuf, sizeof(b->errbuf), "bad format field "
+                     "in the rule for event %#x: precision too large "
+                     "for %%%c", r->event, c);
+            return CONV_FATAL;
+        }
+        if ( v.is_float )
+            v.i = (long long)v.f;
+        if ( c == 'u' )
+            c = 'd';
+        len = format_int(buf, c, p->flags, p->prec, v.i);
+        sign = 1;
+        if ( p->flags & F_ZERO )
+            fill = '0';
+        break;
+
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G':
+        if ( p->arg == ARG_DICT )
+            return CONV_TYPE_ERROR;
+        len = format_float(&buf, sizeof(stack), c, p->flags, p->prec,
+                           v.is_float ? v.f : (double)v.i);
+        sign = 1;
+        if ( p->flags & F_ZERO )
+            fill = '0';
+        break;
+
+    case 'c':
+        if ( p->arg == ARG_DICT || v.is_float )
+            return CONV_TYPE_ERROR;
+        if ( v.i < 0 || v.i > 255 )
+        {
+            snprintf(b->errbuf, sizeof(b->errbuf), "event %#x: value "
+                     "%lld out of range for %%c", r->event, v.i);
+            return CONV_FATAL;
+        }
+        buf[0] = v.i;
+        len = 1;
+        break;
+
+    default:
+        abort();
+    }
+
+    pbuf = buf;
+    if ( sign )
+    {
+        if ( *pbuf == '-' || *pbuf == '+' )
+        {
+            sign = *pbuf++;
+            len--;
+        }
+        else if ( p->flags & F_SIGN )
+            sign = '+';
+        else if ( p->flags & F_BLANK )
+            sign = ' ';
+        else
+            sign = 0;
+    }
+    if ( width < len )
+        width = len;
+    if ( sign )
+    {
+        if ( fill != ' ' )
+            out_putc(o, sign);
+        if ( width > len )
+            width--;
+    }
+    if ( (p->flags & F_ALT) && (c == 'x' || c == 'X') )
+    {
+        if ( fill != ' ' )
+        {
+            out_put(o, pbuf, 2);
+            pbuf += 2;
+        }
+        width -= 2;
+        if ( width < 0 )
+            width = 0;
+        len -= 2;
+    }
+    if ( width > len && !(p->flags & F_LJUST) )
+    {
+        out_fill(o, fill, width - len);
+        width = len;
+    }
+    if ( fill == ' ' )
+    {
+        if ( sign )
+            out_putc(o, sign);
+        if ( (p->flags & F_ALT) && (c == 'x' || c == 'X') )
+        {
+            out_put(o, pbuf, 2);
+            pbuf += 2;
+        }
+    }
+    out_put(o, pbuf, len);
+    if ( width > len )
+        out_fill(o, ' ', width - len);
+
+    if ( buf != stack )
+        free(buf);
+    return CONV_OK;
+}
+
+/***** Records ***************************************************************/
+
+static void format_batch(struct batch *b)
+{
+    struct outbuf *o = &b->out;
+    unsigned int i, j;
+
+    o->len = 0;
+    b->error = NULL;
+
+    for ( i = 0; i < b->nr; i++ )
+    {
+        const struct record *r = &b->rec[i];
+        const struct rule *rule;
+        size_t start;
+
+        if ( r->backward )
+        {
+            char line[96];
+
+            out_put(o, line, snprintf(line, sizeof(line),
+                                      "TSC stepped backward cpu %lld !  "
+                                      "%lld %lld\n",
+                                      r->cpu, r->tsc, r->last_tsc));
+        }
+
+        rule = find_rule(r->event);
+        if ( !rule )
+            continue;
+
+        start = o->len;
+        for ( j = 0; j < rule->nr_pieces; j++ )
+        {
+            const struct piece *p = &rule->pieces[j];
+            int rc = CONV_TYPE_ERROR;
+
+            switch ( p->kind )
+            {
+            case PIECE_TEXT:
+                out_put(o, p->text, p->len);
+                continue;
+            case PIECE_CONV:
+                rc = put_conv(o, p, r, b);
+                break;
+            case PIECE_TYPE_ERROR:
+                break;
+            case PIECE_FATAL:
+                snprintf(b->errbuf, sizeof(b->errbuf), "bad format field "
+                         "in the rule for event %#x: %s", r->event, p->text);
+                rc = CONV_FATAL;
+                break;
+            }
+            if ( rc == CONV_OK )
+                continue;
+
+            o->len = start;
+            if ( rc == CONV_FATAL )
+            {
+                b->error = b->errbuf;
+                return;
+            }
+            /* Python printed the rule itself and then the values. */
+            out_put(o, rule->text, rule->len);
+            out_putc(o, '\n');
+            put_dict(o, r);
+            break;
+        }
+        out_putc(o, '\n');
+    }
+}
+
+static struct {
+    int fd;
+    char *buf;
+    size_t pos, len;
+    unsigned long long bytes;
+    int eof;
+} in;
+
+/* Read up to @n bytes, short only at the end of the input. */
+static size_t in_read(void *dst, size_t n)
+{
+    size_t done = 0;
+
+    while ( done < n )
+    {
+        size_t chunk = in.len - in.pos;
+        ssize_t rc;
+
+        if ( chunk )
+        {
+            if ( chunk > n - done )
+                chunk = n - done;
+            memcpy((char *)dst + done, in.buf + in.pos, chunk);
+            in.pos += chunk;
+            done += chunk;
+            continue;
+        }
+        if ( in.eof )
+            break;
+        rc = read(in.fd, in.buf, INPUT_BUF_SIZE);
+        if ( rc <= 0 )
+        {
+            if ( rc < 0 && errno != EINTR )
+                fatal("reading input: %s", strerror(errno));
+            /* An interrupted read ended the Python script quietly. */
+            in.eof = 1;
+            if ( rc < 0 )
+                return 0;
+            break;
+        }
+        in.pos = 0;
+        in.len = rc;
+        in.bytes += rc;
+    }
+    return done;
+}
+
+/* State carried from one record to the next. */
+static struct {
+    int have_cpu;
+    long long cpu;
+    long long *last_tsc;
+    unsigned char *compact;
+    unsigned long nr_cpus;
+    long long irq_count, irq_tot, irq_max;
+    int done;
+} dec;
+
+enum { DECODE_OK, DECODE_END, DECODE_ERROR };
+
+static void grow_cpus(unsigned long nr)
+{
+    if ( nr > (1UL << 24) )
+        fatal("cpu %lu out of range", nr - 1);
+    dec.last_tsc = xrealloc(dec.last_tsc, nr * sizeof(*dec.last_tsc));
+    dec.compact = xrealloc(dec.compact, nr);
+    memset(dec.last_tsc + dec.nr_cpus, 0,
+           (nr - dec.nr_cpus) * sizeof(*dec.last_tsc));
+    memset(dec.compact + dec.nr_cpus, 0, nr - dec.nr_cpus);
+    dec.nr_cpus = nr;
+}
+
+static int decode_record(struct record *r, const char **error)
+{
+    static char errbuf[80];
+    uint32_t hdr, d[8] = { 0 };
+    uint64_t tsc = 0;
+    unsigned int n, i;
+    size_t got, want;
+    int tsc_in;
+
+    got = in_read(&hdr, want = sizeof(hdr));
+    if ( got == 0 )
+        return DECODE_END;
+    if ( got < want )
+        goto short_read;
+    n = (hdr >> 28) & 7;
+    tsc_in = hdr >> 31;
+
+    if ( tsc_in )
+    {
+        got = in_read(&tsc, want = sizeof(tsc));
+        if ( got == 0 )
+            return DECODE_END;
+        if ( got < want )
+            goto short_read;
+    }
+    if ( n )
+    {
+        got = in_read(d, want = n * sizeof(d[0]));
+        if ( got == 0 )
+            return DECODE_END;
+        if ( got < want )
+            goto short_read;
+    }
+
+    r->event = hdr & 0x0fffffff;
+    for ( i = 0; i < 7; i++ )
+        r->d[i] = d[i];
+
+    if ( r->event == TRC_TRACE_CPU_CHANGE )
+    {
+        dec.have_cpu = 1;
+        dec.cpu = d[0];
+        if ( dec.cpu >= dec.nr_cpus )
+            grow_cpus(dec.cpu + 1);
+        dec.compact[dec.cpu] = n > 2 && (d[2] & 1);
+    }
+    else if ( !tsc_in && n > 0 && !dec.have_cpu )
+        goto no_cpu;
+    else if ( !tsc_in && n > 0 && dec.compact[dec.cpu] &&
+              (r->event >> 16) != 1 )
+    {
+        /*
+         * Compact format: the first word is the TSC delta.  Until a full
+         * TSC has been seen on this cpu, there is nothing to add it to.
+         */
+        for ( i = 0; i < 7; i++ )
+            r->d[i] = d[i + 1];
+        if ( dec.last_tsc[dec.cpu] )
+        {
+            tsc = dec.last_tsc[dec.cpu] + d[0];
+            tsc_in = 1;
+        }
+    }
+
+    if ( r->event == TRC_TRACE_IRQ )
+    {
+        long long diff = r->d[2] - r->d[1];
+
+        if ( diff < 0 )
+            return DECODE_END;
+        if ( r->d[0] >= NR_VECTORS )
+        {
+            snprintf(errbuf, sizeof(errbuf),
+                     "irq record with vector %lld out of range", r->d[0]);
+            *error = errbuf;
+            return DECODE_ERROR;
+        }
+        /* The counts were only ever kept once, not per vector. */
+        dec.irq_count++;
+        dec.irq_tot += diff;
+        if ( dec.irq_max < diff )
+            dec.irq_max = diff;
+        r->d[1] = dec.irq_count;
+        r->d[2] = dec.irq_tot;
+        r->d[3] = dec.irq_max;
+    }
+
+    if ( r->event == TRC_PV_HYPERCALL_V2 ||
+         r->event == TRC_PV_HYPERCALL_SUBCALL )
+        r->d[0] &= 0x000fffff;
+
+    if ( !dec.have_cpu )
+        goto no_cpu;
+
+    r->cpu = dec.cpu;
+    r->tsc = tsc;
+    r->tsc_in = tsc_in;
+    r->backward = 0;
+    if ( dec.cpu >= dec.nr_cpus )
+        grow_cpus(dec.cpu + 1);
+    else if ( tsc_in && (long long)tsc < dec.last_tsc[dec.cpu] )
+    {
+        r->backward = 1;
+        r->last_tsc = dec.last_tsc[dec.cpu];
+    }
+
+    r->reltsc = (dec.last_tsc[dec.cpu] > 0 && tsc_in) ?
+        (long long)tsc - dec.last_tsc[dec.cpu] : 0;
+    if ( tsc_in )
+        dec.last_tsc[dec.cpu] = tsc;
+
+    return DECODE_OK;
+
+ no_cpu:
+    *error = "record without a cpu: no cpu_change record before it";
+    return DECODE_ERROR;
+
+ short_read:
+    snprintf(errbuf, sizeof(errbuf),
+             "short record at the end of the input: %zu of %zu bytes",
+             got, want);
+    *error = errbuf;
+    return DECODE_ERROR;
+}
+
+static void decode_batch(struct batch *b)
+{
+    b->nr = 0;
+    b->decode_error = NULL;
+
+    while ( b->nr < BATCH_RECORDS && !dec.done )
+    {
+        if ( interrupted )
+        {
+            dec.done = 1;
+            break;
+        }
+        switch ( decode_record(&b->rec[b->nr], &b->decode_error) )
+        {
+        case DECODE_OK:
+            b->nr++;
+            break;
+        case DECODE_ERROR:
+        case DECODE_END:
+            dec.done = 1;
+            break;
+        }
+    }
+}
+
+static unsigned long long records, bytes_out;
+
+/* Write out a formatted batch, and stop if the batch hit an error. */
+static void write_batch(struct batch *b)
+{
+    records += b->nr;
+    bytes_out += b->out.len;
+
+    if ( !benchmark && b->out.len &&
+         fwrite(b->out.p, b->out.len, 1, stdout) != 1 )
+    {
+        if ( errno == EPIPE )
+            exit(EXIT_SUCCESS);
+        fatal("writing output: %s", strerror(errno));
+    }
+    if ( b->error )
+        fatal("%s", b->error);
+    if ( b->decode_error )
+        fatal("%s", b->decode_error);
+}
+
+/***** Threads ***************************************************************/
+
+static struct {
+    struct batch *ring;
+    unsigned int size;
+    unsigned long decoded;      /* batches handed out for formatting */
+    unsigned long claimed;      /* batches taken by a formatting thread */
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t work;        /* a batch was decoded, or stop was set */
+    pthread_cond_t done;        /* a batch was formatted */
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+static void *format_thread(void *unused)
+{
+    pthread_mutex_lock(&pool.lock);
+    for ( ;; )
+    {
+        struct batch *b;
+
+        while ( pool.claimed == pool.decoded && !pool.stop )
+            pthread_cond_wait(&pool.work, &pool.lock);
+        if ( pool.claimed == pool.decoded )
+            break;
+        b = &pool.ring[pool.claimed++ % pool.size];
+        pthread_mutex_unlock(&pool.lock);
+
+        format_batch(b);
+
+        pthread_mutex_lock(&pool.lock);
+        b->state = BATCH_FORMATTED;
+        pthread_cond_broadcast(&pool.done);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+/*
+ * Records are always decoded by this thread, as each one depends on
+ * those before it, and batches are written out in order; the threads
+ * only turn batches of decoded records into text.
+ */
+static void run_threads(unsigned int nr_threads)
+{
+    unsigned long written = 0;
+    sigset_t mask, old;
+    pthread_t *tids;
+    unsigned int i;
+
+    pool.size = nr_threads * 2 + 2;
+    pool.ring = calloc(pool.size, sizeof(*pool.ring));
+    tids = calloc(nr_threads, sizeof(*tids));
+    if ( !pool.ring || !tids )
+        fatal("out of memory");
+
+    /* Leave the signals to this thread, which does the reading. */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, &old);
+    for ( i = 0; i < nr_threads; i++ )
+        if ( (errno = pthread_create(&tids[i], NULL, format_thread, NULL)) )
+            fatal("creating thread: %s", strerror(errno));
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    for ( ;; )
+    {
+        struct batch *b;
+
+        pthread_mutex_lock(&pool.lock);
+        while ( written < pool.decoded &&
+                (pool.decoded - written == pool.size || dec.done) &&
+                pool.ring[written % pool.size].state != BATCH_FORMATTED )
+            pthread_cond_wait(&pool.done, &pool.lock);
+        b = &pool.ring[written % pool.size];
+        if ( written < pool.decoded && b->state == BATCH_FORMATTED )
+        {
+            pthread_mutex_unlock(&pool.lock);
+            write_batch(b);
+            b->state = BATCH_FREE;
+            written++;
+            continue;
+        }
+        if ( dec.done )
+        {
+            pthread_mutex_unlock(&pool.lock);
+            break;
+        }
+        pthread_mutex_unlock(&pool.lock);
+
+        b = &pool.ring[pool.decoded % pool.size];
+        decode_batch(b);
+
+        pthread_mutex_lock(&pool.lock);
+        b->state = BATCH_DECODED;
+        pool.decoded++;
+        pthread_cond_signal(&pool.work);
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.stop = 1;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+    for ( i = 0; i < nr_threads; i++ )
+        pthread_join(tids[i], NULL);
+    free(tids);
+}
+
+static void run(void)
+{
+    struct batch *b = calloc(1, sizeof(*b));
+
+    if ( !b )
+        fatal("out of memory");
+    while ( !dec.done )
+    {
+        decode_batch(b);
+        format_batch(b);
+        write_batch(b);
+    }
+}
+
+/***** Main ******************************************************************/
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+"Usage: %s [-c MHZ] [-j THREADS] [-B] defs-file\n"
+"          Parses trace data in binary format, as output by Xentrace and\n"
+"          reformats it according to the rules in a file of definitions.  The\n"
+"          rules in this file should have the format ({ and } show grouping\n"
+"          and are not part of the syntax):\n"
+"\n"
+"          {event_id}{whitespace}{text format string}\n"
+"\n"
+"          The textual format string may include format specifiers, such as:\n"
+"            %%(cpu)d, %%(tsc)d, %%(event)d, %%(1)d, %%(2)d, %%(3)d, %%(4)d, ... \n"
+"          [ the 'd' format specifier outputs in decimal, alternatively 'x'\n"
+"            will output in hexadecimal and 'o' will output in octal ]\n"
+"\n"
+"          Which correspond to the CPU number, event ID, timestamp counter and\n"
+"          the 7 data fields from the trace record.  There should be one such\n"
+"          rule for each type of event.\n"
+"\n"
+"          -c MHZ      print the timestamp in seconds, for a MHZ clock\n"
+"          -j THREADS  format records in THREADS threads\n"
+"          -B          discard the output and report the throughput\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+static void sighand(int sig)
+{
+    interrupted = 1;
+}
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+    struct sigaction act = { .sa_handler = sighand };
+    unsigned long nr_threads = 0;
+    double start;
+    char *end;
+    int opt;
+
+    while ( (opt = getopt(argc, argv, "+c:j:B")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'c':
+            errno = 0;
+            mhz = strtol(optarg, &end, 10);
+            while ( isspace((unsigned char)*end) )
+                end++;
+            if ( errno || end == optarg || *end )
+                fatal("invalid cpu frequency '%s'", optarg);
+            break;
+        case 'j':
+            nr_threads = strtoul(optarg, &end, 0);
+            if ( *end || nr_threads > 256 )
+                usage(argv[0]);
+            break;
+        case 'B':
+            benchmark = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if ( optind >= argc )
+        usage(argv[0]);
+
+    sigaction(SIGTERM, &act, NULL);
+    sigaction(SIGHUP, &act, NULL);
+    sigaction(SIGINT, &act, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    read_rules(argv[optind]);
+
+    in.fd = STDIN_FILENO;
+    in.buf = xmalloc(INPUT_BUF_SIZE);
+
+    start = now();
+    if ( nr_threads )
+        run_threads(nr_threads);
+    else
+        run();
+
+    if ( fflush(stdout) && errno != EPIPE )
+        fatal("writing output: %s", strerror(errno));
+
+    if ( benchmark )
+    {
+        double secs = now() - start;
+
+        if ( secs <= 0 )
+            secs = 1e-6;
+        fprintf(stderr, "%llu records, %.1f MB in, %.1f MB out in %.3fs: "
+                "%.1f MB/s, %.0f records/s\n", records, in.bytes / 1e6,
+                bytes_out / 1e6, secs, in.bytes / 1e6 / secs,
+                records / secs);
+    }
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -75,6 +75,27 @@ static cpumask_t tb_cpu_mask;
 /* which tracing events are enabled */
 static u32 tb_event_mask = TRC_ALL;
 
+/*
+ * Finer grained filters, see struct xen_sysctl_tbuf_filter.  They are
+ * read without any lock, so records traced while they are being changed
+ * may see a mix of the old and new filters.
+ */
+static struct xen_sysctl_tbuf_filter tb_filter __read_mostly;
+static DEFINE_PER_CPU(unsigned int, sample_count);
+
+/* Record format, and TSC of the last timestamped record on each cpu. */
+static unsigned int tb_format __read_mostly = XEN_SYSCTL_TBUF_FORMAT_full;
+static DEFINE_PER_CPU(u64, last_tsc);
+
+/*
+ * Largest TSC delta we write in a compact record.  Half of what fits, as
+ * the TSC is read again when writing the record, possibly after a wrap and
+ * a lost records record.
+ */
+#define TSC_DELTA_MAX 0x7fffffffULL
+
+#define is_gen_event(e) (((e) >> TRC_CLS_SHIFT) == (TRC_GEN >> TRC_CLS_SHIFT))
+
 /* Return the number of elements _type necessary to store at least _x bytes of data
  * i.e., sizeof(_type) * ans >= _x. */
 #define fit_to_type(_type, _x) (((_x)+sizeof(_type)-1) / sizeof(_type))
@@ -85,7 +106,11 @@ static int cpu_callback(
     unsigned int cpu = (unsigned long)hcpu;
 
     if ( action == CPU_UP_PREPARE )
+    {
         spin_lock_init(&per_cpu(t_lock, cpu));
+        /* Tracing may be on already: start this cpu with a full TSC. */
+        per_cpu(last_tsc, cpu) = 0;
+    }
 
     return NOTIFY_DONE;
 }
@@ -306,6 +331,45 @@ static int tb_set_size(unsigned int pages)
     return alloc_trace_bufs(pages);
 }
 
+static bool_t filter_match(u32 event)
+{
+    const struct domain *d;
+
+    if ( likely(!tb_filter.flags) )
+        return 1;
+
+    if ( tb_filter.flags & XEN_SYSCTL_TBUF_FILTER_domain )
+    {
+        d = current->domain;
+        if ( d->domain_id != tb_filter.domid && !is_idle_domain(d) )
+            return 0;
+    }
+
+    if ( (tb_filter.flags & XEN_SYSCTL_TBUF_FILTER_range) &&
+         (event < tb_filter.evt_min || event > tb_filter.evt_max) )
+        return 0;
+
+    return 1;
+}
+
+static int set_filter(const struct xen_sysctl_tbuf_filter *filter)
+{
+    if ( filter->flags & ~(XEN_SYSCTL_TBUF_FILTER_domain |
+                           XEN_SYSCTL_TBUF_FILTER_range |
+                           XEN_SYSCTL_TBUF_FILTER_sample) )
+        return -EINVAL;
+
+    if ( (filter->flags & XEN_SYSCTL_TBUF_FILTER_range) &&
+         filter->evt_min > filter->evt_max )
+        return -EINVAL;
+
+    if ( (filter->flags & XEN_SYSCTL_TBUF_FILTER_sample) && !filter->sample )
+        return -EINVAL;
+
+    tb_filter = *filter;
+    return 0;
+}
+
 int trace_will_trace_event(u32 event)
 {
     if ( !tb_init_done )
@@ -329,6 +393,9 @@ int trace_will_trace_event(u32 event)
     if ( !cpumask_test_cpu(smp_processor_id(), &tb_cpu_mask) )
         return 0;
 
+    if ( !filter_match(event) )
+        return 0;
+
     return 1;
 }
 
@@ -379,6 +446,8 @@ int tb_control(xen_sysctl_tbuf_op_t *tbc)
         tbc->evt_mask   = tb_event_mask;
         tbc->buffer_mfn = t_info ? virt_to_mfn(t_info) : 0;
         tbc->size = t_info_pages * PAGE_SIZE;
+        tbc->filter = tb_filter;
+        tbc->format = tb_format;
         break;
     case XEN_SYSCTL_TBUFOP_set_cpu_mask:
     {
@@ -398,12 +467,38 @@ int tb_control(xen_sysctl_tbuf_op_t *tbc)
     case XEN_SYSCTL_TBUFOP_set_size:
         rc = tb_set_size(tbc->size);
         break;
+    case XEN_SYSCTL_TBUFOP_set_filter:
+        rc = set_filter(&tbc->filter);
+        break;
+    case XEN_SYSCTL_TBUFOP_set_format:
+        /* Consumers must see the same format from enable to disable. */
+        if ( tb_init_done )
+            rc = -EBUSY;
+        else if ( tbc->format != XEN_SYSCTL_TBUF_FORMAT_full &&
+                  tbc->format != XEN_SYSCTL_TBUF_FORMAT_compact )
+            rc = -EINVAL;
+        else
+            tb_format = tbc->format;
+        break;
     case XEN_SYSCTL_TBUFOP_enable:
         /* Enable trace buffers. Check buffers are already allocated. */
         if ( opt_tbuf_size == 0 ) 
             rc = -EINVAL;
         else
+        {
+            int i;
+
+            /* The first record on each cpu must carry the full TSC. */
+            for_each_online_cpu(i)
+            {
+                unsigned long flags;
+                spin_lock_irqsave(&per_cpu(t_lock, i), flags);
+                per_cpu(last_tsc, i) = 0;
+                spin_unlock_irqrestore(&per_cpu(t_lock, i), flags);
+            }
+            smp_wmb();
             tb_init_done = 1;
+        }
         break;
     case XEN_SYSCTL_TBUFOP_disable:
     {
@@ -551,6 +646,7 @@ static inline void __insert_record(struct t_buf *buf,
                                    unsigned long event,
                                    unsigned int extra,
                                    bool_t cycles,
+                                   bool_t delta,
                                    unsigned int rec_size,
                                    const void *extra_data)
 {
@@ -558,7 +654,8 @@ static inline void __insert_record(struct t_buf *buf,
     uint32_t *dst;
     unsigned char *this_page, *next_page;
     unsigned int extra_word = extra / sizeof(u32);
-    unsigned int local_rec_size = calc_rec_size(cycles, extra);
+    unsigned int local_rec_size = calc_rec_size(cycles,
+                                                extra + delta * sizeof(u32));
     uint32_t next;
     uint32_t offset;
     uint32_t remaining;
@@ -588,7 +685,7 @@ static inline void __insert_record(struct t_buf *buf,
     }
 
     rec->event = event;
-    rec->extra_u32 = extra_word;
+    rec->extra_u32 = extra_word + delta;
     dst = rec->u.nocycles.extra_u32;
     if ( (rec->cycles_included = cycles) != 0 )
     {
@@ -596,7 +693,14 @@ static inline void __insert_record(struct t_buf *buf,
         rec->u.cycles.cycles_lo = (uint32_t)tsc;
         rec->u.cycles.cycles_hi = (uint32_t)(tsc >> 32);
         dst = rec->u.cycles.extra_u32;
+        this_cpu(last_tsc) = tsc;
     } 
+    else if ( delta )
+    {
+        u64 tsc = (u64)get_cycles();
+        *dst++ = (uint32_t)(tsc - this_cpu(last_tsc));
+        this_cpu(last_tsc) = tsc;
+    }
 
     if ( extra_data && extra )
         memcpy(dst, extra_data, extra);
@@ -633,7 +737,7 @@ static inline void insert_wrap_record(struct t_buf *buf,
         ASSERT((extra_space/sizeof(u32)) <= TRACE_EXTRA_MAX);
     }
 
-    __insert_record(buf, TRC_TRACE_WRAP_BUFFER, extra_space, cycles,
+    __insert_record(buf, TRC_TRACE_WRAP_BUFFER, extra_space, cycles, 0,
                     space_left, NULL);
 }
 
@@ -654,7 +758,7 @@ static inline void insert_lost_records(struct t_buf *buf)
 
     this_cpu(lost_records) = 0;
 
-    __insert_record(buf, TRC_LOST_RECORDS, sizeof(ed), 1 /* cycles */,
+    __insert_record(buf, TRC_LOST_RECORDS, sizeof(ed), 1 /* cycles */, 0,
                     LOST_REC_SIZE, &ed);
 }
 
@@ -676,7 +780,9 @@ static DECLARE_SOFTIRQ_TASKLET(trace_notify_dom0_tasklet,
  * @extra: size of additional trace data in bytes
  * @extra_data: pointer to additional trace data
  *
- * Logs a trace record into the appropriate buffer.
+ * Logs a trace record into the appropriate buffer.  In the compact format
+ * the timestamp is written as a delta from the previous one when it can,
+ * and always written otherwise.
  */
 void __trace_var(u32 event, bool_t cycles, unsigned int extra,
                  const void *extra_data)
@@ -687,6 +793,7 @@ void __trace_var(u32 event, bool_t cycles, unsigned int extra,
     unsigned int rec_size, total_size;
     unsigned int extra_word;
     bool_t started_below_highwater;
+    bool_t delta = 0;
 
     if( !tb_init_done )
         return;
@@ -717,6 +824,21 @@ void __trace_var(u32 event, bool_t cycles, unsigned int extra,
     if ( !cpumask_test_cpu(smp_processor_id(), &tb_cpu_mask) )
         return;
 
+    if ( !filter_match(event) )
+        return;
+
+    /*
+     * Not atomic against interrupts tracing on this cpu too: at worst one
+     * record more or less gets sampled.
+     */
+    if ( (tb_filter.flags & XEN_SYSCTL_TBUF_FILTER_sample) &&
+         tb_filter.sample > 1 )
+    {
+        if ( ++this_cpu(sample_count) < tb_filter.sample )
+            return;
+        this_cpu(sample_count) = 0;
+    }
+
     /* Read tb_init_done /before/ t_bufs. */
     smp_rmb();
 
@@ -733,8 +855,17 @@ void __trace_var(u32 event, bool_t cycles, unsigned int extra,
 
     started_below_highwater = (calc_unconsumed_bytes(buf) < t_buf_highwater);
 
+    if ( tb_format == XEN_SYSCTL_TBUF_FORMAT_compact && !is_gen_event(event) )
+    {
+        u64 last = this_cpu(last_tsc);
+
+        delta = last && extra_word < TRACE_EXTRA_MAX &&
+                (u64)get_cycles() - last <= TSC_DELTA_MAX;
+        cycles = !delta;
+    }
+
     /* Calculate the record size */
-    rec_size = calc_rec_size(cycles, extra);
+    rec_size = calc_rec_size(cycles, extra + delta * sizeof(u32));
  
     /* How many bytes are available in the buffer? */
     bytes_to_tail = calc_bytes_avail(buf);
@@ -804,7 +935,7 @@ void __trace_var(u32 event, bool_t cycles, unsigned int extra,
         insert_wrap_record(buf, rec_size);
 
     /* Write the original record */
-    __insert_record(buf, event, extra, cycles, rec_size, extra_data);
+    __insert_record(buf, event, extra, cycles, delta, rec_size, extra_data);
 
 unlock:
     spin_unlock_irqrestore(&this_cpu(t_lock), flags);
@@ -36,7 +36,7 @@
 #include "physdev.h"
 #include "tmem.h"
 
-#define XEN_SYSCTL_INTERFACE_VERSION 0x0000000D
+#define XEN_SYSCTL_INTERFACE_VERSION 0x0000000E
 
 /*
  * Read console content from Xen buffer ring.
@@ -61,6 +61,28 @@ struct xen_sysctl_readconsole {
 typedef struct xen_sysctl_readconsole xen_sysctl_readconsole_t;
 DEFINE_XEN_GUEST_HANDLE(xen_sysctl_readconsole_t);
 
+/*
+ * Trace record filters, applied after the event and cpu masks and before
+ * the record is written.  Each filter is only active if its flag is set.
+ */
+struct xen_sysctl_tbuf_filter {
+/*
+ * Only records generated while a vcpu of @domid is running.  Records from
+ * the idle vcpu (e.g. the scheduler switching to the domain) are kept too.
+ */
+#define XEN_SYSCTL_TBUF_FILTER_domain (1u << 0)
+/* Only events in the range [@evt_min, @evt_max]. */
+#define XEN_SYSCTL_TBUF_FILTER_range  (1u << 1)
+/* Only one in every @sample records passing the other filters, per pcpu. */
+#define XEN_SYSCTL_TBUF_FILTER_sample (1u << 2)
+    uint32_t flags;
+    domid_t  domid;
+    uint16_t pad;
+    uint32_t evt_min, evt_max;
+    uint32_t sample;
+};
+typedef struct xen_sysctl_tbuf_filter xen_sysctl_tbuf_filter_t;
+
 /* Get trace buffers machine base address */
 /* XEN_SYSCTL_tbuf_op */
 struct xen_sysctl_tbuf_op {
@@ -71,6 +93,8 @@ struct xen_sysctl_tbuf_op {
 #define XEN_SYSCTL_TBUFOP_set_size     3
 #define XEN_SYSCTL_TBUFOP_enable       4
 #define XEN_SYSCTL_TBUFOP_disable      5
+#define XEN_SYSCTL_TBUFOP_set_filter   6
+#define XEN_SYSCTL_TBUFOP_set_format   7 /* Only while tracing is disabled */
     uint32_t cmd;
     /* IN/OUT variables */
     struct xenctl_bitmap cpu_mask;
@@ -78,6 +102,17 @@ struct xen_sysctl_tbuf_op {
     /* OUT variables */
     uint64_aligned_t buffer_mfn;
     uint32_t size;  /* Also an IN variable! */
+    /* IN/OUT variables */
+    struct xen_sysctl_tbuf_filter filter;
+    /*
+     * Record format.  In the compact format, records other than those of
+     * the TRC_GEN class are written without cycles_included, and their
+     * first extra word is the TSC delta from the previous record on the
+     * same pcpu (see TRC_TRACE_CPU_CHANGE in public/trace.h).
+     */
+#define XEN_SYSCTL_TBUF_FORMAT_full    0
+#define XEN_SYSCTL_TBUF_FORMAT_compact 1
+    uint32_t format;
 };
 typedef struct xen_sysctl_tbuf_op xen_sysctl_tbuf_op_t;
 DEFINE_XEN_GUEST_HANDLE(xen_sysctl_tbuf_op_t);
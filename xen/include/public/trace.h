@@ -280,6 +280,24 @@
  */
 #define TRC_64_FLAG 0x100 /* Addresses are 64 bits (instead of 32 bits) */
 
+/*
+ * Compact record format (XEN_SYSCTL_TBUF_FORMAT_compact): a record whose
+ * cycles_included bit is clear and which is not of the TRC_GEN class
+ * carries, as its first extra word, the TSC delta from the previous
+ * timestamped record written on the same pcpu; the event data follows.
+ * Records with cycles_included set carry the full TSC as usual, and Xen
+ * writes one whenever the delta would not fit, or the record has already
+ * seven words of data.  The first record on each pcpu after tracing is
+ * enabled always carries the full TSC.  Events traced without a TSC in
+ * the full format get a delta as well.
+ *
+ * The buffers themselves do not say which format they are in: consumers
+ * learn it from XEN_SYSCTL_TBUFOP_get_info.  xentrace then adds a third
+ * word of flags to its TRC_TRACE_CPU_CHANGE records, with the bit below
+ * set, so that the trace files describe themselves.
+ */
+#define TRC_TRACE_CPU_CHANGE_COMPACT (1u << 0)
+
 /* This structure represents a single trace buffer record. */
 struct t_rec {
     uint32_t event:28;